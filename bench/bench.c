@@ -0,0 +1,127 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bench/bench.h"
+
+static void bench_put_str(FILE *f, const char *str);
+static void bench_put_key(struct bench_report *r, const char *key);
+
+uint64_t bench_now_ns(void)
+{
+    static uint64_t freq;
+    LARGE_INTEGER li;
+    uint64_t ticks;
+
+    if (freq == 0) {
+        QueryPerformanceFrequency(&li);
+        freq = li.QuadPart;
+    }
+
+    QueryPerformanceCounter(&li);
+    ticks = li.QuadPart;
+
+    /* Split the conversion to avoid overflowing 64 bits on machines with a
+       high QPC frequency. */
+
+    return (ticks / freq) * UINT64_C(1000000000) +
+           ((ticks % freq) * UINT64_C(1000000000)) / freq;
+}
+
+void bench_report_begin(struct bench_report *r, FILE *f, const char *suite)
+{
+    assert(r != NULL);
+    assert(f != NULL);
+    assert(suite != NULL);
+
+    r->f = f;
+    r->nrows = 0;
+    r->nfields = 0;
+
+    fputs("{\"suite\": ", f);
+    bench_put_str(f, suite);
+    fputs(", \"results\": [", f);
+}
+
+void bench_report_end(struct bench_report *r)
+{
+    assert(r != NULL);
+
+    fputs("\n]}\n", r->f);
+    fflush(r->f);
+}
+
+void bench_row_begin(struct bench_report *r)
+{
+    assert(r != NULL);
+
+    fputs(r->nrows > 0 ? ",\n  {" : "\n  {", r->f);
+    r->nfields = 0;
+}
+
+void bench_row_end(struct bench_report *r)
+{
+    assert(r != NULL);
+
+    fputc('}', r->f);
+    r->nrows++;
+
+    /* Rows can take a while to produce, so let whoever is watching the
+       output see progress. */
+
+    fflush(r->f);
+}
+
+void bench_field_str(
+        struct bench_report *r,
+        const char *key,
+        const char *value)
+{
+    assert(value != NULL);
+
+    bench_put_key(r, key);
+    bench_put_str(r->f, value);
+}
+
+void bench_field_uint(struct bench_report *r, const char *key, uint64_t value)
+{
+    bench_put_key(r, key);
+    fprintf(r->f, "%" PRIu64, value);
+}
+
+void bench_field_double(struct bench_report *r, const char *key, double value)
+{
+    bench_put_key(r, key);
+    fprintf(r->f, "%.3f", value);
+}
+
+static void bench_put_key(struct bench_report *r, const char *key)
+{
+    assert(r != NULL);
+    assert(key != NULL);
+
+    if (r->nfields++ > 0) {
+        fputs(", ", r->f);
+    }
+
+    bench_put_str(r->f, key);
+    fputs(": ", r->f);
+}
+
+static void bench_put_str(FILE *f, const char *str)
+{
+    fputc('"', f);
+
+    for ( ; *str ; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', f);
+        }
+
+        fputc(*str, f);
+    }
+
+    fputc('"', f);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Minimal benchmark harness. Results are emitted as a single JSON document of
+   the form {"suite": ..., "results": [{...}, ...]} where each result row is a
+   flat object, so that successive releases can be diffed mechanically. */
+
+struct bench_report {
+    FILE *f;
+    unsigned int nrows;
+    unsigned int nfields;
+};
+
+uint64_t bench_now_ns(void);
+
+void bench_report_begin(struct bench_report *r, FILE *f, const char *suite);
+void bench_report_end(struct bench_report *r);
+
+void bench_row_begin(struct bench_report *r);
+void bench_row_end(struct bench_report *r);
+
+void bench_field_str(
+        struct bench_report *r,
+        const char *key,
+        const char *value);
+void bench_field_uint(struct bench_report *r, const char *key, uint64_t value);
+void bench_field_double(struct bench_report *r, const char *key, double value);
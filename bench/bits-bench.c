@@ -0,0 +1,387 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench/bench.h"
+
+#include "hook/iobuf-bits.h"
+#include "hook/iobuf-varint.h"
+#include "hook/iobuf.h"
+
+/* Bit field and LEB128 codecs against the obvious bit-at-a-time and
+   byte-at-a-time implementations that protocol code tends to grow on its own.
+   Each pass encodes or decodes a fixed set of fields with random widths (for
+   bit fields) or random magnitudes (for varints). Correctness is covered by
+   test/iobuf-test.c. */
+
+#define BENCH_MIN_RUN_NS UINT64_C(100000000)
+#define BENCH_NFIELDS 4096
+#define BENCH_MAX_WIDTH 24
+
+enum bench_op {
+    BENCH_OP_BITS_READ,
+    BENCH_OP_BITS_WRITE,
+    BENCH_OP_ULEB128_READ,
+    BENCH_OP_ULEB128_WRITE,
+};
+
+struct bench_case {
+    const char *op;
+    const char *impl;
+    enum bench_op which;
+    bool naive;
+};
+
+static void bench_setup(void);
+static void bench_naive_read_bits(
+        const uint8_t *bytes,
+        size_t *bitpos,
+        unsigned int nbits,
+        uint64_t *value);
+static void bench_naive_write_bits(
+        uint8_t *bytes,
+        size_t *bitpos,
+        unsigned int nbits,
+        uint64_t value);
+static HRESULT bench_naive_read_uleb128(
+        struct const_iobuf *src,
+        uint64_t *value);
+static HRESULT bench_naive_write_uleb128(struct iobuf *dest, uint64_t value);
+static void bench_pass(const struct bench_case *c);
+static void bench_loop(const struct bench_case *c, uint64_t niters);
+static uint64_t bench_calibrate(const struct bench_case *c);
+
+static const struct bench_case bench_cases[] = {
+    { "bits_read",      "iobuf",    BENCH_OP_BITS_READ,     false },
+    { "bits_read",      "naive",    BENCH_OP_BITS_READ,     true  },
+    { "bits_write",     "iobuf",    BENCH_OP_BITS_WRITE,    false },
+    { "bits_write",     "naive",    BENCH_OP_BITS_WRITE,    true  },
+    { "uleb128_read",   "iobuf",    BENCH_OP_ULEB128_READ,  false },
+    { "uleb128_read",   "naive",    BENCH_OP_ULEB128_READ,  true  },
+    { "uleb128_write",  "iobuf",    BENCH_OP_ULEB128_WRITE, false },
+    { "uleb128_write",  "naive",    BENCH_OP_ULEB128_WRITE, true  },
+};
+
+static unsigned int bench_widths[BENCH_NFIELDS];
+static uint64_t bench_fields[BENCH_NFIELDS];
+static uint64_t bench_varints[BENCH_NFIELDS];
+static uint8_t bench_bits[BENCH_NFIELDS * BENCH_MAX_WIDTH / 8 + 8];
+static uint8_t bench_leb[BENCH_NFIELDS * 10];
+static size_t bench_leb_nbytes;
+static uint8_t bench_scratch[BENCH_NFIELDS * 10];
+static volatile uint64_t bench_sink;
+
+int main(int argc, char **argv)
+{
+    struct bench_report r;
+    const struct bench_case *c;
+    uint64_t niters;
+    uint64_t begin;
+    uint64_t elapsed;
+    unsigned int nbits;
+    size_t i;
+
+    (void) argc;
+    (void) argv;
+
+    srand(1);
+
+    for (i = 0 ; i < BENCH_NFIELDS ; i++) {
+        bench_widths[i] = 1 + rand() % BENCH_MAX_WIDTH;
+        bench_fields[i] =
+                ((uint64_t) rand() << 16 ^ rand()) &
+                ((UINT64_C(1) << bench_widths[i]) - 1);
+
+        /* Skew towards small values, which is what varints are for */
+
+        nbits = rand() % 65;
+        bench_varints[i] = ((uint64_t) rand() << 48) ^
+                ((uint64_t) rand() << 32) ^
+                ((uint64_t) rand() << 16) ^
+                rand();
+        bench_varints[i] = nbits < 64 ?
+                bench_varints[i] & ((UINT64_C(1) << nbits) - 1) :
+                bench_varints[i];
+    }
+
+    bench_setup();
+
+    bench_report_begin(&r, stdout, "bits");
+
+    for (i = 0 ; i < _countof(bench_cases) ; i++) {
+        c = &bench_cases[i];
+        niters = bench_calibrate(c);
+
+        begin = bench_now_ns();
+        bench_loop(c, niters);
+        elapsed = bench_now_ns() - begin;
+
+        bench_row_begin(&r);
+        bench_field_str(&r, "op", c->op);
+        bench_field_str(&r, "impl", c->impl);
+        bench_field_uint(&r, "iterations", niters);
+        bench_field_double(
+                &r,
+                "ns_per_op",
+                (double) elapsed / (niters * BENCH_NFIELDS));
+        bench_field_double(
+                &r,
+                "ops_per_sec",
+                (double) niters * BENCH_NFIELDS * 1e9 / elapsed);
+        bench_row_end(&r);
+    }
+
+    bench_report_end(&r);
+
+    return EXIT_SUCCESS;
+}
+
+static void bench_setup(void)
+{
+    struct iobuf_bit_writer w;
+    struct iobuf dest;
+    size_t i;
+
+    /* Encode the fields once up front for the read cases to decode */
+
+    dest.bytes = bench_bits;
+    dest.nbytes = sizeof(bench_bits);
+    dest.pos = 0;
+    iobuf_bit_writer_init(&w, &dest);
+
+    for (i = 0 ; i < BENCH_NFIELDS ; i++) {
+        iobuf_write_bits(&w, bench_widths[i], bench_fields[i]);
+    }
+
+    iobuf_bit_writer_finish(&w);
+
+    dest.bytes = bench_leb;
+    dest.nbytes = sizeof(bench_leb);
+    dest.pos = 0;
+
+    for (i = 0 ; i < BENCH_NFIELDS ; i++) {
+        iobuf_write_uleb128(&dest, bench_varints[i]);
+    }
+
+    bench_leb_nbytes = dest.pos;
+}
+
+static void bench_naive_read_bits(
+        const uint8_t *bytes,
+        size_t *bitpos,
+        unsigned int nbits,
+        uint64_t *value)
+{
+    uint64_t result;
+    unsigned int i;
+    size_t pos;
+
+    result = 0;
+    pos = *bitpos;
+
+    for (i = 0 ; i < nbits ; i++, pos++) {
+        result = (result << 1) | ((bytes[pos / 8] >> (7 - pos % 8)) & 1);
+    }
+
+    *bitpos = pos;
+    *value = result;
+}
+
+static void bench_naive_write_bits(
+        uint8_t *bytes,
+        size_t *bitpos,
+        unsigned int nbits,
+        uint64_t value)
+{
+    unsigned int i;
+    size_t pos;
+
+    pos = *bitpos;
+
+    for (i = nbits ; i > 0 ; i--, pos++) {
+        if ((value >> (i - 1)) & 1) {
+            bytes[pos / 8] |= 0x80 >> (pos % 8);
+        } else {
+            bytes[pos / 8] &= ~(0x80 >> (pos % 8));
+        }
+    }
+
+    *bitpos = pos;
+}
+
+static HRESULT bench_naive_read_uleb128(
+        struct const_iobuf *src,
+        uint64_t *value)
+{
+    uint64_t result;
+    unsigned int shift;
+    uint8_t byte;
+    HRESULT hr;
+
+    result = 0;
+    shift = 0;
+
+    do {
+        hr = iobuf_read_8(src, &byte);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        if (shift < 64) {
+            result |= (uint64_t) (byte & 0x7F) << shift;
+        }
+
+        shift += 7;
+    } while (byte & 0x80);
+
+    *value = result;
+
+    return S_OK;
+}
+
+static HRESULT bench_naive_write_uleb128(struct iobuf *dest, uint64_t value)
+{
+    uint8_t byte;
+    HRESULT hr;
+
+    do {
+        byte = value & 0x7F;
+        value >>= 7;
+        hr = iobuf_write_8(dest, value != 0 ? byte | 0x80 : byte);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+    } while (value != 0);
+
+    return S_OK;
+}
+
+static void bench_pass(const struct bench_case *c)
+{
+    struct iobuf_bit_writer w;
+    struct iobuf_bit_reader r;
+    struct const_iobuf src;
+    struct iobuf dest;
+    uint64_t value;
+    uint64_t acc;
+    size_t bitpos;
+    size_t i;
+
+    acc = 0;
+    bitpos = 0;
+
+    src.bytes = c->which == BENCH_OP_BITS_READ ? bench_bits : bench_leb;
+    src.nbytes = c->which == BENCH_OP_BITS_READ ?
+            sizeof(bench_bits) : bench_leb_nbytes;
+    src.pos = 0;
+
+    dest.bytes = bench_scratch;
+    dest.nbytes = sizeof(bench_scratch);
+    dest.pos = 0;
+
+    switch (c->which) {
+    case BENCH_OP_BITS_READ:
+        iobuf_bit_reader_init(&r, &src);
+
+        for (i = 0 ; i < BENCH_NFIELDS ; i++) {
+            if (c->naive) {
+                bench_naive_read_bits(
+                        bench_bits,
+                        &bitpos,
+                        bench_widths[i],
+                        &value);
+            } else {
+                iobuf_read_bits(&r, bench_widths[i], &value);
+            }
+
+            acc += value;
+        }
+
+        break;
+
+    case BENCH_OP_BITS_WRITE:
+        iobuf_bit_writer_init(&w, &dest);
+
+        for (i = 0 ; i < BENCH_NFIELDS ; i++) {
+            if (c->naive) {
+                bench_naive_write_bits(
+                        bench_scratch,
+                        &bitpos,
+                        bench_widths[i],
+                        bench_fields[i]);
+            } else {
+                iobuf_write_bits(&w, bench_widths[i], bench_fields[i]);
+            }
+        }
+
+        iobuf_bit_writer_finish(&w);
+        acc = bench_scratch[0];
+
+        break;
+
+    case BENCH_OP_ULEB128_READ:
+        for (i = 0 ; i < BENCH_NFIELDS ; i++) {
+            if (c->naive) {
+                bench_naive_read_uleb128(&src, &value);
+            } else {
+                iobuf_read_uleb128(&src, &value);
+            }
+
+            acc += value;
+        }
+
+        break;
+
+    case BENCH_OP_ULEB128_WRITE:
+        for (i = 0 ; i < BENCH_NFIELDS ; i++) {
+            if (c->naive) {
+                bench_naive_write_uleb128(&dest, bench_varints[i]);
+            } else {
+                iobuf_write_uleb128(&dest, bench_varints[i]);
+            }
+        }
+
+        acc = dest.pos;
+
+        break;
+    }
+
+    bench_sink = acc;
+}
+
+static void bench_loop(const struct bench_case *c, uint64_t niters)
+{
+    uint64_t i;
+
+    for (i = 0 ; i < niters ; i++) {
+        bench_pass(c);
+    }
+}
+
+static uint64_t bench_calibrate(const struct bench_case *c)
+{
+    uint64_t niters;
+    uint64_t begin;
+    uint64_t elapsed;
+
+    niters = 1;
+
+    for (;;) {
+        begin = bench_now_ns();
+        bench_loop(c, niters);
+        elapsed = bench_now_ns() - begin;
+
+        if (elapsed >= BENCH_MIN_RUN_NS / 4) {
+            return niters * 4;
+        }
+
+        niters *= 2;
+    }
+}
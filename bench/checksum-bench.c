@@ -0,0 +1,188 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench/bench.h"
+
+#include "hook/checksum.h"
+#include "hook/iobuf.h"
+
+/* Throughput of the checksum module across a range of buffer sizes, alongside
+   a bit-at-a-time CRC-32 as a baseline. Correctness is covered by
+   test/checksum-test.c. */
+
+#define BENCH_MIN_RUN_NS UINT64_C(100000000)
+#define BENCH_MAX_SIZE 65536
+
+enum bench_algo {
+    BENCH_ALGO_SUM8,
+    BENCH_ALGO_CRC8,
+    BENCH_ALGO_CRC16,
+    BENCH_ALGO_CRC32,
+    BENCH_ALGO_CRC32_BITWISE,
+};
+
+static uint32_t bench_ref_crc32(const uint8_t *bytes, size_t nbytes);
+static uint32_t bench_checksum(
+        enum bench_algo algo,
+        const uint8_t *bytes,
+        size_t nbytes);
+static void bench_loop(
+        enum bench_algo algo,
+        const uint8_t *bytes,
+        size_t nbytes,
+        uint64_t niters);
+static uint64_t bench_calibrate(
+        enum bench_algo algo,
+        const uint8_t *bytes,
+        size_t nbytes);
+
+static const char *const bench_algo_names[] = {
+    "sum8",
+    "crc8",
+    "crc16_ccitt",
+    "crc32",
+    "crc32_bitwise",
+};
+
+static const size_t bench_sizes[] = { 16, 64, 256, 4096, BENCH_MAX_SIZE };
+
+static uint8_t bench_buf[BENCH_MAX_SIZE];
+static volatile uint32_t bench_sink;
+
+int main(int argc, char **argv)
+{
+    struct bench_report r;
+    enum bench_algo algo;
+    uint64_t niters;
+    uint64_t begin;
+    uint64_t elapsed;
+    size_t nbytes;
+    size_t i;
+    size_t j;
+
+    (void) argc;
+    (void) argv;
+
+    srand(1);
+
+    for (i = 0 ; i < sizeof(bench_buf) ; i++) {
+        bench_buf[i] = rand();
+    }
+
+    bench_report_begin(&r, stdout, "checksum");
+
+    for (i = 0 ; i < _countof(bench_algo_names) ; i++) {
+        algo = (enum bench_algo) i;
+
+        for (j = 0 ; j < _countof(bench_sizes) ; j++) {
+            nbytes = bench_sizes[j];
+            niters = bench_calibrate(algo, bench_buf, nbytes);
+
+            begin = bench_now_ns();
+            bench_loop(algo, bench_buf, nbytes, niters);
+            elapsed = bench_now_ns() - begin;
+
+            bench_row_begin(&r);
+            bench_field_str(&r, "algorithm", bench_algo_names[i]);
+            bench_field_uint(&r, "bytes", nbytes);
+            bench_field_uint(&r, "iterations", niters);
+            bench_field_double(&r, "ns_per_op", (double) elapsed / niters);
+            bench_field_double(
+                    &r,
+                    "bytes_per_sec",
+                    (double) niters * nbytes * 1e9 / elapsed);
+            bench_row_end(&r);
+        }
+    }
+
+    bench_report_end(&r);
+
+    return EXIT_SUCCESS;
+}
+
+static uint32_t bench_ref_crc32(const uint8_t *bytes, size_t nbytes)
+{
+    uint32_t crc;
+    size_t i;
+    int j;
+
+    crc = ~UINT32_C(0);
+
+    for (i = 0 ; i < nbytes ; i++) {
+        crc ^= bytes[i];
+
+        for (j = 0 ; j < 8 ; j++) {
+            crc = (crc >> 1) ^ (crc & 1 ? UINT32_C(0xEDB88320) : 0);
+        }
+    }
+
+    return ~crc;
+}
+
+static uint32_t bench_checksum(
+        enum bench_algo algo,
+        const uint8_t *bytes,
+        size_t nbytes)
+{
+    struct const_iobuf span;
+
+    span.bytes = bytes;
+    span.nbytes = nbytes;
+    span.pos = 0;
+
+    switch (algo) {
+    case BENCH_ALGO_SUM8:           return checksum_sum8(0, &span);
+    case BENCH_ALGO_CRC8:           return checksum_crc8(0, &span);
+    case BENCH_ALGO_CRC16:          return checksum_crc16_ccitt(0xFFFF, &span);
+    case BENCH_ALGO_CRC32:          return checksum_crc32(0, &span);
+    case BENCH_ALGO_CRC32_BITWISE:  return bench_ref_crc32(bytes, nbytes);
+    default:                        abort();
+    }
+}
+
+static void bench_loop(
+        enum bench_algo algo,
+        const uint8_t *bytes,
+        size_t nbytes,
+        uint64_t niters)
+{
+    uint32_t acc;
+    uint64_t i;
+
+    acc = 0;
+
+    for (i = 0 ; i < niters ; i++) {
+        acc += bench_checksum(algo, bytes, nbytes);
+    }
+
+    bench_sink = acc;
+}
+
+static uint64_t bench_calibrate(
+        enum bench_algo algo,
+        const uint8_t *bytes,
+        size_t nbytes)
+{
+    uint64_t niters;
+    uint64_t begin;
+    uint64_t elapsed;
+
+    niters = 1;
+
+    for (;;) {
+        begin = bench_now_ns();
+        bench_loop(algo, bytes, nbytes, niters);
+        elapsed = bench_now_ns() - begin;
+
+        if (elapsed >= BENCH_MIN_RUN_NS / 4) {
+            return niters * 4;
+        }
+
+        niters *= 2;
+    }
+}
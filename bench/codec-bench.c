@@ -0,0 +1,331 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench/bench.h"
+
+#include "hook/iobuf-codec.h"
+#include "hook/iobuf.h"
+
+/* Encode and decode throughput for a representative mixed-endian packet
+   header, comparing the code generated by IOBUF_CODEC_DECLARE() with the
+   hand-written chain of iobuf_read_*() and iobuf_write_*() calls that it
+   replaces, and with the table-driven iobuf_codec_decode() and
+   iobuf_codec_encode(). Correctness is covered by test/iobuf-test.c. */
+
+#define BENCH_MIN_RUN_NS UINT64_C(100000000)
+#define BENCH_NPKTS 256
+
+#define BENCH_PKT_FIELDS(X) \
+        X(8,    sync) \
+        X(8,    cmd) \
+        X(le16, seq) \
+        X(be32, addr) \
+        X(le32, length) \
+        X(be16, status) \
+        X(le64, timestamp)
+
+IOBUF_CODEC_DECLARE(bench_pkt, BENCH_PKT_FIELDS)
+IOBUF_CODEC_DEFINE(bench_pkt, BENCH_PKT_FIELDS)
+
+#define BENCH_PKT_NBYTES sizeof(struct bench_pkt_wire)
+
+enum bench_impl {
+    BENCH_IMPL_GENERATED,
+    BENCH_IMPL_MANUAL,
+    BENCH_IMPL_TABLE,
+};
+
+struct bench_case {
+    const char *op;
+    const char *impl_name;
+    enum bench_impl impl;
+    bool encode;
+};
+
+static void bench_setup(void);
+static HRESULT bench_decode(
+        enum bench_impl impl,
+        struct const_iobuf *src,
+        struct bench_pkt *pkt);
+static HRESULT bench_encode(
+        enum bench_impl impl,
+        struct iobuf *dest,
+        const struct bench_pkt *pkt);
+static HRESULT bench_manual_decode(
+        struct const_iobuf *src,
+        struct bench_pkt *pkt);
+static HRESULT bench_manual_encode(
+        struct iobuf *dest,
+        const struct bench_pkt *pkt);
+static void bench_loop(const struct bench_case *c, uint64_t niters);
+static uint64_t bench_calibrate(const struct bench_case *c);
+
+static const struct bench_case bench_cases[] = {
+    { "decode", "generated",  BENCH_IMPL_GENERATED, false },
+    { "decode", "manual",     BENCH_IMPL_MANUAL,    false },
+    { "decode", "table",      BENCH_IMPL_TABLE,     false },
+    { "encode", "generated",  BENCH_IMPL_GENERATED, true  },
+    { "encode", "manual",     BENCH_IMPL_MANUAL,    true  },
+    { "encode", "table",      BENCH_IMPL_TABLE,     true  },
+};
+
+static uint8_t bench_wire[BENCH_NPKTS * BENCH_PKT_NBYTES];
+static uint8_t bench_scratch[BENCH_NPKTS * BENCH_PKT_NBYTES];
+static struct bench_pkt bench_pkts[BENCH_NPKTS];
+static volatile uint64_t bench_sink;
+
+int main(int argc, char **argv)
+{
+    struct bench_report r;
+    const struct bench_case *c;
+    uint64_t niters;
+    uint64_t nops;
+    uint64_t begin;
+    uint64_t elapsed;
+    size_t i;
+
+    (void) argc;
+    (void) argv;
+
+    srand(1);
+
+    for (i = 0 ; i < sizeof(bench_wire) ; i++) {
+        bench_wire[i] = rand();
+    }
+
+    bench_setup();
+
+    bench_report_begin(&r, stdout, "codec");
+
+    for (i = 0 ; i < _countof(bench_cases) ; i++) {
+        c = &bench_cases[i];
+        niters = bench_calibrate(c);
+
+        begin = bench_now_ns();
+        bench_loop(c, niters);
+        elapsed = bench_now_ns() - begin;
+
+        nops = niters * BENCH_NPKTS;
+
+        bench_row_begin(&r);
+        bench_field_str(&r, "op", c->op);
+        bench_field_str(&r, "impl", c->impl_name);
+        bench_field_uint(&r, "bytes", BENCH_PKT_NBYTES);
+        bench_field_uint(&r, "iterations", nops);
+        bench_field_double(&r, "ns_per_op", (double) elapsed / nops);
+        bench_field_double(
+                &r,
+                "bytes_per_sec",
+                (double) nops * BENCH_PKT_NBYTES * 1e9 / elapsed);
+        bench_row_end(&r);
+    }
+
+    bench_report_end(&r);
+
+    return EXIT_SUCCESS;
+}
+
+static void bench_setup(void)
+{
+    struct const_iobuf span;
+    size_t i;
+
+    /* Decode the random wire data once for the encode cases to work on */
+
+    span.bytes = bench_wire;
+    span.nbytes = sizeof(bench_wire);
+    span.pos = 0;
+
+    for (i = 0 ; i < BENCH_NPKTS ; i++) {
+        bench_pkt_decode(&span, &bench_pkts[i]);
+    }
+}
+
+static HRESULT bench_decode(
+        enum bench_impl impl,
+        struct const_iobuf *src,
+        struct bench_pkt *pkt)
+{
+    switch (impl) {
+    case BENCH_IMPL_GENERATED:
+        return bench_pkt_decode(src, pkt);
+
+    case BENCH_IMPL_MANUAL:
+        return bench_manual_decode(src, pkt);
+
+    case BENCH_IMPL_TABLE:
+        return iobuf_codec_decode(bench_pkt_codec(), src, pkt);
+
+    default:
+        abort();
+    }
+}
+
+static HRESULT bench_encode(
+        enum bench_impl impl,
+        struct iobuf *dest,
+        const struct bench_pkt *pkt)
+{
+    switch (impl) {
+    case BENCH_IMPL_GENERATED:
+        return bench_pkt_encode(dest, pkt);
+
+    case BENCH_IMPL_MANUAL:
+        return bench_manual_encode(dest, pkt);
+
+    case BENCH_IMPL_TABLE:
+        return iobuf_codec_encode(bench_pkt_codec(), dest, pkt);
+
+    default:
+        abort();
+    }
+}
+
+static HRESULT bench_manual_decode(
+        struct const_iobuf *src,
+        struct bench_pkt *pkt)
+{
+    size_t pos;
+    HRESULT hr;
+
+    /* What this would look like without the codec macros. Note the explicit
+       rewind, which is needed to leave src untouched on failure. */
+
+    pos = src->pos;
+    hr = iobuf_read_8(src, &pkt->sync);
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_read_8(src, &pkt->cmd);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_read_le16(src, &pkt->seq);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_read_be32(src, &pkt->addr);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_read_le32(src, &pkt->length);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_read_be16(src, &pkt->status);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_read_le64(src, &pkt->timestamp);
+    }
+
+    if (FAILED(hr)) {
+        src->pos = pos;
+    }
+
+    return hr;
+}
+
+static HRESULT bench_manual_encode(
+        struct iobuf *dest,
+        const struct bench_pkt *pkt)
+{
+    size_t pos;
+    HRESULT hr;
+
+    pos = dest->pos;
+    hr = iobuf_write_8(dest, pkt->sync);
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_write_8(dest, pkt->cmd);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_write_le16(dest, pkt->seq);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_write_be32(dest, pkt->addr);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_write_le32(dest, pkt->length);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_write_be16(dest, pkt->status);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_write_le64(dest, pkt->timestamp);
+    }
+
+    if (FAILED(hr)) {
+        dest->pos = pos;
+    }
+
+    return hr;
+}
+
+static void bench_loop(const struct bench_case *c, uint64_t niters)
+{
+    struct const_iobuf span;
+    struct iobuf dest;
+    struct bench_pkt pkt;
+    uint64_t acc;
+    uint64_t i;
+    size_t j;
+
+    acc = 0;
+
+    for (i = 0 ; i < niters ; i++) {
+        if (c->encode) {
+            dest.bytes = bench_scratch;
+            dest.nbytes = sizeof(bench_scratch);
+            dest.pos = 0;
+
+            for (j = 0 ; j < BENCH_NPKTS ; j++) {
+                acc += bench_encode(c->impl, &dest, &bench_pkts[j]);
+            }
+
+            acc += bench_scratch[i % sizeof(bench_scratch)];
+        } else {
+            span.bytes = bench_wire;
+            span.nbytes = sizeof(bench_wire);
+            span.pos = 0;
+
+            for (j = 0 ; j < BENCH_NPKTS ; j++) {
+                acc += bench_decode(c->impl, &span, &pkt);
+                acc += pkt.addr ^ pkt.timestamp;
+            }
+        }
+    }
+
+    bench_sink = acc;
+}
+
+static uint64_t bench_calibrate(const struct bench_case *c)
+{
+    uint64_t niters;
+    uint64_t begin;
+    uint64_t elapsed;
+
+    niters = 1;
+
+    for (;;) {
+        begin = bench_now_ns();
+        bench_loop(c, niters);
+        elapsed = bench_now_ns() - begin;
+
+        if (elapsed >= BENCH_MIN_RUN_NS / 4) {
+            return niters * 4;
+        }
+
+        niters *= 2;
+    }
+}
@@ -0,0 +1,252 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench/bench.h"
+
+#include "hook/iohook.h"
+
+/* Measures the cost of iohook's handler chain on its own, with no IAT hooks
+   and no kernel round trip involved. IRPs are fed straight into
+   iohook_invoke_next() and terminated by a handler at the end of the chain
+   that completes them without calling any further, so unlike iohook-bench
+   this one only needs the dispatch core and runs on host builds too.
+
+   All of the passthrough handlers are pushed up front, followed by the
+   terminal handler. Varying the handler index that an IRP starts at then
+   selects how many passthroughs it traverses. */
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_MAX_HANDLERS 32
+#define BENCH_MIN_RUN_NS UINT64_C(100000000)
+
+struct bench_thread {
+    HANDLE thread;
+    size_t nhandlers;
+    uint64_t niters;
+};
+
+static HRESULT bench_passthru(struct irp *irp);
+static HRESULT bench_terminal(struct irp *irp);
+static void bench_dispatch(size_t nhandlers, uint64_t niters);
+static uint64_t bench_calibrate(size_t nhandlers);
+static uint64_t bench_run_threads(
+        size_t nhandlers,
+        uint64_t niters,
+        unsigned int nthreads);
+static DWORD WINAPI bench_thread_proc(void *ctx);
+
+static const size_t bench_handler_counts[] = { 0, 1, 8, 32 };
+
+static HANDLE bench_start;
+
+int main(int argc, char **argv)
+{
+    struct bench_report r;
+    SYSTEM_INFO si;
+    unsigned int max_threads;
+    unsigned int nthreads;
+    uint64_t niters;
+    uint64_t elapsed;
+    size_t nhandlers;
+    size_t i;
+    HRESULT hr;
+
+    GetSystemInfo(&si);
+    max_threads = si.dwNumberOfProcessors;
+
+    if (argc > 1) {
+        max_threads = atoi(argv[1]);
+    }
+
+    if (max_threads < 1) {
+        max_threads = 1;
+    } else if (max_threads > BENCH_MAX_THREADS) {
+        max_threads = BENCH_MAX_THREADS;
+    }
+
+    for (i = 0 ; i < BENCH_MAX_HANDLERS ; i++) {
+        hr = iohook_push_handler(bench_passthru);
+
+        if (FAILED(hr)) {
+            fprintf(stderr, "iohook_push_handler failed: %x\n", (int) hr);
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    hr = iohook_push_handler(bench_terminal);
+
+    if (FAILED(hr)) {
+        fprintf(stderr, "iohook_push_handler failed: %x\n", (int) hr);
+
+        return EXIT_FAILURE;
+    }
+
+    bench_start = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    if (bench_start == NULL) {
+        fprintf(stderr, "CreateEventW failed: %x\n", (int) GetLastError());
+
+        return EXIT_FAILURE;
+    }
+
+    bench_report_begin(&r, stdout, "dispatch");
+
+    for (i = 0 ; i < _countof(bench_handler_counts) ; i++) {
+        nhandlers = bench_handler_counts[i];
+        niters = bench_calibrate(nhandlers);
+        nthreads = 1;
+
+        for (;;) {
+            elapsed = bench_run_threads(nhandlers, niters, nthreads);
+
+            bench_row_begin(&r);
+            bench_field_uint(&r, "handlers", nhandlers);
+            bench_field_uint(&r, "threads", nthreads);
+            bench_field_uint(&r, "iterations", niters);
+            bench_field_double(&r, "ns_per_irp", (double) elapsed / niters);
+            bench_field_double(
+                    &r,
+                    "irps_per_sec",
+                    (double) niters * nthreads * 1e9 / elapsed);
+            bench_row_end(&r);
+
+            if (nthreads == max_threads) {
+                break;
+            } else if (nthreads * 2 < max_threads) {
+                nthreads *= 2;
+            } else {
+                nthreads = max_threads;
+            }
+        }
+    }
+
+    bench_report_end(&r);
+    CloseHandle(bench_start);
+
+    return EXIT_SUCCESS;
+}
+
+static HRESULT bench_passthru(struct irp *irp)
+{
+    return iohook_invoke_next(irp);
+}
+
+static HRESULT bench_terminal(struct irp *irp)
+{
+    irp->read.pos = irp->read.nbytes;
+
+    return S_OK;
+}
+
+static void bench_dispatch(size_t nhandlers, uint64_t niters)
+{
+    struct irp irp;
+    uint8_t buf[16];
+    uint64_t i;
+    HRESULT hr;
+
+    assert(nhandlers <= BENCH_MAX_HANDLERS);
+
+    for (i = 0 ; i < niters ; i++) {
+        memset(&irp, 0, sizeof(irp));
+        irp.op = IRP_OP_READ;
+        irp.next_handler = BENCH_MAX_HANDLERS - nhandlers;
+        irp.fd = INVALID_HANDLE_VALUE;
+        irp.read.bytes = buf;
+        irp.read.nbytes = sizeof(buf);
+
+        hr = iohook_invoke_next(&irp);
+
+        if (FAILED(hr)) {
+            fprintf(stderr, "iohook_invoke_next failed: %x\n", (int) hr);
+            abort();
+        }
+    }
+}
+
+static uint64_t bench_calibrate(size_t nhandlers)
+{
+    uint64_t niters;
+    uint64_t begin;
+    uint64_t elapsed;
+
+    niters = 1000;
+
+    for (;;) {
+        begin = bench_now_ns();
+        bench_dispatch(nhandlers, niters);
+        elapsed = bench_now_ns() - begin;
+
+        if (elapsed >= BENCH_MIN_RUN_NS / 4) {
+            return niters * 4;
+        }
+
+        niters *= 2;
+    }
+}
+
+static uint64_t bench_run_threads(
+        size_t nhandlers,
+        uint64_t niters,
+        unsigned int nthreads)
+{
+    struct bench_thread threads[BENCH_MAX_THREADS];
+    HANDLE handles[BENCH_MAX_THREADS];
+    uint64_t begin;
+    uint64_t end;
+    unsigned int i;
+
+    assert(nthreads <= BENCH_MAX_THREADS);
+
+    ResetEvent(bench_start);
+
+    for (i = 0 ; i < nthreads ; i++) {
+        threads[i].nhandlers = nhandlers;
+        threads[i].niters = niters;
+        threads[i].thread = CreateThread(
+                NULL,
+                0,
+                bench_thread_proc,
+                &threads[i],
+                0,
+                NULL);
+
+        if (threads[i].thread == NULL) {
+            fprintf(stderr, "CreateThread failed\n");
+            abort();
+        }
+
+        handles[i] = threads[i].thread;
+    }
+
+    Sleep(10);
+
+    begin = bench_now_ns();
+    SetEvent(bench_start);
+    WaitForMultipleObjects(nthreads, handles, TRUE, INFINITE);
+    end = bench_now_ns();
+
+    for (i = 0 ; i < nthreads ; i++) {
+        CloseHandle(handles[i]);
+    }
+
+    return end - begin;
+}
+
+static DWORD WINAPI bench_thread_proc(void *ctx)
+{
+    struct bench_thread *t;
+
+    t = ctx;
+    WaitForSingleObject(bench_start, INFINITE);
+    bench_dispatch(t->nhandlers, t->niters);
+
+    return 0;
+}
@@ -0,0 +1,359 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench/bench.h"
+
+#include "hook/iobuf.h"
+
+/* Baseline numbers for the core iobuf primitives. Bulk operations (move,
+   shift, read, write) are timed across a range of transfer sizes, fixed-width
+   accessors are timed over a batch of back-to-back fields, and everything is
+   run both from a 64-byte aligned base and from one byte past it so that
+   unaligned-access penalties show up. Correctness is covered by
+   test/iobuf-test.c.
+
+   For shift, src starts out holding twice as many bytes as dest has room for,
+   so every operation moves nbytes into dest and then compacts another nbytes
+   within src; the reported byte count is the nbytes transferred to dest. */
+
+#define BENCH_MIN_RUN_NS UINT64_C(100000000)
+#define BENCH_MAX_SIZE 65536
+#define BENCH_BATCH 256
+#define BENCH_BUF_SIZE (2 * BENCH_MAX_SIZE + 128)
+
+enum bench_op {
+    BENCH_OP_MOVE,
+    BENCH_OP_SHIFT,
+    BENCH_OP_READ,
+    BENCH_OP_WRITE,
+    BENCH_OP_READ_8,
+    BENCH_OP_READ_BE16,
+    BENCH_OP_READ_LE16,
+    BENCH_OP_READ_BE32,
+    BENCH_OP_READ_LE32,
+    BENCH_OP_READ_BE64,
+    BENCH_OP_READ_LE64,
+    BENCH_OP_WRITE_8,
+    BENCH_OP_WRITE_BE16,
+    BENCH_OP_WRITE_LE16,
+    BENCH_OP_WRITE_BE32,
+    BENCH_OP_WRITE_LE32,
+    BENCH_OP_WRITE_BE64,
+    BENCH_OP_WRITE_LE64,
+};
+
+struct bench_case {
+    const char *op;
+    enum bench_op which;
+    size_t width;
+};
+
+static uint8_t *bench_align64(uint8_t *bytes);
+static size_t bench_nops(const struct bench_case *c);
+static void bench_loop(
+        const struct bench_case *c,
+        size_t nbytes,
+        size_t align,
+        uint64_t niters);
+static uint64_t bench_read_scalar(
+        enum bench_op which,
+        struct const_iobuf *src);
+static HRESULT bench_write_scalar(
+        enum bench_op which,
+        struct iobuf *dest,
+        uint64_t value);
+static uint64_t bench_calibrate(
+        const struct bench_case *c,
+        size_t nbytes,
+        size_t align);
+
+/* A width of zero denotes a bulk operation that is run at each of the
+   bench_sizes[] below; the rest move a single field of the given width. */
+
+static const struct bench_case bench_cases[] = {
+    { "move",       BENCH_OP_MOVE,          0 },
+    { "shift",      BENCH_OP_SHIFT,         0 },
+    { "read",       BENCH_OP_READ,          0 },
+    { "write",      BENCH_OP_WRITE,         0 },
+    { "read_8",     BENCH_OP_READ_8,        1 },
+    { "read_be16",  BENCH_OP_READ_BE16,     2 },
+    { "read_le16",  BENCH_OP_READ_LE16,     2 },
+    { "read_be32",  BENCH_OP_READ_BE32,     4 },
+    { "read_le32",  BENCH_OP_READ_LE32,     4 },
+    { "read_be64",  BENCH_OP_READ_BE64,     8 },
+    { "read_le64",  BENCH_OP_READ_LE64,     8 },
+    { "write_8",    BENCH_OP_WRITE_8,       1 },
+    { "write_be16", BENCH_OP_WRITE_BE16,    2 },
+    { "write_le16", BENCH_OP_WRITE_LE16,    2 },
+    { "write_be32", BENCH_OP_WRITE_BE32,    4 },
+    { "write_le32", BENCH_OP_WRITE_LE32,    4 },
+    { "write_be64", BENCH_OP_WRITE_BE64,    8 },
+    { "write_le64", BENCH_OP_WRITE_LE64,    8 },
+};
+
+static const size_t bench_sizes[] = { 1, 16, 256, 4096, BENCH_MAX_SIZE };
+static const size_t bench_aligns[] = { 0, 1 };
+
+static uint8_t bench_src_raw[BENCH_BUF_SIZE];
+static uint8_t bench_dest_raw[BENCH_BUF_SIZE];
+static uint8_t *bench_src;
+static uint8_t *bench_dest;
+static volatile uint64_t bench_sink;
+
+int main(int argc, char **argv)
+{
+    struct bench_report r;
+    const struct bench_case *c;
+    uint64_t niters;
+    uint64_t nops;
+    uint64_t begin;
+    uint64_t elapsed;
+    size_t nbytes;
+    size_t align;
+    size_t nsizes;
+    size_t i;
+    size_t j;
+    size_t k;
+
+    (void) argc;
+    (void) argv;
+
+    bench_src = bench_align64(bench_src_raw);
+    bench_dest = bench_align64(bench_dest_raw);
+
+    srand(1);
+
+    for (i = 0 ; i < 2 * BENCH_MAX_SIZE + 64 ; i++) {
+        bench_src[i] = rand();
+    }
+
+    bench_report_begin(&r, stdout, "iobuf");
+
+    for (i = 0 ; i < _countof(bench_cases) ; i++) {
+        c = &bench_cases[i];
+        nsizes = c->width == 0 ? _countof(bench_sizes) : 1;
+
+        for (j = 0 ; j < nsizes ; j++) {
+            nbytes = c->width == 0 ? bench_sizes[j] : c->width;
+
+            for (k = 0 ; k < _countof(bench_aligns) ; k++) {
+                align = bench_aligns[k];
+                niters = bench_calibrate(c, nbytes, align);
+
+                begin = bench_now_ns();
+                bench_loop(c, nbytes, align, niters);
+                elapsed = bench_now_ns() - begin;
+
+                nops = niters * bench_nops(c);
+
+                bench_row_begin(&r);
+                bench_field_str(&r, "op", c->op);
+                bench_field_uint(&r, "bytes", nbytes);
+                bench_field_uint(&r, "align", align);
+                bench_field_uint(&r, "iterations", nops);
+                bench_field_double(&r, "ns_per_op", (double) elapsed / nops);
+                bench_field_double(
+                        &r,
+                        "bytes_per_sec",
+                        (double) nops * nbytes * 1e9 / elapsed);
+                bench_row_end(&r);
+            }
+        }
+    }
+
+    bench_report_end(&r);
+
+    return EXIT_SUCCESS;
+}
+
+static uint8_t *bench_align64(uint8_t *bytes)
+{
+    return (uint8_t *) (((uintptr_t) bytes + 63) & ~(uintptr_t) 63);
+}
+
+static size_t bench_nops(const struct bench_case *c)
+{
+    return c->width == 0 ? 1 : BENCH_BATCH;
+}
+
+static void bench_loop(
+        const struct bench_case *c,
+        size_t nbytes,
+        size_t align,
+        uint64_t niters)
+{
+    struct const_iobuf span;
+    struct iobuf dest;
+    struct iobuf src;
+    uint64_t acc;
+    uint64_t i;
+    size_t j;
+
+    acc = 0;
+
+    switch (c->which) {
+    case BENCH_OP_MOVE:
+        for (i = 0 ; i < niters ; i++) {
+            dest.bytes = &bench_dest[align];
+            dest.nbytes = nbytes;
+            dest.pos = 0;
+            span.bytes = &bench_src[align];
+            span.nbytes = nbytes;
+            span.pos = 0;
+
+            acc += iobuf_move(&dest, &span);
+        }
+
+        break;
+
+    case BENCH_OP_SHIFT:
+        src.bytes = &bench_src[align];
+        src.nbytes = 2 * nbytes;
+
+        for (i = 0 ; i < niters ; i++) {
+            dest.bytes = &bench_dest[align];
+            dest.nbytes = nbytes;
+            dest.pos = 0;
+            src.pos = 2 * nbytes;
+
+            acc += iobuf_shift(&dest, &src);
+        }
+
+        break;
+
+    case BENCH_OP_READ:
+        for (i = 0 ; i < niters ; i++) {
+            span.bytes = &bench_src[align];
+            span.nbytes = nbytes;
+            span.pos = 0;
+
+            acc += iobuf_read(&span, &bench_dest[align], nbytes);
+        }
+
+        break;
+
+    case BENCH_OP_WRITE:
+        for (i = 0 ; i < niters ; i++) {
+            dest.bytes = &bench_dest[align];
+            dest.nbytes = nbytes;
+            dest.pos = 0;
+
+            acc += iobuf_write(&dest, &bench_src[align], nbytes);
+        }
+
+        break;
+
+    case BENCH_OP_READ_8:
+    case BENCH_OP_READ_BE16:
+    case BENCH_OP_READ_LE16:
+    case BENCH_OP_READ_BE32:
+    case BENCH_OP_READ_LE32:
+    case BENCH_OP_READ_BE64:
+    case BENCH_OP_READ_LE64:
+        for (i = 0 ; i < niters ; i++) {
+            span.bytes = &bench_src[align];
+            span.nbytes = BENCH_BATCH * nbytes;
+            span.pos = 0;
+
+            for (j = 0 ; j < BENCH_BATCH ; j++) {
+                acc += bench_read_scalar(c->which, &span);
+            }
+        }
+
+        break;
+
+    default:
+        for (i = 0 ; i < niters ; i++) {
+            dest.bytes = &bench_dest[align];
+            dest.nbytes = BENCH_BATCH * nbytes;
+            dest.pos = 0;
+
+            for (j = 0 ; j < BENCH_BATCH ; j++) {
+                acc += bench_write_scalar(c->which, &dest, i + j);
+            }
+        }
+
+        break;
+    }
+
+    bench_sink = acc;
+}
+
+static uint64_t bench_read_scalar(
+        enum bench_op which,
+        struct const_iobuf *src)
+{
+    uint8_t v8;
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+    HRESULT hr;
+
+    v8 = 0;
+    v16 = 0;
+    v32 = 0;
+    v64 = 0;
+
+    switch (which) {
+    case BENCH_OP_READ_8:       hr = iobuf_read_8(src, &v8); break;
+    case BENCH_OP_READ_BE16:    hr = iobuf_read_be16(src, &v16); break;
+    case BENCH_OP_READ_LE16:    hr = iobuf_read_le16(src, &v16); break;
+    case BENCH_OP_READ_BE32:    hr = iobuf_read_be32(src, &v32); break;
+    case BENCH_OP_READ_LE32:    hr = iobuf_read_le32(src, &v32); break;
+    case BENCH_OP_READ_BE64:    hr = iobuf_read_be64(src, &v64); break;
+    case BENCH_OP_READ_LE64:    hr = iobuf_read_le64(src, &v64); break;
+    default:                    abort();
+    }
+
+    if (FAILED(hr)) {
+        abort();
+    }
+
+    return v8 | v16 | v32 | v64;
+}
+
+static HRESULT bench_write_scalar(
+        enum bench_op which,
+        struct iobuf *dest,
+        uint64_t value)
+{
+    switch (which) {
+    case BENCH_OP_WRITE_8:      return iobuf_write_8(dest, value);
+    case BENCH_OP_WRITE_BE16:   return iobuf_write_be16(dest, value);
+    case BENCH_OP_WRITE_LE16:   return iobuf_write_le16(dest, value);
+    case BENCH_OP_WRITE_BE32:   return iobuf_write_be32(dest, value);
+    case BENCH_OP_WRITE_LE32:   return iobuf_write_le32(dest, value);
+    case BENCH_OP_WRITE_BE64:   return iobuf_write_be64(dest, value);
+    case BENCH_OP_WRITE_LE64:   return iobuf_write_le64(dest, value);
+    default:                    abort();
+    }
+}
+
+static uint64_t bench_calibrate(
+        const struct bench_case *c,
+        size_t nbytes,
+        size_t align)
+{
+    uint64_t niters;
+    uint64_t begin;
+    uint64_t elapsed;
+
+    niters = 1;
+
+    for (;;) {
+        begin = bench_now_ns();
+        bench_loop(c, nbytes, align, niters);
+        elapsed = bench_now_ns() - begin;
+
+        if (elapsed >= BENCH_MIN_RUN_NS / 4) {
+            return niters * 4;
+        }
+
+        niters *= 2;
+    }
+}
@@ -0,0 +1,549 @@
+#include <windows.h>
+#include <winioctl.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench/bench.h"
+
+#include "hook/iohook.h"
+
+/* Measures the per-call overhead of routing Win32 file I/O through iohook.
+   Every operation targets the NUL device, so the cost of the kernel round
+   trip is the same for both paths and the difference between them is the
+   cost of the IAT hook plus the handler chain.
+
+   The "iohook" path calls the Win32 APIs normally, which lands in iohook's
+   hooks once iohook has patched our IAT. The "direct" path calls the real
+   kernel32 exports obtained through GetProcAddress, which is what iohook's
+   next_* pointers resolve to when nobody else has hooked the process. */
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_MIN_RUN_NS UINT64_C(100000000)
+#define BENCH_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, \
+        FILE_ANY_ACCESS)
+
+struct bench_direct {
+    HANDLE (WINAPI *CreateFileW)(
+            const wchar_t *filename,
+            uint32_t access,
+            uint32_t share,
+            SECURITY_ATTRIBUTES *sa,
+            uint32_t creation,
+            uint32_t flags,
+            HANDLE tmpl);
+    BOOL (WINAPI *CloseHandle)(HANDLE fd);
+    BOOL (WINAPI *ReadFile)(
+            HANDLE fd,
+            void *buf,
+            uint32_t nbytes,
+            uint32_t *nread,
+            OVERLAPPED *ovl);
+    BOOL (WINAPI *WriteFile)(
+            HANDLE fd,
+            const void *buf,
+            uint32_t nbytes,
+            uint32_t *nwrit,
+            OVERLAPPED *ovl);
+    BOOL (WINAPI *DeviceIoControl)(
+            HANDLE fd,
+            uint32_t code,
+            void *in_bytes,
+            uint32_t in_nbytes,
+            void *out_bytes,
+            uint32_t out_nbytes,
+            uint32_t *out_returned,
+            OVERLAPPED *ovl);
+    BOOL (WINAPI *SetFilePointerEx)(
+            HANDLE fd,
+            int64_t offset,
+            uint64_t *pos,
+            uint32_t origin);
+};
+
+typedef void (*bench_op_fn_t)(uint64_t niters);
+
+struct bench_op {
+    const char *name;
+    bench_op_fn_t hooked;
+    bench_op_fn_t direct;
+};
+
+struct bench_thread {
+    HANDLE thread;
+    bench_op_fn_t fn;
+    uint64_t niters;
+};
+
+static HRESULT bench_init(void);
+static HRESULT bench_passthru(struct irp *irp);
+static void bench_run_op(
+        struct bench_report *r,
+        const struct bench_op *op,
+        const char *path,
+        bench_op_fn_t fn,
+        size_t nhandlers,
+        unsigned int max_threads);
+static uint64_t bench_calibrate(bench_op_fn_t fn);
+static uint64_t bench_run_threads(
+        bench_op_fn_t fn,
+        uint64_t niters,
+        unsigned int nthreads);
+static DWORD WINAPI bench_thread_proc(void *ctx);
+
+static void bench_read_hooked(uint64_t niters);
+static void bench_read_direct(uint64_t niters);
+static void bench_write_hooked(uint64_t niters);
+static void bench_write_direct(uint64_t niters);
+static void bench_ioctl_hooked(uint64_t niters);
+static void bench_ioctl_direct(uint64_t niters);
+static void bench_seek_hooked(uint64_t niters);
+static void bench_seek_direct(uint64_t niters);
+static void bench_open_hooked(uint64_t niters);
+static void bench_open_direct(uint64_t niters);
+
+static const struct bench_op bench_ops[] = {
+    {
+        .name   = "ReadFile",
+        .hooked = bench_read_hooked,
+        .direct = bench_read_direct,
+    }, {
+        .name   = "WriteFile",
+        .hooked = bench_write_hooked,
+        .direct = bench_write_direct,
+    }, {
+        .name   = "DeviceIoControl",
+        .hooked = bench_ioctl_hooked,
+        .direct = bench_ioctl_direct,
+    }, {
+        .name   = "SetFilePointerEx",
+        .hooked = bench_seek_hooked,
+        .direct = bench_seek_direct,
+    }, {
+        /* Handles have to be closed again, so this one measures the pair */
+        .name   = "CreateFileW+CloseHandle",
+        .hooked = bench_open_hooked,
+        .direct = bench_open_direct,
+    },
+};
+
+static const size_t bench_handler_counts[] = { 0, 1, 8, 32 };
+
+static struct bench_direct bench_direct;
+static HANDLE bench_fd;
+static HANDLE bench_start;
+
+int main(int argc, char **argv)
+{
+    struct bench_report r;
+    SYSTEM_INFO si;
+    unsigned int max_threads;
+    size_t nhandlers;
+    size_t i;
+    size_t j;
+    HRESULT hr;
+
+    GetSystemInfo(&si);
+    max_threads = si.dwNumberOfProcessors;
+
+    if (argc > 1) {
+        max_threads = atoi(argv[1]);
+    }
+
+    if (max_threads < 1) {
+        max_threads = 1;
+    } else if (max_threads > BENCH_MAX_THREADS) {
+        max_threads = BENCH_MAX_THREADS;
+    }
+
+    hr = bench_init();
+
+    if (FAILED(hr)) {
+        fprintf(stderr, "Benchmark setup failed: %x\n", (int) hr);
+
+        return EXIT_FAILURE;
+    }
+
+    bench_report_begin(&r, stdout, "iohook");
+
+    for (i = 0 ; i < _countof(bench_ops) ; i++) {
+        bench_run_op(&r, &bench_ops[i], "direct", bench_ops[i].direct,
+                0, max_threads);
+    }
+
+    /* Handlers cannot be removed again, so work our way upwards */
+
+    nhandlers = 0;
+
+    for (j = 0 ; j < _countof(bench_handler_counts) ; j++) {
+        while (nhandlers < bench_handler_counts[j]) {
+            hr = iohook_push_handler(bench_passthru);
+
+            if (FAILED(hr)) {
+                fprintf(stderr, "iohook_push_handler failed: %x\n", (int) hr);
+
+                return EXIT_FAILURE;
+            }
+
+            nhandlers++;
+        }
+
+        for (i = 0 ; i < _countof(bench_ops) ; i++) {
+            bench_run_op(&r, &bench_ops[i], "iohook", bench_ops[i].hooked,
+                    nhandlers, max_threads);
+        }
+    }
+
+    bench_report_end(&r);
+
+    return EXIT_SUCCESS;
+}
+
+static HRESULT bench_init(void)
+{
+    HMODULE kernel32;
+    HANDLE fd;
+    HRESULT hr;
+
+    /* Resolve the real exports before iohook gets anywhere near our IAT */
+
+    kernel32 = GetModuleHandleW(L"kernel32.dll");
+
+    bench_direct.CreateFileW = (void *) GetProcAddress(
+            kernel32,
+            "CreateFileW");
+    bench_direct.CloseHandle = (void *) GetProcAddress(
+            kernel32,
+            "CloseHandle");
+    bench_direct.ReadFile = (void *) GetProcAddress(kernel32, "ReadFile");
+    bench_direct.WriteFile = (void *) GetProcAddress(kernel32, "WriteFile");
+    bench_direct.DeviceIoControl = (void *) GetProcAddress(
+            kernel32,
+            "DeviceIoControl");
+    bench_direct.SetFilePointerEx = (void *) GetProcAddress(
+            kernel32,
+            "SetFilePointerEx");
+
+    /* Opening a NUL handle makes iohook install itself */
+
+    hr = iohook_open_nul_fd(&fd);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    bench_direct.CloseHandle(fd);
+
+    /* Unlike iohook's own NUL handle, this one is not opened for overlapped
+       I/O, since we want plain synchronous calls. */
+
+    bench_fd = bench_direct.CreateFileW(
+            L"NUL",
+            GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL,
+            OPEN_EXISTING,
+            0,
+            NULL);
+
+    if (bench_fd == INVALID_HANDLE_VALUE) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    bench_start = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    if (bench_start == NULL) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    return S_OK;
+}
+
+static HRESULT bench_passthru(struct irp *irp)
+{
+    return iohook_invoke_next(irp);
+}
+
+static void bench_run_op(
+        struct bench_report *r,
+        const struct bench_op *op,
+        const char *path,
+        bench_op_fn_t fn,
+        size_t nhandlers,
+        unsigned int max_threads)
+{
+    unsigned int nthreads;
+    uint64_t niters;
+    uint64_t elapsed;
+
+    niters = bench_calibrate(fn);
+    nthreads = 1;
+
+    for (;;) {
+        elapsed = bench_run_threads(fn, niters, nthreads);
+
+        bench_row_begin(r);
+        bench_field_str(r, "op", op->name);
+        bench_field_str(r, "path", path);
+
+        if (strcmp(path, "iohook") == 0) {
+            bench_field_uint(r, "handlers", nhandlers);
+        }
+
+        bench_field_uint(r, "threads", nthreads);
+        bench_field_uint(r, "iterations", niters);
+        bench_field_double(r, "ns_per_call", (double) elapsed / niters);
+        bench_field_double(
+                r,
+                "calls_per_sec",
+                (double) niters * nthreads * 1e9 / elapsed);
+        bench_row_end(r);
+
+        /* Double up each time, but make sure that the machine's full width
+           gets measured even when it is not a power of two. */
+
+        if (nthreads == max_threads) {
+            break;
+        } else if (nthreads * 2 < max_threads) {
+            nthreads *= 2;
+        } else {
+            nthreads = max_threads;
+        }
+    }
+}
+
+static uint64_t bench_calibrate(bench_op_fn_t fn)
+{
+    uint64_t niters;
+    uint64_t begin;
+    uint64_t elapsed;
+
+    /* Find an iteration count that keeps a single thread busy for long
+       enough to drown out timer resolution and thread startup costs. */
+
+    niters = 1000;
+
+    for (;;) {
+        begin = bench_now_ns();
+        fn(niters);
+        elapsed = bench_now_ns() - begin;
+
+        if (elapsed >= BENCH_MIN_RUN_NS / 4) {
+            return niters * 4;
+        }
+
+        niters *= 2;
+    }
+}
+
+static uint64_t bench_run_threads(
+        bench_op_fn_t fn,
+        uint64_t niters,
+        unsigned int nthreads)
+{
+    struct bench_thread threads[BENCH_MAX_THREADS];
+    HANDLE handles[BENCH_MAX_THREADS];
+    uint64_t begin;
+    uint64_t end;
+    unsigned int i;
+
+    assert(nthreads <= BENCH_MAX_THREADS);
+
+    ResetEvent(bench_start);
+
+    for (i = 0 ; i < nthreads ; i++) {
+        threads[i].fn = fn;
+        threads[i].niters = niters;
+        threads[i].thread = CreateThread(
+                NULL,
+                0,
+                bench_thread_proc,
+                &threads[i],
+                0,
+                NULL);
+
+        if (threads[i].thread == NULL) {
+            fprintf(stderr, "CreateThread failed\n");
+            abort();
+        }
+
+        handles[i] = threads[i].thread;
+    }
+
+    /* Let the threads get to the starting line before firing the gun. The
+       number we report is the wall clock time for the whole batch, so with
+       multiple threads it reflects any contention inside iohook. */
+
+    Sleep(10);
+
+    begin = bench_now_ns();
+    SetEvent(bench_start);
+    WaitForMultipleObjects(nthreads, handles, TRUE, INFINITE);
+    end = bench_now_ns();
+
+    for (i = 0 ; i < nthreads ; i++) {
+        bench_direct.CloseHandle(handles[i]);
+    }
+
+    return end - begin;
+}
+
+static DWORD WINAPI bench_thread_proc(void *ctx)
+{
+    struct bench_thread *t;
+
+    t = ctx;
+    WaitForSingleObject(bench_start, INFINITE);
+    t->fn(t->niters);
+
+    return 0;
+}
+
+static void bench_read_hooked(uint64_t niters)
+{
+    uint8_t buf[64];
+    DWORD nread;
+    uint64_t i;
+
+    for (i = 0 ; i < niters ; i++) {
+        ReadFile(bench_fd, buf, sizeof(buf), &nread, NULL);
+    }
+}
+
+static void bench_read_direct(uint64_t niters)
+{
+    uint8_t buf[64];
+    uint32_t nread;
+    uint64_t i;
+
+    for (i = 0 ; i < niters ; i++) {
+        bench_direct.ReadFile(bench_fd, buf, sizeof(buf), &nread, NULL);
+    }
+}
+
+static void bench_write_hooked(uint64_t niters)
+{
+    uint8_t buf[64];
+    DWORD nwrit;
+    uint64_t i;
+
+    memset(buf, 0, sizeof(buf));
+
+    for (i = 0 ; i < niters ; i++) {
+        WriteFile(bench_fd, buf, sizeof(buf), &nwrit, NULL);
+    }
+}
+
+static void bench_write_direct(uint64_t niters)
+{
+    uint8_t buf[64];
+    uint32_t nwrit;
+    uint64_t i;
+
+    memset(buf, 0, sizeof(buf));
+
+    for (i = 0 ; i < niters ; i++) {
+        bench_direct.WriteFile(bench_fd, buf, sizeof(buf), &nwrit, NULL);
+    }
+}
+
+static void bench_ioctl_hooked(uint64_t niters)
+{
+    uint32_t in;
+    uint32_t out;
+    DWORD nread;
+    uint64_t i;
+
+    /* The NUL device rejects this ioctl, which is fine: we only care about
+       the cost of getting the request to it. */
+
+    in = 0;
+
+    for (i = 0 ; i < niters ; i++) {
+        DeviceIoControl(bench_fd, BENCH_IOCTL, &in, sizeof(in), &out,
+                sizeof(out), &nread, NULL);
+    }
+}
+
+static void bench_ioctl_direct(uint64_t niters)
+{
+    uint32_t in;
+    uint32_t out;
+    uint32_t nread;
+    uint64_t i;
+
+    in = 0;
+
+    for (i = 0 ; i < niters ; i++) {
+        bench_direct.DeviceIoControl(bench_fd, BENCH_IOCTL, &in, sizeof(in),
+                &out, sizeof(out), &nread, NULL);
+    }
+}
+
+static void bench_seek_hooked(uint64_t niters)
+{
+    LARGE_INTEGER offset;
+    uint64_t i;
+
+    offset.QuadPart = 0;
+
+    for (i = 0 ; i < niters ; i++) {
+        SetFilePointerEx(bench_fd, offset, NULL, FILE_CURRENT);
+    }
+}
+
+static void bench_seek_direct(uint64_t niters)
+{
+    uint64_t i;
+
+    for (i = 0 ; i < niters ; i++) {
+        bench_direct.SetFilePointerEx(bench_fd, 0, NULL, FILE_CURRENT);
+    }
+}
+
+static void bench_open_hooked(uint64_t niters)
+{
+    HANDLE fd;
+    uint64_t i;
+
+    for (i = 0 ; i < niters ; i++) {
+        fd = CreateFileW(
+                L"NUL",
+                GENERIC_READ | GENERIC_WRITE,
+                FILE_SHARE_READ | FILE_SHARE_WRITE,
+                NULL,
+                OPEN_EXISTING,
+                0,
+                NULL);
+
+        if (fd != INVALID_HANDLE_VALUE) {
+            CloseHandle(fd);
+        }
+    }
+}
+
+static void bench_open_direct(uint64_t niters)
+{
+    HANDLE fd;
+    uint64_t i;
+
+    for (i = 0 ; i < niters ; i++) {
+        fd = bench_direct.CreateFileW(
+                L"NUL",
+                GENERIC_READ | GENERIC_WRITE,
+                FILE_SHARE_READ | FILE_SHARE_WRITE,
+                NULL,
+                OPEN_EXISTING,
+                0,
+                NULL);
+
+        if (fd != INVALID_HANDLE_VALUE) {
+            bench_direct.CloseHandle(fd);
+        }
+    }
+}
@@ -0,0 +1,399 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench/bench.h"
+
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf-spsc.h"
+#include "hook/iobuf.h"
+
+/* Cross-thread byte queue numbers, for the lock-free queue that sits between
+   a uart and its device thread and, for comparison, the same traffic over an
+   iobuf_ring guarded by a CRITICAL_SECTION (which is what the alternative to
+   the lock-free queue would look like).
+
+   "throughput" streams bytes from the main thread to a consumer thread in
+   chunks of the given size. "round_trip" bounces a single byte off an echo
+   thread through a pair of queues and back, which is the latency that a
+   device thread adds to a command/response exchange. Both sides spin while
+   they wait, yielding the CPU now and then, so round trips are much slower
+   when there are fewer cores than threads. Correctness is covered by
+   test/iobuf-test.c. */
+
+#define BENCH_MIN_RUN_NS UINT64_C(100000000)
+#define BENCH_QUEUE_SIZE 65536
+#define BENCH_MAX_CHUNK 4096
+#define BENCH_SPINS 1024
+
+enum bench_impl {
+    BENCH_IMPL_SPSC,
+    BENCH_IMPL_LOCKED,
+};
+
+struct bench_queue {
+    enum bench_impl impl;
+    struct iobuf_spsc spsc;
+    struct iobuf_ring ring;
+    CRITICAL_SECTION lock;
+    uint8_t *bytes;
+};
+
+struct bench_run {
+    struct bench_queue *fwd;
+    struct bench_queue *back;
+    size_t chunk;
+    uint64_t nbytes;
+};
+
+static void bench_queue_init(struct bench_queue *q, enum bench_impl impl);
+static void bench_queue_fini(struct bench_queue *q);
+static size_t bench_push(struct bench_queue *q, struct const_iobuf *src);
+static size_t bench_pop(struct bench_queue *q, struct iobuf *dest);
+static void bench_spin(unsigned int *nspins);
+static uint64_t bench_throughput(
+        enum bench_impl impl,
+        size_t chunk,
+        uint64_t nchunks);
+static uint64_t bench_round_trip(enum bench_impl impl, uint64_t niters);
+static uint64_t bench_calibrate(enum bench_impl impl, size_t chunk);
+static HANDLE bench_thread_start(
+        LPTHREAD_START_ROUTINE proc,
+        struct bench_run *run);
+static DWORD WINAPI bench_consume_proc(void *ctx);
+static DWORD WINAPI bench_echo_proc(void *ctx);
+
+static const char *const bench_impl_names[] = { "spsc", "locked_ring" };
+static const size_t bench_chunks[] = { 1, 16, 256, BENCH_MAX_CHUNK };
+
+static uint8_t bench_pattern[2 * BENCH_MAX_CHUNK];
+
+int main(int argc, char **argv)
+{
+    struct bench_report r;
+    enum bench_impl impl;
+    uint64_t niters;
+    uint64_t elapsed;
+    size_t chunk;
+    size_t i;
+    size_t j;
+
+    (void) argc;
+    (void) argv;
+
+    for (i = 0 ; i < sizeof(bench_pattern) ; i++) {
+        bench_pattern[i] = (uint8_t) i;
+    }
+
+    bench_report_begin(&r, stdout, "spsc");
+
+    for (i = 0 ; i < _countof(bench_impl_names) ; i++) {
+        impl = (enum bench_impl) i;
+
+        for (j = 0 ; j < _countof(bench_chunks) ; j++) {
+            chunk = bench_chunks[j];
+            niters = bench_calibrate(impl, chunk);
+            elapsed = bench_throughput(impl, chunk, niters);
+
+            bench_row_begin(&r);
+            bench_field_str(&r, "op", "throughput");
+            bench_field_str(&r, "queue", bench_impl_names[i]);
+            bench_field_uint(&r, "bytes", chunk);
+            bench_field_uint(&r, "iterations", niters);
+            bench_field_double(&r, "ns_per_op", (double) elapsed / niters);
+            bench_field_double(
+                    &r,
+                    "bytes_per_sec",
+                    (double) niters * chunk * 1e9 / elapsed);
+            bench_row_end(&r);
+        }
+
+        niters = bench_calibrate(impl, 0);
+        elapsed = bench_round_trip(impl, niters);
+
+        bench_row_begin(&r);
+        bench_field_str(&r, "op", "round_trip");
+        bench_field_str(&r, "queue", bench_impl_names[i]);
+        bench_field_uint(&r, "bytes", 1);
+        bench_field_uint(&r, "iterations", niters);
+        bench_field_double(&r, "ns_per_op", (double) elapsed / niters);
+        bench_row_end(&r);
+    }
+
+    bench_report_end(&r);
+
+    return EXIT_SUCCESS;
+}
+
+static void bench_queue_init(struct bench_queue *q, enum bench_impl impl)
+{
+    q->impl = impl;
+    q->bytes = malloc(BENCH_QUEUE_SIZE);
+
+    if (q->bytes == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        abort();
+    }
+
+    iobuf_spsc_init(&q->spsc, q->bytes, BENCH_QUEUE_SIZE);
+    iobuf_ring_init(&q->ring, q->bytes, BENCH_QUEUE_SIZE);
+    InitializeCriticalSection(&q->lock);
+}
+
+static void bench_queue_fini(struct bench_queue *q)
+{
+    DeleteCriticalSection(&q->lock);
+    free(q->bytes);
+}
+
+static size_t bench_push(struct bench_queue *q, struct const_iobuf *src)
+{
+    size_t nbytes;
+
+    if (q->impl == BENCH_IMPL_SPSC) {
+        return iobuf_spsc_move(&q->spsc, src);
+    }
+
+    EnterCriticalSection(&q->lock);
+    nbytes = iobuf_ring_move(&q->ring, src);
+    LeaveCriticalSection(&q->lock);
+
+    return nbytes;
+}
+
+static size_t bench_pop(struct bench_queue *q, struct iobuf *dest)
+{
+    size_t nbytes;
+
+    if (q->impl == BENCH_IMPL_SPSC) {
+        return iobuf_spsc_shift(dest, &q->spsc);
+    }
+
+    EnterCriticalSection(&q->lock);
+    nbytes = iobuf_ring_shift(dest, &q->ring);
+    LeaveCriticalSection(&q->lock);
+
+    return nbytes;
+}
+
+static void bench_spin(unsigned int *nspins)
+{
+    if (++(*nspins) == BENCH_SPINS) {
+        *nspins = 0;
+        Sleep(0);
+    }
+}
+
+static uint64_t bench_throughput(
+        enum bench_impl impl,
+        size_t chunk,
+        uint64_t nchunks)
+{
+    struct bench_queue q;
+    struct bench_run run;
+    struct const_iobuf src;
+    unsigned int nspins;
+    uint64_t offset;
+    uint64_t begin;
+    uint64_t elapsed;
+    uint64_t i;
+    HANDLE thread;
+
+    assert(chunk <= BENCH_MAX_CHUNK);
+
+    bench_queue_init(&q, impl);
+
+    run.fwd = &q;
+    run.back = NULL;
+    run.chunk = chunk;
+    run.nbytes = nchunks * chunk;
+
+    thread = bench_thread_start(bench_consume_proc, &run);
+    nspins = 0;
+    offset = 0;
+
+    begin = bench_now_ns();
+
+    for (i = 0 ; i < nchunks ; i++) {
+        src.bytes = &bench_pattern[offset];
+        src.nbytes = chunk;
+        src.pos = 0;
+
+        while (src.pos < src.nbytes) {
+            if (bench_push(&q, &src) == 0) {
+                bench_spin(&nspins);
+            }
+        }
+
+        offset = (offset + chunk) % 256;
+    }
+
+    WaitForSingleObject(thread, INFINITE);
+    elapsed = bench_now_ns() - begin;
+
+    CloseHandle(thread);
+    bench_queue_fini(&q);
+
+    return elapsed;
+}
+
+static uint64_t bench_round_trip(enum bench_impl impl, uint64_t niters)
+{
+    struct bench_queue fwd;
+    struct bench_queue back;
+    struct bench_run run;
+    struct const_iobuf src;
+    struct iobuf dest;
+    unsigned int nspins;
+    uint8_t byte;
+    uint64_t begin;
+    uint64_t elapsed;
+    uint64_t i;
+    HANDLE thread;
+
+    bench_queue_init(&fwd, impl);
+    bench_queue_init(&back, impl);
+
+    run.fwd = &fwd;
+    run.back = &back;
+    run.chunk = 1;
+    run.nbytes = niters;
+
+    thread = bench_thread_start(bench_echo_proc, &run);
+    nspins = 0;
+
+    begin = bench_now_ns();
+
+    for (i = 0 ; i < niters ; i++) {
+        src.bytes = &bench_pattern[i % 256];
+        src.nbytes = 1;
+        src.pos = 0;
+
+        while (bench_push(&fwd, &src) == 0) {
+            bench_spin(&nspins);
+        }
+
+        dest.bytes = &byte;
+        dest.nbytes = 1;
+        dest.pos = 0;
+
+        while (bench_pop(&back, &dest) == 0) {
+            bench_spin(&nspins);
+        }
+    }
+
+    WaitForSingleObject(thread, INFINITE);
+    elapsed = bench_now_ns() - begin;
+
+    CloseHandle(thread);
+    bench_queue_fini(&back);
+    bench_queue_fini(&fwd);
+
+    return elapsed;
+}
+
+static uint64_t bench_calibrate(enum bench_impl impl, size_t chunk)
+{
+    uint64_t niters;
+    uint64_t elapsed;
+
+    /* A chunk size of zero means a round trip */
+
+    niters = 1000;
+
+    for (;;) {
+        if (chunk == 0) {
+            elapsed = bench_round_trip(impl, niters);
+        } else {
+            elapsed = bench_throughput(impl, chunk, niters);
+        }
+
+        if (elapsed >= BENCH_MIN_RUN_NS / 4) {
+            return niters * 4;
+        }
+
+        niters *= 2;
+    }
+}
+
+static HANDLE bench_thread_start(
+        LPTHREAD_START_ROUTINE proc,
+        struct bench_run *run)
+{
+    HANDLE thread;
+
+    thread = CreateThread(NULL, 0, proc, run, 0, NULL);
+
+    if (thread == NULL) {
+        fprintf(stderr, "CreateThread failed\n");
+        abort();
+    }
+
+    return thread;
+}
+
+static DWORD WINAPI bench_consume_proc(void *ctx)
+{
+    struct bench_run *run;
+    struct iobuf dest;
+    uint8_t buf[BENCH_MAX_CHUNK];
+    unsigned int nspins;
+    uint64_t remaining;
+
+    run = ctx;
+    remaining = run->nbytes;
+    nspins = 0;
+
+    while (remaining > 0) {
+        dest.bytes = buf;
+        dest.nbytes = remaining < sizeof(buf) ? remaining : sizeof(buf);
+        dest.pos = 0;
+
+        if (bench_pop(run->fwd, &dest) == 0) {
+            bench_spin(&nspins);
+
+            continue;
+        }
+
+        remaining -= dest.pos;
+    }
+
+    return 0;
+}
+
+static DWORD WINAPI bench_echo_proc(void *ctx)
+{
+    struct bench_run *run;
+    struct const_iobuf src;
+    struct iobuf dest;
+    unsigned int nspins;
+    uint8_t byte;
+    uint64_t i;
+
+    run = ctx;
+    nspins = 0;
+
+    for (i = 0 ; i < run->nbytes ; i++) {
+        dest.bytes = &byte;
+        dest.nbytes = 1;
+        dest.pos = 0;
+
+        while (bench_pop(run->fwd, &dest) == 0) {
+            bench_spin(&nspins);
+        }
+
+        src.bytes = &byte;
+        src.nbytes = 1;
+        src.pos = 0;
+
+        while (bench_push(run->back, &src) == 0) {
+            bench_spin(&nspins);
+        }
+    }
+
+    return 0;
+}
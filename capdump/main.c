@@ -0,0 +1,312 @@
+#include <windows.h>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/iobuf-varint.h"
+#include "hook/iobuf.h"
+
+#include "hooklib/uart-capture.h"
+
+/* Prints a file written by uart_capture (see hooklib/uart-capture.h) as
+   text, one line per record plus a hex dump of any data. Builds for Windows
+   and, against the shim, for Linux. */
+
+static uint8_t *capdump_load(FILE *f, size_t *nbytes);
+static HRESULT capdump_header(struct const_iobuf *src);
+static HRESULT capdump_record(struct const_iobuf *src, uint64_t *now);
+static void capdump_hex(const uint8_t *bytes, size_t nbytes);
+
+int main(int argc, char **argv)
+{
+    struct const_iobuf src;
+    struct const_iobuf save;
+    uint8_t *bytes;
+    size_t nbytes;
+    uint64_t now;
+    HRESULT hr;
+    FILE *f;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <capture file | ->\n", argv[0]);
+
+        return EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "-") == 0) {
+        f = stdin;
+    } else {
+        f = fopen(argv[1], "rb");
+
+        if (f == NULL) {
+            perror(argv[1]);
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    bytes = capdump_load(f, &nbytes);
+
+    if (f != stdin) {
+        fclose(f);
+    }
+
+    if (bytes == NULL) {
+        fprintf(stderr, "%s: Failed to read input\n", argv[1]);
+
+        return EXIT_FAILURE;
+    }
+
+    src.bytes = bytes;
+    src.nbytes = nbytes;
+    src.pos = 0;
+
+    hr = capdump_header(&src);
+
+    if (FAILED(hr)) {
+        fprintf(stderr, "%s: Not a uart capture file\n", argv[1]);
+        free(bytes);
+
+        return EXIT_FAILURE;
+    }
+
+    now = 0;
+    hr = S_OK;
+
+    while (src.pos < src.nbytes) {
+        save = src;
+        hr = capdump_record(&src, &now);
+
+        if (FAILED(hr)) {
+            src = save;
+
+            break;
+        }
+    }
+
+    /* A capture that is still being written, or whose writer died, usually
+       ends part of the way through a record. That's fine. */
+
+    if (hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER)) {
+        printf("(%u trailing bytes of incomplete record)\n",
+                (unsigned int) (src.nbytes - src.pos));
+    } else if (FAILED(hr)) {
+        fprintf(stderr,
+                "%s: Corrupt record at offset %u\n",
+                argv[1],
+                (unsigned int) src.pos);
+        free(bytes);
+
+        return EXIT_FAILURE;
+    }
+
+    free(bytes);
+
+    return EXIT_SUCCESS;
+}
+
+static uint8_t *capdump_load(FILE *f, size_t *nbytes)
+{
+    uint8_t *bytes;
+    uint8_t *tmp;
+    size_t size;
+    size_t pos;
+
+    size = 0x10000;
+    pos = 0;
+    bytes = malloc(size);
+
+    if (bytes == NULL) {
+        return NULL;
+    }
+
+    for (;;) {
+        pos += fread(&bytes[pos], 1, size - pos, f);
+
+        if (pos < size) {
+            break;
+        }
+
+        size *= 2;
+        tmp = realloc(bytes, size);
+
+        if (tmp == NULL) {
+            free(bytes);
+
+            return NULL;
+        }
+
+        bytes = tmp;
+    }
+
+    if (ferror(f)) {
+        free(bytes);
+
+        return NULL;
+    }
+
+    *nbytes = pos;
+
+    return bytes;
+}
+
+static HRESULT capdump_header(struct const_iobuf *src)
+{
+    uint8_t magic[4];
+    uint8_t version;
+    uint64_t port_no;
+    uint64_t start;
+    HRESULT hr;
+
+    hr = iobuf_read(src, magic, sizeof(magic));
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    if (memcmp(magic, UART_CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+
+    hr = iobuf_read_8(src, &version);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    if (version != UART_CAPTURE_VERSION) {
+        return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+
+    hr = iobuf_read_uleb128(src, &port_no);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    hr = iobuf_read_uleb128(src, &start);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    printf("COM%" PRIu64 ", started at %" PRIu64 ".%09" PRIu64 "\n",
+            port_no,
+            start / 1000000000,
+            start % 1000000000);
+
+    return S_OK;
+}
+
+static HRESULT capdump_record(struct const_iobuf *src, uint64_t *now)
+{
+    uint8_t kind;
+    uint64_t delta;
+    uint64_t nbytes;
+    uint64_t result;
+    const char *dir;
+    HRESULT hr;
+
+    hr = iobuf_read_8(src, &kind);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    hr = iobuf_read_uleb128(src, &delta);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    hr = iobuf_read_uleb128(src, &nbytes);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    *now += delta;
+    dir = (kind == UART_CAPTURE_TX || kind == UART_CAPTURE_TX_END)
+            ? "TX" : "RX";
+
+    switch (kind) {
+    case UART_CAPTURE_TX:
+    case UART_CAPTURE_RX:
+        if (nbytes > src->nbytes - src->pos) {
+            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+
+        printf("%6" PRIu64 ".%09" PRIu64 " %s %" PRIu64 " bytes\n",
+                *now / 1000000000,
+                *now % 1000000000,
+                dir,
+                nbytes);
+        capdump_hex(&src->bytes[src->pos], (size_t) nbytes);
+        src->pos += (size_t) nbytes;
+
+        break;
+
+    case UART_CAPTURE_TX_END:
+    case UART_CAPTURE_RX_END:
+        hr = iobuf_read_uleb128(src, &result);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        printf("%6" PRIu64 ".%09" PRIu64 " %s end, %" PRIu64 " bytes, "
+                "hr=%08" PRIx32 "\n",
+                *now / 1000000000,
+                *now % 1000000000,
+                dir,
+                nbytes,
+                (uint32_t) result);
+
+        break;
+
+    case UART_CAPTURE_LOST:
+        printf("%6" PRIu64 ".%09" PRIu64 " -- %" PRIu64 " bytes of "
+                "records lost\n",
+                *now / 1000000000,
+                *now % 1000000000,
+                nbytes);
+
+        break;
+
+    default:
+        return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+
+    return S_OK;
+}
+
+static void capdump_hex(const uint8_t *bytes, size_t nbytes)
+{
+    size_t i;
+    size_t j;
+
+    for (i = 0 ; i < nbytes ; i += 16) {
+        printf("        %04x ", (unsigned int) i);
+
+        for (j = i ; j < i + 16 ; j++) {
+            if (j < nbytes) {
+                printf(" %02x", bytes[j]);
+            } else {
+                printf("   ");
+            }
+        }
+
+        printf("  |");
+
+        for (j = i ; j < i + 16 && j < nbytes ; j++) {
+            putchar(bytes[j] >= 0x20 && bytes[j] < 0x7f ? bytes[j] : '.');
+        }
+
+        printf("|\n");
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hook/iobuf.h"
+
+/* Checksums that serial device protocols commonly append to their frames.
+   Each function covers the unread portion of a span (from pos up to nbytes)
+   without consuming it, and takes the value returned by a previous call so
+   that a checksum can be accumulated across several spans. Pass the initial
+   value listed below to start a fresh checksum.
+
+   checksum_sum8:        8-bit sum of all bytes modulo 256. Initial value 0.
+   checksum_crc8:        CRC-8 with polynomial 0x07, MSB first, no final XOR.
+                         Initial value 0 gives CRC-8/SMBUS.
+   checksum_crc16_ccitt: CRC-16 with polynomial 0x1021, MSB first, no final
+                         XOR. Initial value 0xFFFF gives CRC-16/CCITT-FALSE,
+                         initial value 0 gives CRC-16/XMODEM.
+   checksum_crc32:       The zlib/Ethernet CRC-32 (reflected polynomial
+                         0xEDB88320). Initial value 0; the pre- and post-
+                         inversion are applied internally. */
+
+uint8_t checksum_sum8(uint8_t sum, const struct const_iobuf *src);
+uint8_t checksum_crc8(uint8_t crc, const struct const_iobuf *src);
+uint16_t checksum_crc16_ccitt(uint16_t crc, const struct const_iobuf *src);
+uint32_t checksum_crc32(uint32_t crc, const struct const_iobuf *src);
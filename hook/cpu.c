@@ -0,0 +1,142 @@
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "hook/cpu.h"
+
+#define CPU_FEATURES_VALID (UINT32_C(1) << 31)
+
+static uint32_t cpu_detect(void);
+
+static volatile uint32_t cpu_features;
+static volatile uint32_t cpu_feature_mask = UINT32_MAX;
+
+uint32_t cpu_get_features(void)
+{
+    uint32_t features;
+
+    /* Racing threads will all arrive at the same answer, so there is no need
+       for anything stronger than a plain word-sized store here. */
+
+    features = cpu_features;
+
+    if (!(features & CPU_FEATURES_VALID)) {
+        features = cpu_detect() | CPU_FEATURES_VALID;
+        cpu_features = features;
+    }
+
+    return features & cpu_feature_mask & ~CPU_FEATURES_VALID;
+}
+
+void cpu_set_feature_mask(uint32_t mask)
+{
+    cpu_feature_mask = mask;
+}
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+
+static void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+    int tmp[4];
+
+    __cpuidex(tmp, (int) leaf, (int) subleaf);
+    regs[0] = tmp[0];
+    regs[1] = tmp[1];
+    regs[2] = tmp[2];
+    regs[3] = tmp[3];
+}
+
+static uint64_t cpu_xgetbv(void)
+{
+    return _xgetbv(0);
+}
+
+#define CPU_HAVE_CPUID
+
+#elif defined(__i386__) || defined(__x86_64__)
+
+static void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+}
+
+static uint64_t cpu_xgetbv(void)
+{
+    uint32_t lo;
+    uint32_t hi;
+
+    /* Spelled out as opcode bytes since older assemblers lack xgetbv */
+
+    __asm__ volatile (".byte 0x0f, 0x01, 0xd0" : "=a"(lo), "=d"(hi) : "c"(0));
+
+    return ((uint64_t) hi << 32) | lo;
+}
+
+#define CPU_HAVE_CPUID
+
+#endif
+
+#ifdef CPU_HAVE_CPUID
+
+static uint32_t cpu_detect(void)
+{
+    uint32_t features;
+    uint32_t max_leaf;
+    uint32_t regs[4];
+
+    features = 0;
+
+    cpu_cpuid(0, 0, regs);
+    max_leaf = regs[0];
+
+    if (max_leaf < 1) {
+        return 0;
+    }
+
+    cpu_cpuid(1, 0, regs);
+
+    if (regs[3] & (1 << 26)) {
+        features |= CPU_FEATURE_SSE2;
+    }
+
+    if (regs[2] & (1 << 9)) {
+        features |= CPU_FEATURE_SSSE3;
+    }
+
+    if (regs[2] & (1 << 19)) {
+        features |= CPU_FEATURE_SSE41;
+    }
+
+    if (regs[2] & (1 << 1)) {
+        features |= CPU_FEATURE_PCLMUL;
+    }
+
+    /* AVX2 needs the OS to preserve the upper halves of the YMM registers
+       across context switches, which is what OSXSAVE + XCR0 tell us. */
+
+    if (    max_leaf >= 7 &&
+            (regs[2] & (1 << 27)) &&
+            (regs[2] & (1 << 28)) &&
+            (cpu_xgetbv() & 6) == 6) {
+        cpu_cpuid(7, 0, regs);
+
+        if (regs[1] & (1 << 5)) {
+            features |= CPU_FEATURE_AVX2;
+        }
+    }
+
+    return features;
+}
+
+#else
+
+static uint32_t cpu_detect(void)
+{
+    return 0;
+}
+
+#endif
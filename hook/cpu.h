@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || \
+        defined(_M_X64)
+#define CPU_X86
+#endif
+
+/* GCC only lets us use intrinsics for instruction sets that the translation
+   unit as a whole is not compiled for inside functions that carry a matching
+   target attribute. 32-bit Windows only guarantees 4-byte stack alignment, so
+   realign on entry there too, otherwise XMM spills in unoptimized builds will
+   fault. */
+
+#if defined(__GNUC__) && defined(__i386__)
+#define CPU_TARGET(isa) __attribute__((target(isa), force_align_arg_pointer))
+#elif defined(__GNUC__)
+#define CPU_TARGET(isa) __attribute__((target(isa)))
+#else
+#define CPU_TARGET(isa)
+#endif
+
+/* x86 instruction set extensions that hook code may pick kernels for at
+   runtime. A feature is only reported if the OS also saves the register state
+   that it needs, so callers can simply test the bit. */
+
+enum {
+    CPU_FEATURE_SSE2    = 1 << 0,
+    CPU_FEATURE_SSSE3   = 1 << 1,
+    CPU_FEATURE_SSE41   = 1 << 2,
+    CPU_FEATURE_PCLMUL  = 1 << 3,
+    CPU_FEATURE_AVX2    = 1 << 4,
+};
+
+uint32_t cpu_get_features(void);
+
+/* Hide every feature outside of mask from cpu_get_features(), so that tests
+   and benchmarks can run the fallback kernels on a CPU that has better ones.
+   Pass UINT32_MAX to put things back. Not for use outside of those. */
+
+void cpu_set_feature_mask(uint32_t mask);
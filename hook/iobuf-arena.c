@@ -0,0 +1,177 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/iobuf-arena.h"
+#include "hook/iobuf.h"
+
+#define IOBUF_ARENA_MIN_SIZE 256
+
+static void iobuf_arena_track(struct iobuf_arena *arena);
+
+void iobuf_arena_init(struct iobuf_arena *arena, size_t limit)
+{
+    assert(arena != NULL);
+
+    arena->buf.bytes = NULL;
+    arena->buf.nbytes = 0;
+    arena->buf.pos = 0;
+    arena->limit = limit;
+    arena->high_water = 0;
+}
+
+void iobuf_arena_fini(struct iobuf_arena *arena)
+{
+    assert(arena != NULL);
+
+    free(arena->buf.bytes);
+    iobuf_arena_init(arena, arena->limit);
+}
+
+void iobuf_arena_reset(struct iobuf_arena *arena)
+{
+    assert(arena != NULL);
+
+    arena->buf.pos = 0;
+}
+
+HRESULT iobuf_arena_reserve(struct iobuf_arena *arena, size_t nbytes)
+{
+    uint8_t *new_bytes;
+    size_t new_size;
+    size_t want;
+
+    assert(arena != NULL);
+    assert(arena->buf.pos <= arena->buf.nbytes);
+
+    if (nbytes > SIZE_MAX - arena->buf.pos) {
+        return E_OUTOFMEMORY;
+    }
+
+    /* The limit may have been lowered since the buffer last grew, so check
+       it before deciding that the room we already have will do. */
+
+    want = arena->buf.pos + nbytes;
+
+    if (arena->limit != 0 && want > arena->limit) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    if (want <= arena->buf.nbytes) {
+        return S_OK;
+    }
+
+    new_size = arena->buf.nbytes;
+
+    if (new_size < IOBUF_ARENA_MIN_SIZE) {
+        new_size = IOBUF_ARENA_MIN_SIZE;
+    }
+
+    while (new_size < want && new_size <= SIZE_MAX / 2) {
+        new_size *= 2;
+    }
+
+    if (new_size < want) {
+        new_size = want;
+    }
+
+    if (arena->limit != 0 && new_size > arena->limit) {
+        new_size = arena->limit;
+    }
+
+    new_bytes = realloc(arena->buf.bytes, new_size);
+
+    if (new_bytes == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    arena->buf.bytes = new_bytes;
+    arena->buf.nbytes = new_size;
+
+    return S_OK;
+}
+
+void *iobuf_arena_alloc(struct iobuf_arena *arena, size_t nbytes)
+{
+    void *bytes;
+
+    if (FAILED(iobuf_arena_reserve(arena, nbytes))) {
+        return NULL;
+    }
+
+    bytes = &arena->buf.bytes[arena->buf.pos];
+    arena->buf.pos += nbytes;
+    iobuf_arena_track(arena);
+
+    return bytes;
+}
+
+HRESULT iobuf_arena_write(
+        struct iobuf_arena *arena,
+        const void *bytes,
+        size_t nbytes)
+{
+    HRESULT hr;
+
+    assert(bytes != NULL || nbytes == 0);
+
+    hr = iobuf_arena_reserve(arena, nbytes);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    memcpy(&arena->buf.bytes[arena->buf.pos], bytes, nbytes);
+    arena->buf.pos += nbytes;
+    iobuf_arena_track(arena);
+
+    return S_OK;
+}
+
+size_t iobuf_arena_move(struct iobuf_arena *dest, struct const_iobuf *src)
+{
+    struct const_iobuf view;
+    size_t nbytes;
+
+    assert(dest != NULL);
+    assert(src != NULL);
+    assert(src->pos <= src->nbytes);
+
+    nbytes = src->nbytes - src->pos;
+
+    if (dest->limit != 0) {
+        if (dest->buf.pos >= dest->limit) {
+            nbytes = 0;
+        } else if (nbytes > dest->limit - dest->buf.pos) {
+            nbytes = dest->limit - dest->buf.pos;
+        }
+    }
+
+    /* If growing fails then settle for whatever room we already have. The
+       buffer may already be larger than the limit, so move through a view
+       of src that ends at the limit rather than letting iobuf_move() fill
+       the whole buffer. */
+
+    iobuf_arena_reserve(dest, nbytes);
+
+    view.bytes = src->bytes;
+    view.nbytes = src->pos + nbytes;
+    view.pos = src->pos;
+
+    nbytes = iobuf_move(&dest->buf, &view);
+    src->pos = view.pos;
+    iobuf_arena_track(dest);
+
+    return nbytes;
+}
+
+static void iobuf_arena_track(struct iobuf_arena *arena)
+{
+    if (arena->high_water < arena->buf.pos) {
+        arena->high_water = arena->buf.pos;
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iobuf.h"
+
+/* A growable iobuf. buf.bytes is a single heap block that is grown on demand
+   (by doubling, up to limit bytes if limit is non-zero) and is never shrunk:
+   iobuf_arena_reset() merely rewinds buf.pos. Once a workload's high-water
+   mark has been reached it therefore runs without touching the heap at all.
+
+   buf may be used with all of the ordinary iobuf functions, e.g. use
+   iobuf_flip() on it to consume what has been written. Appending through
+   iobuf_arena_*() may move buf.bytes, so do not hold on to pointers into it
+   across those calls. */
+
+struct iobuf_arena {
+    struct iobuf buf;
+    size_t limit;
+    size_t high_water;
+};
+
+void iobuf_arena_init(struct iobuf_arena *arena, size_t limit);
+void iobuf_arena_fini(struct iobuf_arena *arena);
+void iobuf_arena_reset(struct iobuf_arena *arena);
+HRESULT iobuf_arena_reserve(struct iobuf_arena *arena, size_t nbytes);
+void *iobuf_arena_alloc(struct iobuf_arena *arena, size_t nbytes);
+HRESULT iobuf_arena_write(
+        struct iobuf_arena *arena,
+        const void *bytes,
+        size_t nbytes);
+size_t iobuf_arena_move(struct iobuf_arena *dest, struct const_iobuf *src);
@@ -0,0 +1,396 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hook/cpu.h"
+#include "hook/iobuf-array.h"
+#include "hook/iobuf.h"
+
+/* Every platform that we run on is little-endian, so LE arrays are a straight
+   memcpy() and BE arrays need each element byte-swapped on the way through.
+   The swap kernel is picked on every call from the CPU's (cached) feature
+   bits, which costs a couple of branches and lets tests force each one. */
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+/* MinGW GCC cannot align the stack to 32 bytes (GCC bug 54412), so YMM spills
+   in unoptimized builds would fault. AVX2 is left to MSVC and host builds. */
+
+#if defined(CPU_X86) && !defined(__MINGW32__)
+#define IOBUF_ARRAY_AVX2
+#endif
+
+typedef void (*iobuf_swap_fn_t)(
+        uint8_t *dest,
+        const uint8_t *src,
+        size_t nvalues,
+        size_t width);
+
+static HRESULT iobuf_read_array(
+        struct const_iobuf *src,
+        void *values,
+        size_t nvalues,
+        size_t width,
+        bool swap);
+static HRESULT iobuf_write_array(
+        struct iobuf *dest,
+        const void *values,
+        size_t nvalues,
+        size_t width,
+        bool swap);
+static iobuf_swap_fn_t iobuf_get_swap_fn(void);
+static void iobuf_swap_scalar(
+        uint8_t *dest,
+        const uint8_t *src,
+        size_t nvalues,
+        size_t width);
+
+#ifdef CPU_X86
+static void iobuf_swap_sse2(
+        uint8_t *dest,
+        const uint8_t *src,
+        size_t nvalues,
+        size_t width);
+static void iobuf_swap_ssse3(
+        uint8_t *dest,
+        const uint8_t *src,
+        size_t nvalues,
+        size_t width);
+#endif
+
+#ifdef IOBUF_ARRAY_AVX2
+static void iobuf_swap_avx2(
+        uint8_t *dest,
+        const uint8_t *src,
+        size_t nvalues,
+        size_t width);
+#endif
+
+/* pshufb masks that reverse the bytes of each 2, 4 or 8 byte element */
+
+static const uint8_t iobuf_swap_masks[3][16] = {
+    { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+    { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+    { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 },
+};
+
+HRESULT iobuf_read_be16_array(
+        struct const_iobuf *src,
+        uint16_t *values,
+        size_t nvalues)
+{
+    return iobuf_read_array(src, values, nvalues, sizeof(*values), true);
+}
+
+HRESULT iobuf_read_be32_array(
+        struct const_iobuf *src,
+        uint32_t *values,
+        size_t nvalues)
+{
+    return iobuf_read_array(src, values, nvalues, sizeof(*values), true);
+}
+
+HRESULT iobuf_read_be64_array(
+        struct const_iobuf *src,
+        uint64_t *values,
+        size_t nvalues)
+{
+    return iobuf_read_array(src, values, nvalues, sizeof(*values), true);
+}
+
+HRESULT iobuf_read_le16_array(
+        struct const_iobuf *src,
+        uint16_t *values,
+        size_t nvalues)
+{
+    return iobuf_read_array(src, values, nvalues, sizeof(*values), false);
+}
+
+HRESULT iobuf_read_le32_array(
+        struct const_iobuf *src,
+        uint32_t *values,
+        size_t nvalues)
+{
+    return iobuf_read_array(src, values, nvalues, sizeof(*values), false);
+}
+
+HRESULT iobuf_read_le64_array(
+        struct const_iobuf *src,
+        uint64_t *values,
+        size_t nvalues)
+{
+    return iobuf_read_array(src, values, nvalues, sizeof(*values), false);
+}
+
+HRESULT iobuf_write_be16_array(
+        struct iobuf *dest,
+        const uint16_t *values,
+        size_t nvalues)
+{
+    return iobuf_write_array(dest, values, nvalues, sizeof(*values), true);
+}
+
+HRESULT iobuf_write_be32_array(
+        struct iobuf *dest,
+        const uint32_t *values,
+        size_t nvalues)
+{
+    return iobuf_write_array(dest, values, nvalues, sizeof(*values), true);
+}
+
+HRESULT iobuf_write_be64_array(
+        struct iobuf *dest,
+        const uint64_t *values,
+        size_t nvalues)
+{
+    return iobuf_write_array(dest, values, nvalues, sizeof(*values), true);
+}
+
+HRESULT iobuf_write_le16_array(
+        struct iobuf *dest,
+        const uint16_t *values,
+        size_t nvalues)
+{
+    return iobuf_write_array(dest, values, nvalues, sizeof(*values), false);
+}
+
+HRESULT iobuf_write_le32_array(
+        struct iobuf *dest,
+        const uint32_t *values,
+        size_t nvalues)
+{
+    return iobuf_write_array(dest, values, nvalues, sizeof(*values), false);
+}
+
+HRESULT iobuf_write_le64_array(
+        struct iobuf *dest,
+        const uint64_t *values,
+        size_t nvalues)
+{
+    return iobuf_write_array(dest, values, nvalues, sizeof(*values), false);
+}
+
+static HRESULT iobuf_read_array(
+        struct const_iobuf *src,
+        void *values,
+        size_t nvalues,
+        size_t width,
+        bool swap)
+{
+    size_t nbytes;
+
+    assert(src != NULL);
+    assert(src->pos <= src->nbytes);
+    assert(values != NULL || nvalues == 0);
+
+    if (nvalues > (src->nbytes - src->pos) / width) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    nbytes = nvalues * width;
+
+    if (swap) {
+        iobuf_get_swap_fn()(values, &src->bytes[src->pos], nvalues, width);
+    } else {
+        memcpy(values, &src->bytes[src->pos], nbytes);
+    }
+
+    src->pos += nbytes;
+
+    return S_OK;
+}
+
+static HRESULT iobuf_write_array(
+        struct iobuf *dest,
+        const void *values,
+        size_t nvalues,
+        size_t width,
+        bool swap)
+{
+    size_t nbytes;
+
+    assert(dest != NULL);
+    assert(dest->pos <= dest->nbytes);
+    assert(values != NULL || nvalues == 0);
+
+    if (nvalues > (dest->nbytes - dest->pos) / width) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    nbytes = nvalues * width;
+
+    if (swap) {
+        iobuf_get_swap_fn()(&dest->bytes[dest->pos], values, nvalues, width);
+    } else {
+        memcpy(&dest->bytes[dest->pos], values, nbytes);
+    }
+
+    dest->pos += nbytes;
+
+    return S_OK;
+}
+
+static iobuf_swap_fn_t iobuf_get_swap_fn(void)
+{
+    iobuf_swap_fn_t fn;
+    uint32_t features;
+
+    features = cpu_get_features();
+    fn = iobuf_swap_scalar;
+
+#ifdef CPU_X86
+    if (features & CPU_FEATURE_SSE2) {
+        fn = iobuf_swap_sse2;
+    }
+
+    if (features & CPU_FEATURE_SSSE3) {
+        fn = iobuf_swap_ssse3;
+    }
+#endif
+
+#ifdef IOBUF_ARRAY_AVX2
+    if (features & CPU_FEATURE_AVX2) {
+        fn = iobuf_swap_avx2;
+    }
+#endif
+
+    (void) features;
+
+    return fn;
+}
+
+static void iobuf_swap_scalar(
+        uint8_t *dest,
+        const uint8_t *src,
+        size_t nvalues,
+        size_t width)
+{
+    size_t i;
+    size_t j;
+
+    for (i = 0 ; i < nvalues ; i++) {
+        for (j = 0 ; j < width ; j++) {
+            dest[j] = src[width - 1 - j];
+        }
+
+        dest += width;
+        src += width;
+    }
+}
+
+#ifdef CPU_X86
+
+CPU_TARGET("sse2")
+static void iobuf_swap_sse2(
+        uint8_t *dest,
+        const uint8_t *src,
+        size_t nvalues,
+        size_t width)
+{
+    __m128i v;
+    size_t nblocks;
+    size_t i;
+
+    /* No byte shuffle before SSSE3, so reverse 16-bit words within each
+       element with the word shuffles and then swap the bytes of each word
+       with a pair of shifts. */
+
+    nblocks = (nvalues * width) / 16;
+
+    for (i = 0 ; i < nblocks ; i++) {
+        v = _mm_loadu_si128((const __m128i *) (src + 16 * i));
+
+        if (width == 4) {
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        } else if (width == 8) {
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        }
+
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *) (dest + 16 * i), v);
+    }
+
+    i = (nblocks * 16) / width;
+    iobuf_swap_scalar(
+            dest + i * width,
+            src + i * width,
+            nvalues - i,
+            width);
+}
+
+CPU_TARGET("ssse3")
+static void iobuf_swap_ssse3(
+        uint8_t *dest,
+        const uint8_t *src,
+        size_t nvalues,
+        size_t width)
+{
+    __m128i mask;
+    __m128i v;
+    size_t nblocks;
+    size_t i;
+
+    mask = _mm_loadu_si128(
+            (const __m128i *) iobuf_swap_masks[width == 2 ? 0 : width / 4]);
+    nblocks = (nvalues * width) / 16;
+
+    for (i = 0 ; i < nblocks ; i++) {
+        v = _mm_loadu_si128((const __m128i *) (src + 16 * i));
+        v = _mm_shuffle_epi8(v, mask);
+        _mm_storeu_si128((__m128i *) (dest + 16 * i), v);
+    }
+
+    i = (nblocks * 16) / width;
+    iobuf_swap_scalar(
+            dest + i * width,
+            src + i * width,
+            nvalues - i,
+            width);
+}
+
+#endif
+
+#ifdef IOBUF_ARRAY_AVX2
+
+CPU_TARGET("avx2")
+static void iobuf_swap_avx2(
+        uint8_t *dest,
+        const uint8_t *src,
+        size_t nvalues,
+        size_t width)
+{
+    __m256i mask;
+    __m256i v;
+    size_t nblocks;
+    size_t i;
+
+    /* vpshufb shuffles within each 128-bit lane, so the same 16-byte mask
+       goes into both lanes. */
+
+    mask = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+            (const __m128i *) iobuf_swap_masks[width == 2 ? 0 : width / 4]));
+    nblocks = (nvalues * width) / 32;
+
+    for (i = 0 ; i < nblocks ; i++) {
+        v = _mm256_loadu_si256((const __m256i *) (src + 32 * i));
+        v = _mm256_shuffle_epi8(v, mask);
+        _mm256_storeu_si256((__m256i *) (dest + 32 * i), v);
+    }
+
+    i = (nblocks * 32) / width;
+    iobuf_swap_ssse3(
+            dest + i * width,
+            src + i * width,
+            nvalues - i,
+            width);
+}
+
+#endif
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iobuf.h"
+
+/* Bulk counterparts of the scalar iobuf codecs. Each call checks bounds once
+   for the whole array and either transfers all nvalues elements or none. */
+
+HRESULT iobuf_read_be16_array(
+        struct const_iobuf *src,
+        uint16_t *values,
+        size_t nvalues);
+HRESULT iobuf_read_be32_array(
+        struct const_iobuf *src,
+        uint32_t *values,
+        size_t nvalues);
+HRESULT iobuf_read_be64_array(
+        struct const_iobuf *src,
+        uint64_t *values,
+        size_t nvalues);
+HRESULT iobuf_read_le16_array(
+        struct const_iobuf *src,
+        uint16_t *values,
+        size_t nvalues);
+HRESULT iobuf_read_le32_array(
+        struct const_iobuf *src,
+        uint32_t *values,
+        size_t nvalues);
+HRESULT iobuf_read_le64_array(
+        struct const_iobuf *src,
+        uint64_t *values,
+        size_t nvalues);
+
+HRESULT iobuf_write_be16_array(
+        struct iobuf *dest,
+        const uint16_t *values,
+        size_t nvalues);
+HRESULT iobuf_write_be32_array(
+        struct iobuf *dest,
+        const uint32_t *values,
+        size_t nvalues);
+HRESULT iobuf_write_be64_array(
+        struct iobuf *dest,
+        const uint64_t *values,
+        size_t nvalues);
+HRESULT iobuf_write_le16_array(
+        struct iobuf *dest,
+        const uint16_t *values,
+        size_t nvalues);
+HRESULT iobuf_write_le32_array(
+        struct iobuf *dest,
+        const uint32_t *values,
+        size_t nvalues);
+HRESULT iobuf_write_le64_array(
+        struct iobuf *dest,
+        const uint64_t *values,
+        size_t nvalues);
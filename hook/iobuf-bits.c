@@ -0,0 +1,235 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iobuf-bits.h"
+#include "hook/iobuf.h"
+
+static void iobuf_bit_reader_refill(struct iobuf_bit_reader *r);
+static void iobuf_bit_writer_flush(struct iobuf_bit_writer *w);
+static uint64_t iobuf_bits_load_be64(const uint8_t *bytes);
+static void iobuf_bits_store_be64(uint8_t *bytes, uint64_t value);
+
+void iobuf_bit_reader_init(
+        struct iobuf_bit_reader *r,
+        struct const_iobuf *src)
+{
+    assert(r != NULL);
+    assert(src != NULL);
+    assert(src->bytes != NULL || src->nbytes == 0);
+    assert(src->pos <= src->nbytes);
+
+    r->src = src;
+    r->cache = 0;
+    r->nbits = 0;
+}
+
+HRESULT iobuf_read_bits(
+        struct iobuf_bit_reader *r,
+        unsigned int nbits,
+        uint64_t *value)
+{
+    assert(r != NULL);
+    assert(nbits <= IOBUF_BITS_MAX);
+    assert(value != NULL);
+
+    if (nbits == 0) {
+        *value = 0;
+
+        return S_OK;
+    }
+
+    if (r->nbits < nbits) {
+        iobuf_bit_reader_refill(r);
+
+        if (r->nbits < nbits) {
+            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+    }
+
+    *value = r->cache >> (64 - nbits);
+    r->cache <<= nbits;
+    r->nbits -= nbits;
+
+    return S_OK;
+}
+
+HRESULT iobuf_skip_bits(struct iobuf_bit_reader *r, unsigned int nbits)
+{
+    uint64_t dummy;
+    unsigned int chunksz;
+    HRESULT hr;
+
+    while (nbits > 0) {
+        chunksz = nbits < IOBUF_BITS_MAX ? nbits : IOBUF_BITS_MAX;
+        hr = iobuf_read_bits(r, chunksz, &dummy);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        nbits -= chunksz;
+    }
+
+    return S_OK;
+}
+
+void iobuf_bit_reader_align(struct iobuf_bit_reader *r)
+{
+    unsigned int nbits;
+
+    assert(r != NULL);
+
+    /* The number of bits consumed from src so far is a multiple of eight, so
+       the read position is byte aligned whenever the cache's is. */
+
+    nbits = r->nbits & 7;
+    r->cache <<= nbits;
+    r->nbits -= nbits;
+}
+
+void iobuf_bit_reader_finish(struct iobuf_bit_reader *r)
+{
+    iobuf_bit_reader_align(r);
+
+    r->src->pos -= r->nbits / 8;
+    r->cache = 0;
+    r->nbits = 0;
+}
+
+void iobuf_bit_writer_init(struct iobuf_bit_writer *w, struct iobuf *dest)
+{
+    assert(w != NULL);
+    assert(dest != NULL);
+    assert(dest->bytes != NULL || dest->nbytes == 0);
+    assert(dest->pos <= dest->nbytes);
+
+    w->dest = dest;
+    w->cache = 0;
+    w->nbits = 0;
+}
+
+HRESULT iobuf_write_bits(
+        struct iobuf_bit_writer *w,
+        unsigned int nbits,
+        uint64_t value)
+{
+    size_t avail;
+
+    assert(w != NULL);
+    assert(nbits <= IOBUF_BITS_MAX);
+    assert(value >> nbits == 0);
+
+    if (nbits == 0) {
+        return S_OK;
+    }
+
+    /* Check against everything that is still pending as well, so that the
+       eventual flush of this field cannot fail. */
+
+    avail = w->dest->nbytes - w->dest->pos;
+
+    if ((w->nbits + nbits + 7) / 8 > avail) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    if (w->nbits + nbits > 64) {
+        iobuf_bit_writer_flush(w);
+    }
+
+    w->cache |= value << (64 - w->nbits - nbits);
+    w->nbits += nbits;
+
+    return S_OK;
+}
+
+void iobuf_bit_writer_finish(struct iobuf_bit_writer *w)
+{
+    assert(w != NULL);
+
+    /* Padding bits are already zero in the cache */
+
+    w->nbits = (w->nbits + 7) & ~7;
+    iobuf_bit_writer_flush(w);
+
+    w->cache = 0;
+    w->nbits = 0;
+}
+
+static void iobuf_bit_reader_refill(struct iobuf_bit_reader *r)
+{
+    struct const_iobuf *src;
+    size_t nbytes;
+
+    src = r->src;
+
+    /* Top the cache up to at least 57 bits with a single unaligned load where
+       possible. The low bits beyond nbits then hold the start of the next
+       byte, which is harmless: the next load ORs the same bits back in. */
+
+    if (src->nbytes - src->pos >= 8) {
+        r->cache |= iobuf_bits_load_be64(&src->bytes[src->pos]) >> r->nbits;
+        nbytes = (63 - r->nbits) >> 3;
+        src->pos += nbytes;
+        r->nbits += nbytes * 8;
+
+        return;
+    }
+
+    while (r->nbits <= 56 && src->pos < src->nbytes) {
+        r->cache |= (uint64_t) src->bytes[src->pos++] << (56 - r->nbits);
+        r->nbits += 8;
+    }
+}
+
+static void iobuf_bit_writer_flush(struct iobuf_bit_writer *w)
+{
+    struct iobuf *dest;
+    size_t nbytes;
+    size_t i;
+
+    /* Store whole bytes only, keeping any partial byte in the cache. Where
+       there is room we store all eight bytes regardless, since whatever lands
+       past the new pos is unused space in dest anyway. */
+
+    dest = w->dest;
+    nbytes = w->nbits / 8;
+
+    if (dest->nbytes - dest->pos >= 8) {
+        iobuf_bits_store_be64(&dest->bytes[dest->pos], w->cache);
+    } else {
+        for (i = 0 ; i < nbytes ; i++) {
+            dest->bytes[dest->pos + i] = (uint8_t) (w->cache >> (56 - 8 * i));
+        }
+    }
+
+    dest->pos += nbytes;
+    w->cache = nbytes < 8 ? w->cache << (nbytes * 8) : 0;
+    w->nbits -= nbytes * 8;
+}
+
+static uint64_t iobuf_bits_load_be64(const uint8_t *bytes)
+{
+    return  ((uint64_t) bytes[0] << 56) |
+            ((uint64_t) bytes[1] << 48) |
+            ((uint64_t) bytes[2] << 40) |
+            ((uint64_t) bytes[3] << 32) |
+            ((uint64_t) bytes[4] << 24) |
+            ((uint64_t) bytes[5] << 16) |
+            ((uint64_t) bytes[6] << 8)  |
+            ((uint64_t) bytes[7]);
+}
+
+static void iobuf_bits_store_be64(uint8_t *bytes, uint64_t value)
+{
+    bytes[0] = (uint8_t) (value >> 56);
+    bytes[1] = (uint8_t) (value >> 48);
+    bytes[2] = (uint8_t) (value >> 40);
+    bytes[3] = (uint8_t) (value >> 32);
+    bytes[4] = (uint8_t) (value >> 24);
+    bytes[5] = (uint8_t) (value >> 16);
+    bytes[6] = (uint8_t) (value >> 8);
+    bytes[7] = (uint8_t) value;
+}
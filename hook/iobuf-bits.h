@@ -0,0 +1,55 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iobuf.h"
+
+/* MSB-first bit fields packed into a byte stream, i.e. the first field read
+   or written occupies the most significant bits of the first byte.
+
+   Both directions keep up to 64 bits in a register-sized cache that is
+   refilled (or flushed) a whole word at a time wherever the underlying buffer
+   permits, so individual fields cost a couple of shifts instead of a loop.
+   Fields may be from 0 to IOBUF_BITS_MAX bits wide.
+
+   While a reader is active it has usually consumed a few bytes of src beyond
+   the fields that have actually been read. Call iobuf_bit_reader_finish() to
+   hand unread whole bytes back to src before using src directly again.
+   Likewise a writer holds on to up to seven bytes of output until
+   iobuf_bit_writer_finish() pads the final partial byte with zero bits and
+   stores everything into dest. */
+
+#define IOBUF_BITS_MAX 56
+
+struct iobuf_bit_reader {
+    struct const_iobuf *src;
+    uint64_t cache;
+    unsigned int nbits;
+};
+
+struct iobuf_bit_writer {
+    struct iobuf *dest;
+    uint64_t cache;
+    unsigned int nbits;
+};
+
+void iobuf_bit_reader_init(
+        struct iobuf_bit_reader *r,
+        struct const_iobuf *src);
+HRESULT iobuf_read_bits(
+        struct iobuf_bit_reader *r,
+        unsigned int nbits,
+        uint64_t *value);
+HRESULT iobuf_skip_bits(struct iobuf_bit_reader *r, unsigned int nbits);
+void iobuf_bit_reader_align(struct iobuf_bit_reader *r);
+void iobuf_bit_reader_finish(struct iobuf_bit_reader *r);
+
+void iobuf_bit_writer_init(struct iobuf_bit_writer *w, struct iobuf *dest);
+HRESULT iobuf_write_bits(
+        struct iobuf_bit_writer *w,
+        unsigned int nbits,
+        uint64_t value);
+void iobuf_bit_writer_finish(struct iobuf_bit_writer *w);
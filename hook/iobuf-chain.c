@@ -0,0 +1,444 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/iobuf-chain.h"
+#include "hook/iobuf.h"
+
+static HRESULT iobuf_chain_grow(struct iobuf_chain *chain, size_t nextra);
+static void iobuf_chain_push(
+        struct iobuf_chain *chain,
+        struct iobuf_seg *seg,
+        const uint8_t *bytes,
+        size_t nbytes);
+static void iobuf_chain_trim(struct iobuf_chain *chain);
+
+HRESULT iobuf_seg_alloc(size_t nbytes, struct iobuf_seg **out)
+{
+    struct iobuf_seg *seg;
+
+    assert(out != NULL);
+
+    *out = NULL;
+
+    if (nbytes > SIZE_MAX - sizeof(*seg)) {
+        return E_OUTOFMEMORY;
+    }
+
+    /* Storage immediately follows the header in the same allocation */
+
+    seg = malloc(sizeof(*seg) + nbytes);
+
+    if (seg == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    seg->nrefs = 1;
+    seg->release = NULL;
+    seg->ctx = NULL;
+    seg->bytes = (uint8_t *) (seg + 1);
+    seg->nbytes = nbytes;
+
+    *out = seg;
+
+    return S_OK;
+}
+
+HRESULT iobuf_seg_wrap(
+        const void *bytes,
+        size_t nbytes,
+        iobuf_seg_release_t release,
+        void *ctx,
+        struct iobuf_seg **out)
+{
+    struct iobuf_seg *seg;
+
+    assert(bytes != NULL || nbytes == 0);
+    assert(out != NULL);
+
+    *out = NULL;
+    seg = malloc(sizeof(*seg));
+
+    if (seg == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    /* Wrapped memory is only ever read through a chain, the cast just lets
+       allocated and wrapped segments share a struct. */
+
+    seg->nrefs = 1;
+    seg->release = release;
+    seg->ctx = ctx;
+    seg->bytes = (uint8_t *) bytes;
+    seg->nbytes = nbytes;
+
+    *out = seg;
+
+    return S_OK;
+}
+
+void iobuf_seg_ref(struct iobuf_seg *seg)
+{
+    assert(seg != NULL);
+    assert(seg->nrefs > 0);
+
+    InterlockedIncrement(&seg->nrefs);
+}
+
+void iobuf_seg_unref(struct iobuf_seg *seg)
+{
+    if (seg == NULL) {
+        return;
+    }
+
+    assert(seg->nrefs > 0);
+
+    if (InterlockedDecrement(&seg->nrefs) != 0) {
+        return;
+    }
+
+    if (seg->release != NULL) {
+        seg->release(seg, seg->ctx);
+    }
+
+    free(seg);
+}
+
+void iobuf_chain_init(struct iobuf_chain *chain)
+{
+    assert(chain != NULL);
+
+    memset(chain, 0, sizeof(*chain));
+}
+
+void iobuf_chain_fini(struct iobuf_chain *chain)
+{
+    size_t i;
+
+    assert(chain != NULL);
+
+    for (i = 0 ; i < chain->nspans ; i++) {
+        iobuf_seg_unref(chain->segs[i]);
+    }
+
+    free(chain->spans);
+    free(chain->segs);
+    iobuf_chain_init(chain);
+}
+
+HRESULT iobuf_chain_append(
+        struct iobuf_chain *chain,
+        struct iobuf_seg *seg,
+        size_t offset,
+        size_t nbytes)
+{
+    HRESULT hr;
+
+    assert(chain != NULL);
+    assert(seg != NULL);
+    assert(offset <= seg->nbytes && nbytes <= seg->nbytes - offset);
+
+    hr = iobuf_chain_grow(chain, 1);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    iobuf_seg_ref(seg);
+    iobuf_chain_push(chain, seg, &seg->bytes[offset], nbytes);
+
+    return S_OK;
+}
+
+HRESULT iobuf_chain_prepend(
+        struct iobuf_chain *chain,
+        struct iobuf_seg *seg,
+        size_t offset,
+        size_t nbytes)
+{
+    HRESULT hr;
+
+    assert(chain != NULL);
+    assert(seg != NULL);
+    assert(offset <= seg->nbytes && nbytes <= seg->nbytes - offset);
+
+    hr = iobuf_chain_grow(chain, 1);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    /* Chains are short (a payload plus a header or two per protocol layer)
+       so shuffling the arrays along is cheaper than anything cleverer. */
+
+    memmove(&chain->spans[1], chain->spans,
+            chain->nspans * sizeof(*chain->spans));
+    memmove(&chain->segs[1], chain->segs,
+            chain->nspans * sizeof(*chain->segs));
+
+    iobuf_seg_ref(seg);
+    chain->spans[0].bytes = &seg->bytes[offset];
+    chain->spans[0].nbytes = nbytes;
+    chain->spans[0].pos = 0;
+    chain->segs[0] = seg;
+    chain->nspans++;
+    chain->nbytes += nbytes;
+
+    return S_OK;
+}
+
+HRESULT iobuf_chain_splice(struct iobuf_chain *dest, struct iobuf_chain *src)
+{
+    size_t i;
+    HRESULT hr;
+
+    assert(dest != NULL);
+    assert(src != NULL);
+    assert(dest != src);
+
+    hr = iobuf_chain_grow(dest, src->nspans);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    /* References move across along with the spans */
+
+    for (i = 0 ; i < src->nspans ; i++) {
+        iobuf_chain_push(
+                dest,
+                src->segs[i],
+                &src->spans[i].bytes[src->spans[i].pos],
+                src->spans[i].nbytes - src->spans[i].pos);
+    }
+
+    src->nspans = 0;
+    src->nbytes = 0;
+
+    return S_OK;
+}
+
+HRESULT iobuf_chain_split(
+        struct iobuf_chain *dest,
+        struct iobuf_chain *src,
+        size_t nbytes)
+{
+    struct const_iobuf *span;
+    size_t nspans;
+    size_t remain;
+    size_t chunksz;
+    size_t i;
+    HRESULT hr;
+
+    assert(dest != NULL);
+    assert(src != NULL);
+    assert(dest != src);
+
+    if (nbytes > src->nbytes) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    /* Work out how many spans are affected and make room for them first, so
+       that nothing can fail once we start moving things around. */
+
+    remain = nbytes;
+
+    for (nspans = 0 ; remain > 0 ; nspans++) {
+        span = &src->spans[nspans];
+        chunksz = span->nbytes - span->pos;
+        remain -= chunksz < remain ? chunksz : remain;
+    }
+
+    hr = iobuf_chain_grow(dest, nspans);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    remain = nbytes;
+
+    for (i = 0 ; i < nspans ; i++) {
+        span = &src->spans[i];
+        chunksz = span->nbytes - span->pos;
+
+        if (chunksz > remain) {
+            /* Final span straddles the split point, so both chains end up
+               referencing its segment. */
+            chunksz = remain;
+            iobuf_seg_ref(src->segs[i]);
+        }
+
+        iobuf_chain_push(dest, src->segs[i], &span->bytes[span->pos], chunksz);
+        span->pos += chunksz;
+        src->nbytes -= chunksz;
+        remain -= chunksz;
+    }
+
+    /* Fully consumed spans have had their references handed over to dest,
+       so forget them without unreffing. */
+
+    for (i = 0 ; i < nspans ; i++) {
+        if (src->spans[i].pos == src->spans[i].nbytes) {
+            src->segs[i] = NULL;
+        }
+    }
+
+    iobuf_chain_trim(src);
+
+    return S_OK;
+}
+
+size_t iobuf_chain_skip(struct iobuf_chain *chain, size_t nbytes)
+{
+    struct const_iobuf *span;
+    size_t chunksz;
+    size_t done;
+    size_t i;
+
+    assert(chain != NULL);
+
+    done = 0;
+
+    for (i = 0 ; i < chain->nspans && done < nbytes ; i++) {
+        span = &chain->spans[i];
+        chunksz = span->nbytes - span->pos;
+
+        if (chunksz > nbytes - done) {
+            chunksz = nbytes - done;
+        }
+
+        span->pos += chunksz;
+        done += chunksz;
+    }
+
+    chain->nbytes -= done;
+    iobuf_chain_trim(chain);
+
+    return done;
+}
+
+size_t iobuf_chain_gather(struct iobuf *dest, struct iobuf_chain *src)
+{
+    size_t nbytes;
+    size_t i;
+
+    assert(dest != NULL);
+    assert(src != NULL);
+
+    nbytes = 0;
+
+    for (i = 0 ; i < src->nspans ; i++) {
+        nbytes += iobuf_move(dest, &src->spans[i]);
+
+        if (src->spans[i].pos != src->spans[i].nbytes) {
+            break;
+        }
+    }
+
+    src->nbytes -= nbytes;
+    iobuf_chain_trim(src);
+
+    return nbytes;
+}
+
+HRESULT iobuf_chain_read(struct iobuf_chain *src, void *bytes, size_t nbytes)
+{
+    struct iobuf dest;
+
+    assert(src != NULL);
+    assert(bytes != NULL || nbytes == 0);
+
+    if (nbytes > src->nbytes) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    dest.bytes = bytes;
+    dest.nbytes = nbytes;
+    dest.pos = 0;
+
+    iobuf_chain_gather(&dest, src);
+
+    return S_OK;
+}
+
+static HRESULT iobuf_chain_grow(struct iobuf_chain *chain, size_t nextra)
+{
+    struct const_iobuf *new_spans;
+    struct iobuf_seg **new_segs;
+    size_t new_max;
+
+    if (nextra <= chain->max_spans - chain->nspans) {
+        return S_OK;
+    }
+
+    new_max = chain->max_spans != 0 ? chain->max_spans * 2 : 4;
+
+    while (new_max < chain->nspans + nextra) {
+        new_max *= 2;
+    }
+
+    new_spans = realloc(chain->spans, new_max * sizeof(*new_spans));
+
+    if (new_spans == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    chain->spans = new_spans;
+    new_segs = realloc(chain->segs, new_max * sizeof(*new_segs));
+
+    if (new_segs == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    chain->segs = new_segs;
+    chain->max_spans = new_max;
+
+    return S_OK;
+}
+
+static void iobuf_chain_push(
+        struct iobuf_chain *chain,
+        struct iobuf_seg *seg,
+        const uint8_t *bytes,
+        size_t nbytes)
+{
+    /* Caller has made room and passes on a reference to seg */
+
+    assert(chain->nspans < chain->max_spans);
+
+    chain->spans[chain->nspans].bytes = bytes;
+    chain->spans[chain->nspans].nbytes = nbytes;
+    chain->spans[chain->nspans].pos = 0;
+    chain->segs[chain->nspans] = seg;
+    chain->nspans++;
+    chain->nbytes += nbytes;
+}
+
+static void iobuf_chain_trim(struct iobuf_chain *chain)
+{
+    size_t i;
+
+    /* Drop fully consumed spans from the front of the chain */
+
+    for (i = 0 ; i < chain->nspans ; i++) {
+        if (chain->spans[i].pos != chain->spans[i].nbytes) {
+            break;
+        }
+
+        iobuf_seg_unref(chain->segs[i]);
+    }
+
+    if (i == 0) {
+        return;
+    }
+
+    chain->nspans -= i;
+    memmove(chain->spans, &chain->spans[i],
+            chain->nspans * sizeof(*chain->spans));
+    memmove(chain->segs, &chain->segs[i],
+            chain->nspans * sizeof(*chain->segs));
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iobuf.h"
+
+/* Zero-copy chained buffers.
+
+   A segment is a reference-counted block of bytes. Segments are either
+   allocated by iobuf_seg_alloc(), in which case the storage lives with the
+   segment, or wrap memory that belongs to somebody else, in which case an
+   optional release callback is run when the last reference goes away. A
+   wrapped segment over an IRP's buffer must not outlive that IRP.
+
+   A chain is an ordered list of const_iobuf views onto segments, each of
+   which holds a reference. Payloads can be framed (prepend/append), split
+   and handed from one protocol layer to the next without touching the bytes
+   themselves; only the final consumer flattens the chain with
+   iobuf_chain_gather() or iobuf_chain_read(). Chains are not thread-safe,
+   segment reference counts are. */
+
+struct iobuf_seg;
+
+typedef void (*iobuf_seg_release_t)(struct iobuf_seg *seg, void *ctx);
+
+struct iobuf_seg {
+    volatile LONG nrefs;
+    iobuf_seg_release_t release;
+    void *ctx;
+    uint8_t *bytes;
+    size_t nbytes;
+};
+
+struct iobuf_chain {
+    struct const_iobuf *spans;
+    struct iobuf_seg **segs;
+    size_t nspans;
+    size_t max_spans;
+    size_t nbytes;
+};
+
+HRESULT iobuf_seg_alloc(size_t nbytes, struct iobuf_seg **out);
+HRESULT iobuf_seg_wrap(
+        const void *bytes,
+        size_t nbytes,
+        iobuf_seg_release_t release,
+        void *ctx,
+        struct iobuf_seg **out);
+void iobuf_seg_ref(struct iobuf_seg *seg);
+void iobuf_seg_unref(struct iobuf_seg *seg);
+
+void iobuf_chain_init(struct iobuf_chain *chain);
+void iobuf_chain_fini(struct iobuf_chain *chain);
+HRESULT iobuf_chain_append(
+        struct iobuf_chain *chain,
+        struct iobuf_seg *seg,
+        size_t offset,
+        size_t nbytes);
+HRESULT iobuf_chain_prepend(
+        struct iobuf_chain *chain,
+        struct iobuf_seg *seg,
+        size_t offset,
+        size_t nbytes);
+HRESULT iobuf_chain_splice(struct iobuf_chain *dest, struct iobuf_chain *src);
+HRESULT iobuf_chain_split(
+        struct iobuf_chain *dest,
+        struct iobuf_chain *src,
+        size_t nbytes);
+size_t iobuf_chain_skip(struct iobuf_chain *chain, size_t nbytes);
+size_t iobuf_chain_gather(struct iobuf *dest, struct iobuf_chain *src);
+HRESULT iobuf_chain_read(struct iobuf_chain *src, void *bytes, size_t nbytes);
@@ -0,0 +1,189 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hook/iobuf-codec.h"
+#include "hook/iobuf.h"
+
+/* Table-driven counterparts to the functions generated by
+   IOBUF_CODEC_DECLARE(). These are much slower than the generated code, but
+   they work from nothing more than a struct iobuf_codec, so that generic code
+   (and fuzzers that cross-check the generated code) can handle any wire
+   struct. */
+
+size_t iobuf_codec_kind_width(enum iobuf_codec_kind kind)
+{
+    switch (kind) {
+    case IOBUF_CODEC_8:     return 1;
+    case IOBUF_CODEC_BE16:  return 2;
+    case IOBUF_CODEC_LE16:  return 2;
+    case IOBUF_CODEC_BE32:  return 4;
+    case IOBUF_CODEC_LE32:  return 4;
+    case IOBUF_CODEC_BE64:  return 8;
+    case IOBUF_CODEC_LE64:  return 8;
+    default:                assert(0); return 0;
+    }
+}
+
+uint64_t iobuf_codec_get(
+        const struct iobuf_codec_field *field,
+        const void *obj)
+{
+    const uint8_t *member;
+    uint8_t v8;
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    assert(field != NULL);
+    assert(obj != NULL);
+
+    member = (const uint8_t *) obj + field->struct_offset;
+
+    switch (iobuf_codec_kind_width(field->kind)) {
+    case 1:
+        memcpy(&v8, member, sizeof(v8));
+
+        return v8;
+
+    case 2:
+        memcpy(&v16, member, sizeof(v16));
+
+        return v16;
+
+    case 4:
+        memcpy(&v32, member, sizeof(v32));
+
+        return v32;
+
+    default:
+        memcpy(&v64, member, sizeof(v64));
+
+        return v64;
+    }
+}
+
+void iobuf_codec_set(
+        const struct iobuf_codec_field *field,
+        void *obj,
+        uint64_t value)
+{
+    uint8_t *member;
+    uint8_t v8;
+    uint16_t v16;
+    uint32_t v32;
+
+    assert(field != NULL);
+    assert(obj != NULL);
+
+    member = (uint8_t *) obj + field->struct_offset;
+
+    switch (iobuf_codec_kind_width(field->kind)) {
+    case 1:
+        v8 = (uint8_t) value;
+        memcpy(member, &v8, sizeof(v8));
+
+        break;
+
+    case 2:
+        v16 = (uint16_t) value;
+        memcpy(member, &v16, sizeof(v16));
+
+        break;
+
+    case 4:
+        v32 = (uint32_t) value;
+        memcpy(member, &v32, sizeof(v32));
+
+        break;
+
+    default:
+        memcpy(member, &value, sizeof(value));
+
+        break;
+    }
+}
+
+HRESULT iobuf_codec_decode(
+        const struct iobuf_codec *codec,
+        struct const_iobuf *src,
+        void *obj)
+{
+    const struct iobuf_codec_field *field;
+    struct iobuf_cursor cur;
+    uint64_t value;
+    size_t i;
+    HRESULT hr;
+
+    assert(codec != NULL);
+    assert(obj != NULL);
+
+    hr = iobuf_reserve(src, &cur, codec->wire_nbytes);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    for (i = 0 ; i < codec->nfields ; i++) {
+        field = &codec->fields[i];
+
+        switch (field->kind) {
+        case IOBUF_CODEC_8:     value = iobuf_cursor_8(&cur); break;
+        case IOBUF_CODEC_BE16:  value = iobuf_cursor_be16(&cur); break;
+        case IOBUF_CODEC_LE16:  value = iobuf_cursor_le16(&cur); break;
+        case IOBUF_CODEC_BE32:  value = iobuf_cursor_be32(&cur); break;
+        case IOBUF_CODEC_LE32:  value = iobuf_cursor_le32(&cur); break;
+        case IOBUF_CODEC_BE64:  value = iobuf_cursor_be64(&cur); break;
+        case IOBUF_CODEC_LE64:  value = iobuf_cursor_le64(&cur); break;
+        default:                assert(0); value = 0; break;
+        }
+
+        iobuf_codec_set(field, obj, value);
+    }
+
+    return S_OK;
+}
+
+HRESULT iobuf_codec_encode(
+        const struct iobuf_codec *codec,
+        struct iobuf *dest,
+        const void *obj)
+{
+    const struct iobuf_codec_field *field;
+    uint8_t *bytes;
+    uint64_t value;
+    size_t i;
+
+    assert(codec != NULL);
+    assert(dest != NULL);
+    assert(dest->pos <= dest->nbytes);
+    assert(obj != NULL);
+
+    if (codec->wire_nbytes > dest->nbytes - dest->pos) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    for (i = 0 ; i < codec->nfields ; i++) {
+        field = &codec->fields[i];
+        bytes = &dest->bytes[dest->pos + field->wire_offset];
+        value = iobuf_codec_get(field, obj);
+
+        switch (field->kind) {
+        case IOBUF_CODEC_8:     iobuf_codec_put_8(bytes, value); break;
+        case IOBUF_CODEC_BE16:  iobuf_codec_put_be16(bytes, value); break;
+        case IOBUF_CODEC_LE16:  iobuf_codec_put_le16(bytes, value); break;
+        case IOBUF_CODEC_BE32:  iobuf_codec_put_be32(bytes, value); break;
+        case IOBUF_CODEC_LE32:  iobuf_codec_put_le32(bytes, value); break;
+        case IOBUF_CODEC_BE64:  iobuf_codec_put_be64(bytes, value); break;
+        case IOBUF_CODEC_LE64:  iobuf_codec_put_le64(bytes, value); break;
+        default:                assert(0); break;
+        }
+    }
+
+    dest->pos += codec->wire_nbytes;
+
+    return S_OK;
+}
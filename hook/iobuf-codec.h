@@ -0,0 +1,253 @@
+#pragma once
+
+#include <windows.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iobuf.h"
+
+/* Declarative fixed-layout wire structs.
+
+   A wire format is described once as an X-macro that lists its fields in
+   wire order, each as a (kind, name) pair where kind is one of 8, be16, le16,
+   be32, le32, be64 or le64:
+
+       #define FOO_REQ_FIELDS(X) \
+               X(8,    cmd) \
+               X(le16, addr) \
+               X(be32, value)
+
+   Then, in a header,
+
+       IOBUF_CODEC_DECLARE(foo_req, FOO_REQ_FIELDS)
+
+   produces a native struct foo_req with one member of the appropriate width
+   per field, and static inline foo_req_decode() and foo_req_encode()
+   functions. These perform a single bounds check and then expand to a
+   straight-line sequence of loads or stores at constant offsets. Reserved
+   bytes on the wire are simply declared as fields and ignored.
+
+       IOBUF_CODEC_DEFINE(foo_req, FOO_REQ_FIELDS)
+
+   in exactly one translation unit additionally provides foo_req_codec(),
+   which returns a run-time description of the same layout (field names,
+   kinds, wire and struct offsets) for logging, fuzzing and similar generic
+   code.
+
+   Wire offsets are obtained from a companion struct foo_req_wire made up
+   purely of byte arrays, which has no padding on any compiler that we
+   support, so sizeof(struct foo_req_wire) is the encoded size. */
+
+enum iobuf_codec_kind {
+    IOBUF_CODEC_8,
+    IOBUF_CODEC_BE16,
+    IOBUF_CODEC_LE16,
+    IOBUF_CODEC_BE32,
+    IOBUF_CODEC_LE32,
+    IOBUF_CODEC_BE64,
+    IOBUF_CODEC_LE64,
+};
+
+struct iobuf_codec_field {
+    const char *name;
+    enum iobuf_codec_kind kind;
+    size_t wire_offset;
+    size_t struct_offset;
+};
+
+struct iobuf_codec {
+    const char *name;
+    const struct iobuf_codec_field *fields;
+    size_t nfields;
+    size_t wire_nbytes;
+    size_t struct_nbytes;
+};
+
+size_t iobuf_codec_kind_width(enum iobuf_codec_kind kind);
+uint64_t iobuf_codec_get(
+        const struct iobuf_codec_field *field,
+        const void *obj);
+void iobuf_codec_set(
+        const struct iobuf_codec_field *field,
+        void *obj,
+        uint64_t value);
+HRESULT iobuf_codec_decode(
+        const struct iobuf_codec *codec,
+        struct const_iobuf *src,
+        void *obj);
+HRESULT iobuf_codec_encode(
+        const struct iobuf_codec *codec,
+        struct iobuf *dest,
+        const void *obj);
+
+#define IOBUF_CODEC_TYPE_8 uint8_t
+#define IOBUF_CODEC_TYPE_be16 uint16_t
+#define IOBUF_CODEC_TYPE_le16 uint16_t
+#define IOBUF_CODEC_TYPE_be32 uint32_t
+#define IOBUF_CODEC_TYPE_le32 uint32_t
+#define IOBUF_CODEC_TYPE_be64 uint64_t
+#define IOBUF_CODEC_TYPE_le64 uint64_t
+
+#define IOBUF_CODEC_WIDTH_8 1
+#define IOBUF_CODEC_WIDTH_be16 2
+#define IOBUF_CODEC_WIDTH_le16 2
+#define IOBUF_CODEC_WIDTH_be32 4
+#define IOBUF_CODEC_WIDTH_le32 4
+#define IOBUF_CODEC_WIDTH_be64 8
+#define IOBUF_CODEC_WIDTH_le64 8
+
+#define IOBUF_CODEC_KIND_8 IOBUF_CODEC_8
+#define IOBUF_CODEC_KIND_be16 IOBUF_CODEC_BE16
+#define IOBUF_CODEC_KIND_le16 IOBUF_CODEC_LE16
+#define IOBUF_CODEC_KIND_be32 IOBUF_CODEC_BE32
+#define IOBUF_CODEC_KIND_le32 IOBUF_CODEC_LE32
+#define IOBUF_CODEC_KIND_be64 IOBUF_CODEC_BE64
+#define IOBUF_CODEC_KIND_le64 IOBUF_CODEC_LE64
+
+#define IOBUF_CODEC_MEMBER_(kind, field) \
+        IOBUF_CODEC_TYPE_##kind field;
+#define IOBUF_CODEC_WIRE_(kind, field) \
+        uint8_t field[IOBUF_CODEC_WIDTH_##kind];
+#define IOBUF_CODEC_DECODE_(kind, field) \
+        obj->field = iobuf_cursor_##kind(&cur);
+#define IOBUF_CODEC_ENCODE_(kind, field) \
+        bytes = iobuf_codec_put_##kind(bytes, obj->field);
+#define IOBUF_CODEC_FIELD_(kind, field) \
+        { \
+            #field, \
+            IOBUF_CODEC_KIND_##kind, \
+            offsetof(iobuf_codec_wire_t, field), \
+            offsetof(iobuf_codec_struct_t, field), \
+        },
+
+#define IOBUF_CODEC_DECLARE(name, FIELDS) \
+        struct name { \
+            FIELDS(IOBUF_CODEC_MEMBER_) \
+        }; \
+        \
+        struct name##_wire { \
+            FIELDS(IOBUF_CODEC_WIRE_) \
+        }; \
+        \
+        const struct iobuf_codec *name##_codec(void); \
+        \
+        static inline HRESULT name##_decode( \
+                struct const_iobuf *src, \
+                struct name *obj) \
+        { \
+            struct iobuf_cursor cur; \
+            HRESULT hr; \
+            \
+            assert(obj != NULL); \
+            \
+            hr = iobuf_reserve(src, &cur, sizeof(struct name##_wire)); \
+            \
+            if (FAILED(hr)) { \
+                return hr; \
+            } \
+            \
+            FIELDS(IOBUF_CODEC_DECODE_) \
+            \
+            return S_OK; \
+        } \
+        \
+        static inline HRESULT name##_encode( \
+                struct iobuf *dest, \
+                const struct name *obj) \
+        { \
+            uint8_t *bytes; \
+            \
+            assert(dest != NULL); \
+            assert(dest->pos <= dest->nbytes); \
+            assert(obj != NULL); \
+            \
+            if (sizeof(struct name##_wire) > dest->nbytes - dest->pos) { \
+                return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER); \
+            } \
+            \
+            bytes = &dest->bytes[dest->pos]; \
+            FIELDS(IOBUF_CODEC_ENCODE_) \
+            dest->pos += sizeof(struct name##_wire); \
+            \
+            return S_OK; \
+        }
+
+#define IOBUF_CODEC_DEFINE(name, FIELDS) \
+        const struct iobuf_codec *name##_codec(void) \
+        { \
+            typedef struct name iobuf_codec_struct_t; \
+            typedef struct name##_wire iobuf_codec_wire_t; \
+            \
+            static const struct iobuf_codec_field fields[] = { \
+                FIELDS(IOBUF_CODEC_FIELD_) \
+            }; \
+            \
+            static const struct iobuf_codec codec = { \
+                #name, \
+                fields, \
+                _countof(fields), \
+                sizeof(struct name##_wire), \
+                sizeof(struct name), \
+            }; \
+            \
+            return &codec; \
+        }
+
+static inline uint8_t *iobuf_codec_put_8(uint8_t *bytes, uint8_t value)
+{
+    bytes[0] = value;
+
+    return bytes + 1;
+}
+
+static inline uint8_t *iobuf_codec_put_be16(uint8_t *bytes, uint16_t value)
+{
+    bytes[0] = value >> 8;
+    bytes[1] = value;
+
+    return bytes + 2;
+}
+
+static inline uint8_t *iobuf_codec_put_le16(uint8_t *bytes, uint16_t value)
+{
+    bytes[0] = value;
+    bytes[1] = value >> 8;
+
+    return bytes + 2;
+}
+
+static inline uint8_t *iobuf_codec_put_be32(uint8_t *bytes, uint32_t value)
+{
+    bytes[0] = value >> 24;
+    bytes[1] = value >> 16;
+    bytes[2] = value >> 8;
+    bytes[3] = value;
+
+    return bytes + 4;
+}
+
+static inline uint8_t *iobuf_codec_put_le32(uint8_t *bytes, uint32_t value)
+{
+    bytes[0] = value;
+    bytes[1] = value >> 8;
+    bytes[2] = value >> 16;
+    bytes[3] = value >> 24;
+
+    return bytes + 4;
+}
+
+static inline uint8_t *iobuf_codec_put_be64(uint8_t *bytes, uint64_t value)
+{
+    bytes = iobuf_codec_put_be32(bytes, value >> 32);
+
+    return iobuf_codec_put_be32(bytes, (uint32_t) value);
+}
+
+static inline uint8_t *iobuf_codec_put_le64(uint8_t *bytes, uint64_t value)
+{
+    bytes = iobuf_codec_put_le32(bytes, (uint32_t) value);
+
+    return iobuf_codec_put_le32(bytes, value >> 32);
+}
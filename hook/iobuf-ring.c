@@ -0,0 +1,412 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf.h"
+
+static void iobuf_ring_copy_out(
+        const struct iobuf_ring *ring,
+        void *bytes,
+        size_t nbytes);
+static void iobuf_ring_copy_in(
+        struct iobuf_ring *ring,
+        const void *bytes,
+        size_t nbytes);
+
+void iobuf_ring_init(struct iobuf_ring *ring, uint8_t *bytes, size_t nbytes)
+{
+    assert(ring != NULL);
+    assert(bytes != NULL || nbytes == 0);
+    assert((nbytes & (nbytes - 1)) == 0);
+
+    ring->bytes = bytes;
+    ring->nbytes = nbytes;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+void iobuf_ring_clear(struct iobuf_ring *ring)
+{
+    assert(ring != NULL);
+
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+size_t iobuf_ring_avail(const struct iobuf_ring *ring)
+{
+    assert(ring != NULL);
+    assert(ring->tail - ring->head <= ring->nbytes);
+
+    return ring->tail - ring->head;
+}
+
+size_t iobuf_ring_space(const struct iobuf_ring *ring)
+{
+    assert(ring != NULL);
+    assert(ring->tail - ring->head <= ring->nbytes);
+
+    return ring->nbytes - (ring->tail - ring->head);
+}
+
+size_t iobuf_ring_move(struct iobuf_ring *dest, struct const_iobuf *src)
+{
+    size_t src_avail;
+    size_t chunksz;
+
+    assert(dest != NULL);
+    assert(src != NULL);
+    assert(src->bytes != NULL || src->nbytes == 0);
+    assert(src->pos <= src->nbytes);
+
+    src_avail = src->nbytes - src->pos;
+    chunksz = iobuf_ring_space(dest);
+
+    if (chunksz > src_avail) {
+        chunksz = src_avail;
+    }
+
+    iobuf_ring_copy_in(dest, &src->bytes[src->pos], chunksz);
+    src->pos += chunksz;
+
+    return chunksz;
+}
+
+size_t iobuf_ring_shift(struct iobuf *dest, struct iobuf_ring *src)
+{
+    size_t nbytes;
+
+    nbytes = iobuf_ring_peek(dest, src);
+    src->head += nbytes;
+
+    return nbytes;
+}
+
+size_t iobuf_ring_peek(struct iobuf *dest, const struct iobuf_ring *src)
+{
+    size_t dest_avail;
+    size_t chunksz;
+
+    assert(dest != NULL);
+    assert(dest->bytes != NULL || dest->nbytes == 0);
+    assert(dest->pos <= dest->nbytes);
+    assert(src != NULL);
+
+    dest_avail = dest->nbytes - dest->pos;
+    chunksz = iobuf_ring_avail(src);
+
+    if (chunksz > dest_avail) {
+        chunksz = dest_avail;
+    }
+
+    iobuf_ring_copy_out(src, &dest->bytes[dest->pos], chunksz);
+    dest->pos += chunksz;
+
+    return chunksz;
+}
+
+size_t iobuf_ring_skip(struct iobuf_ring *ring, size_t nbytes)
+{
+    size_t avail;
+
+    avail = iobuf_ring_avail(ring);
+
+    if (nbytes > avail) {
+        nbytes = avail;
+    }
+
+    ring->head += nbytes;
+
+    return nbytes;
+}
+
+HRESULT iobuf_ring_read(struct iobuf_ring *src, void *bytes, size_t nbytes)
+{
+    assert(bytes != NULL || nbytes == 0);
+
+    if (nbytes > iobuf_ring_avail(src)) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    iobuf_ring_copy_out(src, bytes, nbytes);
+    src->head += nbytes;
+
+    return S_OK;
+}
+
+HRESULT iobuf_ring_read_8(struct iobuf_ring *src, uint8_t *out)
+{
+    assert(out != NULL);
+
+    return iobuf_ring_read(src, out, sizeof(*out));
+}
+
+HRESULT iobuf_ring_read_be16(struct iobuf_ring *src, uint16_t *out)
+{
+    uint8_t b[2];
+    HRESULT hr;
+
+    assert(out != NULL);
+
+    hr = iobuf_ring_read(src, b, sizeof(b));
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    *out = (b[0] << 8) | b[1];
+
+    return S_OK;
+}
+
+HRESULT iobuf_ring_read_be32(struct iobuf_ring *src, uint32_t *out)
+{
+    uint8_t b[4];
+    HRESULT hr;
+
+    assert(out != NULL);
+
+    hr = iobuf_ring_read(src, b, sizeof(b));
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    *out = ((uint32_t) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+
+    return S_OK;
+}
+
+HRESULT iobuf_ring_read_be64(struct iobuf_ring *src, uint64_t *out)
+{
+    uint8_t b[8];
+    uint64_t value;
+    HRESULT hr;
+    size_t i;
+
+    assert(out != NULL);
+
+    hr = iobuf_ring_read(src, b, sizeof(b));
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    value = 0;
+
+    for (i = 0 ; i < sizeof(b) ; i++) {
+        value = (value << 8) | b[i];
+    }
+
+    *out = value;
+
+    return S_OK;
+}
+
+HRESULT iobuf_ring_read_le16(struct iobuf_ring *src, uint16_t *out)
+{
+    uint8_t b[2];
+    HRESULT hr;
+
+    assert(out != NULL);
+
+    hr = iobuf_ring_read(src, b, sizeof(b));
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    *out = b[0] | (b[1] << 8);
+
+    return S_OK;
+}
+
+HRESULT iobuf_ring_read_le32(struct iobuf_ring *src, uint32_t *out)
+{
+    uint8_t b[4];
+    HRESULT hr;
+
+    assert(out != NULL);
+
+    hr = iobuf_ring_read(src, b, sizeof(b));
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    *out = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+
+    return S_OK;
+}
+
+HRESULT iobuf_ring_read_le64(struct iobuf_ring *src, uint64_t *out)
+{
+    uint8_t b[8];
+    uint64_t value;
+    HRESULT hr;
+    size_t i;
+
+    assert(out != NULL);
+
+    hr = iobuf_ring_read(src, b, sizeof(b));
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    value = 0;
+
+    for (i = sizeof(b) ; i > 0 ; i--) {
+        value = (value << 8) | b[i - 1];
+    }
+
+    *out = value;
+
+    return S_OK;
+}
+
+HRESULT iobuf_ring_write(
+        struct iobuf_ring *dest,
+        const void *bytes,
+        size_t nbytes)
+{
+    assert(bytes != NULL || nbytes == 0);
+
+    if (nbytes > iobuf_ring_space(dest)) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    iobuf_ring_copy_in(dest, bytes, nbytes);
+
+    return S_OK;
+}
+
+HRESULT iobuf_ring_write_8(struct iobuf_ring *dest, uint8_t value)
+{
+    return iobuf_ring_write(dest, &value, sizeof(value));
+}
+
+HRESULT iobuf_ring_write_be16(struct iobuf_ring *dest, uint16_t value)
+{
+    uint8_t b[2];
+
+    b[0] = value >> 8;
+    b[1] = value;
+
+    return iobuf_ring_write(dest, b, sizeof(b));
+}
+
+HRESULT iobuf_ring_write_be32(struct iobuf_ring *dest, uint32_t value)
+{
+    uint8_t b[4];
+
+    b[0] = value >> 24;
+    b[1] = value >> 16;
+    b[2] = value >> 8;
+    b[3] = value;
+
+    return iobuf_ring_write(dest, b, sizeof(b));
+}
+
+HRESULT iobuf_ring_write_be64(struct iobuf_ring *dest, uint64_t value)
+{
+    uint8_t b[8];
+    size_t i;
+
+    for (i = sizeof(b) ; i > 0 ; i--) {
+        b[i - 1] = value;
+        value >>= 8;
+    }
+
+    return iobuf_ring_write(dest, b, sizeof(b));
+}
+
+HRESULT iobuf_ring_write_le16(struct iobuf_ring *dest, uint16_t value)
+{
+    uint8_t b[2];
+
+    b[0] = value;
+    b[1] = value >> 8;
+
+    return iobuf_ring_write(dest, b, sizeof(b));
+}
+
+HRESULT iobuf_ring_write_le32(struct iobuf_ring *dest, uint32_t value)
+{
+    uint8_t b[4];
+
+    b[0] = value;
+    b[1] = value >> 8;
+    b[2] = value >> 16;
+    b[3] = value >> 24;
+
+    return iobuf_ring_write(dest, b, sizeof(b));
+}
+
+HRESULT iobuf_ring_write_le64(struct iobuf_ring *dest, uint64_t value)
+{
+    uint8_t b[8];
+    size_t i;
+
+    for (i = 0 ; i < sizeof(b) ; i++) {
+        b[i] = value;
+        value >>= 8;
+    }
+
+    return iobuf_ring_write(dest, b, sizeof(b));
+}
+
+static void iobuf_ring_copy_out(
+        const struct iobuf_ring *ring,
+        void *bytes,
+        size_t nbytes)
+{
+    size_t offset;
+    size_t chunksz;
+
+    /* Copy nbytes starting at the head, which the caller has checked are
+       available. At most two memcpy()s are needed: one up to the end of the
+       buffer and one from the start of the buffer. */
+
+    if (nbytes == 0) {
+        return;
+    }
+
+    offset = ring->head & (ring->nbytes - 1);
+    chunksz = ring->nbytes - offset;
+
+    if (chunksz > nbytes) {
+        chunksz = nbytes;
+    }
+
+    memcpy(bytes, &ring->bytes[offset], chunksz);
+    memcpy((uint8_t *) bytes + chunksz, ring->bytes, nbytes - chunksz);
+}
+
+static void iobuf_ring_copy_in(
+        struct iobuf_ring *ring,
+        const void *bytes,
+        size_t nbytes)
+{
+    size_t offset;
+    size_t chunksz;
+
+    if (nbytes == 0) {
+        return;
+    }
+
+    offset = ring->tail & (ring->nbytes - 1);
+    chunksz = ring->nbytes - offset;
+
+    if (chunksz > nbytes) {
+        chunksz = nbytes;
+    }
+
+    memcpy(&ring->bytes[offset], bytes, chunksz);
+    memcpy(ring->bytes, (const uint8_t *) bytes + chunksz, nbytes - chunksz);
+    ring->tail += nbytes;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iobuf.h"
+
+/* Fixed-capacity FIFO byte queue. The capacity must be a power of two (or
+   zero). head and tail are free-running byte counters that are only reduced
+   modulo the capacity when the buffer is indexed, so the ring is empty when
+   they are equal and full when they are exactly nbytes apart. */
+
+struct iobuf_ring {
+    uint8_t *bytes;
+    size_t nbytes;
+    size_t head;
+    size_t tail;
+};
+
+void iobuf_ring_init(struct iobuf_ring *ring, uint8_t *bytes, size_t nbytes);
+void iobuf_ring_clear(struct iobuf_ring *ring);
+size_t iobuf_ring_avail(const struct iobuf_ring *ring);
+size_t iobuf_ring_space(const struct iobuf_ring *ring);
+
+size_t iobuf_ring_move(struct iobuf_ring *dest, struct const_iobuf *src);
+size_t iobuf_ring_shift(struct iobuf *dest, struct iobuf_ring *src);
+size_t iobuf_ring_peek(struct iobuf *dest, const struct iobuf_ring *src);
+size_t iobuf_ring_skip(struct iobuf_ring *ring, size_t nbytes);
+
+HRESULT iobuf_ring_read(struct iobuf_ring *src, void *bytes, size_t nbytes);
+HRESULT iobuf_ring_read_8(struct iobuf_ring *src, uint8_t *value);
+HRESULT iobuf_ring_read_be16(struct iobuf_ring *src, uint16_t *value);
+HRESULT iobuf_ring_read_be32(struct iobuf_ring *src, uint32_t *value);
+HRESULT iobuf_ring_read_be64(struct iobuf_ring *src, uint64_t *value);
+HRESULT iobuf_ring_read_le16(struct iobuf_ring *src, uint16_t *value);
+HRESULT iobuf_ring_read_le32(struct iobuf_ring *src, uint32_t *value);
+HRESULT iobuf_ring_read_le64(struct iobuf_ring *src, uint64_t *value);
+
+HRESULT iobuf_ring_write(
+        struct iobuf_ring *dest,
+        const void *bytes,
+        size_t nbytes);
+HRESULT iobuf_ring_write_8(struct iobuf_ring *dest, uint8_t value);
+HRESULT iobuf_ring_write_be16(struct iobuf_ring *dest, uint16_t value);
+HRESULT iobuf_ring_write_be32(struct iobuf_ring *dest, uint32_t value);
+HRESULT iobuf_ring_write_be64(struct iobuf_ring *dest, uint64_t value);
+HRESULT iobuf_ring_write_le16(struct iobuf_ring *dest, uint16_t value);
+HRESULT iobuf_ring_write_le32(struct iobuf_ring *dest, uint32_t value);
+HRESULT iobuf_ring_write_le64(struct iobuf_ring *dest, uint64_t value);
@@ -0,0 +1,256 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hook/cpu.h"
+#include "hook/iobuf-spsc.h"
+#include "hook/iobuf.h"
+
+static size_t iobuf_spsc_load(const size_t *p);
+static void iobuf_spsc_store(size_t *p, size_t value);
+static size_t iobuf_spsc_reserve_in(struct iobuf_spsc *q, size_t nbytes);
+static size_t iobuf_spsc_reserve_out(struct iobuf_spsc *q, size_t nbytes);
+static void iobuf_spsc_copy_in(
+        struct iobuf_spsc *q,
+        const void *bytes,
+        size_t nbytes);
+static void iobuf_spsc_copy_out(
+        struct iobuf_spsc *q,
+        void *bytes,
+        size_t nbytes);
+
+void iobuf_spsc_init(struct iobuf_spsc *q, uint8_t *bytes, size_t nbytes)
+{
+    assert(q != NULL);
+    assert(bytes != NULL || nbytes == 0);
+    assert((nbytes & (nbytes - 1)) == 0);
+
+    memset(q, 0, sizeof(*q));
+    q->bytes = bytes;
+    q->nbytes = nbytes;
+}
+
+size_t iobuf_spsc_space(struct iobuf_spsc *q)
+{
+    assert(q != NULL);
+
+    return iobuf_spsc_reserve_in(q, q->nbytes);
+}
+
+size_t iobuf_spsc_move(struct iobuf_spsc *dest, struct const_iobuf *src)
+{
+    size_t nbytes;
+
+    assert(dest != NULL);
+    assert(src != NULL);
+    assert(src->bytes != NULL || src->nbytes == 0);
+    assert(src->pos <= src->nbytes);
+
+    nbytes = iobuf_spsc_reserve_in(dest, src->nbytes - src->pos);
+    iobuf_spsc_copy_in(dest, &src->bytes[src->pos], nbytes);
+    src->pos += nbytes;
+
+    return nbytes;
+}
+
+HRESULT iobuf_spsc_write(
+        struct iobuf_spsc *dest,
+        const void *bytes,
+        size_t nbytes)
+{
+    assert(dest != NULL);
+    assert(bytes != NULL || nbytes == 0);
+
+    if (iobuf_spsc_reserve_in(dest, nbytes) < nbytes) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    iobuf_spsc_copy_in(dest, bytes, nbytes);
+
+    return S_OK;
+}
+
+size_t iobuf_spsc_commit(struct iobuf_spsc *q, size_t nbytes)
+{
+    assert(q != NULL);
+
+    nbytes = iobuf_spsc_reserve_in(q, nbytes);
+    iobuf_spsc_store(&q->tail, q->tail + nbytes);
+
+    return nbytes;
+}
+
+size_t iobuf_spsc_avail(struct iobuf_spsc *q)
+{
+    assert(q != NULL);
+
+    return iobuf_spsc_reserve_out(q, q->nbytes);
+}
+
+size_t iobuf_spsc_shift(struct iobuf *dest, struct iobuf_spsc *src)
+{
+    size_t nbytes;
+
+    assert(dest != NULL);
+    assert(dest->bytes != NULL || dest->nbytes == 0);
+    assert(dest->pos <= dest->nbytes);
+    assert(src != NULL);
+
+    nbytes = iobuf_spsc_reserve_out(src, dest->nbytes - dest->pos);
+    iobuf_spsc_copy_out(src, &dest->bytes[dest->pos], nbytes);
+    dest->pos += nbytes;
+
+    return nbytes;
+}
+
+size_t iobuf_spsc_skip(struct iobuf_spsc *q, size_t nbytes)
+{
+    assert(q != NULL);
+
+    nbytes = iobuf_spsc_reserve_out(q, nbytes);
+    iobuf_spsc_store(&q->head, q->head + nbytes);
+
+    return nbytes;
+}
+
+HRESULT iobuf_spsc_read(struct iobuf_spsc *src, void *bytes, size_t nbytes)
+{
+    assert(src != NULL);
+    assert(bytes != NULL || nbytes == 0);
+
+    if (iobuf_spsc_reserve_out(src, nbytes) < nbytes) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    iobuf_spsc_copy_out(src, bytes, nbytes);
+
+    return S_OK;
+}
+
+/* Acquire load of the other side's counter and release store of our own. On
+   x86 ordinary loads and stores already have these semantics, so all that is
+   needed there is to stop the compiler from moving the buffer accesses
+   across them. */
+
+static size_t iobuf_spsc_load(const size_t *p)
+{
+#if defined(__GNUC__)
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#elif defined(CPU_X86)
+    size_t value;
+
+    value = *(const volatile size_t *) p;
+    _ReadWriteBarrier();
+
+    return value;
+#else
+    size_t value;
+
+    value = *(const volatile size_t *) p;
+    MemoryBarrier();
+
+    return value;
+#endif
+}
+
+static void iobuf_spsc_store(size_t *p, size_t value)
+{
+#if defined(__GNUC__)
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+#elif defined(CPU_X86)
+    _ReadWriteBarrier();
+    *(volatile size_t *) p = value;
+#else
+    MemoryBarrier();
+    *(volatile size_t *) p = value;
+#endif
+}
+
+static size_t iobuf_spsc_reserve_in(struct iobuf_spsc *q, size_t nbytes)
+{
+    size_t space;
+
+    /* Producer: how much of nbytes fits, going back to the consumer's
+       counter only if our cached copy of it can't tell us that it all
+       does. */
+
+    space = q->nbytes - (q->tail - q->head_cache);
+
+    if (space < nbytes) {
+        q->head_cache = iobuf_spsc_load(&q->head);
+        space = q->nbytes - (q->tail - q->head_cache);
+    }
+
+    assert(space <= q->nbytes);
+
+    return space < nbytes ? space : nbytes;
+}
+
+static size_t iobuf_spsc_reserve_out(struct iobuf_spsc *q, size_t nbytes)
+{
+    size_t avail;
+
+    /* Consumer: mirror image of the above */
+
+    avail = q->tail_cache - q->head;
+
+    if (avail < nbytes) {
+        q->tail_cache = iobuf_spsc_load(&q->tail);
+        avail = q->tail_cache - q->head;
+    }
+
+    assert(avail <= q->nbytes);
+
+    return avail < nbytes ? avail : nbytes;
+}
+
+static void iobuf_spsc_copy_in(
+        struct iobuf_spsc *q,
+        const void *bytes,
+        size_t nbytes)
+{
+    size_t offset;
+    size_t chunksz;
+
+    if (nbytes == 0) {
+        return;
+    }
+
+    offset = q->tail & (q->nbytes - 1);
+    chunksz = q->nbytes - offset;
+
+    if (chunksz > nbytes) {
+        chunksz = nbytes;
+    }
+
+    memcpy(&q->bytes[offset], bytes, chunksz);
+    memcpy(q->bytes, (const uint8_t *) bytes + chunksz, nbytes - chunksz);
+    iobuf_spsc_store(&q->tail, q->tail + nbytes);
+}
+
+static void iobuf_spsc_copy_out(
+        struct iobuf_spsc *q,
+        void *bytes,
+        size_t nbytes)
+{
+    size_t offset;
+    size_t chunksz;
+
+    if (nbytes == 0) {
+        return;
+    }
+
+    offset = q->head & (q->nbytes - 1);
+    chunksz = q->nbytes - offset;
+
+    if (chunksz > nbytes) {
+        chunksz = nbytes;
+    }
+
+    memcpy(bytes, &q->bytes[offset], chunksz);
+    memcpy((uint8_t *) bytes + chunksz, q->bytes, nbytes - chunksz);
+    iobuf_spsc_store(&q->head, q->head + nbytes);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iobuf.h"
+
+/* Lock-free byte queue with exactly one producer thread and one consumer
+   thread. Like struct iobuf_ring, the capacity is a power of two and head and
+   tail are free-running byte counters, but here tail is only ever written by
+   the producer and head only by the consumer, and each side publishes its
+   counter with release semantics once the bytes that it covers have been
+   copied.
+
+   Each side also keeps a private copy of the other side's counter and only
+   re-reads the shared one when that copy says the queue is full (or empty),
+   so in steady state neither side touches the other's cache line except to
+   publish. The three groups of fields are padded out to separate cache lines
+   for the same reason; align the struct itself to IOBUF_SPSC_LINE for best
+   results.
+
+   Functions are labelled with the side that may call them. Nothing here ever
+   blocks, waking the other side up is the caller's business. */
+
+#define IOBUF_SPSC_LINE 64
+
+struct iobuf_spsc {
+    uint8_t *bytes;
+    size_t nbytes;
+    uint8_t pad0[IOBUF_SPSC_LINE - sizeof(uint8_t *) - sizeof(size_t)];
+
+    /* Consumer */
+    size_t head;
+    size_t tail_cache;
+    uint8_t pad1[IOBUF_SPSC_LINE - 2 * sizeof(size_t)];
+
+    /* Producer */
+    size_t tail;
+    size_t head_cache;
+    uint8_t pad2[IOBUF_SPSC_LINE - 2 * sizeof(size_t)];
+};
+
+/* Neither side may be running */
+
+void iobuf_spsc_init(struct iobuf_spsc *q, uint8_t *bytes, size_t nbytes);
+
+/* Producer side */
+
+size_t iobuf_spsc_space(struct iobuf_spsc *q);
+size_t iobuf_spsc_move(struct iobuf_spsc *dest, struct const_iobuf *src);
+HRESULT iobuf_spsc_write(
+        struct iobuf_spsc *dest,
+        const void *bytes,
+        size_t nbytes);
+
+/* Publish up to nbytes that were placed in the buffer by some other means,
+   such as by another process that maps the same memory. This is the
+   producer's counterpart of iobuf_spsc_skip(). */
+
+size_t iobuf_spsc_commit(struct iobuf_spsc *q, size_t nbytes);
+
+/* Consumer side */
+
+size_t iobuf_spsc_avail(struct iobuf_spsc *q);
+size_t iobuf_spsc_shift(struct iobuf *dest, struct iobuf_spsc *src);
+size_t iobuf_spsc_skip(struct iobuf_spsc *q, size_t nbytes);
+HRESULT iobuf_spsc_read(struct iobuf_spsc *src, void *bytes, size_t nbytes);
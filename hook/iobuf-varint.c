@@ -0,0 +1,294 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iobuf-varint.h"
+#include "hook/iobuf.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define IOBUF_VARINT_MAX_BYTES 10
+#define IOBUF_VARINT_MSBS UINT64_C(0x8080808080808080)
+
+static HRESULT iobuf_read_leb128(
+        struct const_iobuf *src,
+        bool is_signed,
+        uint64_t *value,
+        unsigned int *nbits);
+static HRESULT iobuf_read_leb128_slow(
+        struct const_iobuf *src,
+        bool is_signed,
+        uint64_t *value,
+        unsigned int *nbits);
+static unsigned int iobuf_varint_ctz64(uint64_t x);
+static unsigned int iobuf_varint_bsr64(uint64_t x);
+
+HRESULT iobuf_read_uleb128(struct const_iobuf *src, uint64_t *value)
+{
+    unsigned int nbits;
+
+    assert(value != NULL);
+
+    return iobuf_read_leb128(src, false, value, &nbits);
+}
+
+HRESULT iobuf_read_sleb128(struct const_iobuf *src, int64_t *value)
+{
+    uint64_t raw;
+    unsigned int nbits;
+    HRESULT hr;
+
+    assert(value != NULL);
+
+    hr = iobuf_read_leb128(src, true, &raw, &nbits);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    if (nbits < 64 && (raw >> (nbits - 1)) & 1) {
+        raw |= ~UINT64_C(0) << nbits;
+    }
+
+    *value = (int64_t) raw;
+
+    return S_OK;
+}
+
+HRESULT iobuf_write_uleb128(struct iobuf *dest, uint64_t value)
+{
+    uint8_t bytes[IOBUF_VARINT_MAX_BYTES];
+    uint64_t x;
+    size_t nbytes;
+    size_t i;
+
+    assert(dest != NULL);
+    assert(dest->pos <= dest->nbytes);
+
+    if (value < (UINT64_C(1) << 56) && dest->nbytes - dest->pos >= 8) {
+        /* Mirror image of the fast read path: spread the 7-bit groups out
+           into bytes, set the continuation bits on all but the last byte in
+           use and store the whole word. Bytes past the end of the encoding
+           land in unused space in dest. */
+
+        x = value;
+        x = ((x & UINT64_C(0x00FFFFFFF0000000)) << 4) |
+             (x & UINT64_C(0x000000000FFFFFFF));
+        x = ((x & UINT64_C(0x0FFFC0000FFFC000)) << 2) |
+             (x & UINT64_C(0x00003FFF00003FFF));
+        x = ((x & UINT64_C(0x3F803F803F803F80)) << 1) |
+             (x & UINT64_C(0x007F007F007F007F));
+
+        nbytes = x != 0 ? iobuf_varint_bsr64(x) / 8 + 1 : 1;
+        x |= IOBUF_VARINT_MSBS & ((UINT64_C(1) << (8 * (nbytes - 1))) - 1);
+
+        for (i = 0 ; i < 8 ; i++) {
+            dest->bytes[dest->pos + i] = (uint8_t) (x >> (8 * i));
+        }
+
+        dest->pos += nbytes;
+
+        return S_OK;
+    }
+
+    nbytes = 0;
+
+    do {
+        bytes[nbytes] = value & 0x7F;
+        value >>= 7;
+
+        if (value != 0) {
+            bytes[nbytes] |= 0x80;
+        }
+
+        nbytes++;
+    } while (value != 0);
+
+    return iobuf_write(dest, bytes, nbytes);
+}
+
+HRESULT iobuf_write_sleb128(struct iobuf *dest, int64_t value)
+{
+    uint8_t bytes[IOBUF_VARINT_MAX_BYTES];
+    size_t nbytes;
+    bool done;
+
+    nbytes = 0;
+
+    /* Stop once the remaining bits are all copies of the sign bit that the
+       final group carries. Right shifts of negative values are arithmetic on
+       every compiler that we support. */
+
+    do {
+        bytes[nbytes] = value & 0x7F;
+        value >>= 7;
+        done =  (value == 0 && !(bytes[nbytes] & 0x40)) ||
+                (value == -1 && (bytes[nbytes] & 0x40));
+
+        if (!done) {
+            bytes[nbytes] |= 0x80;
+        }
+
+        nbytes++;
+    } while (!done);
+
+    return iobuf_write(dest, bytes, nbytes);
+}
+
+static HRESULT iobuf_read_leb128(
+        struct const_iobuf *src,
+        bool is_signed,
+        uint64_t *value,
+        unsigned int *nbits)
+{
+    uint64_t word;
+    uint64_t stops;
+    uint64_t x;
+    unsigned int nbytes;
+
+    assert(src != NULL);
+    assert(src->bytes != NULL || src->nbytes == 0);
+    assert(src->pos <= src->nbytes);
+
+    if (src->nbytes - src->pos < 8) {
+        return iobuf_read_leb128_slow(src, is_signed, value, nbits);
+    }
+
+    /* Fast path for encodings of up to eight bytes (56 bits): load a whole
+       word, find the first byte with its top bit clear, then squeeze the
+       7-bit groups together pairwise in three steps. */
+
+    word =  ((uint64_t) src->bytes[src->pos + 0]) |
+            ((uint64_t) src->bytes[src->pos + 1] << 8) |
+            ((uint64_t) src->bytes[src->pos + 2] << 16) |
+            ((uint64_t) src->bytes[src->pos + 3] << 24) |
+            ((uint64_t) src->bytes[src->pos + 4] << 32) |
+            ((uint64_t) src->bytes[src->pos + 5] << 40) |
+            ((uint64_t) src->bytes[src->pos + 6] << 48) |
+            ((uint64_t) src->bytes[src->pos + 7] << 56);
+
+    stops = ~word & IOBUF_VARINT_MSBS;
+
+    if (stops == 0) {
+        return iobuf_read_leb128_slow(src, is_signed, value, nbits);
+    }
+
+    /* Keep everything up to and including the terminating byte */
+
+    x = word & (stops ^ (stops - 1)) & ~IOBUF_VARINT_MSBS;
+    x = ((x & UINT64_C(0x7F007F007F007F00)) >> 1) |
+         (x & UINT64_C(0x007F007F007F007F));
+    x = ((x & UINT64_C(0x3FFF00003FFF0000)) >> 2) |
+         (x & UINT64_C(0x00003FFF00003FFF));
+    x = ((x & UINT64_C(0x0FFFFFFF00000000)) >> 4) |
+         (x & UINT64_C(0x000000000FFFFFFF));
+
+    nbytes = iobuf_varint_ctz64(stops) / 8 + 1;
+    src->pos += nbytes;
+    *value = x;
+    *nbits = 7 * nbytes;
+
+    return S_OK;
+}
+
+static HRESULT iobuf_read_leb128_slow(
+        struct const_iobuf *src,
+        bool is_signed,
+        uint64_t *value,
+        unsigned int *nbits)
+{
+    uint64_t result;
+    unsigned int i;
+    uint8_t byte;
+
+    result = 0;
+
+    for (i = 0 ; ; i++) {
+        if (i == IOBUF_VARINT_MAX_BYTES) {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        if (src->pos + i >= src->nbytes) {
+            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+
+        byte = src->bytes[src->pos + i];
+
+        /* The tenth byte only has room for bit 63; the rest of it has to be
+           zero, or sign extension for signed values. */
+
+        if (i == IOBUF_VARINT_MAX_BYTES - 1) {
+            if (    (byte & 0x7E) != 0 &&
+                    !(is_signed && (byte & 0x7F) == 0x7F)) {
+                return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            }
+        }
+
+        result |= (uint64_t) (byte & 0x7F) << (7 * i);
+
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+
+    src->pos += i + 1;
+    *value = result;
+    *nbits = 7 * (i + 1) < 64 ? 7 * (i + 1) : 64;
+
+    return S_OK;
+}
+
+static unsigned int iobuf_varint_ctz64(uint64_t x)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+
+    _BitScanForward64(&index, x);
+
+    return index;
+#elif defined(_MSC_VER)
+    unsigned long index;
+
+    if ((uint32_t) x != 0) {
+        _BitScanForward(&index, (uint32_t) x);
+
+        return index;
+    }
+
+    _BitScanForward(&index, (uint32_t) (x >> 32));
+
+    return index + 32;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+static unsigned int iobuf_varint_bsr64(uint64_t x)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+
+    _BitScanReverse64(&index, x);
+
+    return index;
+#elif defined(_MSC_VER)
+    unsigned long index;
+
+    if ((uint32_t) (x >> 32) != 0) {
+        _BitScanReverse(&index, (uint32_t) (x >> 32));
+
+        return index + 32;
+    }
+
+    _BitScanReverse(&index, (uint32_t) x);
+
+    return index;
+#else
+    return 63 - __builtin_clzll(x);
+#endif
+}
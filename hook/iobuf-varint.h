@@ -0,0 +1,20 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stdint.h>
+
+#include "hook/iobuf.h"
+
+/* LEB128 variable-length integers: seven bits per byte, least significant
+   group first, with the top bit of each byte set on all but the last. The
+   signed variant sign-extends from the top bit of the final group.
+
+   Reads fail with ERROR_INSUFFICIENT_BUFFER on truncated input, leaving src
+   untouched, and with ERROR_INVALID_DATA on encodings that do not fit in 64
+   bits. Writes either store the complete encoding or nothing. */
+
+HRESULT iobuf_read_uleb128(struct const_iobuf *src, uint64_t *value);
+HRESULT iobuf_read_sleb128(struct const_iobuf *src, int64_t *value);
+HRESULT iobuf_write_uleb128(struct iobuf *dest, uint64_t value);
+HRESULT iobuf_write_sleb128(struct iobuf *dest, int64_t value);
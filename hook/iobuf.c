@@ -55,6 +55,28 @@ size_t iobuf_shift(struct iobuf *dest, struct iobuf *src)
     return span.pos;
 }
 
+HRESULT iobuf_reserve(
+        struct const_iobuf *src,
+        struct iobuf_cursor *cur,
+        size_t nbytes)
+{
+    assert(src != NULL);
+    assert(src->pos <= src->nbytes);
+    assert(cur != NULL);
+
+    /* Written so as not to overflow with a bogus length from the wire */
+
+    if (nbytes > src->nbytes - src->pos) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    cur->bytes = &src->bytes[src->pos];
+    cur->end = cur->bytes + nbytes;
+    src->pos += nbytes;
+
+    return S_OK;
+}
+
 HRESULT iobuf_read(struct const_iobuf *src, void *bytes, size_t nbytes)
 {
     assert(src != NULL);
@@ -114,7 +136,7 @@ HRESULT iobuf_read_be32(struct const_iobuf *src, uint32_t *out)
         return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
     }
 
-    value  = src->bytes[src->pos++] << 24;
+    value  = ((uint32_t) src->bytes[src->pos++]) << 24;
     value |= src->bytes[src->pos++] << 16;
     value |= src->bytes[src->pos++] << 8;
     value |= src->bytes[src->pos++];
@@ -182,7 +204,7 @@ HRESULT iobuf_read_le32(struct const_iobuf *src, uint32_t *out)
     value  = src->bytes[src->pos++];
     value |= src->bytes[src->pos++] << 8;
     value |= src->bytes[src->pos++] << 16;
-    value |= src->bytes[src->pos++] << 24;
+    value |= ((uint32_t) src->bytes[src->pos++]) << 24;
 
     *out = value;
 
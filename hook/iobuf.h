@@ -2,6 +2,7 @@
 
 #include <windows.h>
 
+#include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -17,6 +18,16 @@ struct const_iobuf {
     size_t pos;
 };
 
+/* A span of a const_iobuf that has already been bounds-checked by
+   iobuf_reserve(). The iobuf_cursor_*() accessors below do no checking of
+   their own beyond debug assertions, so a fixed-layout structure can be
+   decoded with a single check up front. */
+
+struct iobuf_cursor {
+    const uint8_t *bytes;
+    const uint8_t *end;
+};
+
 void iobuf_flip(struct const_iobuf *child, struct iobuf *parent);
 size_t iobuf_move(struct iobuf *dest, struct const_iobuf *src);
 size_t iobuf_shift(struct iobuf *dest, struct iobuf *src);
@@ -38,3 +49,95 @@ HRESULT iobuf_write_be64(struct iobuf *dest, uint64_t value);
 HRESULT iobuf_write_le16(struct iobuf *dest, uint16_t value);
 HRESULT iobuf_write_le32(struct iobuf *dest, uint32_t value);
 HRESULT iobuf_write_le64(struct iobuf *dest, uint64_t value);
+
+HRESULT iobuf_reserve(
+        struct const_iobuf *src,
+        struct iobuf_cursor *cur,
+        size_t nbytes);
+
+static inline size_t iobuf_cursor_remaining(const struct iobuf_cursor *cur)
+{
+    return cur->end - cur->bytes;
+}
+
+static inline void iobuf_cursor_skip(struct iobuf_cursor *cur, size_t nbytes)
+{
+    assert(iobuf_cursor_remaining(cur) >= nbytes);
+
+    cur->bytes += nbytes;
+}
+
+static inline const uint8_t *iobuf_cursor_bytes(
+        struct iobuf_cursor *cur,
+        size_t nbytes)
+{
+    const uint8_t *bytes;
+
+    assert(iobuf_cursor_remaining(cur) >= nbytes);
+
+    bytes = cur->bytes;
+    cur->bytes += nbytes;
+
+    return bytes;
+}
+
+static inline uint8_t iobuf_cursor_8(struct iobuf_cursor *cur)
+{
+    assert(iobuf_cursor_remaining(cur) >= 1);
+
+    return *cur->bytes++;
+}
+
+static inline uint16_t iobuf_cursor_be16(struct iobuf_cursor *cur)
+{
+    const uint8_t *b;
+
+    b = iobuf_cursor_bytes(cur, 2);
+
+    return (b[0] << 8) | b[1];
+}
+
+static inline uint32_t iobuf_cursor_be32(struct iobuf_cursor *cur)
+{
+    const uint8_t *b;
+
+    b = iobuf_cursor_bytes(cur, 4);
+
+    return ((uint32_t) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+static inline uint64_t iobuf_cursor_be64(struct iobuf_cursor *cur)
+{
+    uint64_t hi;
+
+    hi = iobuf_cursor_be32(cur);
+
+    return (hi << 32) | iobuf_cursor_be32(cur);
+}
+
+static inline uint16_t iobuf_cursor_le16(struct iobuf_cursor *cur)
+{
+    const uint8_t *b;
+
+    b = iobuf_cursor_bytes(cur, 2);
+
+    return b[0] | (b[1] << 8);
+}
+
+static inline uint32_t iobuf_cursor_le32(struct iobuf_cursor *cur)
+{
+    const uint8_t *b;
+
+    b = iobuf_cursor_bytes(cur, 4);
+
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+static inline uint64_t iobuf_cursor_le64(struct iobuf_cursor *cur)
+{
+    uint64_t lo;
+
+    lo = iobuf_cursor_le32(cur);
+
+    return lo | ((uint64_t) iobuf_cursor_le32(cur) << 32);
+}
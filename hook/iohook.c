@@ -18,14 +18,55 @@
 #include "hook/iohook.h"
 #include "hook/table.h"
 
+struct iohook_handler {
+    iohook_fn_t fn;
+    bool batch;
+};
+
+/* Pending IRP tracking */
+
+enum iohook_pending_state {
+    IOHOOK_PENDING_ACTIVE,
+    IOHOOK_PENDING_CANCELLING,
+    IOHOOK_PENDING_DONE,
+};
+
+struct iohook_pending {
+    struct iohook_pending *prev;
+    struct iohook_pending *next;
+    struct irp irp;
+    iohook_cancel_fn_t cancel;
+    void *ctx;
+    uint32_t thread_id;
+    HANDLE done;
+    HRESULT hr;
+    unsigned int nrefs;
+    enum iohook_pending_state state;
+};
+
 /* Helpers */
 
 static void iohook_init(void);
+static HRESULT iohook_push(iohook_fn_t fn, bool batch);
+static HRESULT iohook_split_batch(
+        struct irp *irp,
+        size_t next_handler,
+        iohook_fn_t fn);
 static BOOL iohook_overlapped_result(
         uint32_t *syncout,
         OVERLAPPED *ovl,
         uint32_t value);
 
+static HRESULT iohook_await(struct irp *irp, HRESULT hr);
+static void iohook_finish_pending(struct iohook_pending *p, HRESULT hr);
+static void iohook_unref_pending(struct iohook_pending *p);
+static size_t iohook_cancel_pending(
+        HANDLE fd,
+        OVERLAPPED *ovl,
+        uint32_t thread_id,
+        bool sync_only);
+static NTSTATUS iohook_hr_to_ntstatus(HRESULT hr);
+
 static HRESULT iohook_invoke_real(struct irp *irp);
 static HRESULT iohook_invoke_real_open(struct irp *irp);
 static HRESULT iohook_invoke_real_close(struct irp *irp);
@@ -34,10 +75,14 @@ static HRESULT iohook_invoke_real_write(struct irp *irp);
 static HRESULT iohook_invoke_real_seek(struct irp *irp);
 static HRESULT iohook_invoke_real_fsync(struct irp *irp);
 static HRESULT iohook_invoke_real_ioctl(struct irp *irp);
+static HRESULT iohook_invoke_real_ioctl_batch(struct irp *irp);
 
 /* API hooks. We take some liberties with function signatures here (e.g.
    stdint.h types instead of DWORD and LARGE_INTEGER et al). */
 
+static BOOL WINAPI iohook_CancelIo(HANDLE hFile);
+static BOOL WINAPI iohook_CancelIoEx(HANDLE hFile, OVERLAPPED *lpOverlapped);
+static BOOL WINAPI iohook_CancelSynchronousIo(HANDLE hThread);
 static BOOL WINAPI iohook_CloseHandle(HANDLE fd);
 
 static HANDLE WINAPI iohook_CreateFileW(
@@ -98,6 +143,9 @@ static BOOL WINAPI iohook_DeviceIoControl(
 
 /* Links */
 
+static BOOL (WINAPI *next_CancelIo)(HANDLE fd);
+static BOOL (WINAPI *next_CancelIoEx)(HANDLE fd, OVERLAPPED *ovl);
+static BOOL (WINAPI *next_CancelSynchronousIo)(HANDLE thread);
 static BOOL (WINAPI *next_CloseHandle)(HANDLE fd);
 
 static HANDLE (WINAPI *next_CreateFileA)(
@@ -160,6 +208,18 @@ static BOOL (WINAPI *next_FlushFileBuffers)(HANDLE fd);
 
 static const struct hook_symbol iohook_kernel32_syms[] = {
     {
+        .name   = "CancelIo",
+        .patch  = iohook_CancelIo,
+        .link   = (void *) &next_CancelIo,
+    }, {
+        .name   = "CancelIoEx",
+        .patch  = iohook_CancelIoEx,
+        .link   = (void *) &next_CancelIoEx,
+    }, {
+        .name   = "CancelSynchronousIo",
+        .patch  = iohook_CancelSynchronousIo,
+        .link   = (void *) &next_CancelSynchronousIo,
+    }, {
         .name   = "CloseHandle",
         .patch  = iohook_CloseHandle,
         .link   = (void *) &next_CloseHandle,
@@ -199,19 +259,22 @@ static const struct hook_symbol iohook_kernel32_syms[] = {
 };
 
 static const iohook_fn_t iohook_real_handlers[] = {
-    [IRP_OP_OPEN]   = iohook_invoke_real_open,
-    [IRP_OP_CLOSE]  = iohook_invoke_real_close,
-    [IRP_OP_READ]   = iohook_invoke_real_read,
-    [IRP_OP_WRITE]  = iohook_invoke_real_write,
-    [IRP_OP_SEEK]   = iohook_invoke_real_seek,
-    [IRP_OP_FSYNC]  = iohook_invoke_real_fsync,
-    [IRP_OP_IOCTL]  = iohook_invoke_real_ioctl,
+    [IRP_OP_OPEN]        = iohook_invoke_real_open,
+    [IRP_OP_CLOSE]       = iohook_invoke_real_close,
+    [IRP_OP_READ]        = iohook_invoke_real_read,
+    [IRP_OP_WRITE]       = iohook_invoke_real_write,
+    [IRP_OP_SEEK]        = iohook_invoke_real_seek,
+    [IRP_OP_FSYNC]       = iohook_invoke_real_fsync,
+    [IRP_OP_IOCTL]       = iohook_invoke_real_ioctl,
+    [IRP_OP_IOCTL_BATCH] = iohook_invoke_real_ioctl_batch,
 };
 
 static bool iohook_initted;
 static CRITICAL_SECTION iohook_lock;
-static iohook_fn_t *iohook_handlers;
+static struct iohook_handler *iohook_handlers;
 static size_t iohook_nhandlers;
+static CRITICAL_SECTION iohook_pending_lock;
+static struct iohook_pending *iohook_pending_list;
 
 static void iohook_init(void)
 {
@@ -225,6 +288,7 @@ static void iohook_init(void)
     }
 
     InitializeCriticalSection(&iohook_lock);
+    InitializeCriticalSection(&iohook_pending_lock);
     EnterCriticalSection(&iohook_lock);
 
     /* Splice iohook into IAT entries referencing Win32 I/O APIs */
@@ -276,6 +340,16 @@ static void iohook_init(void)
                 "SetFilePointerEx");
     }
 
+    /* We close our own event handles through this too, so that they don't
+       go round the handler chain as IRP_OP_CLOSE, and so it has to be
+       there even if nothing else in the process imports CloseHandle. */
+
+    if (next_CloseHandle == NULL) {
+        next_CloseHandle = (void *) GetProcAddress(
+                kernel32,
+                "CloseHandle");
+    }
+
     iohook_initted = true;
 
     LeaveCriticalSection(&iohook_lock);
@@ -325,7 +399,17 @@ HRESULT iohook_open_nul_fd(HANDLE *out)
 
 HRESULT iohook_push_handler(iohook_fn_t fn)
 {
-    iohook_fn_t *new_array;
+    return iohook_push(fn, false);
+}
+
+HRESULT iohook_push_batch_handler(iohook_fn_t fn)
+{
+    return iohook_push(fn, true);
+}
+
+static HRESULT iohook_push(iohook_fn_t fn, bool batch)
+{
+    struct iohook_handler *new_array;
     size_t new_size;
     HRESULT hr;
 
@@ -335,11 +419,15 @@ HRESULT iohook_push_handler(iohook_fn_t fn)
     EnterCriticalSection(&iohook_lock);
 
     new_size = iohook_nhandlers + 1;
-    new_array = realloc(iohook_handlers, new_size * sizeof(iohook_fn_t));
+    new_array = realloc(
+            iohook_handlers,
+            new_size * sizeof(struct iohook_handler));
 
     if (new_array != NULL) {
         iohook_handlers = new_array;
-        iohook_handlers[iohook_nhandlers++] = fn;
+        iohook_handlers[iohook_nhandlers].fn = fn;
+        iohook_handlers[iohook_nhandlers].batch = batch;
+        iohook_nhandlers++;
         hr = S_OK;
     } else {
         hr = E_OUTOFMEMORY;
@@ -379,6 +467,7 @@ static BOOL iohook_overlapped_result(
 HRESULT iohook_invoke_next(struct irp *irp)
 {
     iohook_fn_t handler;
+    bool split;
     HRESULT hr;
 
     assert(irp != NULL);
@@ -388,9 +477,17 @@ HRESULT iohook_invoke_next(struct irp *irp)
     assert(iohook_initted);
     assert(irp->next_handler <= iohook_nhandlers);
 
+    split = false;
+
     if (irp->next_handler < iohook_nhandlers) {
-        handler = iohook_handlers[irp->next_handler];
-        irp->next_handler++;
+        handler = iohook_handlers[irp->next_handler].fn;
+
+        if (    irp->op == IRP_OP_IOCTL_BATCH &&
+                !iohook_handlers[irp->next_handler].batch) {
+            split = true;
+        } else {
+            irp->next_handler++;
+        }
     } else {
         handler = iohook_invoke_real;
         irp->next_handler = (size_t) -1;
@@ -398,6 +495,15 @@ HRESULT iohook_invoke_next(struct irp *irp)
 
     LeaveCriticalSection(&iohook_lock);
 
+    if (split) {
+        /* The remainder of the chain gets single ioctls, starting with this
+           handler. */
+        hr = iohook_split_batch(irp, irp->next_handler, iohook_invoke_next);
+        irp->next_handler = (size_t) -1;
+
+        return hr;
+    }
+
     hr = handler(irp);
 
     if (FAILED(hr)) {
@@ -407,6 +513,356 @@ HRESULT iohook_invoke_next(struct irp *irp)
     return hr;
 }
 
+HRESULT iohook_invoke_and_wait(struct irp *irp)
+{
+    HRESULT hr;
+
+    assert(irp != NULL);
+
+    hr = iohook_invoke_next(irp);
+
+    return iohook_await(irp, hr);
+}
+
+static HRESULT iohook_split_batch(
+        struct irp *irp,
+        size_t next_handler,
+        iohook_fn_t fn)
+{
+    struct irp_ioctl *sub;
+    struct irp single;
+    HRESULT hr;
+    size_t i;
+
+    assert(irp != NULL);
+    assert(irp->op == IRP_OP_IOCTL_BATCH);
+    assert(irp->ioctls != NULL || irp->nioctls == 0);
+    assert(irp->ovl == NULL);
+
+    for (i = 0 ; i < irp->nioctls ; i++) {
+        sub = &irp->ioctls[i];
+
+        memset(&single, 0, sizeof(single));
+        single.op = IRP_OP_IOCTL;
+        single.next_handler = next_handler;
+        single.fd = irp->fd;
+        single.ioctl = sub->ioctl;
+        single.write = sub->write;
+        single.read = sub->read;
+
+        /* Batches are only ever issued synchronously, so a handler that
+           pends one of the singles must be waited out here. Nothing else
+           knows about the single IRP to wait for it. */
+
+        hr = fn(&single);
+        hr = iohook_await(&single, hr);
+
+        sub->write = single.write;
+        sub->read = single.read;
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+    }
+
+    return S_OK;
+}
+
+HRESULT iohook_pend_irp(
+        struct irp *irp,
+        iohook_cancel_fn_t cancel,
+        void *ctx,
+        struct irp **out)
+{
+    struct iohook_pending *p;
+
+    assert(irp != NULL);
+    assert(irp->op == IRP_OP_READ ||
+           irp->op == IRP_OP_WRITE ||
+           irp->op == IRP_OP_IOCTL);
+    assert(irp->pending == NULL);
+    assert(out != NULL);
+
+    *out = NULL;
+
+    p = calloc(1, sizeof(*p));
+
+    if (p == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    if (irp->ovl == NULL) {
+        /* Synchronous caller, which will block in iohook_await() and then
+           release its own reference. */
+
+        p->done = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+        if (p->done == NULL) {
+            free(p);
+
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        p->nrefs = 2;
+    } else {
+        irp->ovl->Internal = STATUS_PENDING;
+        irp->ovl->InternalHigh = 0;
+
+        if (irp->ovl->hEvent != NULL) {
+            ResetEvent(irp->ovl->hEvent);
+        }
+
+        p->nrefs = 1;
+    }
+
+    memcpy(&p->irp, irp, sizeof(*irp));
+    p->irp.pending = p;
+    p->cancel = cancel;
+    p->ctx = ctx;
+    p->thread_id = GetCurrentThreadId();
+    p->state = IOHOOK_PENDING_ACTIVE;
+
+    EnterCriticalSection(&iohook_pending_lock);
+
+    p->next = iohook_pending_list;
+
+    if (iohook_pending_list != NULL) {
+        iohook_pending_list->prev = p;
+    }
+
+    iohook_pending_list = p;
+
+    LeaveCriticalSection(&iohook_pending_lock);
+
+    irp->pending = p;
+    *out = &p->irp;
+
+    return S_OK;
+}
+
+void iohook_complete_irp(struct irp *irp, HRESULT hr)
+{
+    struct iohook_pending *p;
+
+    assert(irp != NULL);
+    assert(irp->pending != NULL);
+    assert(hr != HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    p = irp->pending;
+
+    assert(&p->irp == irp);
+
+    EnterCriticalSection(&iohook_pending_lock);
+
+    /* Might have been aborted already, in which case we just drop the
+       handler's reference. */
+
+    if (p->state != IOHOOK_PENDING_DONE) {
+        iohook_finish_pending(p, hr);
+    }
+
+    LeaveCriticalSection(&iohook_pending_lock);
+
+    iohook_unref_pending(p);
+}
+
+HRESULT iohook_cancel_io(HANDLE fd, OVERLAPPED *ovl)
+{
+    size_t count;
+
+    assert(fd != NULL && fd != INVALID_HANDLE_VALUE);
+
+    count = iohook_cancel_pending(fd, ovl, 0, false);
+
+    if (count == 0) {
+        return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+    }
+
+    return S_OK;
+}
+
+static HRESULT iohook_await(struct irp *irp, HRESULT hr)
+{
+    struct iohook_pending *p;
+
+    assert(irp != NULL);
+
+    /* Overlapped callers get their ERROR_IO_PENDING, as do callers whose IRP
+       went pending inside the real Win32 API. */
+
+    if (    hr != HRESULT_FROM_WIN32(ERROR_IO_PENDING) ||
+            irp->pending == NULL ||
+            irp->ovl != NULL) {
+        return hr;
+    }
+
+    p = irp->pending;
+    WaitForSingleObject(p->done, INFINITE);
+
+    EnterCriticalSection(&iohook_pending_lock);
+
+    assert(p->state == IOHOOK_PENDING_DONE);
+
+    irp->read.pos = p->irp.read.pos;
+    irp->write.pos = p->irp.write.pos;
+    hr = p->hr;
+
+    LeaveCriticalSection(&iohook_pending_lock);
+
+    irp->pending = NULL;
+    iohook_unref_pending(p);
+
+    return hr;
+}
+
+static void iohook_finish_pending(struct iohook_pending *p, HRESULT hr)
+{
+    OVERLAPPED *ovl;
+
+    /* Caller holds iohook_pending_lock */
+
+    p->state = IOHOOK_PENDING_DONE;
+    p->hr = hr;
+
+    if (p->prev != NULL) {
+        p->prev->next = p->next;
+    } else {
+        iohook_pending_list = p->next;
+    }
+
+    if (p->next != NULL) {
+        p->next->prev = p->prev;
+    }
+
+    p->prev = NULL;
+    p->next = NULL;
+
+    ovl = p->irp.ovl;
+
+    if (ovl == NULL) {
+        SetEvent(p->done);
+
+        return;
+    }
+
+    if (p->irp.op == IRP_OP_WRITE) {
+        ovl->InternalHigh = p->irp.write.pos;
+    } else {
+        ovl->InternalHigh = p->irp.read.pos;
+    }
+
+    /* Internal has to be written last, since it is the field that
+       HasOverlappedIoCompleted() and GetOverlappedResult() poll. */
+
+    MemoryBarrier();
+    ovl->Internal = iohook_hr_to_ntstatus(hr);
+
+    if (ovl->hEvent != NULL) {
+        SetEvent(ovl->hEvent);
+    }
+}
+
+static void iohook_unref_pending(struct iohook_pending *p)
+{
+    unsigned int nrefs;
+
+    EnterCriticalSection(&iohook_pending_lock);
+    nrefs = --p->nrefs;
+    LeaveCriticalSection(&iohook_pending_lock);
+
+    if (nrefs > 0) {
+        return;
+    }
+
+    if (p->done != NULL) {
+        next_CloseHandle(p->done);
+    }
+
+    free(p);
+}
+
+static size_t iohook_cancel_pending(
+        HANDLE fd,
+        OVERLAPPED *ovl,
+        uint32_t thread_id,
+        bool sync_only)
+{
+    struct iohook_pending *p;
+    size_t count;
+
+    /* NULL/zero criteria match anything. Cancel callbacks may well take locks
+       of their own which are also held while IRPs get pended or completed, so
+       we must drop our lock around each callback. This means we have to
+       rescan the list from the top after each cancellation, but there should
+       never be more than a handful of IRPs outstanding. */
+
+    count = 0;
+
+    for (;;) {
+        EnterCriticalSection(&iohook_pending_lock);
+
+        for (p = iohook_pending_list ; p != NULL ; p = p->next) {
+            if (    p->state == IOHOOK_PENDING_ACTIVE &&
+                    (fd == NULL || p->irp.fd == fd) &&
+                    (ovl == NULL || p->irp.ovl == ovl) &&
+                    (thread_id == 0 || p->thread_id == thread_id) &&
+                    (!sync_only || p->irp.ovl == NULL)) {
+                break;
+            }
+        }
+
+        if (p == NULL) {
+            LeaveCriticalSection(&iohook_pending_lock);
+
+            break;
+        }
+
+        p->state = IOHOOK_PENDING_CANCELLING;
+        p->nrefs++;
+
+        LeaveCriticalSection(&iohook_pending_lock);
+
+        if (p->cancel != NULL) {
+            p->cancel(&p->irp, p->ctx);
+        }
+
+        EnterCriticalSection(&iohook_pending_lock);
+
+        if (p->state != IOHOOK_PENDING_DONE) {
+            iohook_finish_pending(
+                    p,
+                    HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+        }
+
+        LeaveCriticalSection(&iohook_pending_lock);
+
+        iohook_unref_pending(p);
+        count++;
+    }
+
+    return count;
+}
+
+static NTSTATUS iohook_hr_to_ntstatus(HRESULT hr)
+{
+    uint32_t error;
+
+    if (SUCCEEDED(hr)) {
+        return STATUS_SUCCESS;
+    }
+
+    error = hr_to_win32_error(hr);
+
+    if (error == ERROR_OPERATION_ABORTED) {
+        return STATUS_CANCELLED;
+    }
+
+    /* NTSTATUS codes in the NTWIN32 facility get translated back into their
+       original Win32 error code by GetOverlappedResult(). */
+
+    return (NTSTATUS) (0xC0000000 | (FACILITY_NTWIN32 << 16) | error);
+}
+
 static HRESULT iohook_invoke_real(struct irp *irp)
 {
     iohook_fn_t handler;
@@ -576,6 +1032,15 @@ static HRESULT iohook_invoke_real_ioctl(struct irp *irp)
     return S_OK;
 }
 
+static HRESULT iohook_invoke_real_ioctl_batch(struct irp *irp)
+{
+    assert(irp != NULL);
+
+    /* The OS only does one ioctl at a time */
+
+    return iohook_split_batch(irp, (size_t) -1, iohook_invoke_real_ioctl);
+}
+
 static HANDLE WINAPI iohook_CreateFileA(
         const char *lpFileName,
         uint32_t dwDesiredAccess,
@@ -679,6 +1144,10 @@ static BOOL WINAPI iohook_CloseHandle(HANDLE hFile)
         return FALSE;
     }
 
+    /* Closing a handle aborts any I/O still outstanding on it */
+
+    iohook_cancel_pending(hFile, NULL, 0, false);
+
     memset(&irp, 0, sizeof(irp));
     irp.op = IRP_OP_CLOSE;
     irp.fd = hFile;
@@ -729,6 +1198,7 @@ static BOOL WINAPI iohook_ReadFile(
     irp.read.pos = 0;
 
     hr = iohook_invoke_next(&irp);
+    hr = iohook_await(&irp, hr);
 
     if (FAILED(hr)) {
         return hr_propagate_win32(hr, FALSE);
@@ -777,6 +1247,7 @@ static BOOL WINAPI iohook_WriteFile(
     irp.write.pos = 0;
 
     hr = iohook_invoke_next(&irp);
+    hr = iohook_await(&irp, hr);
 
     if (FAILED(hr)) {
         return hr_propagate_win32(hr, FALSE);
@@ -946,6 +1417,7 @@ static BOOL WINAPI iohook_DeviceIoControl(
     }
 
     hr = iohook_invoke_next(&irp);
+    hr = iohook_await(&irp, hr);
 
     if (FAILED(hr)) {
         /* Special case: ERROR_MORE_DATA requires this out parameter to be
@@ -966,3 +1438,57 @@ static BOOL WINAPI iohook_DeviceIoControl(
             lpOverlapped,
             irp.read.pos);
 }
+
+static BOOL WINAPI iohook_CancelIo(HANDLE hFile)
+{
+    size_t count;
+
+    if (hFile == NULL || hFile == INVALID_HANDLE_VALUE) {
+        return next_CancelIo(hFile);
+    }
+
+    /* CancelIo only affects I/O issued by the calling thread */
+
+    count = iohook_cancel_pending(hFile, NULL, GetCurrentThreadId(), false);
+
+    if (count > 0) {
+        return TRUE;
+    }
+
+    return next_CancelIo(hFile);
+}
+
+static BOOL WINAPI iohook_CancelIoEx(HANDLE hFile, OVERLAPPED *lpOverlapped)
+{
+    size_t count;
+
+    if (hFile == NULL || hFile == INVALID_HANDLE_VALUE) {
+        return next_CancelIoEx(hFile, lpOverlapped);
+    }
+
+    count = iohook_cancel_pending(hFile, lpOverlapped, 0, false);
+
+    if (count > 0) {
+        return TRUE;
+    }
+
+    return next_CancelIoEx(hFile, lpOverlapped);
+}
+
+static BOOL WINAPI iohook_CancelSynchronousIo(HANDLE hThread)
+{
+    uint32_t thread_id;
+    size_t count;
+
+    thread_id = GetThreadId(hThread);
+
+    if (thread_id != 0) {
+        count = iohook_cancel_pending(NULL, NULL, thread_id, true);
+
+        if (count > 0) {
+            return TRUE;
+        }
+    }
+
+    return next_CancelSynchronousIo(hThread);
+}
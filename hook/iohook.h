@@ -15,6 +15,18 @@ enum irp_op {
     IRP_OP_IOCTL,
     IRP_OP_FSYNC,
     IRP_OP_SEEK,
+    IRP_OP_IOCTL_BATCH,
+};
+
+struct iohook_pending;
+
+/* One sub-request of an IRP_OP_IOCTL_BATCH IRP. The buffers have the same
+   meaning as the write and read buffers of a single IRP_OP_IOCTL IRP. */
+
+struct irp_ioctl {
+    uint32_t ioctl;
+    struct const_iobuf write;
+    struct iobuf read;
 };
 
 struct irp {
@@ -35,9 +47,13 @@ struct irp {
     uint32_t seek_origin;
     int64_t seek_offset;
     uint64_t seek_pos;
+    struct iohook_pending *pending;
+    struct irp_ioctl *ioctls;
+    size_t nioctls;
 };
 
 typedef HRESULT (*iohook_fn_t)(struct irp *irp);
+typedef void (*iohook_cancel_fn_t)(struct irp *irp, void *ctx);
 
 HANDLE iohook_open_dummy_fd(void)
 #ifdef __GNUC__
@@ -47,4 +63,53 @@ __attribute__((deprecated("Use iohook_open_nul_fd instead")))
 
 HRESULT iohook_open_nul_fd(HANDLE *fd);
 HRESULT iohook_push_handler(iohook_fn_t fn);
+
+/* Push a handler that understands IRP_OP_IOCTL_BATCH IRPs. These carry a
+   sequence of ioctls for one fd that are executed in order, stopping at the
+   first failure, and are only ever issued synchronously. Handlers pushed with
+   plain iohook_push_handler() never see a batch: iohook splits it up into
+   individual IRP_OP_IOCTL IRPs before it reaches them, and those continue
+   down the rest of the chain one at a time. */
+
+HRESULT iohook_push_batch_handler(iohook_fn_t fn);
 HRESULT iohook_invoke_next(struct irp *irp);
+
+/* For Win32 API hooks outside of iohook itself (such as WaitCommEvent) that
+   issue a fresh IRP down the chain. Behaves like iohook_invoke_next(), except
+   that if a handler leaves the IRP pending then a synchronous caller blocks
+   until it completes, exactly as it would inside ReadFile. Overlapped callers
+   get ERROR_IO_PENDING as usual. */
+
+HRESULT iohook_invoke_and_wait(struct irp *irp);
+
+/* Leave a read, write or ioctl IRP pending so that it can be completed later
+   (possibly from a different thread). On success *out receives a heap copy of
+   the IRP which the handler fills in and eventually passes to
+   iohook_complete_irp() exactly once; the handler must then return
+   HRESULT_FROM_WIN32(ERROR_IO_PENDING) up the chain.
+
+   Overlapped callers get ERROR_IO_PENDING and are notified through their
+   OVERLAPPED as usual, synchronous callers block inside iohook until the IRP
+   is completed.
+
+   If the application cancels the IRP (CancelIo, CancelIoEx,
+   CancelSynchronousIo or by closing the handle) then the cancel callback is
+   invoked with no iohook locks held, after which iohook completes the IRP
+   with ERROR_OPERATION_ABORTED on the handler's behalf. The callback should
+   forget about the IRP, but the heap copy remains valid until the handler's
+   own call to iohook_complete_irp(), which becomes a no-op apart from
+   releasing it. */
+
+HRESULT iohook_pend_irp(
+        struct irp *irp,
+        iohook_cancel_fn_t cancel,
+        void *ctx,
+        struct irp **out);
+void iohook_complete_irp(struct irp *irp, HRESULT hr);
+
+/* Abort pending IRPs exactly as CancelIoEx() would: every IRP that is
+   pending on fd, or only the one that was issued with ovl if that is not
+   NULL. Returns HRESULT_FROM_WIN32(ERROR_NOT_FOUND) if there was nothing to
+   cancel. For code (and tests) that has no IAT hook to go through. */
+
+HRESULT iohook_cancel_io(HANDLE fd, OVERLAPPED *ovl);
@@ -0,0 +1,376 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "hook/iohook.h"
+
+#include "hooklib/fault.h"
+
+struct fault_fd {
+    HANDLE fd;
+    wchar_t *path;
+};
+
+static HRESULT fault_handle_irp(struct irp *irp);
+static HRESULT fault_handle_open(struct irp *irp);
+static HRESULT fault_handle_close(struct irp *irp);
+static bool fault_match_rule(
+        const struct fault_rule *rule,
+        const struct irp *irp,
+        const wchar_t *path);
+static const wchar_t *fault_get_path(HANDLE fd);
+static uint64_t fault_rand(void);
+static HRESULT fault_apply(const struct fault_rule *rule, struct irp *irp);
+
+static bool fault_hook_initted;
+static CRITICAL_SECTION fault_lock;
+static uint64_t fault_rng_state;
+static struct fault_rule *fault_rules;
+static size_t fault_nrules;
+static struct fault_fd *fault_fds;
+static size_t fault_nfds;
+
+HRESULT fault_hook_init(uint64_t seed)
+{
+    HRESULT hr;
+
+    if (fault_hook_initted) {
+        return S_FALSE;
+    }
+
+    InitializeCriticalSection(&fault_lock);
+    fault_rng_state = seed;
+
+    hr = iohook_push_handler(fault_handle_irp);
+
+    if (FAILED(hr)) {
+        DeleteCriticalSection(&fault_lock);
+
+        return hr;
+    }
+
+    fault_hook_initted = true;
+
+    return S_OK;
+}
+
+HRESULT fault_hook_add_rule(const struct fault_rule *rule)
+{
+    struct fault_rule *new_array;
+    struct fault_rule copy;
+    HRESULT hr;
+
+    assert(rule != NULL);
+    assert(fault_hook_initted);
+
+    memcpy(&copy, rule, sizeof(copy));
+
+    if (rule->path != NULL) {
+        copy.path = _wcsdup(rule->path);
+
+        if (copy.path == NULL) {
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    EnterCriticalSection(&fault_lock);
+
+    new_array = realloc(
+            fault_rules,
+            (fault_nrules + 1) * sizeof(struct fault_rule));
+
+    if (new_array != NULL) {
+        fault_rules = new_array;
+        fault_rules[fault_nrules++] = copy;
+        hr = S_OK;
+    } else {
+        free((wchar_t *) copy.path);
+        hr = E_OUTOFMEMORY;
+    }
+
+    LeaveCriticalSection(&fault_lock);
+
+    return hr;
+}
+
+static HRESULT fault_handle_irp(struct irp *irp)
+{
+    struct fault_rule rule;
+    const wchar_t *path;
+    bool found;
+    size_t i;
+
+    assert(irp != NULL);
+
+    if (irp->op == IRP_OP_CLOSE) {
+        return fault_handle_close(irp);
+    }
+
+    EnterCriticalSection(&fault_lock);
+
+    if (irp->op == IRP_OP_OPEN) {
+        path = irp->open_filename;
+    } else {
+        path = fault_get_path(irp->fd);
+    }
+
+    found = false;
+
+    for (i = 0 ; i < fault_nrules ; i++) {
+        if (!fault_match_rule(&fault_rules[i], irp, path)) {
+            continue;
+        }
+
+        /* Take a copy, since the rules array can be reallocated as soon as
+           we drop the lock. The path pointer does stay valid though. */
+
+        memcpy(&rule, &fault_rules[i], sizeof(rule));
+        found = true;
+
+        break;
+    }
+
+    LeaveCriticalSection(&fault_lock);
+
+    if (found) {
+        return fault_apply(&rule, irp);
+    } else if (irp->op == IRP_OP_OPEN) {
+        return fault_handle_open(irp);
+    } else {
+        return iohook_invoke_next(irp);
+    }
+}
+
+static HRESULT fault_handle_open(struct irp *irp)
+{
+    struct fault_fd *new_array;
+    wchar_t *path;
+    bool wanted;
+    HRESULT hr;
+    size_t i;
+
+    hr = iohook_invoke_next(irp);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    /* Remember the paths of handles that path-filtered rules are interested
+       in. Everything else is not worth the bookkeeping. */
+
+    EnterCriticalSection(&fault_lock);
+
+    wanted = false;
+
+    for (i = 0 ; i < fault_nrules && !wanted ; i++) {
+        wanted = fault_rules[i].path != NULL && _wcsnicmp(
+                irp->open_filename,
+                fault_rules[i].path,
+                wcslen(fault_rules[i].path)) == 0;
+    }
+
+    if (wanted) {
+        path = _wcsdup(irp->open_filename);
+        new_array = realloc(
+                fault_fds,
+                (fault_nfds + 1) * sizeof(struct fault_fd));
+
+        if (new_array != NULL) {
+            fault_fds = new_array;
+        }
+
+        if (path != NULL && new_array != NULL) {
+            fault_fds[fault_nfds].fd = irp->fd;
+            fault_fds[fault_nfds].path = path;
+            fault_nfds++;
+        } else {
+            /* Not worth failing the open over, this handle just won't be
+               matched by path. */
+            free(path);
+        }
+    }
+
+    LeaveCriticalSection(&fault_lock);
+
+    return S_OK;
+}
+
+static HRESULT fault_handle_close(struct irp *irp)
+{
+    size_t i;
+
+    EnterCriticalSection(&fault_lock);
+
+    for (i = 0 ; i < fault_nfds ; i++) {
+        if (fault_fds[i].fd == irp->fd) {
+            free(fault_fds[i].path);
+            fault_fds[i] = fault_fds[--fault_nfds];
+
+            break;
+        }
+    }
+
+    LeaveCriticalSection(&fault_lock);
+
+    return iohook_invoke_next(irp);
+}
+
+static bool fault_match_rule(
+        const struct fault_rule *rule,
+        const struct irp *irp,
+        const wchar_t *path)
+{
+    double roll;
+
+    /* Caller holds fault_lock */
+
+    if (rule->ops != 0 && !(rule->ops & (1 << irp->op))) {
+        return false;
+    }
+
+    if (    rule->ioctl != 0 &&
+            (irp->op != IRP_OP_IOCTL || irp->ioctl != rule->ioctl)) {
+        return false;
+    }
+
+    if (rule->path != NULL) {
+        if (    path == NULL ||
+                _wcsnicmp(path, rule->path, wcslen(rule->path)) != 0) {
+            return false;
+        }
+    }
+
+    /* A rule that leaves its probability at zero always fires, like every
+       other field that is left at zero. Don't roll the dice for it either,
+       so that adding such a rule doesn't shift anybody else's rolls. */
+
+    if (rule->probability == 0.0) {
+        return true;
+    }
+
+    /* Only roll the dice for IRPs that actually match, so that the random
+       sequence (and hence the run) is reproducible for a given seed as long
+       as the application issues the same I/O. */
+
+    roll = (double) (fault_rand() >> 11) / (double) (UINT64_C(1) << 53);
+
+    return roll < rule->probability;
+}
+
+static const wchar_t *fault_get_path(HANDLE fd)
+{
+    size_t i;
+
+    /* Caller holds fault_lock */
+
+    for (i = 0 ; i < fault_nfds ; i++) {
+        if (fault_fds[i].fd == fd) {
+            return fault_fds[i].path;
+        }
+    }
+
+    return NULL;
+}
+
+static uint64_t fault_rand(void)
+{
+    uint64_t z;
+
+    /* SplitMix64. Caller holds fault_lock. */
+
+    fault_rng_state += UINT64_C(0x9E3779B97F4A7C15);
+
+    z = fault_rng_state;
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+
+    return z ^ (z >> 31);
+}
+
+static HRESULT fault_apply(const struct fault_rule *rule, struct irp *irp)
+{
+    uint32_t delay_ms;
+    size_t xfer_max;
+    size_t nbytes;
+    size_t orig_nbytes;
+    size_t orig_pos;
+    HRESULT hr;
+
+    /* Do all of our dice rolls up front while holding the lock */
+
+    EnterCriticalSection(&fault_lock);
+
+    delay_ms = rule->delay_ms;
+
+    if (rule->jitter_ms != 0) {
+        delay_ms += (uint32_t) (fault_rand() % (rule->jitter_ms + 1));
+    }
+
+    if (rule->max_xfer != 0) {
+        xfer_max = 1 + (size_t) (fault_rand() % rule->max_xfer);
+    } else {
+        xfer_max = SIZE_MAX;
+    }
+
+    LeaveCriticalSection(&fault_lock);
+
+    if (delay_ms != 0) {
+        Sleep(delay_ms);
+    }
+
+    if (rule->error != ERROR_SUCCESS) {
+        return HRESULT_FROM_WIN32(rule->error);
+    }
+
+    switch (irp->op) {
+    case IRP_OP_OPEN:
+        return fault_handle_open(irp);
+
+    case IRP_OP_READ:
+        orig_nbytes = irp->read.nbytes;
+        orig_pos = irp->read.pos;
+
+        if (irp->read.nbytes - irp->read.pos > xfer_max) {
+            irp->read.nbytes = irp->read.pos + xfer_max;
+        }
+
+        hr = iohook_invoke_next(irp);
+        irp->read.nbytes = orig_nbytes;
+        nbytes = irp->read.pos - orig_pos;
+
+        break;
+
+    case IRP_OP_WRITE:
+        orig_nbytes = irp->write.nbytes;
+        orig_pos = irp->write.pos;
+
+        if (irp->write.nbytes - irp->write.pos > xfer_max) {
+            irp->write.nbytes = irp->write.pos + xfer_max;
+        }
+
+        hr = iohook_invoke_next(irp);
+        irp->write.nbytes = orig_nbytes;
+        nbytes = irp->write.pos - orig_pos;
+
+        break;
+
+    default:
+        return iohook_invoke_next(irp);
+    }
+
+    /* Stall for as long as the data would have taken to cross a link of the
+       configured bandwidth. This holds up the calling thread, which is
+       exactly what a slow device does to a synchronous caller. */
+
+    if (SUCCEEDED(hr) && rule->bandwidth != 0 && nbytes != 0) {
+        Sleep((DWORD) (((uint64_t) nbytes * 1000) / rule->bandwidth));
+    }
+
+    return hr;
+}
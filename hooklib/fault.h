@@ -0,0 +1,50 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iohook.h"
+
+/* Fault and latency injection for stress testing. Each rule selects a subset
+   of IRPs and describes what should happen to them; the first rule that
+   matches an IRP (and wins its dice roll) is applied. Zero-valued fields are
+   "don't care" filters or disabled effects respectively. */
+
+struct fault_rule {
+    /* Case-insensitive prefix of the path that the handle was opened with */
+    const wchar_t *path;
+
+    /* Mask of (1 << IRP_OP_xxx) values */
+    uint32_t ops;
+
+    /* Only match ioctl IRPs carrying this ioctl code */
+    uint32_t ioctl;
+
+    /* Chance of the rule firing for a matching IRP, from 0.0 to 1.0. Zero
+       means that it always fires, the same as 1.0. */
+    double probability;
+
+    /* Delay applied before the IRP is passed on, plus a random amount of up
+       to jitter_ms milliseconds on top. The delay is a Sleep() on the thread
+       that issued the IRP, so it holds up overlapped callers as well as
+       synchronous ones, and the IRP cannot be cancelled while it lasts. */
+    uint32_t delay_ms;
+    uint32_t jitter_ms;
+
+    /* Bytes per second; reads and writes are stalled afterwards for as long
+       as the transferred data would have taken on a link this fast. This
+       is a Sleep() on the calling thread too. */
+    uint32_t bandwidth;
+
+    /* Reads and writes transfer a random number of bytes between one and
+       this value instead of everything that was asked for. */
+    size_t max_xfer;
+
+    /* Win32 error code to fail the IRP with instead of passing it on */
+    uint32_t error;
+};
+
+HRESULT fault_hook_init(uint64_t seed);
+HRESULT fault_hook_add_rule(const struct fault_rule *rule);
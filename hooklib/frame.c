@@ -0,0 +1,429 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hook/cpu.h"
+#include "hook/iobuf-arena.h"
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf.h"
+
+#include "hooklib/frame.h"
+
+/* Frame bodies mostly consist of long runs of bytes that need no special
+   treatment, so both directions search for the next sync or mark byte sixteen
+   bytes at a time and then copy the run preceding it in one go. Outside of a
+   frame only the sync byte matters, which is what memchr() is for. */
+
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+typedef size_t (*frame_scan_fn_t)(
+        const uint8_t *bytes,
+        size_t nbytes,
+        uint8_t a,
+        uint8_t b);
+
+static void frame_decoder_begin(struct frame_decoder *dec);
+static HRESULT frame_decoder_append(
+        struct frame_decoder *dec,
+        const uint8_t *bytes,
+        size_t nbytes);
+static HRESULT frame_decoder_offer(struct frame_decoder *dec);
+static uint8_t frame_escape(const struct frame_config *config, uint8_t c);
+static uint8_t frame_unescape(const struct frame_config *config, uint8_t c);
+static size_t frame_scan(
+        const uint8_t *bytes,
+        size_t nbytes,
+        uint8_t a,
+        uint8_t b);
+static size_t frame_scan_scalar(
+        const uint8_t *bytes,
+        size_t nbytes,
+        uint8_t a,
+        uint8_t b);
+
+#ifdef CPU_X86
+static size_t frame_scan_sse2(
+        const uint8_t *bytes,
+        size_t nbytes,
+        uint8_t a,
+        uint8_t b);
+#endif
+
+static frame_scan_fn_t frame_scan_fn;
+
+void frame_decoder_init(
+        struct frame_decoder *dec,
+        const struct frame_config *config,
+        size_t max_nbytes,
+        frame_fn_t fn,
+        void *ctx)
+{
+    assert(dec != NULL);
+    assert(config != NULL);
+    assert(config->sync != config->mark);
+    assert(fn != NULL);
+
+    dec->config = *config;
+    dec->fn = fn;
+    dec->ctx = ctx;
+    iobuf_arena_init(&dec->body, max_nbytes);
+    dec->in_frame = false;
+    dec->escaped = false;
+    dec->ndropped = 0;
+}
+
+void frame_decoder_fini(struct frame_decoder *dec)
+{
+    assert(dec != NULL);
+
+    iobuf_arena_fini(&dec->body);
+}
+
+void frame_decoder_reset(struct frame_decoder *dec)
+{
+    assert(dec != NULL);
+
+    iobuf_arena_reset(&dec->body);
+    dec->in_frame = false;
+    dec->escaped = false;
+}
+
+HRESULT frame_decode(struct frame_decoder *dec, struct const_iobuf *src)
+{
+    const struct frame_config *config;
+    const uint8_t *bytes;
+    const uint8_t *sync;
+    size_t nbytes;
+    size_t run;
+    bool grew;
+    uint8_t c;
+    HRESULT hr;
+
+    assert(dec != NULL);
+    assert(src != NULL);
+    assert(src->bytes != NULL || src->nbytes == 0);
+    assert(src->pos <= src->nbytes);
+
+    config = &dec->config;
+    grew = false;
+
+    while (src->pos < src->nbytes) {
+        bytes = &src->bytes[src->pos];
+        nbytes = src->nbytes - src->pos;
+
+        if (!dec->in_frame) {
+            /* Hunting: skip everything up to and including the next sync */
+            sync = memchr(bytes, config->sync, nbytes);
+
+            if (sync == NULL) {
+                src->pos = src->nbytes;
+
+                break;
+            }
+
+            src->pos += sync - bytes + 1;
+            frame_decoder_begin(dec);
+
+            continue;
+        }
+
+        if (dec->escaped && bytes[0] != config->sync) {
+            /* Second half of an escape sequence, which might have been split
+               across two calls. A sync byte here aborts the frame below. */
+            c = frame_unescape(config, bytes[0]);
+            src->pos++;
+            dec->escaped = false;
+            grew = true;
+            hr = frame_decoder_append(dec, &c, 1);
+
+            if (FAILED(hr)) {
+                dec->ndropped++;
+                dec->in_frame = false;
+                grew = false;
+            }
+
+            continue;
+        }
+
+        if (dec->escaped) {
+            run = 0;
+        } else {
+            run = frame_scan(bytes, nbytes, config->sync, config->mark);
+        }
+
+        if (run > 0) {
+            src->pos += run;
+            grew = true;
+            hr = frame_decoder_append(dec, bytes, run);
+
+            if (FAILED(hr)) {
+                dec->ndropped++;
+                dec->in_frame = false;
+                grew = false;
+
+                continue;
+            }
+        }
+
+        if (grew) {
+            grew = false;
+            hr = frame_decoder_offer(dec);
+
+            if (FAILED(hr)) {
+                return hr;
+            }
+
+            if (!dec->in_frame) {
+                continue;
+            }
+        }
+
+        if (src->pos == src->nbytes) {
+            break;
+        }
+
+        c = src->bytes[src->pos++];
+
+        if (c == config->mark) {
+            dec->escaped = true;
+        } else {
+            /* Sync before the callback accepted the current frame */
+            dec->ndropped++;
+            frame_decoder_begin(dec);
+        }
+    }
+
+    if (grew && dec->in_frame) {
+        return frame_decoder_offer(dec);
+    }
+
+    return S_OK;
+}
+
+HRESULT frame_decode_arena(
+        struct frame_decoder *dec,
+        struct iobuf_arena *src)
+{
+    struct const_iobuf span;
+    HRESULT hr;
+
+    assert(dec != NULL);
+    assert(src != NULL);
+
+    iobuf_flip(&span, &src->buf);
+    hr = frame_decode(dec, &span);
+
+    /* Only a failing callback leaves anything behind */
+
+    if (span.pos > 0) {
+        memmove(src->buf.bytes, &span.bytes[span.pos], span.nbytes - span.pos);
+        src->buf.pos -= span.pos;
+    }
+
+    return hr;
+}
+
+HRESULT frame_encode(
+        const struct frame_config *config,
+        struct iobuf_ring *dest,
+        const struct const_iobuf *body)
+{
+    const uint8_t *bytes;
+    size_t nbytes;
+    size_t nspecial;
+    size_t run;
+    size_t i;
+    uint8_t esc[2];
+    HRESULT hr;
+
+    assert(config != NULL);
+    assert(dest != NULL);
+    assert(body != NULL);
+    assert(body->bytes != NULL || body->nbytes == 0);
+    assert(body->pos <= body->nbytes);
+
+    bytes = &body->bytes[body->pos];
+    nbytes = body->nbytes - body->pos;
+
+    /* Size the escaped frame up front so that it is written all or nothing */
+
+    nspecial = 0;
+
+    for (i = 0 ; i < nbytes ; i += run + 1) {
+        run = frame_scan(&bytes[i], nbytes - i, config->sync, config->mark);
+
+        if (i + run < nbytes) {
+            nspecial++;
+        }
+    }
+
+    if (    nbytes + nspecial < nbytes ||
+            nbytes + nspecial >= iobuf_ring_space(dest)) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    hr = iobuf_ring_write_8(dest, config->sync);
+
+    for (i = 0 ; i < nbytes && SUCCEEDED(hr) ; i += run + 1) {
+        run = frame_scan(&bytes[i], nbytes - i, config->sync, config->mark);
+        hr = iobuf_ring_write(dest, &bytes[i], run);
+
+        if (SUCCEEDED(hr) && i + run < nbytes) {
+            esc[0] = config->mark;
+            esc[1] = frame_escape(config, bytes[i + run]);
+            hr = iobuf_ring_write(dest, esc, sizeof(esc));
+        }
+    }
+
+    /* Can't fail, there was room for everything */
+    assert(SUCCEEDED(hr));
+
+    return hr;
+}
+
+static void frame_decoder_begin(struct frame_decoder *dec)
+{
+    iobuf_arena_reset(&dec->body);
+    dec->in_frame = true;
+    dec->escaped = false;
+}
+
+static HRESULT frame_decoder_append(
+        struct frame_decoder *dec,
+        const uint8_t *bytes,
+        size_t nbytes)
+{
+    return iobuf_arena_write(&dec->body, bytes, nbytes);
+}
+
+static HRESULT frame_decoder_offer(struct frame_decoder *dec)
+{
+    struct const_iobuf body;
+    HRESULT hr;
+
+    iobuf_flip(&body, &dec->body.buf);
+    hr = dec->fn(dec->ctx, &body);
+
+    if (hr == S_FALSE) {
+        return S_OK;
+    }
+
+    /* Either handled or failed; in both cases go looking for the next sync */
+
+    dec->in_frame = false;
+
+    return hr;
+}
+
+static uint8_t frame_escape(const struct frame_config *config, uint8_t c)
+{
+    if (config->escape == FRAME_ESCAPE_XOR) {
+        return c ^ 0x20;
+    } else {
+        return c - 1;
+    }
+}
+
+static uint8_t frame_unescape(const struct frame_config *config, uint8_t c)
+{
+    if (config->escape == FRAME_ESCAPE_XOR) {
+        return c ^ 0x20;
+    } else {
+        return c + 1;
+    }
+}
+
+static size_t frame_scan(
+        const uint8_t *bytes,
+        size_t nbytes,
+        uint8_t a,
+        uint8_t b)
+{
+    frame_scan_fn_t fn;
+
+    /* Racing threads all pick the same kernel, so this is benign */
+
+    fn = frame_scan_fn;
+
+    if (fn == NULL) {
+        fn = frame_scan_scalar;
+
+#ifdef CPU_X86
+        if (cpu_get_features() & CPU_FEATURE_SSE2) {
+            fn = frame_scan_sse2;
+        }
+#endif
+
+        frame_scan_fn = fn;
+    }
+
+    return fn(bytes, nbytes, a, b);
+}
+
+static size_t frame_scan_scalar(
+        const uint8_t *bytes,
+        size_t nbytes,
+        uint8_t a,
+        uint8_t b)
+{
+    size_t i;
+
+    for (i = 0 ; i < nbytes ; i++) {
+        if (bytes[i] == a || bytes[i] == b) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+#ifdef CPU_X86
+
+CPU_TARGET("sse2")
+static size_t frame_scan_sse2(
+        const uint8_t *bytes,
+        size_t nbytes,
+        uint8_t a,
+        uint8_t b)
+{
+    __m128i va;
+    __m128i vb;
+    __m128i v;
+    unsigned long bit;
+    unsigned int hits;
+    size_t i;
+
+    va = _mm_set1_epi8((char) a);
+    vb = _mm_set1_epi8((char) b);
+
+    for (i = 0 ; i + 16 <= nbytes ; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) &bytes[i]);
+        hits = _mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(v, va),
+                _mm_cmpeq_epi8(v, vb)));
+
+        if (hits != 0) {
+#ifdef _MSC_VER
+            _BitScanForward(&bit, hits);
+#else
+            bit = __builtin_ctz(hits);
+#endif
+
+            return i + bit;
+        }
+    }
+
+    return i + frame_scan_scalar(&bytes[i], nbytes - i, a, b);
+}
+
+#endif
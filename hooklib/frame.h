@@ -0,0 +1,85 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iobuf-arena.h"
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf.h"
+
+/* Sync/escape framing as used by most of the serial protocols that we
+   emulate: every frame begins with a sync byte, and any sync or mark bytes
+   within the frame body are replaced by the mark byte followed by an escaped
+   version of the original byte. */
+
+enum frame_escape {
+    /* Mark is followed by the original byte minus one (JVS style) */
+    FRAME_ESCAPE_DECREMENT,
+
+    /* Mark is followed by the original byte XOR 0x20 (HDLC style) */
+    FRAME_ESCAPE_XOR,
+};
+
+struct frame_config {
+    uint8_t sync;
+    uint8_t mark;
+    enum frame_escape escape;
+};
+
+/* Called with the un-escaped body of the frame received so far (excluding
+   the sync byte) whenever more of it has arrived. Frames are expected to be
+   self-delimiting, e.g. through a length field in their header, so return
+   S_FALSE if the body is still incomplete or S_OK once a whole frame has been
+   handled. Bytes that arrived in the same write as the end of the frame may
+   trail it in body. Failure codes abort the frame_decode() call and are
+   passed back to its caller. */
+
+typedef HRESULT (*frame_fn_t)(void *ctx, const struct const_iobuf *body);
+
+struct frame_decoder {
+    struct frame_config config;
+    frame_fn_t fn;
+    void *ctx;
+    struct iobuf_arena body;
+    bool in_frame;
+    bool escaped;
+
+    /* Frames that were interrupted by a new sync byte or which exceeded the
+       maximum size before the callback accepted them. */
+    uint32_t ndropped;
+};
+
+/* The decoder keeps its state between calls, so input may be fed to it in
+   arbitrarily sized pieces and each byte is only examined once. Up to
+   max_nbytes of un-escaped body are buffered (or unlimited if zero). */
+
+void frame_decoder_init(
+        struct frame_decoder *dec,
+        const struct frame_config *config,
+        size_t max_nbytes,
+        frame_fn_t fn,
+        void *ctx);
+void frame_decoder_fini(struct frame_decoder *dec);
+void frame_decoder_reset(struct frame_decoder *dec);
+
+/* Consumes src, stopping early only if the callback fails. */
+
+HRESULT frame_decode(struct frame_decoder *dec, struct const_iobuf *src);
+
+/* Decodes everything that has been written to an arena (typically
+   uart->written) and then removes the decoded bytes from it. */
+
+HRESULT frame_decode_arena(
+        struct frame_decoder *dec,
+        struct iobuf_arena *src);
+
+/* Appends a sync byte and the escaped body to dest (typically
+   uart->readable). Either the whole frame is written or nothing is. */
+
+HRESULT frame_encode(
+        const struct frame_config *config,
+        struct iobuf_ring *dest,
+        const struct const_iobuf *body);
@@ -27,6 +27,7 @@ static BOOL WINAPI my_ClearCommError(
         COMSTAT *status);
 static BOOL WINAPI my_EscapeCommFunction(HANDLE fd, uint32_t func);
 static BOOL WINAPI my_GetCommMask(HANDLE fd, uint32_t *out);
+static BOOL WINAPI my_GetCommModemStatus(HANDLE fd, uint32_t *out);
 static BOOL WINAPI my_GetCommState(HANDLE fd, DCB *dcb);
 static BOOL WINAPI my_GetCommTimeouts(HANDLE fd, COMMTIMEOUTS *dest);
 static BOOL WINAPI my_PurgeComm(HANDLE fd, uint32_t flags);
@@ -35,6 +36,10 @@ static BOOL WINAPI my_SetCommState(HANDLE fd, const DCB *dcb);
 static BOOL WINAPI my_SetCommTimeouts(HANDLE fd, COMMTIMEOUTS *timeouts);
 static BOOL WINAPI my_SetupComm(HANDLE fd, uint32_t in_q, uint32_t out_q);
 static BOOL WINAPI my_SetCommBreak(HANDLE fd);
+static BOOL WINAPI my_WaitCommEvent(
+        HANDLE fd,
+        uint32_t *evtmask,
+        OVERLAPPED *ovl);
 
 static struct hook_symbol serial_syms[] = {
     {
@@ -46,6 +51,9 @@ static struct hook_symbol serial_syms[] = {
     }, {
         .name   = "GetCommMask",
         .patch  = my_GetCommMask,
+    }, {
+        .name   = "GetCommModemStatus",
+        .patch  = my_GetCommModemStatus,
     }, {
         .name   = "GetCommState",
         .patch  = my_GetCommState,
@@ -73,6 +81,9 @@ static struct hook_symbol serial_syms[] = {
     }, {
         .name   = "ClearCommBreak",
         .patch  = my_ClearCommBreak,
+    }, {
+        .name   = "WaitCommEvent",
+        .patch  = my_WaitCommEvent,
     },
 };
 
@@ -239,39 +250,30 @@ static BOOL WINAPI my_GetCommMask(HANDLE fd, uint32_t *out)
         return hr_propagate_win32(hr, FALSE);
     }
 
+    *out = mask;
     SetLastError(ERROR_SUCCESS);
 
     return TRUE;
 }
 
-static BOOL WINAPI my_GetCommState(HANDLE fd, DCB *dcb)
+static BOOL WINAPI my_GetCommModemStatus(HANDLE fd, uint32_t *out)
 {
     struct irp irp;
-    SERIAL_BAUD_RATE baud;
-    SERIAL_CHARS chars;
-    SERIAL_HANDFLOW handflow;
-    SERIAL_LINE_CONTROL line;
+    uint32_t status;
     HRESULT hr;
 
-    /* Validate params. Despite what MSDN has to say on the matter, the
-       DCBlength field is not validated (and is indeed overwritten) by the real
-       implementation of this function. */
-
-    if (dcb == NULL) {
+    if (out == NULL) {
         SetLastError(ERROR_INVALID_PARAMETER);
 
         return FALSE;
     }
 
-    /* Issue ioctls */
-
     memset(&irp, 0, sizeof(irp));
     irp.op = IRP_OP_IOCTL;
     irp.fd = fd;
-    irp.ioctl = IOCTL_SERIAL_GET_BAUD_RATE;
-    irp.read.bytes = (uint8_t *) &baud;
-    irp.read.nbytes = sizeof(baud);
-    memset(&baud, 0, sizeof(baud));
+    irp.ioctl = IOCTL_SERIAL_GET_MODEMSTATUS;
+    irp.read.bytes = (uint8_t *) &status;
+    irp.read.nbytes = sizeof(status);
 
     hr = iohook_invoke_next(&irp);
 
@@ -279,41 +281,61 @@ static BOOL WINAPI my_GetCommState(HANDLE fd, DCB *dcb)
         return hr_propagate_win32(hr, FALSE);
     }
 
-    memset(&irp, 0, sizeof(irp));
-    irp.op = IRP_OP_IOCTL;
-    irp.fd = fd;
-    irp.ioctl = IOCTL_SERIAL_GET_HANDFLOW;
-    irp.read.bytes = (uint8_t *) &handflow;
-    irp.read.nbytes = sizeof(handflow);
-    memset(&handflow, 0, sizeof(handflow));
+    /* The MS_xxx_ON values are the same bits as SERIAL_MSR_xxx */
 
-    hr = iohook_invoke_next(&irp);
+    *out = status;
+    SetLastError(ERROR_SUCCESS);
 
-    if (FAILED(hr)) {
-        return hr_propagate_win32(hr, FALSE);
-    }
+    return TRUE;
+}
 
-    memset(&irp, 0, sizeof(irp));
-    irp.op = IRP_OP_IOCTL;
-    irp.fd = fd;
-    irp.ioctl = IOCTL_SERIAL_GET_LINE_CONTROL;
-    irp.read.bytes = (uint8_t *) &line;
-    irp.read.nbytes = sizeof(line);
-    memset(&line, 0, sizeof(line));
+static BOOL WINAPI my_GetCommState(HANDLE fd, DCB *dcb)
+{
+    struct irp_ioctl ioctls[4];
+    struct irp irp;
+    SERIAL_BAUD_RATE baud;
+    SERIAL_CHARS chars;
+    SERIAL_HANDFLOW handflow;
+    SERIAL_LINE_CONTROL line;
+    HRESULT hr;
 
-    hr = iohook_invoke_next(&irp);
+    /* Validate params. Despite what MSDN has to say on the matter, the
+       DCBlength field is not validated (and is indeed overwritten) by the real
+       implementation of this function. */
 
-    if (FAILED(hr)) {
-        return hr_propagate_win32(hr, FALSE);
+    if (dcb == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+
+        return FALSE;
     }
 
+    /* Issue ioctls. These go down the chain as a single batch IRP, since
+       some applications call this function at a very high rate. */
+
+    memset(&baud, 0, sizeof(baud));
+    memset(&handflow, 0, sizeof(handflow));
+    memset(&line, 0, sizeof(line));
+    memset(&chars, 0, sizeof(chars));
+    memset(ioctls, 0, sizeof(ioctls));
+
+    ioctls[0].ioctl = IOCTL_SERIAL_GET_BAUD_RATE;
+    ioctls[0].read.bytes = (uint8_t *) &baud;
+    ioctls[0].read.nbytes = sizeof(baud);
+    ioctls[1].ioctl = IOCTL_SERIAL_GET_HANDFLOW;
+    ioctls[1].read.bytes = (uint8_t *) &handflow;
+    ioctls[1].read.nbytes = sizeof(handflow);
+    ioctls[2].ioctl = IOCTL_SERIAL_GET_LINE_CONTROL;
+    ioctls[2].read.bytes = (uint8_t *) &line;
+    ioctls[2].read.nbytes = sizeof(line);
+    ioctls[3].ioctl = IOCTL_SERIAL_GET_CHARS;
+    ioctls[3].read.bytes = (uint8_t *) &chars;
+    ioctls[3].read.nbytes = sizeof(chars);
+
     memset(&irp, 0, sizeof(irp));
-    irp.op = IRP_OP_IOCTL;
+    irp.op = IRP_OP_IOCTL_BATCH;
     irp.fd = fd;
-    irp.ioctl = IOCTL_SERIAL_GET_CHARS;
-    irp.read.bytes = (uint8_t *) &chars;
-    irp.read.nbytes = sizeof(chars);
-    memset(&chars, 0, sizeof(chars));
+    irp.ioctls = ioctls;
+    irp.nioctls = _countof(ioctls);
 
     hr = iohook_invoke_next(&irp);
 
@@ -473,6 +495,7 @@ static BOOL WINAPI my_SetCommMask(HANDLE fd, uint32_t mask)
 
 static BOOL WINAPI my_SetCommState(HANDLE fd, const DCB *dcb)
 {
+    struct irp_ioctl ioctls[4];
     struct irp irp;
     SERIAL_BAUD_RATE baud;
     SERIAL_CHARS chars;
@@ -563,51 +586,26 @@ static BOOL WINAPI my_SetCommState(HANDLE fd, const DCB *dcb)
 
     /* Parameters populated and validated, commit new settings */
 
-    memset(&irp, 0, sizeof(irp));
-    irp.op = IRP_OP_IOCTL;
-    irp.fd = fd;
-    irp.ioctl = IOCTL_SERIAL_SET_BAUD_RATE;
-    irp.write.bytes = (uint8_t *) &baud;
-    irp.write.nbytes = sizeof(baud);
-
-    hr = iohook_invoke_next(&irp);
-
-    if (FAILED(hr)) {
-        return hr_propagate_win32(hr, FALSE);
-    }
+    memset(ioctls, 0, sizeof(ioctls));
+
+    ioctls[0].ioctl = IOCTL_SERIAL_SET_BAUD_RATE;
+    ioctls[0].write.bytes = (uint8_t *) &baud;
+    ioctls[0].write.nbytes = sizeof(baud);
+    ioctls[1].ioctl = IOCTL_SERIAL_SET_HANDFLOW;
+    ioctls[1].write.bytes = (uint8_t *) &handflow;
+    ioctls[1].write.nbytes = sizeof(handflow);
+    ioctls[2].ioctl = IOCTL_SERIAL_SET_LINE_CONTROL;
+    ioctls[2].write.bytes = (uint8_t *) &line;
+    ioctls[2].write.nbytes = sizeof(line);
+    ioctls[3].ioctl = IOCTL_SERIAL_SET_CHARS;
+    ioctls[3].write.bytes = (uint8_t *) &chars;
+    ioctls[3].write.nbytes = sizeof(chars);
 
     memset(&irp, 0, sizeof(irp));
-    irp.op = IRP_OP_IOCTL;
-    irp.fd = fd;
-    irp.ioctl = IOCTL_SERIAL_SET_HANDFLOW;
-    irp.write.bytes = (uint8_t *) &handflow;
-    irp.write.nbytes = sizeof(handflow);
-
-    hr = iohook_invoke_next(&irp);
-
-    if (FAILED(hr)) {
-        return hr_propagate_win32(hr, FALSE);
-    }
-
-    memset(&irp, 0, sizeof(irp));
-    irp.op = IRP_OP_IOCTL;
-    irp.fd = fd;
-    irp.ioctl = IOCTL_SERIAL_SET_LINE_CONTROL;
-    irp.write.bytes = (uint8_t *) &line;
-    irp.write.nbytes = sizeof(line);
-
-    hr = iohook_invoke_next(&irp);
-
-    if (FAILED(hr)) {
-        return hr_propagate_win32(hr, FALSE);
-    }
-
-    memset(&irp, 0, sizeof(irp));
-    irp.op = IRP_OP_IOCTL;
+    irp.op = IRP_OP_IOCTL_BATCH;
     irp.fd = fd;
-    irp.ioctl = IOCTL_SERIAL_SET_CHARS;
-    irp.write.bytes = (uint8_t *) &chars;
-    irp.write.nbytes = sizeof(chars);
+    irp.ioctls = ioctls;
+    irp.nioctls = _countof(ioctls);
 
     hr = iohook_invoke_next(&irp);
 
@@ -724,3 +722,49 @@ static BOOL WINAPI my_ClearCommBreak(HANDLE fd)
 
     return TRUE;
 }
+
+static BOOL WINAPI my_WaitCommEvent(
+        HANDLE fd,
+        uint32_t *evtmask,
+        OVERLAPPED *ovl)
+{
+    struct irp irp;
+    HRESULT hr;
+
+    if (evtmask == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+
+        return FALSE;
+    }
+
+    /* This may well go pending. An overlapped caller gets ERROR_IO_PENDING
+       and collects the result later, at which point the event mask has been
+       written through evtmask, exactly as with the real serial driver. */
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_IOCTL;
+    irp.fd = fd;
+    irp.ovl = ovl;
+    irp.ioctl = IOCTL_SERIAL_WAIT_ON_MASK;
+    irp.read.bytes = (uint8_t *) evtmask;
+    irp.read.nbytes = sizeof(*evtmask);
+
+    hr = iohook_invoke_and_wait(&irp);
+
+    if (FAILED(hr)) {
+        return hr_propagate_win32(hr, FALSE);
+    }
+
+    if (ovl != NULL) {
+        ovl->Internal = STATUS_SUCCESS;
+        ovl->InternalHigh = irp.read.pos;
+
+        if (ovl->hEvent != NULL) {
+            SetEvent(ovl->hEvent);
+        }
+    }
+
+    SetLastError(ERROR_SUCCESS);
+
+    return TRUE;
+}
@@ -0,0 +1,411 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hooklib/timer-wheel.h"
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+static DWORD CALLBACK timer_wheel_thread_proc(void *ctx);
+static void timer_wheel_run(uint64_t now);
+static void timer_wheel_expire(
+        struct timer_wheel_entry *expired,
+        uint64_t tick,
+        uint64_t now);
+static uint64_t timer_wheel_next(void);
+static void timer_wheel_link(
+        struct timer_wheel_entry *head,
+        struct timer_wheel_entry *entry);
+static void timer_wheel_unlink(struct timer_wheel_entry *entry);
+
+static bool timer_wheel_initted;
+static CRITICAL_SECTION timer_wheel_lock;
+static HANDLE timer_wheel_thread;
+static DWORD timer_wheel_thread_id;
+static HANDLE timer_wheel_timer;
+static HANDLE timer_wheel_wake;
+static LARGE_INTEGER timer_wheel_freq;
+static struct timer_wheel_entry timer_wheel_slots[TIMER_WHEEL_NSLOTS];
+static uint64_t timer_wheel_cursor;
+static uint64_t timer_wheel_due;
+static size_t timer_wheel_narmed;
+
+HRESULT timer_wheel_init(void)
+{
+    HRESULT hr;
+    size_t i;
+
+    if (timer_wheel_initted) {
+        return S_FALSE;
+    }
+
+    QueryPerformanceFrequency(&timer_wheel_freq);
+
+    for (i = 0 ; i < TIMER_WHEEL_NSLOTS ; i++) {
+        timer_wheel_slots[i].prev = &timer_wheel_slots[i];
+        timer_wheel_slots[i].next = &timer_wheel_slots[i];
+    }
+
+    timer_wheel_cursor = timer_wheel_now() / TIMER_WHEEL_TICK_NS;
+    timer_wheel_due = UINT64_MAX;
+    timer_wheel_narmed = 0;
+
+    /* Ordinary waitable timers are at the mercy of the system timer
+       resolution, which is 15.6ms unless somebody has asked for better. High
+       resolution timers are not, but they only exist on Windows 10 1803 and
+       later. */
+
+    timer_wheel_timer = CreateWaitableTimerExW(
+            NULL,
+            NULL,
+            CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+            TIMER_ALL_ACCESS);
+
+    if (timer_wheel_timer == NULL) {
+        timer_wheel_timer = CreateWaitableTimerW(NULL, FALSE, NULL);
+    }
+
+    if (timer_wheel_timer == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto fail;
+    }
+
+    timer_wheel_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+
+    if (timer_wheel_wake == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto fail;
+    }
+
+    InitializeCriticalSection(&timer_wheel_lock);
+
+    timer_wheel_thread = CreateThread(
+            NULL,
+            0,
+            timer_wheel_thread_proc,
+            NULL,
+            0,
+            &timer_wheel_thread_id);
+
+    if (timer_wheel_thread == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        DeleteCriticalSection(&timer_wheel_lock);
+
+        goto fail;
+    }
+
+    SetThreadPriority(timer_wheel_thread, THREAD_PRIORITY_HIGHEST);
+    timer_wheel_initted = true;
+
+    return S_OK;
+
+fail:
+    if (timer_wheel_wake != NULL) {
+        CloseHandle(timer_wheel_wake);
+        timer_wheel_wake = NULL;
+    }
+
+    if (timer_wheel_timer != NULL) {
+        CloseHandle(timer_wheel_timer);
+        timer_wheel_timer = NULL;
+    }
+
+    return hr;
+}
+
+uint64_t timer_wheel_now(void)
+{
+    LARGE_INTEGER count;
+    uint64_t freq;
+    uint64_t ticks;
+
+    QueryPerformanceCounter(&count);
+    freq = timer_wheel_freq.QuadPart;
+    ticks = count.QuadPart;
+
+    /* Split the conversion so that the multiplication can't overflow */
+
+    return  (ticks / freq) * 1000000000 +
+            (ticks % freq) * 1000000000 / freq;
+}
+
+void timer_wheel_entry_init(
+        struct timer_wheel_entry *entry,
+        timer_wheel_fn_t fn,
+        void *ctx)
+{
+    assert(entry != NULL);
+    assert(fn != NULL);
+
+    entry->prev = NULL;
+    entry->next = NULL;
+    entry->fn = fn;
+    entry->ctx = ctx;
+    entry->due = 0;
+    entry->armed = false;
+    entry->running = false;
+}
+
+void timer_wheel_arm(struct timer_wheel_entry *entry, uint64_t due)
+{
+    uint64_t tick;
+    bool wake;
+
+    assert(timer_wheel_initted);
+    assert(entry != NULL);
+
+    EnterCriticalSection(&timer_wheel_lock);
+
+    if (entry->armed) {
+        timer_wheel_unlink(entry);
+    }
+
+    /* Anything that is already due goes into the slot that the thread is
+       going to look at next, and gets run on its next pass. */
+
+    tick = due / TIMER_WHEEL_TICK_NS;
+
+    if (tick < timer_wheel_cursor) {
+        tick = timer_wheel_cursor;
+    }
+
+    entry->due = due;
+    entry->armed = true;
+    timer_wheel_link(
+            &timer_wheel_slots[tick & (TIMER_WHEEL_NSLOTS - 1)],
+            entry);
+
+    wake = due < timer_wheel_due;
+
+    if (wake) {
+        timer_wheel_due = due;
+    }
+
+    LeaveCriticalSection(&timer_wheel_lock);
+
+    if (wake) {
+        SetEvent(timer_wheel_wake);
+    }
+}
+
+void timer_wheel_disarm(struct timer_wheel_entry *entry)
+{
+    assert(timer_wheel_initted);
+    assert(entry != NULL);
+
+    /* The thread's sleep is left alone. Waking up for nothing once is
+       cheaper than working out whether this was the earliest timer. */
+
+    EnterCriticalSection(&timer_wheel_lock);
+
+    if (entry->armed) {
+        timer_wheel_unlink(entry);
+    }
+
+    LeaveCriticalSection(&timer_wheel_lock);
+}
+
+void timer_wheel_disarm_sync(struct timer_wheel_entry *entry)
+{
+    assert(entry != NULL);
+
+    if (!timer_wheel_initted) {
+        return;
+    }
+
+    EnterCriticalSection(&timer_wheel_lock);
+
+    if (entry->armed) {
+        timer_wheel_unlink(entry);
+    }
+
+    /* A callback can disarm its own entry, it just can't wait for itself to
+       return. Callbacks are short, so spinning is fine otherwise. */
+
+    while (entry->running && GetCurrentThreadId() != timer_wheel_thread_id) {
+        LeaveCriticalSection(&timer_wheel_lock);
+        SwitchToThread();
+        EnterCriticalSection(&timer_wheel_lock);
+    }
+
+    LeaveCriticalSection(&timer_wheel_lock);
+}
+
+static DWORD CALLBACK timer_wheel_thread_proc(void *ctx)
+{
+    HANDLE handles[2];
+    LARGE_INTEGER rel;
+    uint64_t now;
+    uint64_t due;
+
+    handles[0] = timer_wheel_wake;
+    handles[1] = timer_wheel_timer;
+
+    for (;;) {
+        now = timer_wheel_now();
+
+        EnterCriticalSection(&timer_wheel_lock);
+        timer_wheel_run(now);
+        due = timer_wheel_next();
+        timer_wheel_due = due;
+        LeaveCriticalSection(&timer_wheel_lock);
+
+        if (due == UINT64_MAX) {
+            WaitForSingleObject(timer_wheel_wake, INFINITE);
+
+            continue;
+        }
+
+        now = timer_wheel_now();
+
+        if (due <= now) {
+            continue;
+        }
+
+        /* Negative due times are relative, in units of 100ns. Round up, a
+           timer that fires early just costs us another trip around. */
+
+        rel.QuadPart = -(LONGLONG) ((due - now + 99) / 100);
+        SetWaitableTimer(timer_wheel_timer, &rel, 0, NULL, NULL, FALSE);
+        WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+    }
+
+    return 0;
+}
+
+static void timer_wheel_run(uint64_t now)
+{
+    struct timer_wheel_entry expired;
+    uint64_t tick;
+    uint64_t last;
+    uint64_t t;
+
+    /* Caller holds timer_wheel_lock. Visit every slot between the last one
+       that we looked at and the current one (each slot at most once, if we
+       have fallen a whole revolution behind) and collect what has expired
+       onto a private list, so that callbacks can re-arm freely while we run
+       them. The current tick is not finished yet, so we come back to it. */
+
+    expired.prev = &expired;
+    expired.next = &expired;
+
+    tick = now / TIMER_WHEEL_TICK_NS;
+    last = tick;
+
+    if (last - timer_wheel_cursor >= TIMER_WHEEL_NSLOTS) {
+        last = timer_wheel_cursor + TIMER_WHEEL_NSLOTS - 1;
+    }
+
+    for (t = timer_wheel_cursor ; t <= last ; t++) {
+        timer_wheel_expire(&expired, t, now);
+    }
+
+    timer_wheel_cursor = tick;
+
+    while (expired.next != &expired) {
+        struct timer_wheel_entry *entry;
+        timer_wheel_fn_t fn;
+        void *ctx;
+
+        entry = expired.next;
+        timer_wheel_unlink(entry);
+        fn = entry->fn;
+        ctx = entry->ctx;
+        entry->running = true;
+
+        LeaveCriticalSection(&timer_wheel_lock);
+        fn(entry, now, ctx);
+        EnterCriticalSection(&timer_wheel_lock);
+
+        entry->running = false;
+    }
+}
+
+static void timer_wheel_expire(
+        struct timer_wheel_entry *expired,
+        uint64_t tick,
+        uint64_t now)
+{
+    struct timer_wheel_entry *head;
+    struct timer_wheel_entry *entry;
+    struct timer_wheel_entry *next;
+
+    /* Entries that hash to this slot but are a revolution or more away stay
+       where they are. */
+
+    head = &timer_wheel_slots[tick & (TIMER_WHEEL_NSLOTS - 1)];
+
+    for (entry = head->next ; entry != head ; entry = next) {
+        next = entry->next;
+
+        if (entry->due <= now) {
+            timer_wheel_unlink(entry);
+            entry->armed = true;
+            timer_wheel_link(expired, entry);
+        }
+    }
+}
+
+static uint64_t timer_wheel_next(void)
+{
+    struct timer_wheel_entry *head;
+    struct timer_wheel_entry *entry;
+    uint64_t due;
+    uint64_t t;
+
+    /* The earliest entry lives in the first non-empty slot that holds
+       anything for the current revolution. If every slot is empty or only
+       holds entries for later revolutions, wake up once we have gone all the
+       way round and look again. */
+
+    if (timer_wheel_narmed == 0) {
+        return UINT64_MAX;
+    }
+
+    for (t = timer_wheel_cursor ;
+            t < timer_wheel_cursor + TIMER_WHEEL_NSLOTS ;
+            t++) {
+        head = &timer_wheel_slots[t & (TIMER_WHEEL_NSLOTS - 1)];
+        due = UINT64_MAX;
+
+        for (entry = head->next ; entry != head ; entry = entry->next) {
+            if (entry->due / TIMER_WHEEL_TICK_NS <= t && entry->due < due) {
+                due = entry->due;
+            }
+        }
+
+        if (due != UINT64_MAX) {
+            return due;
+        }
+    }
+
+    return (timer_wheel_cursor + TIMER_WHEEL_NSLOTS) * TIMER_WHEEL_TICK_NS;
+}
+
+static void timer_wheel_link(
+        struct timer_wheel_entry *head,
+        struct timer_wheel_entry *entry)
+{
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+    timer_wheel_narmed++;
+}
+
+static void timer_wheel_unlink(struct timer_wheel_entry *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+    entry->armed = false;
+    timer_wheel_narmed--;
+}
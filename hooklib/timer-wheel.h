@@ -0,0 +1,49 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A single process-wide hashed timer wheel, serviced by one thread sleeping
+   on a high-resolution waitable timer. Intended for large numbers of
+   short-lived, frequently re-armed timers (such as one per emulated serial
+   port) where a kernel timer object each would be wasteful.
+
+   Times are in nanoseconds on the timer_wheel_now() clock. Timers fire up to
+   TIMER_WHEEL_TICK_NS late, never early. Callbacks run on the wheel thread
+   with no wheel locks held, so they may freely re-arm their own entry (or
+   any other). timer_wheel_disarm() does not wait for a callback that is
+   already running; use timer_wheel_disarm_sync() for that before freeing an
+   entry, and never while holding a lock that the callback takes. */
+
+#define TIMER_WHEEL_TICK_NS 500000
+#define TIMER_WHEEL_NSLOTS 512
+
+struct timer_wheel_entry;
+
+typedef void (*timer_wheel_fn_t)(
+        struct timer_wheel_entry *entry,
+        uint64_t now,
+        void *ctx);
+
+struct timer_wheel_entry {
+    struct timer_wheel_entry *prev;
+    struct timer_wheel_entry *next;
+    timer_wheel_fn_t fn;
+    void *ctx;
+    uint64_t due;
+    bool armed;
+    bool running;
+};
+
+HRESULT timer_wheel_init(void);
+uint64_t timer_wheel_now(void);
+
+void timer_wheel_entry_init(
+        struct timer_wheel_entry *entry,
+        timer_wheel_fn_t fn,
+        void *ctx);
+void timer_wheel_arm(struct timer_wheel_entry *entry, uint64_t due);
+void timer_wheel_disarm(struct timer_wheel_entry *entry);
+void timer_wheel_disarm_sync(struct timer_wheel_entry *entry);
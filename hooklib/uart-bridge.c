@@ -0,0 +1,801 @@
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#if defined(__GNUC__) && defined(_WIN32)
+#include <ntdef.h>
+#else
+#include <winnt.h>
+#endif
+#include <devioctl.h>
+#include <ntddser.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "hook/iobuf-spsc.h"
+#include "hook/iobuf.h"
+#include "hook/iohook.h"
+
+#include "hooklib/uart-bridge.h"
+#include "hooklib/uart.h"
+
+/* How often the I/O thread looks again at incoming data that it could not
+   hand over yet, either because rx is full or because a file has no more
+   data in it for the time being. */
+
+#define UART_BRIDGE_POLL_MS 10
+
+enum uart_bridge_kind {
+    UART_BRIDGE_HANDLE,
+    UART_BRIDGE_SOCKET,
+    UART_BRIDGE_FILES,
+};
+
+/* One direction of transfer between the backend and a queue. bytes[pos] up
+   to bytes[nbytes] have been received but not yet queued (rx), or dequeued
+   but not yet sent (tx). */
+
+struct uart_bridge_dir {
+    HANDLE fd;
+    OVERLAPPED ovl;
+    uint64_t offset;
+    bool busy;
+    size_t pos;
+    size_t nbytes;
+    uint8_t bytes[UART_BRIDGE_CHUNK];
+};
+
+struct uart_bridge {
+    struct iobuf_spsc rx_queue;
+    struct iobuf_spsc tx_queue;
+    struct uart *uart;
+    CRITICAL_SECTION lock;
+    enum uart_bridge_kind kind;
+    SOCKET sock;
+    bool wsa_started;
+    bool connected;
+    bool attached;
+    bool tx_sent;
+    volatile bool rx_idle;
+    HANDLE thread;
+    HANDLE stop;
+    HANDLE wake;
+    struct uart_bridge_dir rx;
+    struct uart_bridge_dir tx;
+    uint8_t rx_bytes[UART_BRIDGE_QUEUE_SIZE];
+    uint8_t tx_bytes[UART_BRIDGE_QUEUE_SIZE];
+};
+
+static HRESULT uart_bridge_connect_tcp(
+        struct uart_bridge *bridge,
+        const wchar_t *spec);
+static HRESULT uart_bridge_connect_files(
+        struct uart_bridge *bridge,
+        const wchar_t *spec);
+static HRESULT uart_bridge_connect_handle(
+        struct uart_bridge *bridge,
+        const wchar_t *path);
+static void uart_bridge_disconnect(struct uart_bridge *bridge);
+static DWORD WINAPI uart_bridge_thread_proc(void *ctx);
+static void uart_bridge_pump_rx(struct uart_bridge *bridge);
+static void uart_bridge_pump_tx(struct uart_bridge *bridge);
+static HRESULT uart_bridge_begin(
+        struct uart_bridge *bridge,
+        struct uart_bridge_dir *dir,
+        bool write);
+static HRESULT uart_bridge_result(
+        struct uart_bridge *bridge,
+        struct uart_bridge_dir *dir,
+        bool wait,
+        size_t *nbytes);
+static void uart_bridge_cancel(
+        struct uart_bridge *bridge,
+        struct uart_bridge_dir *dir);
+
+HRESULT uart_bridge_open(
+        struct uart_bridge **out,
+        struct uart *uart,
+        const wchar_t *target)
+{
+    struct uart_bridge *bridge;
+    HRESULT hr;
+
+    assert(out != NULL);
+    assert(uart != NULL);
+    assert(target != NULL);
+
+    *out = NULL;
+
+    bridge = calloc(1, sizeof(*bridge));
+
+    if (bridge == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    bridge->uart = uart;
+    bridge->sock = INVALID_SOCKET;
+    InitializeCriticalSection(&bridge->lock);
+    iobuf_spsc_init(
+            &bridge->rx_queue,
+            bridge->rx_bytes,
+            sizeof(bridge->rx_bytes));
+    iobuf_spsc_init(
+            &bridge->tx_queue,
+            bridge->tx_bytes,
+            sizeof(bridge->tx_bytes));
+
+    bridge->stop = CreateEventW(NULL, TRUE, FALSE, NULL);
+    bridge->wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+    bridge->rx.ovl.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    bridge->tx.ovl.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    if (    bridge->stop == NULL ||
+            bridge->wake == NULL ||
+            bridge->rx.ovl.hEvent == NULL ||
+            bridge->tx.ovl.hEvent == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto fail;
+    }
+
+    if (wcsncmp(target, L"tcp:", 4) == 0) {
+        hr = uart_bridge_connect_tcp(bridge, target + 4);
+    } else if (wcsncmp(target, L"file:", 5) == 0) {
+        hr = uart_bridge_connect_files(bridge, target + 5);
+    } else {
+        hr = uart_bridge_connect_handle(bridge, target);
+    }
+
+    if (FAILED(hr)) {
+        goto fail;
+    }
+
+    /* Nothing can fail after the uart has been pointed at our queues */
+
+    bridge->thread = CreateThread(
+            NULL,
+            0,
+            uart_bridge_thread_proc,
+            bridge,
+            CREATE_SUSPENDED,
+            NULL);
+
+    if (bridge->thread == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto fail;
+    }
+
+    bridge->connected = true;
+    uart_attach_queues(uart, &bridge->rx_queue, &bridge->tx_queue);
+    bridge->attached = true;
+    uart_set_modem_status(
+            uart,
+            SERIAL_MSR_CTS | SERIAL_MSR_DSR | SERIAL_MSR_DCD);
+
+    ResumeThread(bridge->thread);
+    *out = bridge;
+
+    return S_OK;
+
+fail:
+    uart_bridge_close(bridge);
+
+    return hr;
+}
+
+void uart_bridge_close(struct uart_bridge *bridge)
+{
+    if (bridge == NULL) {
+        return;
+    }
+
+    if (bridge->thread != NULL) {
+        SetEvent(bridge->stop);
+        WaitForSingleObject(bridge->thread, INFINITE);
+        CloseHandle(bridge->thread);
+    }
+
+    /* The queues are about to be freed, so the uart must let go of them */
+
+    if (bridge->attached) {
+        uart_detach_queues(bridge->uart);
+    }
+
+    if (bridge->sock != INVALID_SOCKET) {
+        closesocket(bridge->sock);
+    } else {
+        if (bridge->tx.fd != NULL && bridge->tx.fd != bridge->rx.fd) {
+            CloseHandle(bridge->tx.fd);
+        }
+
+        if (bridge->rx.fd != NULL) {
+            CloseHandle(bridge->rx.fd);
+        }
+    }
+
+    if (bridge->wsa_started) {
+        WSACleanup();
+    }
+
+    if (bridge->tx.ovl.hEvent != NULL) {
+        CloseHandle(bridge->tx.ovl.hEvent);
+    }
+
+    if (bridge->rx.ovl.hEvent != NULL) {
+        CloseHandle(bridge->rx.ovl.hEvent);
+    }
+
+    if (bridge->wake != NULL) {
+        CloseHandle(bridge->wake);
+    }
+
+    if (bridge->stop != NULL) {
+        CloseHandle(bridge->stop);
+    }
+
+    DeleteCriticalSection(&bridge->lock);
+    free(bridge);
+}
+
+HRESULT uart_bridge_handle_irp(struct uart *uart, struct irp *irp, void *ctx)
+{
+    struct uart_bridge *bridge;
+    HRESULT hr;
+
+    assert(uart != NULL);
+    assert(irp != NULL);
+    assert(ctx != NULL);
+
+    bridge = ctx;
+
+    assert(bridge->uart == uart);
+
+    EnterCriticalSection(&bridge->lock);
+    hr = uart_handle_irp(uart, irp);
+    LeaveCriticalSection(&bridge->lock);
+
+    /* Kick the I/O thread if there is something new for it to send, or if
+       the application may just have made room for data that it is sitting
+       on. */
+
+    if (    (irp->op == IRP_OP_WRITE && irp->write.pos > 0) ||
+            (irp->op == IRP_OP_READ && bridge->rx_idle)) {
+        SetEvent(bridge->wake);
+    }
+
+    return hr;
+}
+
+static HRESULT uart_bridge_connect_tcp(
+        struct uart_bridge *bridge,
+        const wchar_t *spec)
+{
+    ADDRINFOW hints;
+    ADDRINFOW *addrs;
+    ADDRINFOW *addr;
+    WSADATA wsa;
+    wchar_t host[256];
+    const wchar_t *port;
+    BOOL nodelay;
+    size_t len;
+    int err;
+
+    port = wcsrchr(spec, L':');
+
+    if (port == NULL) {
+        return E_INVALIDARG;
+    }
+
+    len = port - spec;
+    port++;
+
+    if (len == 0 || len >= _countof(host) || *port == L'\0') {
+        return E_INVALIDARG;
+    }
+
+    memcpy(host, spec, len * sizeof(wchar_t));
+    host[len] = L'\0';
+
+    err = WSAStartup(MAKEWORD(2, 2), &wsa);
+
+    if (err != 0) {
+        return HRESULT_FROM_WIN32(err);
+    }
+
+    bridge->wsa_started = true;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    err = GetAddrInfoW(host, port, &hints, &addrs);
+
+    if (err != 0) {
+        return HRESULT_FROM_WIN32(err);
+    }
+
+    err = WSAECONNREFUSED;
+
+    for (addr = addrs ; addr != NULL ; addr = addr->ai_next) {
+        bridge->sock = WSASocketW(
+                addr->ai_family,
+                addr->ai_socktype,
+                addr->ai_protocol,
+                NULL,
+                0,
+                WSA_FLAG_OVERLAPPED);
+
+        if (bridge->sock == INVALID_SOCKET) {
+            err = WSAGetLastError();
+
+            continue;
+        }
+
+        if (connect(bridge->sock, addr->ai_addr, (int) addr->ai_addrlen)
+                == 0) {
+            break;
+        }
+
+        err = WSAGetLastError();
+        closesocket(bridge->sock);
+        bridge->sock = INVALID_SOCKET;
+    }
+
+    FreeAddrInfoW(addrs);
+
+    if (bridge->sock == INVALID_SOCKET) {
+        return HRESULT_FROM_WIN32(err);
+    }
+
+    /* Serial traffic is mostly small request/response exchanges, which
+       Nagle's algorithm would hold up for no benefit. */
+
+    nodelay = TRUE;
+    setsockopt(
+            bridge->sock,
+            IPPROTO_TCP,
+            TCP_NODELAY,
+            (const char *) &nodelay,
+            sizeof(nodelay));
+
+    bridge->kind = UART_BRIDGE_SOCKET;
+    bridge->rx.fd = (HANDLE) bridge->sock;
+    bridge->tx.fd = (HANDLE) bridge->sock;
+
+    return S_OK;
+}
+
+static HRESULT uart_bridge_connect_files(
+        struct uart_bridge *bridge,
+        const wchar_t *spec)
+{
+    LARGE_INTEGER size;
+    wchar_t rx_path[MAX_PATH];
+    const wchar_t *tx_path;
+    HANDLE fd;
+    size_t len;
+
+    /* | cannot appear in a Win32 path, so it makes an unambiguous separator */
+
+    tx_path = wcschr(spec, L'|');
+
+    if (tx_path == NULL) {
+        return E_INVALIDARG;
+    }
+
+    len = tx_path - spec;
+    tx_path++;
+
+    if (len == 0 || len >= _countof(rx_path) || *tx_path == L'\0') {
+        return E_INVALIDARG;
+    }
+
+    memcpy(rx_path, spec, len * sizeof(wchar_t));
+    rx_path[len] = L'\0';
+
+    /* Either side may be started first, and either side may truncate or
+       delete the files between sessions. */
+
+    fd = CreateFileW(
+            rx_path,
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL,
+            OPEN_ALWAYS,
+            FILE_FLAG_OVERLAPPED,
+            NULL);
+
+    if (fd == INVALID_HANDLE_VALUE) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    bridge->rx.fd = fd;
+
+    fd = CreateFileW(
+            tx_path,
+            GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL,
+            OPEN_ALWAYS,
+            FILE_FLAG_OVERLAPPED,
+            NULL);
+
+    if (fd == INVALID_HANDLE_VALUE) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    bridge->tx.fd = fd;
+
+    if (!GetFileSizeEx(fd, &size)) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    bridge->kind = UART_BRIDGE_FILES;
+    bridge->tx.offset = size.QuadPart;
+
+    return S_OK;
+}
+
+static HRESULT uart_bridge_connect_handle(
+        struct uart_bridge *bridge,
+        const wchar_t *path)
+{
+    HANDLE fd;
+
+    fd = CreateFileW(
+            path,
+            GENERIC_READ | GENERIC_WRITE,
+            0,
+            NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_OVERLAPPED,
+            NULL);
+
+    if (fd == INVALID_HANDLE_VALUE) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    bridge->kind = UART_BRIDGE_HANDLE;
+    bridge->rx.fd = fd;
+    bridge->tx.fd = fd;
+
+    return S_OK;
+}
+
+static void uart_bridge_disconnect(struct uart_bridge *bridge)
+{
+    if (!bridge->connected) {
+        return;
+    }
+
+    bridge->connected = false;
+    uart_set_modem_status(bridge->uart, 0);
+}
+
+static DWORD WINAPI uart_bridge_thread_proc(void *ctx)
+{
+    struct uart_bridge *bridge;
+    HANDLE handles[4];
+    DWORD timeout;
+    DWORD result;
+
+    bridge = ctx;
+
+    handles[0] = bridge->stop;
+    handles[1] = bridge->wake;
+    handles[2] = bridge->rx.ovl.hEvent;
+    handles[3] = bridge->tx.ovl.hEvent;
+
+    for (;;) {
+        uart_bridge_pump_rx(bridge);
+        uart_bridge_pump_tx(bridge);
+
+        timeout = bridge->rx_idle ? UART_BRIDGE_POLL_MS : INFINITE;
+
+        result = WaitForMultipleObjects(
+                _countof(handles),
+                handles,
+                FALSE,
+                timeout);
+
+        if (result == WAIT_OBJECT_0) {
+            break;
+        }
+    }
+
+    uart_bridge_cancel(bridge, &bridge->rx);
+    uart_bridge_cancel(bridge, &bridge->tx);
+
+    return 0;
+}
+
+static void uart_bridge_pump_rx(struct uart_bridge *bridge)
+{
+    struct uart_bridge_dir *rx;
+    struct const_iobuf src;
+    size_t nbytes;
+    HRESULT hr;
+    bool eof;
+
+    rx = &bridge->rx;
+
+    for (;;) {
+        if (rx->busy) {
+            hr = uart_bridge_result(bridge, rx, false, &nbytes);
+
+            if (hr == HRESULT_FROM_WIN32(ERROR_IO_INCOMPLETE)) {
+                return;
+            }
+
+            rx->busy = false;
+            eof =   hr == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF) ||
+                    (SUCCEEDED(hr) && nbytes == 0);
+
+            if (SUCCEEDED(hr) && nbytes > 0) {
+                rx->pos = 0;
+                rx->nbytes = nbytes;
+
+                if (bridge->kind == UART_BRIDGE_FILES) {
+                    rx->offset += nbytes;
+                }
+            } else if (eof && bridge->kind != UART_BRIDGE_SOCKET) {
+                /* End of file, or an empty pipe message. Try again later. */
+                bridge->rx_idle = true;
+
+                return;
+            } else {
+                /* Includes a socket that has been closed by the other end */
+                uart_bridge_disconnect(bridge);
+            }
+        }
+
+        if (rx->pos < rx->nbytes) {
+            /* Hold back whatever the application's flow control doesn't
+               have room for. It'll be polled for again shortly. */
+
+            src.bytes = rx->bytes;
+            src.nbytes = rx->pos + uart_rx_space(bridge->uart);
+            src.pos = rx->pos;
+
+            if (src.nbytes > rx->nbytes) {
+                src.nbytes = rx->nbytes;
+            }
+
+            if (iobuf_spsc_move(&bridge->rx_queue, &src) > 0) {
+                uart_notify_readable(bridge->uart);
+            }
+
+            rx->pos = src.pos;
+
+            if (rx->pos < rx->nbytes) {
+                bridge->rx_idle = true;
+
+                return;
+            }
+        }
+
+        if (!bridge->connected) {
+            bridge->rx_idle = false;
+
+            return;
+        }
+
+        bridge->rx_idle = false;
+        hr = uart_bridge_begin(bridge, rx, false);
+
+        if (hr == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF)) {
+            bridge->rx_idle = true;
+
+            return;
+        } else if (FAILED(hr)) {
+            uart_bridge_disconnect(bridge);
+
+            return;
+        }
+
+        /* Go around again, in case that completed straight away */
+    }
+}
+
+static void uart_bridge_pump_tx(struct uart_bridge *bridge)
+{
+    struct uart_bridge_dir *tx;
+    struct iobuf dest;
+    size_t nbytes;
+    HRESULT hr;
+
+    tx = &bridge->tx;
+
+    for (;;) {
+        if (tx->busy) {
+            hr = uart_bridge_result(bridge, tx, false, &nbytes);
+
+            if (hr == HRESULT_FROM_WIN32(ERROR_IO_INCOMPLETE)) {
+                return;
+            }
+
+            tx->busy = false;
+
+            if (SUCCEEDED(hr)) {
+                tx->pos += nbytes;
+
+                if (bridge->kind == UART_BRIDGE_FILES) {
+                    tx->offset += nbytes;
+                }
+            } else {
+                uart_bridge_disconnect(bridge);
+            }
+        }
+
+        if (!bridge->connected) {
+            /* Nobody to send it to, so it goes nowhere, like it would on a
+               real port with nothing plugged into it. */
+
+            nbytes = tx->nbytes - tx->pos;
+            nbytes += iobuf_spsc_skip(&bridge->tx_queue, (size_t) -1);
+            tx->pos = 0;
+            tx->nbytes = 0;
+
+            if (nbytes > 0) {
+                uart_raise_events(bridge->uart, SERIAL_EV_TXEMPTY);
+                uart_notify_writable(bridge->uart);
+            }
+
+            return;
+        }
+
+        if (tx->pos == tx->nbytes) {
+            dest.bytes = tx->bytes;
+            dest.nbytes = sizeof(tx->bytes);
+            dest.pos = 0;
+
+            iobuf_spsc_shift(&dest, &bridge->tx_queue);
+
+            tx->pos = 0;
+            tx->nbytes = dest.pos;
+
+            if (tx->nbytes > 0) {
+                uart_notify_writable(bridge->uart);
+            }
+
+            if (tx->nbytes == 0) {
+                if (bridge->tx_sent) {
+                    bridge->tx_sent = false;
+                    uart_raise_events(bridge->uart, SERIAL_EV_TXEMPTY);
+                }
+
+                return;
+            }
+        }
+
+        hr = uart_bridge_begin(bridge, tx, true);
+
+        if (FAILED(hr)) {
+            uart_bridge_disconnect(bridge);
+        } else {
+            bridge->tx_sent = true;
+        }
+    }
+}
+
+static HRESULT uart_bridge_begin(
+        struct uart_bridge *bridge,
+        struct uart_bridge_dir *dir,
+        bool write)
+{
+    WSABUF buf;
+    DWORD flags;
+    DWORD nbytes;
+    uint8_t *bytes;
+    BOOL ok;
+    int rc;
+
+    assert(!dir->busy);
+
+    if (write) {
+        bytes = &dir->bytes[dir->pos];
+        nbytes = (DWORD) (dir->nbytes - dir->pos);
+    } else {
+        bytes = dir->bytes;
+        nbytes = sizeof(dir->bytes);
+    }
+
+    if (bridge->kind == UART_BRIDGE_SOCKET) {
+        buf.buf = (char *) bytes;
+        buf.len = nbytes;
+        flags = 0;
+
+        if (write) {
+            rc = WSASend(bridge->sock, &buf, 1, NULL, 0, &dir->ovl, NULL);
+        } else {
+            rc = WSARecv(bridge->sock, &buf, 1, NULL, &flags, &dir->ovl, NULL);
+        }
+
+        if (rc != 0 && WSAGetLastError() != WSA_IO_PENDING) {
+            return HRESULT_FROM_WIN32(WSAGetLastError());
+        }
+    } else {
+        dir->ovl.Offset = (DWORD) dir->offset;
+        dir->ovl.OffsetHigh = (DWORD) (dir->offset >> 32);
+
+        if (write) {
+            ok = WriteFile(dir->fd, bytes, nbytes, NULL, &dir->ovl);
+        } else {
+            ok = ReadFile(dir->fd, bytes, nbytes, NULL, &dir->ovl);
+        }
+
+        if (!ok && GetLastError() != ERROR_IO_PENDING) {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    /* Completion is picked up from the event either way */
+
+    dir->busy = true;
+
+    return S_OK;
+}
+
+static HRESULT uart_bridge_result(
+        struct uart_bridge *bridge,
+        struct uart_bridge_dir *dir,
+        bool wait,
+        size_t *nbytes)
+{
+    DWORD flags;
+    DWORD count;
+    DWORD error;
+    BOOL ok;
+
+    assert(dir->busy);
+
+    if (bridge->kind == UART_BRIDGE_SOCKET) {
+        ok = WSAGetOverlappedResult(
+                bridge->sock,
+                &dir->ovl,
+                &count,
+                wait,
+                &flags);
+        error = ok ? 0 : WSAGetLastError();
+    } else {
+        ok = GetOverlappedResult(dir->fd, &dir->ovl, &count, wait);
+        error = ok ? 0 : GetLastError();
+    }
+
+    /* WSA_IO_INCOMPLETE has the same value as ERROR_IO_INCOMPLETE */
+
+    if (error == ERROR_IO_INCOMPLETE) {
+        return HRESULT_FROM_WIN32(ERROR_IO_INCOMPLETE);
+    }
+
+    /* Stop the event from waking the I/O thread until the next transfer in
+       this direction has finished. */
+
+    ResetEvent(dir->ovl.hEvent);
+    *nbytes = count;
+
+    return ok ? S_OK : HRESULT_FROM_WIN32(error);
+}
+
+static void uart_bridge_cancel(
+        struct uart_bridge *bridge,
+        struct uart_bridge_dir *dir)
+{
+    size_t nbytes;
+
+    if (!dir->busy) {
+        return;
+    }
+
+    CancelIoEx(dir->fd, &dir->ovl);
+    uart_bridge_result(bridge, dir, true, &nbytes);
+    dir->busy = false;
+}
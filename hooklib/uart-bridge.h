@@ -0,0 +1,45 @@
+#pragma once
+
+#include <windows.h>
+
+#include "hook/iohook.h"
+
+#include "hooklib/uart.h"
+
+/* Connects an emulated COM port to a byte stream outside of the process, so
+   that the device on the other end can be emulated by a separate program,
+   possibly on another machine. target selects the backend:
+
+       tcp:HOST:PORT   A TCP connection. To reach a pseudo-terminal on a Linux
+                       host, put something like socat between the two.
+       file:RX|TX      Bytes are read from file RX, which is followed as it
+                       grows, and appended to file TX.
+       (anything else) A path that is opened with CreateFileW, such as the
+                       client end of a named pipe (\\.\pipe\NAME) or a real
+                       COM port.
+
+   The bridge puts the uart into the queued mode described in uart.h and runs
+   an I/O thread that shuttles bytes between the queues and the backend using
+   overlapped I/O, in batches of up to UART_BRIDGE_CHUNK bytes, so the
+   application never waits for the other end, unless the queues fill up or
+   the application's flow control calls a halt. CTS, DSR and RLSD are
+   asserted while the backend is connected and dropped if it goes away; the
+   bridge does not reconnect.
+
+   uart_bridge_open() must be called before the port is opened. The
+   application's IRPs must then be routed to uart_bridge_handle_irp() with the
+   bridge as ctx, which is most easily done by passing both to
+   uart_registry_add(). The uart must be removed from the registry (or
+   otherwise detached from iohook) before the bridge is closed. */
+
+#define UART_BRIDGE_CHUNK 4096
+#define UART_BRIDGE_QUEUE_SIZE 0x10000
+
+struct uart_bridge;
+
+HRESULT uart_bridge_open(
+        struct uart_bridge **out,
+        struct uart *uart,
+        const wchar_t *target);
+void uart_bridge_close(struct uart_bridge *bridge);
+HRESULT uart_bridge_handle_irp(struct uart *uart, struct irp *irp, void *ctx);
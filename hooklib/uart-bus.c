@@ -0,0 +1,256 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hook/iobuf.h"
+
+#include "hooklib/frame.h"
+#include "hooklib/uart-bus.h"
+#include "hooklib/uart.h"
+
+static HRESULT uart_bus_frame(void *ctx, const struct const_iobuf *body);
+static HRESULT uart_bus_broadcast(
+        struct uart_bus *bus,
+        const struct const_iobuf *frame);
+static struct uart_bus_node *uart_bus_next_unaddressed(struct uart_bus *bus);
+
+void uart_bus_init(
+        struct uart_bus *bus,
+        struct uart *uart,
+        const struct uart_bus_config *config)
+{
+    assert(bus != NULL);
+    assert(uart != NULL);
+    assert(config != NULL);
+    assert(config->measure != NULL);
+
+    bus->uart = uart;
+    bus->config = *config;
+    frame_decoder_init(
+            &bus->decoder,
+            &config->frame,
+            config->max_nbytes,
+            uart_bus_frame,
+            bus);
+    memset(bus->nodes, 0, sizeof(bus->nodes));
+    bus->chain = NULL;
+    bus->nunaddressed = 0;
+    bus->nunclaimed = 0;
+}
+
+void uart_bus_fini(struct uart_bus *bus)
+{
+    assert(bus != NULL);
+
+    frame_decoder_fini(&bus->decoder);
+}
+
+void uart_bus_attach(
+        struct uart_bus *bus,
+        struct uart_bus_node *node,
+        uart_bus_fn_t fn,
+        void *ctx)
+{
+    struct uart_bus_node **pos;
+
+    assert(bus != NULL);
+    assert(node != NULL);
+    assert(fn != NULL);
+
+    node->bus = bus;
+    node->next = NULL;
+    node->fn = fn;
+    node->ctx = ctx;
+    node->addr = 0;
+    node->has_addr = false;
+
+    /* Attaching is rare, so there's no tail pointer to keep up to date */
+
+    pos = &bus->chain;
+
+    while (*pos != NULL) {
+        pos = &(*pos)->next;
+    }
+
+    *pos = node;
+    bus->nunaddressed++;
+}
+
+HRESULT uart_bus_set_address(struct uart_bus_node *node, uint8_t addr)
+{
+    struct uart_bus *bus;
+
+    assert(node != NULL);
+    assert(node->bus != NULL);
+
+    bus = node->bus;
+
+    if (bus->config.has_broadcast && addr == bus->config.broadcast) {
+        return E_INVALIDARG;
+    }
+
+    if (bus->nodes[addr] != NULL && bus->nodes[addr] != node) {
+        return HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+    }
+
+    uart_bus_clear_address(node);
+
+    bus->nodes[addr] = node;
+    bus->nunaddressed--;
+    node->addr = addr;
+    node->has_addr = true;
+
+    return S_OK;
+}
+
+void uart_bus_clear_address(struct uart_bus_node *node)
+{
+    struct uart_bus *bus;
+
+    assert(node != NULL);
+    assert(node->bus != NULL);
+
+    if (!node->has_addr) {
+        return;
+    }
+
+    bus = node->bus;
+    bus->nodes[node->addr] = NULL;
+    bus->nunaddressed++;
+    node->has_addr = false;
+}
+
+bool uart_bus_enumerated(const struct uart_bus *bus)
+{
+    assert(bus != NULL);
+
+    return bus->nunaddressed == 0;
+}
+
+HRESULT uart_bus_process(struct uart_bus *bus)
+{
+    assert(bus != NULL);
+
+    return frame_decode_arena(&bus->decoder, &bus->uart->written);
+}
+
+HRESULT uart_bus_reply(
+        struct uart_bus_node *node,
+        const struct const_iobuf *body)
+{
+    struct uart_bus *bus;
+    HRESULT hr;
+
+    assert(node != NULL);
+    assert(node->bus != NULL);
+    assert(body != NULL);
+
+    bus = node->bus;
+    hr = frame_encode(&bus->config.frame, &bus->uart->readable, body);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    uart_notify_readable(bus->uart);
+
+    return S_OK;
+}
+
+static HRESULT uart_bus_frame(void *ctx, const struct const_iobuf *body)
+{
+    struct uart_bus_node *node;
+    struct const_iobuf frame;
+    struct uart_bus *bus;
+    size_t nbytes;
+    uint8_t addr;
+    bool broadcast;
+
+    bus = ctx;
+
+    if (body->nbytes <= bus->config.addr_offset) {
+        return S_FALSE;
+    }
+
+    /* Skip the rest of a frame that nobody is going to answer as soon as
+       we know that. Nothing inside the frame can look like a sync byte, so
+       the decoder's hunt for the next one steps over it in one go. */
+
+    addr = body->bytes[bus->config.addr_offset];
+    broadcast = bus->config.has_broadcast && addr == bus->config.broadcast;
+    node = bus->nodes[addr];
+
+    if (node == NULL && !broadcast) {
+        bus->nunclaimed++;
+
+        return S_OK;
+    }
+
+    nbytes = bus->config.measure(body);
+
+    if (nbytes == 0 || nbytes > body->nbytes) {
+        return S_FALSE;
+    }
+
+    frame.bytes = body->bytes;
+    frame.nbytes = nbytes;
+    frame.pos = 0;
+
+    if (broadcast) {
+        return uart_bus_broadcast(bus, &frame);
+    }
+
+    return node->fn(node, &frame, node->ctx);
+}
+
+static HRESULT uart_bus_broadcast(
+        struct uart_bus *bus,
+        const struct const_iobuf *frame)
+{
+    struct uart_bus_node *first;
+    struct uart_bus_node *node;
+    struct const_iobuf copy;
+    HRESULT hr;
+
+    /* Work out which unaddressed node is on the bus before any of them gets
+       a chance to change that, otherwise one broadcast could address the
+       entire chain. */
+
+    first = uart_bus_next_unaddressed(bus);
+
+    for (node = bus->chain ; node != NULL ; node = node->next) {
+        if (!node->has_addr && node != first) {
+            continue;
+        }
+
+        copy = *frame;
+        hr = node->fn(node, &copy, node->ctx);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+    }
+
+    return S_OK;
+}
+
+static struct uart_bus_node *uart_bus_next_unaddressed(struct uart_bus *bus)
+{
+    struct uart_bus_node *node;
+
+    if (bus->nunaddressed == 0) {
+        return NULL;
+    }
+
+    for (node = bus->chain ; node != NULL ; node = node->next) {
+        if (!node->has_addr) {
+            return node;
+        }
+    }
+
+    return NULL;
+}
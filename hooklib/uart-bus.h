@@ -0,0 +1,106 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iobuf.h"
+
+#include "hooklib/frame.h"
+#include "hooklib/uart.h"
+
+/* Emulates any number of devices sharing one multi-drop (RS-485 style) bus
+   behind a single emulated COM port. The application is the bus master: it
+   writes sync/escape framed requests (see frame.h) that each begin with an
+   address byte at addr_offset into the frame body, and the addressed node
+   replies with uart_bus_reply().
+
+   The address is looked at once per frame, as soon as it has arrived, and
+   used to index a table of nodes, so the cost of a frame does not depend on
+   how many nodes there are. Frames for addresses that nobody has claimed are
+   skipped there and then, without being buffered; they are counted in
+   nunclaimed. Frames sent to the broadcast address (if has_broadcast is set)
+   go to every node that has an address, in the order that the nodes were
+   attached.
+
+   Since frames are expected to be self-delimiting, measure is called with
+   the body received so far and returns the length of the whole frame, or
+   zero if not enough of it has arrived to tell. Node callbacks only ever see
+   complete frames. Failures from a node callback are passed back to the
+   caller of uart_bus_process(), and the frame is dropped.
+
+   Nodes start out without an address. The owner can give them fixed
+   addresses with uart_bus_set_address() up front, or leave them for the
+   application to enumerate. For that, the nodes that have no address yet
+   form a daisy chain in the order that they were attached, and the first of
+   them receives broadcasts along with the addressed nodes, as if the others
+   were still cut off from the bus behind it. Its callback handles the
+   protocol's address assignment command by calling uart_bus_set_address()
+   on itself (nodes that already have an address see the command too, and
+   should ignore it), after which the next node in the chain takes its
+   place. A bus reset is handled similarly by each node calling
+   uart_bus_clear_address(). uart_bus_enumerated() is true once every node
+   has an address, which is what sense lines on such buses usually report.
+
+   The bus works on the uart's written and readable buffers, so the owner
+   calls uart_bus_process() after each write IRP, under the same lock that
+   it holds around uart_handle_irp(). Node callbacks run under that lock
+   too. */
+
+#define UART_BUS_NADDRS 256
+
+struct uart_bus_node;
+
+typedef size_t (*uart_bus_measure_fn_t)(const struct const_iobuf *body);
+typedef HRESULT (*uart_bus_fn_t)(
+        struct uart_bus_node *node,
+        const struct const_iobuf *frame,
+        void *ctx);
+
+struct uart_bus_config {
+    struct frame_config frame;
+    size_t max_nbytes;
+    size_t addr_offset;
+    uint8_t broadcast;
+    bool has_broadcast;
+    uart_bus_measure_fn_t measure;
+};
+
+struct uart_bus_node {
+    struct uart_bus *bus;
+    struct uart_bus_node *next;
+    uart_bus_fn_t fn;
+    void *ctx;
+    uint8_t addr;
+    bool has_addr;
+};
+
+struct uart_bus {
+    struct uart *uart;
+    struct uart_bus_config config;
+    struct frame_decoder decoder;
+    struct uart_bus_node *nodes[UART_BUS_NADDRS];
+    struct uart_bus_node *chain;
+    size_t nunaddressed;
+    uint32_t nunclaimed;
+};
+
+void uart_bus_init(
+        struct uart_bus *bus,
+        struct uart *uart,
+        const struct uart_bus_config *config);
+void uart_bus_fini(struct uart_bus *bus);
+void uart_bus_attach(
+        struct uart_bus *bus,
+        struct uart_bus_node *node,
+        uart_bus_fn_t fn,
+        void *ctx);
+HRESULT uart_bus_set_address(struct uart_bus_node *node, uint8_t addr);
+void uart_bus_clear_address(struct uart_bus_node *node);
+bool uart_bus_enumerated(const struct uart_bus *bus);
+HRESULT uart_bus_process(struct uart_bus *bus);
+HRESULT uart_bus_reply(
+        struct uart_bus_node *node,
+        const struct const_iobuf *body);
@@ -0,0 +1,410 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hook/iobuf-spsc.h"
+#include "hook/iobuf-varint.h"
+#include "hook/iobuf.h"
+
+#include "hooklib/uart-capture.h"
+
+/* How often the background thread empties the ring if nobody asks it to
+   sooner. Writers only ask once the ring is half full. */
+
+#define UART_CAPTURE_FLUSH_MS 100
+
+/* Size of the biggest record header: kind, time and two ULEB128 fields */
+
+#define UART_CAPTURE_HEAD_MAX 31
+
+struct uart_capture {
+    struct iobuf_spsc ring;
+    HANDLE fd;
+    HANDLE thread;
+    HANDLE stop;
+    HANDLE wake;
+    LARGE_INTEGER freq;
+    uint64_t last;
+    size_t lost;
+    bool failed;
+    uint8_t *bytes;
+    uint8_t chunk[0x10000];
+};
+
+static uint64_t uart_capture_now(const struct uart_capture *cap);
+static HRESULT uart_capture_write_header(
+        struct uart_capture *cap,
+        unsigned int port_no);
+static size_t uart_capture_head(
+        uint8_t *head,
+        enum uart_capture_kind kind,
+        uint64_t delta,
+        const uint64_t *fields,
+        size_t nfields);
+static void uart_capture_record(
+        struct uart_capture *cap,
+        enum uart_capture_kind kind,
+        const uint64_t *fields,
+        size_t nfields,
+        const void *bytes,
+        size_t nbytes);
+static DWORD WINAPI uart_capture_thread_proc(void *ctx);
+static void uart_capture_drain(struct uart_capture *cap);
+
+HRESULT uart_capture_open(
+        struct uart_capture **out,
+        const wchar_t *path,
+        unsigned int port_no,
+        size_t ring_size)
+{
+    struct uart_capture *cap;
+    HRESULT hr;
+
+    assert(out != NULL);
+    assert(path != NULL);
+    assert(ring_size > 0 && (ring_size & (ring_size - 1)) == 0);
+
+    *out = NULL;
+
+    cap = calloc(1, sizeof(*cap));
+
+    if (cap == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    cap->fd = INVALID_HANDLE_VALUE;
+    cap->bytes = malloc(ring_size);
+
+    if (cap->bytes == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto fail;
+    }
+
+    iobuf_spsc_init(&cap->ring, cap->bytes, ring_size);
+    QueryPerformanceFrequency(&cap->freq);
+
+    cap->fd = CreateFileW(
+            path,
+            GENERIC_WRITE,
+            FILE_SHARE_READ,
+            NULL,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+
+    if (cap->fd == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto fail;
+    }
+
+    hr = uart_capture_write_header(cap, port_no);
+
+    if (FAILED(hr)) {
+        goto fail;
+    }
+
+    cap->stop = CreateEventW(NULL, TRUE, FALSE, NULL);
+    cap->wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+
+    if (cap->stop == NULL || cap->wake == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto fail;
+    }
+
+    cap->thread = CreateThread(
+            NULL,
+            0,
+            uart_capture_thread_proc,
+            cap,
+            0,
+            NULL);
+
+    if (cap->thread == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto fail;
+    }
+
+    *out = cap;
+
+    return S_OK;
+
+fail:
+    uart_capture_close(cap);
+
+    return hr;
+}
+
+void uart_capture_close(struct uart_capture *cap)
+{
+    if (cap == NULL) {
+        return;
+    }
+
+    /* The thread empties the ring one last time on its way out */
+
+    if (cap->thread != NULL) {
+        SetEvent(cap->stop);
+        WaitForSingleObject(cap->thread, INFINITE);
+        CloseHandle(cap->thread);
+    }
+
+    if (cap->wake != NULL) {
+        CloseHandle(cap->wake);
+    }
+
+    if (cap->stop != NULL) {
+        CloseHandle(cap->stop);
+    }
+
+    if (cap->fd != INVALID_HANDLE_VALUE) {
+        CloseHandle(cap->fd);
+    }
+
+    free(cap->bytes);
+    free(cap);
+}
+
+void uart_capture_data(
+        struct uart_capture *cap,
+        enum uart_capture_kind kind,
+        const void *bytes,
+        size_t nbytes)
+{
+    uint64_t field;
+
+    assert(cap != NULL);
+    assert(kind == UART_CAPTURE_TX || kind == UART_CAPTURE_RX);
+    assert(bytes != NULL || nbytes == 0);
+
+    if (nbytes == 0) {
+        return;
+    }
+
+    field = nbytes;
+    uart_capture_record(cap, kind, &field, 1, bytes, nbytes);
+}
+
+void uart_capture_end(
+        struct uart_capture *cap,
+        enum uart_capture_kind kind,
+        size_t nbytes,
+        HRESULT hr)
+{
+    uint64_t fields[2];
+
+    assert(cap != NULL);
+    assert(kind == UART_CAPTURE_TX_END || kind == UART_CAPTURE_RX_END);
+
+    fields[0] = nbytes;
+    fields[1] = (uint32_t) hr;
+    uart_capture_record(cap, kind, fields, 2, NULL, 0);
+}
+
+static uint64_t uart_capture_now(const struct uart_capture *cap)
+{
+    LARGE_INTEGER count;
+    uint64_t freq;
+    uint64_t ticks;
+
+    QueryPerformanceCounter(&count);
+    freq = cap->freq.QuadPart;
+    ticks = count.QuadPart;
+
+    return  (ticks / freq) * 1000000000 +
+            (ticks % freq) * 1000000000 / freq;
+}
+
+static HRESULT uart_capture_write_header(
+        struct uart_capture *cap,
+        unsigned int port_no)
+{
+    uint8_t bytes[4 + 1 + 10 + 10];
+    struct iobuf dest;
+    DWORD nwritten;
+    HRESULT hr;
+    BOOL ok;
+
+    dest.bytes = bytes;
+    dest.nbytes = sizeof(bytes);
+    dest.pos = 0;
+
+    cap->last = uart_capture_now(cap);
+
+    hr = iobuf_write(&dest, UART_CAPTURE_MAGIC, 4);
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_write_8(&dest, UART_CAPTURE_VERSION);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_write_uleb128(&dest, port_no);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_write_uleb128(&dest, cap->last);
+    }
+
+    assert(SUCCEEDED(hr));
+
+    ok = WriteFile(cap->fd, bytes, (DWORD) dest.pos, &nwritten, NULL);
+
+    if (!ok) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    return S_OK;
+}
+
+static size_t uart_capture_head(
+        uint8_t *head,
+        enum uart_capture_kind kind,
+        uint64_t delta,
+        const uint64_t *fields,
+        size_t nfields)
+{
+    struct iobuf dest;
+    HRESULT hr;
+    size_t i;
+
+    assert(nfields <= 2);
+
+    dest.bytes = head;
+    dest.nbytes = UART_CAPTURE_HEAD_MAX;
+    dest.pos = 0;
+
+    hr = iobuf_write_8(&dest, (uint8_t) kind);
+
+    if (SUCCEEDED(hr)) {
+        hr = iobuf_write_uleb128(&dest, delta);
+    }
+
+    for (i = 0 ; i < nfields && SUCCEEDED(hr) ; i++) {
+        hr = iobuf_write_uleb128(&dest, fields[i]);
+    }
+
+    assert(SUCCEEDED(hr));
+
+    return dest.pos;
+}
+
+static void uart_capture_record(
+        struct uart_capture *cap,
+        enum uart_capture_kind kind,
+        const uint64_t *fields,
+        size_t nfields,
+        const void *bytes,
+        size_t nbytes)
+{
+    uint8_t lost_head[UART_CAPTURE_HEAD_MAX];
+    uint8_t head[UART_CAPTURE_HEAD_MAX];
+    size_t lost_len;
+    size_t half;
+    size_t space;
+    size_t len;
+    uint64_t lost;
+    uint64_t now;
+
+    /* Caller holds the uart's pending_lock, so we are the only producer.
+       Records go into the ring whole or not at all. A record of dropped
+       records has to go in first, if there is one outstanding. */
+
+    now = uart_capture_now(cap);
+    space = iobuf_spsc_space(&cap->ring);
+    lost_len = 0;
+
+    if (cap->lost != 0) {
+        lost = cap->lost;
+        lost_len = uart_capture_head(
+                lost_head,
+                UART_CAPTURE_LOST,
+                now - cap->last,
+                &lost,
+                1);
+        len = uart_capture_head(head, kind, 0, fields, nfields);
+    } else {
+        len = uart_capture_head(head, kind, now - cap->last, fields, nfields);
+    }
+
+    if (space < lost_len + len + nbytes) {
+        cap->lost += len + nbytes;
+
+        return;
+    }
+
+    iobuf_spsc_write(&cap->ring, lost_head, lost_len);
+    iobuf_spsc_write(&cap->ring, head, len);
+    iobuf_spsc_write(&cap->ring, bytes, nbytes);
+    cap->last = now;
+    cap->lost = 0;
+
+    /* Only wake the thread as the ring crosses the half-way mark, rather
+       than on every record from then on. */
+
+    half = cap->ring.nbytes / 2;
+
+    if (space >= half && space - (lost_len + len + nbytes) < half) {
+        SetEvent(cap->wake);
+    }
+}
+
+static DWORD WINAPI uart_capture_thread_proc(void *ctx)
+{
+    struct uart_capture *cap;
+    HANDLE handles[2];
+    DWORD result;
+
+    cap = ctx;
+    handles[0] = cap->stop;
+    handles[1] = cap->wake;
+
+    do {
+        result = WaitForMultipleObjects(
+                2,
+                handles,
+                FALSE,
+                UART_CAPTURE_FLUSH_MS);
+        uart_capture_drain(cap);
+    } while (result != WAIT_OBJECT_0);
+
+    return 0;
+}
+
+static void uart_capture_drain(struct uart_capture *cap)
+{
+    struct iobuf dest;
+    DWORD nwritten;
+    BOOL ok;
+
+    for (;;) {
+        dest.bytes = cap->chunk;
+        dest.nbytes = sizeof(cap->chunk);
+        dest.pos = 0;
+
+        iobuf_spsc_shift(&dest, &cap->ring);
+
+        if (dest.pos == 0) {
+            return;
+        }
+
+        /* If the disk gives up on us then keep emptying the ring, so that
+           the port carries on regardless. */
+
+        if (cap->failed) {
+            continue;
+        }
+
+        ok = WriteFile(cap->fd, cap->chunk, (DWORD) dest.pos, &nwritten, NULL);
+
+        if (!ok) {
+            cap->failed = true;
+        }
+    }
+}
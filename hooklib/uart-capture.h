@@ -0,0 +1,77 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Records the traffic on an emulated COM port, as the application saw it,
+   to a file that can be picked apart afterwards with capdump (see
+   capdump/main.c), which also builds for Linux.
+
+   Records are appended to a ring of ring_size bytes that is allocated up
+   front, and a background thread copies the ring out to disk, so capturing
+   does not disturb the port's timing. If the thread falls behind then
+   records that don't fit are dropped and counted, and the count is written
+   to the file as soon as there is room for it.
+
+   The file starts with a header:
+
+       magic      4 bytes, UART_CAPTURE_MAGIC
+       version    1 byte, UART_CAPTURE_VERSION
+       port_no    ULEB128
+       start      ULEB128, QueryPerformanceCounter() time of the capture's
+                  start in nanoseconds
+
+   and continues with records, each of which begins with a one byte kind
+   followed by a ULEB128 count of nanoseconds since the previous record (or
+   the start). The rest depends on the kind:
+
+       UART_CAPTURE_TX, UART_CAPTURE_RX
+           ULEB128 length, then that many bytes. Bytes that the application
+           wrote at the moment that they were handed to the device, or bytes
+           that it read at the moment that they were placed in its buffer.
+           A single IRP may be split across several of these.
+
+       UART_CAPTURE_TX_END, UART_CAPTURE_RX_END
+           ULEB128 total bytes transferred, ULEB128 HRESULT. Marks the
+           completion of a write or read IRP, so everything of the same
+           direction since the previous end record belongs to it.
+
+       UART_CAPTURE_LOST
+           ULEB128 number of bytes' worth of records that were dropped.
+
+   uart_capture_data() and uart_capture_end() are called by uart.c with the
+   uart's pending_lock held, which is what makes it safe for them to share a
+   single lock-free queue with the background thread. */
+
+#define UART_CAPTURE_MAGIC "UCAP"
+#define UART_CAPTURE_VERSION 1
+#define UART_CAPTURE_RING_SIZE 0x40000
+
+enum uart_capture_kind {
+    UART_CAPTURE_TX = 0,
+    UART_CAPTURE_RX = 1,
+    UART_CAPTURE_TX_END = 2,
+    UART_CAPTURE_RX_END = 3,
+    UART_CAPTURE_LOST = 4,
+};
+
+struct uart_capture;
+
+HRESULT uart_capture_open(
+        struct uart_capture **out,
+        const wchar_t *path,
+        unsigned int port_no,
+        size_t ring_size);
+void uart_capture_close(struct uart_capture *cap);
+void uart_capture_data(
+        struct uart_capture *cap,
+        enum uart_capture_kind kind,
+        const void *bytes,
+        size_t nbytes);
+void uart_capture_end(
+        struct uart_capture *cap,
+        enum uart_capture_kind kind,
+        size_t nbytes,
+        HRESULT hr);
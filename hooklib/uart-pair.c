@@ -0,0 +1,506 @@
+#include <windows.h>
+
+#if defined(__GNUC__) && defined(_WIN32)
+#include <ntdef.h>
+#else
+#include <winnt.h>
+#endif
+#include <devioctl.h>
+#include <ntddser.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "hook/iobuf-spsc.h"
+#include "hook/iohook.h"
+
+#include "hooklib/uart-pair.h"
+#include "hooklib/uart.h"
+
+#define UART_PAIR_PREFIX L"Local\\capnhook-uart-pair-"
+
+/* Everything in the shared section is zero to begin with, which is a valid
+   state, so there is no need to work out which end creates it. Counters are
+   32 bits wide whatever the bitness of the process; the local queues'
+   counters agree with them in their low 32 bits, which is all that matters
+   since the ring size divides 2^32. */
+
+struct uart_pair_ring {
+    LONG tail;
+    uint8_t pad0[IOBUF_SPSC_LINE - sizeof(LONG)];
+    LONG head;
+    uint8_t pad1[IOBUF_SPSC_LINE - sizeof(LONG)];
+};
+
+struct uart_pair_shared {
+    LONG present[2];
+    LONG lines[2];
+    uint8_t pad[IOBUF_SPSC_LINE - 4 * sizeof(LONG)];
+    struct uart_pair_ring rings[2];
+    uint8_t bytes[2][UART_PAIR_QUEUE_SIZE];
+};
+
+struct uart_pair {
+    struct iobuf_spsc rx_queue;
+    struct iobuf_spsc tx_queue;
+    struct uart *uart;
+    CRITICAL_SECTION lock;
+    HANDLE section;
+    struct uart_pair_shared *shared;
+    unsigned int end;
+    bool claimed;
+    bool attached;
+    HANDLE wake[2];
+    HANDLE stop;
+    HANDLE thread;
+    uint32_t rx_head;
+    uint32_t tx_tail;
+    LONG lines;
+    uint32_t modem_status;
+};
+
+static HRESULT uart_pair_name(
+        wchar_t *dest,
+        size_t nchars,
+        const wchar_t *name,
+        const wchar_t *suffix);
+static void uart_pair_attach(struct uart_pair *pair);
+static DWORD WINAPI uart_pair_thread_proc(void *ctx);
+static void uart_pair_pull(struct uart_pair *pair);
+static void uart_pair_publish(struct uart_pair *pair);
+static LONG uart_pair_load(LONG *p);
+
+HRESULT uart_pair_open(
+        struct uart_pair **out,
+        struct uart *uart,
+        const wchar_t *name)
+{
+    static const wchar_t *suffixes[2] = { L"-0", L"-1" };
+
+    struct uart_pair *pair;
+    wchar_t path[MAX_PATH];
+    HRESULT hr;
+    size_t i;
+
+    assert(out != NULL);
+    assert(uart != NULL);
+    assert(name != NULL);
+
+    *out = NULL;
+
+    pair = calloc(1, sizeof(*pair));
+
+    if (pair == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    pair->uart = uart;
+    InitializeCriticalSection(&pair->lock);
+
+    hr = uart_pair_name(path, _countof(path), name, L"");
+
+    if (FAILED(hr)) {
+        goto fail;
+    }
+
+    pair->section = CreateFileMappingW(
+            INVALID_HANDLE_VALUE,
+            NULL,
+            PAGE_READWRITE,
+            0,
+            sizeof(struct uart_pair_shared),
+            path);
+
+    if (pair->section == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto fail;
+    }
+
+    pair->shared = MapViewOfFile(
+            pair->section,
+            FILE_MAP_ALL_ACCESS,
+            0,
+            0,
+            sizeof(struct uart_pair_shared));
+
+    if (pair->shared == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto fail;
+    }
+
+    for (i = 0 ; i < _countof(pair->wake) ; i++) {
+        hr = uart_pair_name(path, _countof(path), name, suffixes[i]);
+
+        if (FAILED(hr)) {
+            goto fail;
+        }
+
+        pair->wake[i] = CreateEventW(NULL, FALSE, FALSE, path);
+
+        if (pair->wake[i] == NULL) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+
+            goto fail;
+        }
+    }
+
+    pair->stop = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    if (pair->stop == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto fail;
+    }
+
+    /* Take whichever end is free. An end stays taken until whoever has it
+       closes the pair, so if they crash without doing so then the end can't
+       be reused until every process has let go of the section. */
+
+    for (i = 0 ; i < 2 ; i++) {
+        if (InterlockedCompareExchange(&pair->shared->present[i], 1, 0)
+                == 0) {
+            break;
+        }
+    }
+
+    if (i == 2) {
+        hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+
+        goto fail;
+    }
+
+    pair->end = (unsigned int) i;
+    pair->claimed = true;
+
+    pair->thread = CreateThread(
+            NULL,
+            0,
+            uart_pair_thread_proc,
+            pair,
+            CREATE_SUSPENDED,
+            NULL);
+
+    if (pair->thread == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto fail;
+    }
+
+    /* Nothing can fail after the uart has been pointed at our queues */
+
+    uart_pair_attach(pair);
+
+    ResumeThread(pair->thread);
+    *out = pair;
+
+    return S_OK;
+
+fail:
+    uart_pair_close(pair);
+
+    return hr;
+}
+
+void uart_pair_close(struct uart_pair *pair)
+{
+    unsigned int peer;
+    size_t i;
+
+    if (pair == NULL) {
+        return;
+    }
+
+    if (pair->thread != NULL) {
+        SetEvent(pair->stop);
+        WaitForSingleObject(pair->thread, INFINITE);
+        CloseHandle(pair->thread);
+    }
+
+    /* The queues are about to be freed, so the uart must let go of them */
+
+    if (pair->attached) {
+        uart_detach_queues(pair->uart);
+    }
+
+    /* Hang up, and let the other end know */
+
+    if (pair->claimed) {
+        peer = !pair->end;
+
+        InterlockedExchange(&pair->shared->lines[pair->end], 0);
+        InterlockedExchange(&pair->shared->present[pair->end], 0);
+        SetEvent(pair->wake[peer]);
+    }
+
+    if (pair->stop != NULL) {
+        CloseHandle(pair->stop);
+    }
+
+    for (i = 0 ; i < _countof(pair->wake) ; i++) {
+        if (pair->wake[i] != NULL) {
+            CloseHandle(pair->wake[i]);
+        }
+    }
+
+    if (pair->shared != NULL) {
+        UnmapViewOfFile(pair->shared);
+    }
+
+    if (pair->section != NULL) {
+        CloseHandle(pair->section);
+    }
+
+    DeleteCriticalSection(&pair->lock);
+    free(pair);
+}
+
+HRESULT uart_pair_handle_irp(struct uart *uart, struct irp *irp, void *ctx)
+{
+    struct uart_pair *pair;
+    HRESULT hr;
+
+    assert(uart != NULL);
+    assert(irp != NULL);
+    assert(ctx != NULL);
+
+    pair = ctx;
+
+    assert(pair->uart == uart);
+
+    EnterCriticalSection(&pair->lock);
+    hr = uart_handle_irp(uart, irp);
+    uart_pair_publish(pair);
+    LeaveCriticalSection(&pair->lock);
+
+    return hr;
+}
+
+static HRESULT uart_pair_name(
+        wchar_t *dest,
+        size_t nchars,
+        const wchar_t *name,
+        const wchar_t *suffix)
+{
+    size_t prefix_len;
+    size_t name_len;
+    size_t suffix_len;
+
+    /* Backslashes would put the objects in some other namespace */
+
+    if (*name == L'\0' || wcschr(name, L'\\') != NULL) {
+        return E_INVALIDARG;
+    }
+
+    prefix_len = wcslen(UART_PAIR_PREFIX);
+    name_len = wcslen(name);
+    suffix_len = wcslen(suffix);
+
+    if (prefix_len + name_len + suffix_len >= nchars) {
+        return E_INVALIDARG;
+    }
+
+    memcpy(dest, UART_PAIR_PREFIX, prefix_len * sizeof(wchar_t));
+    memcpy(&dest[prefix_len], name, name_len * sizeof(wchar_t));
+    memcpy(&dest[prefix_len + name_len],
+            suffix,
+            (suffix_len + 1) * sizeof(wchar_t));
+
+    return S_OK;
+}
+
+static void uart_pair_attach(struct uart_pair *pair)
+{
+    struct uart_pair_shared *shared;
+    struct iobuf_spsc *q;
+    unsigned int peer;
+    uint32_t head;
+    uint32_t tail;
+
+    shared = pair->shared;
+    peer = !pair->end;
+
+    iobuf_spsc_init(
+            &pair->rx_queue,
+            shared->bytes[peer],
+            sizeof(shared->bytes[peer]));
+    iobuf_spsc_init(
+            &pair->tx_queue,
+            shared->bytes[pair->end],
+            sizeof(shared->bytes[pair->end]));
+
+    /* Neither queue is in use yet, so their counters can simply be lined up
+       with the rings. Anything that was written to us before we got here is
+       thrown away. What we wrote last time round stays where it is, since
+       the other end might still be reading it. */
+
+    tail = (uint32_t) uart_pair_load(&shared->rings[peer].tail);
+
+    q = &pair->rx_queue;
+    q->head = tail;
+    q->tail = tail;
+    q->tail_cache = tail;
+    q->head_cache = tail;
+    pair->rx_head = tail;
+    InterlockedExchange(&shared->rings[peer].head, (LONG) tail);
+
+    head = (uint32_t) uart_pair_load(&shared->rings[pair->end].head);
+    tail = (uint32_t) uart_pair_load(&shared->rings[pair->end].tail);
+
+    q = &pair->tx_queue;
+    q->head = head;
+    q->tail = tail;
+    q->tail_cache = tail;
+    q->head_cache = head;
+    pair->tx_tail = tail;
+
+    uart_attach_queues(pair->uart, &pair->rx_queue, &pair->tx_queue);
+    pair->attached = true;
+
+    /* Pick up the state of the other end, and tell it that we're here */
+
+    uart_pair_pull(pair);
+    SetEvent(pair->wake[peer]);
+}
+
+static DWORD WINAPI uart_pair_thread_proc(void *ctx)
+{
+    struct uart_pair *pair;
+    HANDLE handles[2];
+    DWORD result;
+
+    pair = ctx;
+
+    handles[0] = pair->stop;
+    handles[1] = pair->wake[pair->end];
+
+    for (;;) {
+        result = WaitForMultipleObjects(
+                _countof(handles),
+                handles,
+                FALSE,
+                INFINITE);
+
+        if (result != WAIT_OBJECT_0 + 1) {
+            break;
+        }
+
+        EnterCriticalSection(&pair->lock);
+        uart_pair_pull(pair);
+        uart_pair_publish(pair);
+        LeaveCriticalSection(&pair->lock);
+    }
+
+    return 0;
+}
+
+static void uart_pair_pull(struct uart_pair *pair)
+{
+    struct uart_pair_shared *shared;
+    unsigned int peer;
+    uint32_t status;
+    uint32_t delta;
+    LONG lines;
+
+    /* Caller holds pair->lock. We are the producer for rx_queue, on behalf
+       of the other end, and the consumer for tx_queue. */
+
+    shared = pair->shared;
+    peer = !pair->end;
+
+    delta = (uint32_t) uart_pair_load(&shared->rings[peer].tail) -
+            (uint32_t) pair->rx_queue.tail;
+
+    if (delta > 0 && iobuf_spsc_commit(&pair->rx_queue, delta) > 0) {
+        uart_notify_readable(pair->uart);
+    }
+
+    delta = (uint32_t) uart_pair_load(&shared->rings[pair->end].head) -
+            (uint32_t) pair->tx_queue.head;
+
+    if (delta > 0 && iobuf_spsc_skip(&pair->tx_queue, delta) > 0) {
+        uart_notify_writable(pair->uart);
+
+        if (iobuf_spsc_avail(&pair->tx_queue) == 0) {
+            uart_raise_events(pair->uart, SERIAL_EV_TXEMPTY);
+        }
+    }
+
+    status = 0;
+
+    if (uart_pair_load(&shared->present[peer])) {
+        lines = uart_pair_load(&shared->lines[peer]);
+
+        if (lines & SERIAL_RTS_STATE) {
+            status |= SERIAL_MSR_CTS;
+        }
+
+        if (lines & SERIAL_DTR_STATE) {
+            status |= SERIAL_MSR_DSR | SERIAL_MSR_DCD;
+        }
+    }
+
+    if (status != pair->modem_status) {
+        pair->modem_status = status;
+        uart_set_modem_status(pair->uart, status);
+    }
+}
+
+static void uart_pair_publish(struct uart_pair *pair)
+{
+    struct uart_pair_shared *shared;
+    unsigned int peer;
+    uint32_t head;
+    uint32_t tail;
+    LONG lines;
+    bool kick;
+
+    /* Caller holds pair->lock. Only signal the other end if something it
+       cares about has actually changed, which is rarely true of an ioctl. */
+
+    shared = pair->shared;
+    peer = !pair->end;
+    kick = false;
+
+    tail = (uint32_t) pair->tx_queue.tail;
+
+    if (tail != pair->tx_tail) {
+        pair->tx_tail = tail;
+        InterlockedExchange(&shared->rings[pair->end].tail, (LONG) tail);
+        kick = true;
+    }
+
+    head = (uint32_t) pair->rx_queue.head;
+
+    if (head != pair->rx_head) {
+        pair->rx_head = head;
+        InterlockedExchange(&shared->rings[peer].head, (LONG) head);
+        kick = true;
+    }
+
+    lines = pair->uart->lines & (SERIAL_RTS_STATE | SERIAL_DTR_STATE);
+
+    if (lines != pair->lines) {
+        pair->lines = lines;
+        InterlockedExchange(&shared->lines[pair->end], lines);
+        kick = true;
+    }
+
+    if (kick) {
+        SetEvent(pair->wake[peer]);
+    }
+}
+
+static LONG uart_pair_load(LONG *p)
+{
+    /* The other end's counters get published with InterlockedExchange(),
+       this is the matching full-barrier read. */
+
+    return InterlockedCompareExchange(p, 0, 0);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <windows.h>
+
+#include "hook/iohook.h"
+
+#include "hooklib/uart.h"
+
+/* Connects two emulated COM ports back to back, like a null-modem cable, so
+   that whatever the application on one end writes is read by the
+   application on the other. The two ends may be in different processes
+   (such as two instances of a game, or a game and a test tool) or in the
+   same one; each end opens the pair by the same name, and whichever opens
+   it first gets to be end 0.
+
+   The ends share a named section holding one ring of UART_PAIR_QUEUE_SIZE
+   bytes in each direction. Each end puts its uart into the queued mode
+   described in uart.h with local queues laid over the shared rings, so a
+   write is copied once, straight from the write IRP into the ring, and a
+   read once, straight out of it. Only the ring counters are passed across:
+   each end publishes its own after every IRP and signals a named event,
+   and a thread at the other end picks them up and wakes any read or write
+   that was waiting on them. The section's layout does not depend on the
+   bitness of the process, so a 32-bit and a 64-bit process can be paired.
+
+   The modem lines are crossed over as well: each end's RTS output appears
+   as CTS at the other end, and DTR as DSR and DCD, so hardware handshaking
+   works end to end. All of them read as off while there is nobody on the
+   other end. Bytes written in the meantime are discarded when the other
+   end does open the pair, as they would be on a cable with nothing on the
+   other end of it; until then they wait in the ring, and writes stall once
+   it is full.
+
+   uart_pair_open() must be called before the port is opened, and the
+   application's IRPs routed to uart_pair_handle_irp() with the pair as ctx,
+   for instance through uart_registry_add(). The uart must be removed from
+   the registry before the pair is closed. */
+
+#define UART_PAIR_QUEUE_SIZE 0x10000
+
+struct uart_pair;
+
+HRESULT uart_pair_open(
+        struct uart_pair **out,
+        struct uart *uart,
+        const wchar_t *name);
+void uart_pair_close(struct uart_pair *pair);
+HRESULT uart_pair_handle_irp(struct uart *uart, struct irp *irp, void *ctx);
@@ -0,0 +1,304 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hook/iohook.h"
+
+#include "hooklib/uart-registry.h"
+#include "hooklib/uart.h"
+
+/* Must be a power of two. Handles are multiples of four and tend to be
+   allocated densely, so the low bits above that make a good enough index. */
+
+#define UART_REGISTRY_NSLOTS 1024
+#define UART_REGISTRY_NPORTS (UART_REGISTRY_MAX_PORT + 1)
+
+struct uart_registry_port {
+    struct uart *uart;
+    uart_fn_t fn;
+    void *ctx;
+    HANDLE fd;
+};
+
+/* Maps an open handle to the port that it belongs to. Each port has at most
+   one handle open at a time, so the rare handles whose slot is already taken
+   go into a small overflow list that is only searched when non-empty. */
+
+struct uart_registry_slot {
+    HANDLE fd;
+    unsigned int port_no;
+};
+
+static HRESULT uart_registry_handle_irp(struct irp *irp);
+static HRESULT uart_registry_handle_open(struct irp *irp);
+static HRESULT uart_registry_call(
+        const struct uart_registry_port *port,
+        struct irp *irp);
+static size_t uart_registry_hash(HANDLE fd);
+static unsigned int uart_registry_lookup(HANDLE fd);
+static void uart_registry_map(HANDLE fd, unsigned int port_no);
+static void uart_registry_unmap(HANDLE fd);
+
+static bool uart_registry_initted;
+static CRITICAL_SECTION uart_registry_lock;
+static struct uart_registry_port uart_registry_ports[UART_REGISTRY_NPORTS];
+static struct uart_registry_slot uart_registry_slots[UART_REGISTRY_NSLOTS];
+static struct uart_registry_slot uart_registry_spill[UART_REGISTRY_MAX_PORT];
+static size_t uart_registry_nspill;
+
+HRESULT uart_registry_init(void)
+{
+    HRESULT hr;
+
+    if (uart_registry_initted) {
+        return S_FALSE;
+    }
+
+    InitializeCriticalSection(&uart_registry_lock);
+
+    hr = iohook_push_batch_handler(uart_registry_handle_irp);
+
+    if (FAILED(hr)) {
+        DeleteCriticalSection(&uart_registry_lock);
+
+        return hr;
+    }
+
+    uart_registry_initted = true;
+
+    return S_OK;
+}
+
+HRESULT uart_registry_add(struct uart *uart, uart_fn_t fn, void *ctx)
+{
+    struct uart_registry_port *port;
+    HRESULT hr;
+
+    assert(uart != NULL);
+    assert(uart_registry_initted);
+
+    if (uart->port_no > UART_REGISTRY_MAX_PORT) {
+        return E_INVALIDARG;
+    }
+
+    EnterCriticalSection(&uart_registry_lock);
+
+    port = &uart_registry_ports[uart->port_no];
+
+    if (port->uart == NULL) {
+        port->uart = uart;
+        port->fn = fn;
+        port->ctx = ctx;
+        port->fd = NULL;
+
+        /* Not normally the case, but cheap to support */
+
+        if (uart->fd != NULL) {
+            uart_registry_map(uart->fd, uart->port_no);
+        }
+
+        hr = S_OK;
+    } else {
+        hr = HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+    }
+
+    LeaveCriticalSection(&uart_registry_lock);
+
+    return hr;
+}
+
+void uart_registry_remove(struct uart *uart)
+{
+    struct uart_registry_port *port;
+
+    assert(uart != NULL);
+    assert(uart_registry_initted);
+
+    if (uart->port_no > UART_REGISTRY_MAX_PORT) {
+        return;
+    }
+
+    EnterCriticalSection(&uart_registry_lock);
+
+    port = &uart_registry_ports[uart->port_no];
+
+    if (port->uart == uart) {
+        if (port->fd != NULL) {
+            uart_registry_unmap(port->fd);
+        }
+
+        memset(port, 0, sizeof(*port));
+    }
+
+    LeaveCriticalSection(&uart_registry_lock);
+}
+
+static HRESULT uart_registry_handle_irp(struct irp *irp)
+{
+    struct uart_registry_port port;
+    unsigned int port_no;
+
+    assert(irp != NULL);
+
+    if (irp->op == IRP_OP_OPEN) {
+        return uart_registry_handle_open(irp);
+    }
+
+    EnterCriticalSection(&uart_registry_lock);
+
+    port_no = uart_registry_lookup(irp->fd);
+
+    if (port_no != 0) {
+        port = uart_registry_ports[port_no];
+
+        /* Forget the handle before the close is passed on, since the handle
+           value may be reused by another thread as soon as it is closed. */
+
+        if (irp->op == IRP_OP_CLOSE) {
+            uart_registry_unmap(irp->fd);
+        }
+    }
+
+    LeaveCriticalSection(&uart_registry_lock);
+
+    if (port_no == 0) {
+        return iohook_invoke_next(irp);
+    }
+
+    return uart_registry_call(&port, irp);
+}
+
+static HRESULT uart_registry_handle_open(struct irp *irp)
+{
+    struct uart_registry_port port;
+    unsigned int port_no;
+    HRESULT hr;
+
+    if (    !uart_parse_path(irp->open_filename, &port_no) ||
+            port_no > UART_REGISTRY_MAX_PORT) {
+        return iohook_invoke_next(irp);
+    }
+
+    EnterCriticalSection(&uart_registry_lock);
+    port = uart_registry_ports[port_no];
+    LeaveCriticalSection(&uart_registry_lock);
+
+    if (port.uart == NULL) {
+        return iohook_invoke_next(irp);
+    }
+
+    hr = uart_registry_call(&port, irp);
+
+    if (SUCCEEDED(hr) && irp->fd != NULL) {
+        EnterCriticalSection(&uart_registry_lock);
+
+        /* Unless the port was removed in the meantime */
+
+        if (    uart_registry_ports[port_no].uart == port.uart &&
+                uart_registry_ports[port_no].fd == NULL) {
+            uart_registry_map(irp->fd, port_no);
+        }
+
+        LeaveCriticalSection(&uart_registry_lock);
+    }
+
+    return hr;
+}
+
+static HRESULT uart_registry_call(
+        const struct uart_registry_port *port,
+        struct irp *irp)
+{
+    if (port->fn != NULL) {
+        return port->fn(port->uart, irp, port->ctx);
+    } else {
+        return uart_handle_irp(port->uart, irp);
+    }
+}
+
+static size_t uart_registry_hash(HANDLE fd)
+{
+    return ((uintptr_t) fd >> 2) & (UART_REGISTRY_NSLOTS - 1);
+}
+
+static unsigned int uart_registry_lookup(HANDLE fd)
+{
+    const struct uart_registry_slot *slot;
+    size_t i;
+
+    if (fd == NULL) {
+        return 0;
+    }
+
+    slot = &uart_registry_slots[uart_registry_hash(fd)];
+
+    if (slot->fd == fd) {
+        return slot->port_no;
+    }
+
+    for (i = 0 ; i < uart_registry_nspill ; i++) {
+        if (uart_registry_spill[i].fd == fd) {
+            return uart_registry_spill[i].port_no;
+        }
+    }
+
+    return 0;
+}
+
+static void uart_registry_map(HANDLE fd, unsigned int port_no)
+{
+    struct uart_registry_slot *slot;
+
+    assert(fd != NULL);
+    assert(port_no != 0);
+
+    slot = &uart_registry_slots[uart_registry_hash(fd)];
+
+    if (slot->fd == NULL) {
+        slot->fd = fd;
+        slot->port_no = port_no;
+    } else {
+        assert(uart_registry_nspill < _countof(uart_registry_spill));
+
+        uart_registry_spill[uart_registry_nspill].fd = fd;
+        uart_registry_spill[uart_registry_nspill].port_no = port_no;
+        uart_registry_nspill++;
+    }
+
+    uart_registry_ports[port_no].fd = fd;
+}
+
+static void uart_registry_unmap(HANDLE fd)
+{
+    struct uart_registry_slot *slot;
+    unsigned int port_no;
+    size_t i;
+
+    slot = &uart_registry_slots[uart_registry_hash(fd)];
+
+    if (slot->fd == fd) {
+        port_no = slot->port_no;
+        slot->fd = NULL;
+        slot->port_no = 0;
+    } else {
+        port_no = 0;
+
+        for (i = 0 ; i < uart_registry_nspill ; i++) {
+            if (uart_registry_spill[i].fd == fd) {
+                port_no = uart_registry_spill[i].port_no;
+                uart_registry_spill[i] =
+                        uart_registry_spill[--uart_registry_nspill];
+
+                break;
+            }
+        }
+    }
+
+    if (port_no != 0) {
+        uart_registry_ports[port_no].fd = NULL;
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <windows.h>
+
+#include "hook/iohook.h"
+
+#include "hooklib/uart.h"
+
+/* Routes IRPs for any number of emulated COM ports through a single iohook
+   handler, instead of pushing one handler per port that each run
+   uart_match_irp() on every IRP in the process. Ports are looked up by number
+   in a directly indexed table when they are opened, and by handle in a
+   second table (indexed by the bits of the handle value) for everything
+   else, so an unrelated IRP costs one table probe however many ports are
+   registered.
+
+   Each registered uart receives its IRPs through fn, which typically takes
+   the owner's lock, calls uart_handle_irp() and then deals with whatever
+   was written. fn may be NULL, in which case uart_handle_irp() is called
+   directly. The registry's handler is pushed with iohook_push_batch_handler()
+   so fn will also see IRP_OP_IOCTL_BATCH IRPs, which uart_handle_irp()
+   understands.
+
+   A uart must not be removed (or finalized) while IRPs for it might still be
+   in flight. */
+
+#define UART_REGISTRY_MAX_PORT 256
+
+typedef HRESULT (*uart_fn_t)(struct uart *uart, struct irp *irp, void *ctx);
+
+HRESULT uart_registry_init(void);
+HRESULT uart_registry_add(struct uart *uart, uart_fn_t fn, void *ctx);
+void uart_registry_remove(struct uart *uart);
@@ -1,6 +1,6 @@
 #include <windows.h>
 
-#ifdef __GNUC__
+#if defined(__GNUC__) && defined(_WIN32)
 #include <ntdef.h>
 #else
 #include <winnt.h>
@@ -10,11 +10,16 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
+#include "hook/iobuf-arena.h"
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf-spsc.h"
 #include "hook/iobuf.h"
 #include "hook/iohook.h"
 
+#include "hooklib/timer-wheel.h"
 #include "hooklib/uart.h"
 
 static HRESULT uart_handle_open(struct uart *uart, struct irp *irp);
@@ -22,6 +27,73 @@ static HRESULT uart_handle_close(struct uart *uart, struct irp *irp);
 static HRESULT uart_handle_read(struct uart *uart, struct irp *irp);
 static HRESULT uart_handle_write(struct uart *uart, struct irp *irp);
 static HRESULT uart_handle_ioctl(struct uart *uart, struct irp *irp);
+static HRESULT uart_handle_ioctl_batch(struct uart *uart, struct irp *irp);
+
+/* How a read should behave, as derived from the SERIAL_TIMEOUTS in force at
+   the time that it was issued. Zero values mean no such timeout. */
+
+struct uart_read_policy {
+    bool immediate;
+    bool any;
+    uint64_t total_ms;
+    uint32_t interval_ms;
+};
+
+#define UART_NS_PER_MS 1000000
+
+static HRESULT uart_ioctl(
+        struct uart *uart,
+        uint32_t ioctl,
+        struct const_iobuf *in,
+        struct iobuf *out);
+static size_t uart_rx_avail(struct uart *uart);
+static size_t uart_rx_shift(struct uart *uart, struct iobuf *dest);
+static size_t uart_readable_avail(struct uart *uart);
+static size_t uart_readable_shift(struct uart *uart, struct iobuf *dest);
+static size_t uart_writable_pending(struct uart *uart);
+static size_t uart_rx_size(struct uart *uart);
+static void uart_rx_flow(struct uart *uart);
+static HRESULT uart_set_handflow(struct uart *uart, struct const_iobuf *in);
+static HRESULT uart_set_lines(struct uart *uart, uint32_t ioctl);
+static HRESULT uart_set_queue_size(struct uart *uart, struct const_iobuf *in);
+static HRESULT uart_purge(struct uart *uart, struct const_iobuf *in);
+static HRESULT uart_set_wait_mask(struct uart *uart, struct const_iobuf *in);
+static HRESULT uart_handle_wait(struct uart *uart, struct irp *irp);
+static void uart_wait_raise(struct uart *uart, uint32_t events);
+static void uart_wait_finish(struct uart *uart, HRESULT hr);
+static void uart_wait_cancel(struct irp *irp, void *ctx);
+static uint32_t uart_tx_hold(struct uart *uart);
+static uint64_t uart_write_send(struct uart *uart, struct irp *irp);
+static void uart_write_pump(struct uart *uart, uint64_t now);
+static void uart_write_cancel(struct irp *irp, void *ctx);
+static void uart_write_finish(
+        struct uart *uart,
+        struct irp *irp,
+        HRESULT hr);
+static void uart_read_policy_get(
+        struct uart_read_policy *policy,
+        const SERIAL_TIMEOUTS *timeouts,
+        size_t nbytes);
+static uint64_t uart_read_now(const struct uart *uart);
+static void uart_read_feed(struct uart *uart);
+static void uart_read_check(struct uart *uart, uint64_t now);
+static void uart_read_arm(struct uart *uart, uint64_t now);
+static void uart_read_finish(struct uart *uart, HRESULT hr);
+static void uart_read_cancel(struct irp *irp, void *ctx);
+static void uart_read_timer_proc(
+        struct timer_wheel_entry *entry,
+        uint64_t now,
+        void *ctx);
+static uint64_t uart_pace_now(const struct uart *uart);
+static uint64_t uart_pace_byte_ns(const struct uart *uart);
+static void uart_pace_update(struct uart *uart, uint64_t now);
+static bool uart_pace_rx(struct uart *uart, uint64_t now);
+static void uart_pace_tx(struct uart *uart, uint64_t now);
+static void uart_pace_arm(struct uart *uart);
+static void uart_pace_timer_proc(
+        struct timer_wheel_entry *entry,
+        uint64_t now,
+        void *ctx);
 
 void uart_init(struct uart *uart, unsigned int port_no)
 {
@@ -49,19 +121,88 @@ void uart_init(struct uart *uart, unsigned int port_no)
     uart->line.WordLength = 8;
 
     memset(&uart->timeouts, 0, sizeof(uart->timeouts));
+    memset(&uart->queue, 0, sizeof(uart->queue));
 
     uart->mask = 0;
-
-    memset(&uart->written, 0, sizeof(uart->written));
-    memset(&uart->readable, 0, sizeof(uart->readable));
+    uart->events = 0;
+    uart->modem_status = 0;
+    uart->lines = 0;
+
+    iobuf_arena_init(&uart->written, UART_WRITTEN_LIMIT);
+    iobuf_ring_init(&uart->readable, NULL, 0);
+    uart->rx = NULL;
+    uart->tx = NULL;
+    uart->capture = NULL;
+
+    InitializeCriticalSection(&uart->pending_lock);
+    timer_wheel_entry_init(&uart->read_timer, uart_read_timer_proc, uart);
+    uart->read_irp = NULL;
+    uart->read_due = 0;
+    uart->read_deadline = 0;
+    uart->read_last = 0;
+    uart->read_interval = 0;
+    uart->read_any = false;
+    uart->wait_irp = NULL;
+    uart->nwrites = 0;
+    uart->nwrites_sent = 0;
+    uart->rx_flow_off = false;
+    uart->tx_xoff = false;
+
+    uart->pace = false;
+    timer_wheel_entry_init(&uart->pace_timer, uart_pace_timer_proc, uart);
+    uart->pace_due = 0;
+    uart->pace_rx_released = 0;
+    uart->pace_rx_next = 0;
+    uart->pace_rx_busy = false;
+    uart->pace_tx_clock = 0;
+    uart->pace_tx_empty = false;
 }
 
 void uart_fini(struct uart *uart)
 {
     struct irp irp;
+    bool paced;
 
     assert(uart != NULL);
 
+    EnterCriticalSection(&uart->pending_lock);
+
+    /* Clearing pace stops the pacing timer from re-arming itself */
+
+    paced = uart->pace;
+    uart->pace = false;
+
+    while (uart->nwrites > 0) {
+        uart->nwrites--;
+        uart_write_finish(
+                uart,
+                uart->write_irps[uart->nwrites],
+                HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+    }
+
+    uart->nwrites_sent = 0;
+
+    if (uart->read_irp != NULL) {
+        uart_read_finish(uart, HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+    }
+
+    if (uart->wait_irp != NULL) {
+        uart_wait_finish(uart, HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+
+    if (paced) {
+        timer_wheel_disarm_sync(&uart->pace_timer);
+    }
+
+    /* The read has been finished, so a read timeout callback that is already
+       under way will find nothing to do. Wait for it before the lock goes. */
+
+    timer_wheel_disarm_sync(&uart->read_timer);
+
+    DeleteCriticalSection(&uart->pending_lock);
+
     if (uart->fd != NULL) {
         memset(&irp, 0, sizeof(irp));
         irp.op = IRP_OP_CLOSE;
@@ -70,73 +211,150 @@ void uart_fini(struct uart *uart)
         /* Not much we can do if this fails */
         iohook_invoke_next(&irp);
     }
+
+    iobuf_arena_fini(&uart->written);
+}
+
+void uart_attach_queues(
+        struct uart *uart,
+        struct iobuf_spsc *rx,
+        struct iobuf_spsc *tx)
+{
+    assert(uart != NULL);
+    assert(rx != NULL);
+    assert(tx != NULL);
+    assert(uart->fd == NULL);
+
+    uart->rx = rx;
+    uart->tx = tx;
+}
+
+void uart_detach_queues(struct uart *uart)
+{
+    bool paced;
+
+    assert(uart != NULL);
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    /* As in uart_fini(), clearing pace stops the pacing timer from re-arming
+       itself, and once it has been waited for nothing can be left looking
+       at the queues. A read timeout that fires later finds them gone. */
+
+    paced = uart->pace;
+    uart->pace = false;
+    uart->rx = NULL;
+    uart->tx = NULL;
+
+    LeaveCriticalSection(&uart->pending_lock);
+
+    if (paced) {
+        timer_wheel_disarm_sync(&uart->pace_timer);
+    }
+}
+
+void uart_attach_capture(struct uart *uart, struct uart_capture *capture)
+{
+    assert(uart != NULL);
+    assert(capture != NULL);
+    assert(uart->fd == NULL);
+
+    uart->capture = capture;
+}
+
+HRESULT uart_enable_pacing(struct uart *uart)
+{
+    HRESULT hr;
+
+    assert(uart != NULL);
+    assert(uart->fd == NULL);
+
+    hr = timer_wheel_init();
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    uart->pace = true;
+
+    return S_OK;
 }
 
 bool uart_match_irp(const struct uart *uart, const struct irp *irp)
 {
-    const wchar_t *path;
     unsigned int port_no;
-    wchar_t wc;
-    size_t i;
 
     if (irp->op == IRP_OP_OPEN) {
-        /* Win32 device nodes can unfortunately be identified using a variety
-           of different syntax */
-
-        path = irp->open_filename;
+        return  uart_parse_path(irp->open_filename, &port_no) &&
+                port_no == uart->port_no;
+    } else {
+        /* All other IRPs are matched by checking the file descriptor. */
 
-        if (    wcsncmp(path, L"\\\\.\\", 4) == 0 ||
-                wcsncmp(path, L"\\\\?\\", 4) == 0 ||
-                wcsncmp(path, L"\\??\\",  4) == 0 ) {
-            /* NT style */
+        return irp->fd == uart->fd;
+    }
+}
 
-            path = path + 4;
+bool uart_parse_path(const wchar_t *path, unsigned int *port_no)
+{
+    unsigned int result;
+    wchar_t wc;
+    size_t i;
 
-            if (    (path[0] & ~0x20) != L'C' ||
-                    (path[1] & ~0x20) != L'O' ||
-                    (path[2] & ~0x20) != L'M' ) {
-                return false;
-            }
+    assert(path != NULL);
+    assert(port_no != NULL);
 
-            port_no = 0;
+    /* Win32 device nodes can unfortunately be identified using a variety of
+       different syntax */
 
-            for (i = 3 ; path[i] ; i++) {
-                wc = path[i];
+    if (    wcsncmp(path, L"\\\\.\\", 4) == 0 ||
+            wcsncmp(path, L"\\\\?\\", 4) == 0 ||
+            wcsncmp(path, L"\\??\\",  4) == 0 ) {
+        /* NT style */
 
-                if (wc < L'0' || wc > L'9') {
-                    return false;
-                }
+        path = path + 4;
 
-                port_no *= 10;
-                port_no += wc - L'0';
-            }
-        } else {
-            /* DOS style. Only COM1 through COM9 are supported. */
+        if (    (path[0] & ~0x20) != L'C' ||
+                (path[1] & ~0x20) != L'O' ||
+                (path[2] & ~0x20) != L'M' ) {
+            return false;
+        }
 
-            if (    (path[0] & ~0x20) != L'C' ||
-                    (path[1] & ~0x20) != L'O' ||
-                    (path[2] & ~0x20) != L'M' ||
-                    (path[3] < L'1' || path[3] > L'9') ) {
-                return false;
-            }
+        result = 0;
 
-            /* DOS-style COM port names are allowed to have an optional trailing
-               colon, as if this wasn't complicated enough. */
+        for (i = 3 ; path[i] ; i++) {
+            wc = path[i];
 
-            if (    (path[4] != L'\0') &&
-                    (path[4] != L':' || path[5] != L'\0') ) {
+            if (wc < L'0' || wc > L'9') {
                 return false;
             }
 
-            port_no = path[3] - L'0';
+            result *= 10;
+            result += wc - L'0';
         }
-
-        return port_no == uart->port_no;
     } else {
-        /* All other IRPs are matched by checking the file descriptor. */
+        /* DOS style. Only COM1 through COM9 are supported. */
 
-        return irp->fd == uart->fd;
+        if (    (path[0] & ~0x20) != L'C' ||
+                (path[1] & ~0x20) != L'O' ||
+                (path[2] & ~0x20) != L'M' ||
+                (path[3] < L'1' || path[3] > L'9') ) {
+            return false;
+        }
+
+        /* DOS-style COM port names are allowed to have an optional trailing
+           colon, as if this wasn't complicated enough. */
+
+        if (    (path[4] != L'\0') &&
+                (path[4] != L':' || path[5] != L'\0') ) {
+            return false;
+        }
+
+        result = path[3] - L'0';
     }
+
+    *port_no = result;
+
+    return true;
 }
 
 HRESULT uart_handle_irp(struct uart *uart, struct irp *irp)
@@ -145,13 +363,14 @@ HRESULT uart_handle_irp(struct uart *uart, struct irp *irp)
     assert(irp != NULL);
 
     switch (irp->op) {
-    case IRP_OP_OPEN:   return uart_handle_open(uart, irp);
-    case IRP_OP_CLOSE:  return uart_handle_close(uart, irp);
-    case IRP_OP_READ:   return uart_handle_read(uart, irp);
-    case IRP_OP_WRITE:  return uart_handle_write(uart, irp);
-    case IRP_OP_IOCTL:  return uart_handle_ioctl(uart, irp);
-    case IRP_OP_FSYNC:  return S_OK;
-    default:            return HRESULT_FROM_WIN32(ERROR_INVALID_FUNCTION);
+    case IRP_OP_OPEN:        return uart_handle_open(uart, irp);
+    case IRP_OP_CLOSE:       return uart_handle_close(uart, irp);
+    case IRP_OP_READ:        return uart_handle_read(uart, irp);
+    case IRP_OP_WRITE:       return uart_handle_write(uart, irp);
+    case IRP_OP_IOCTL:       return uart_handle_ioctl(uart, irp);
+    case IRP_OP_FSYNC:       return S_OK;
+    case IRP_OP_IOCTL_BATCH: return uart_handle_ioctl_batch(uart, irp);
+    default:                 return HRESULT_FROM_WIN32(ERROR_INVALID_FUNCTION);
     }
 }
 
@@ -195,85 +414,1465 @@ static HRESULT uart_handle_close(struct uart *uart, struct irp *irp)
     return iohook_invoke_next(irp);
 }
 
+void uart_notify_readable(struct uart *uart)
+{
+    assert(uart != NULL);
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    /* When pacing, the new bytes are merely scheduled for release here.
+       EV_RXCHAR and any pending read follow as and when they arrive. */
+
+    if (uart->pace) {
+        uart_pace_update(uart, timer_wheel_now());
+    } else {
+        /* Raise EV_RXCHAR before a pending read gets the chance to drain
+           readable, since the application may well be waiting on both. */
+
+        if (uart_readable_avail(uart) > 0) {
+            uart_wait_raise(uart, SERIAL_EV_RXCHAR);
+        }
+
+        uart_read_feed(uart);
+    }
+
+    uart_rx_flow(uart);
+
+    LeaveCriticalSection(&uart->pending_lock);
+}
+
+void uart_notify_writable(struct uart *uart)
+{
+    uint64_t now;
+
+    assert(uart != NULL);
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    now = uart_pace_now(uart);
+    uart_write_pump(uart, now);
+
+    if (uart->pace) {
+        uart_pace_arm(uart);
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+}
+
+size_t uart_rx_space(struct uart *uart)
+{
+    size_t avail;
+    size_t size;
+    size_t space;
+
+    assert(uart != NULL);
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    /* Bytes that are still being paced in count as occupying the buffer */
+
+    avail = uart_rx_avail(uart);
+    size = uart_rx_size(uart);
+    space = avail < size && !uart->rx_flow_off ? size - avail : 0;
+
+    LeaveCriticalSection(&uart->pending_lock);
+
+    return space;
+}
+
 static HRESULT uart_handle_read(struct uart *uart, struct irp *irp)
 {
-    /* This does a memmove() under the covers. Less efficient than a ring
-       buffer, but I don't expect this to matter in the common case where the
-       entire buffer gets drained, particularly since UARTs are decidedly
-       low-speed devices anyway. */
+    struct uart_read_policy policy;
+    struct irp *pending;
+    uint64_t now;
+    HRESULT hr;
 
-    iobuf_shift(&irp->read, &uart->readable);
+    uart_read_policy_get(
+            &policy,
+            &uart->timeouts,
+            irp->read.nbytes - irp->read.pos);
 
-    return S_OK;
+    /* Hold pending_lock throughout. uart_notify_readable() may be called
+       from a device thread that consumes from rx concurrently with us, and a
+       cancellation that arrives straight after iohook_pend_irp() must find
+       the IRP in read_irp. */
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    if (uart->pace) {
+        uart_pace_update(uart, timer_wheel_now());
+    }
+
+    uart_readable_shift(uart, &irp->read);
+
+    if (    policy.immediate ||
+            irp->read.pos == irp->read.nbytes ||
+            (policy.any && irp->read.pos > 0)) {
+        hr = S_OK;
+
+        goto end;
+    }
+
+    if (uart->read_irp != NULL) {
+        hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+
+        goto end;
+    }
+
+    now = 0;
+
+    if (policy.total_ms != 0 || policy.interval_ms != 0) {
+        hr = timer_wheel_init();
+
+        if (FAILED(hr)) {
+            goto end;
+        }
+
+        now = timer_wheel_now();
+    }
+
+    hr = iohook_pend_irp(irp, uart_read_cancel, uart, &pending);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    uart->read_irp = pending;
+    uart->read_deadline = policy.total_ms != 0 ?
+            now + policy.total_ms * UART_NS_PER_MS : 0;
+    uart->read_last = now;
+    uart->read_interval = (uint64_t) policy.interval_ms * UART_NS_PER_MS;
+    uart->read_any = policy.any;
+
+    uart_read_arm(uart, now);
+
+    hr = HRESULT_FROM_WIN32(ERROR_IO_PENDING);
+
+end:
+    if (uart->capture != NULL && hr != HRESULT_FROM_WIN32(ERROR_IO_PENDING)) {
+        uart_capture_end(
+                uart->capture,
+                UART_CAPTURE_RX_END,
+                irp->read.pos,
+                hr);
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+
+    return hr;
 }
 
 static HRESULT uart_handle_write(struct uart *uart, struct irp *irp)
 {
-    iobuf_move(&uart->written, &irp->write);
+    struct irp *pending;
+    uint64_t due;
+    HRESULT hr;
 
-    return S_OK;
+    EnterCriticalSection(&uart->pending_lock);
+
+    /* Check for room before anything is sent, so that a failed write really
+       hasn't written anything. */
+
+    if (uart->nwrites == UART_MAX_WRITES) {
+        hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+
+        goto end;
+    }
+
+    /* Writes go out in the order that they were issued, so this one can only
+       be sent straight away if nothing is waiting ahead of it. Unless it is
+       being paced, it is then done. */
+
+    due = 0;
+
+    if (uart->nwrites == 0 && uart_tx_hold(uart) == 0) {
+        due = uart_write_send(uart, irp);
+
+        if (irp->write.pos == irp->write.nbytes && due == 0) {
+            hr = S_OK;
+
+            goto end;
+        }
+    }
+
+    hr = iohook_pend_irp(irp, uart_write_cancel, uart, &pending);
+
+    if (FAILED(hr)) {
+        /* Whatever has already been sent counts as written */
+
+        if (irp->write.pos > 0) {
+            hr = S_OK;
+        }
+
+        goto end;
+    }
+
+    uart->write_irps[uart->nwrites] = pending;
+    uart->write_due[uart->nwrites] = due;
+    uart->nwrites++;
+
+    if (pending->write.pos == pending->write.nbytes) {
+        uart->nwrites_sent++;
+    }
+
+    if (uart->pace) {
+        uart_pace_arm(uart);
+    }
+
+    hr = HRESULT_FROM_WIN32(ERROR_IO_PENDING);
+
+end:
+    if (uart->capture != NULL && hr != HRESULT_FROM_WIN32(ERROR_IO_PENDING)) {
+        uart_capture_end(
+                uart->capture,
+                UART_CAPTURE_TX_END,
+                irp->write.pos,
+                hr);
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+
+    return hr;
 }
 
 static HRESULT uart_handle_ioctl(struct uart *uart, struct irp *irp)
 {
-    switch (irp->ioctl) {
+    /* This is the only ioctl that can go pending, and it needs the IRP in
+       order to do so. It is never issued as part of a batch. */
+
+    if (irp->ioctl == IOCTL_SERIAL_WAIT_ON_MASK) {
+        return uart_handle_wait(uart, irp);
+    }
+
+    return uart_ioctl(uart, irp->ioctl, &irp->write, &irp->read);
+}
+
+static HRESULT uart_handle_ioctl_batch(struct uart *uart, struct irp *irp)
+{
+    struct irp_ioctl *sub;
+    HRESULT hr;
+    size_t i;
+
+    for (i = 0 ; i < irp->nioctls ; i++) {
+        sub = &irp->ioctls[i];
+        hr = uart_ioctl(uart, sub->ioctl, &sub->write, &sub->read);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+    }
+
+    return S_OK;
+}
+
+static size_t uart_rx_avail(struct uart *uart)
+{
+    /* Caller holds pending_lock */
+
+    if (uart->rx != NULL) {
+        return iobuf_spsc_avail(uart->rx);
+    } else {
+        return iobuf_ring_avail(&uart->readable);
+    }
+}
+
+static size_t uart_rx_shift(struct uart *uart, struct iobuf *dest)
+{
+    size_t nbytes;
+
+    /* Caller holds pending_lock. Everything that the application reads
+       passes through here. */
+
+    if (uart->rx != NULL) {
+        nbytes = iobuf_spsc_shift(dest, uart->rx);
+    } else {
+        nbytes = iobuf_ring_shift(dest, &uart->readable);
+    }
+
+    if (uart->capture != NULL) {
+        uart_capture_data(
+                uart->capture,
+                UART_CAPTURE_RX,
+                &dest->bytes[dest->pos - nbytes],
+                nbytes);
+    }
+
+    return nbytes;
+}
+
+static size_t uart_readable_avail(struct uart *uart)
+{
+    /* Caller holds pending_lock. Only the bytes that have been released onto
+       the wire are visible to the application. */
+
+    if (uart->pace) {
+        return uart->pace_rx_released;
+    } else {
+        return uart_rx_avail(uart);
+    }
+}
+
+static size_t uart_readable_shift(struct uart *uart, struct iobuf *dest)
+{
+    struct iobuf view;
+    size_t nbytes;
+
+    /* Caller holds pending_lock */
+
+    if (!uart->pace) {
+        nbytes = uart_rx_shift(uart, dest);
+        uart_rx_flow(uart);
+
+        return nbytes;
+    }
+
+    view = *dest;
+
+    if (view.nbytes - view.pos > uart->pace_rx_released) {
+        view.nbytes = view.pos + uart->pace_rx_released;
+    }
+
+    nbytes = uart_rx_shift(uart, &view);
+    dest->pos = view.pos;
+    uart->pace_rx_released -= nbytes;
+    uart_rx_flow(uart);
+
+    return nbytes;
+}
+
+static size_t uart_writable_pending(struct uart *uart)
+{
+    const struct const_iobuf *write;
+    uint64_t byte_ns;
+    uint64_t now;
+    size_t nbytes;
+    size_t i;
+
+    /* Caller holds pending_lock. Bytes from writes that haven't been sent
+       yet count, as do bytes that have been sent and not yet consumed or,
+       when pacing, are still on their way out (rounding up so that a byte
+       half-way out counts). */
+
+    nbytes = 0;
+
+    for (i = uart->nwrites_sent ; i < uart->nwrites ; i++) {
+        write = &uart->write_irps[i]->write;
+        nbytes += write->nbytes - write->pos;
+    }
+
+    if (uart->tx != NULL) {
+        return nbytes + uart->tx->nbytes - iobuf_spsc_space(uart->tx);
+    } else if (!uart->pace) {
+        return nbytes + uart->written.buf.pos;
+    }
+
+    byte_ns = uart_pace_byte_ns(uart);
+    now = timer_wheel_now();
+
+    if (byte_ns != 0 && uart->pace_tx_clock > now) {
+        nbytes += (size_t) ((uart->pace_tx_clock - now + byte_ns - 1) /
+                byte_ns);
+    }
+
+    return nbytes;
+}
+
+static HRESULT uart_ioctl(
+        struct uart *uart,
+        uint32_t ioctl,
+        struct const_iobuf *in,
+        struct iobuf *out)
+{
+    switch (ioctl) {
     case IOCTL_SERIAL_GET_BAUD_RATE:
-        return iobuf_write(&irp->read, &uart->baud, sizeof(uart->baud));
+        return iobuf_write(out, &uart->baud, sizeof(uart->baud));
 
     case IOCTL_SERIAL_GET_CHARS:
-        return iobuf_write(&irp->read, &uart->chars, sizeof(uart->chars));
+        return iobuf_write(out, &uart->chars, sizeof(uart->chars));
+
+    case IOCTL_SERIAL_GET_DTRRTS:
+        return iobuf_write(out, &uart->lines, sizeof(uart->lines));
 
     case IOCTL_SERIAL_GET_COMMSTATUS:
-        uart->status.AmountInInQueue = uart->readable.pos;
-        uart->status.AmountInOutQueue = uart->written.pos;
+        EnterCriticalSection(&uart->pending_lock);
+
+        if (uart->pace) {
+            uart_pace_update(uart, timer_wheel_now());
+        }
 
-        return iobuf_write(&irp->read, &uart->status, sizeof(uart->status));
+        uart->status.AmountInInQueue = uart_readable_avail(uart);
+        uart->status.AmountInOutQueue = uart_writable_pending(uart);
+        uart->status.HoldReasons = uart_tx_hold(uart);
+
+        if (    uart->rx_flow_off &&
+                (uart->handflow.FlowReplace & SERIAL_AUTO_RECEIVE)) {
+            uart->status.HoldReasons |= SERIAL_TX_WAITING_XOFF_SENT;
+        }
+
+        LeaveCriticalSection(&uart->pending_lock);
+
+        return iobuf_write(out, &uart->status, sizeof(uart->status));
 
     case IOCTL_SERIAL_GET_HANDFLOW:
-        return iobuf_write(&irp->read, &uart->handflow, sizeof(uart->handflow));
+        return iobuf_write(out, &uart->handflow, sizeof(uart->handflow));
 
     case IOCTL_SERIAL_GET_LINE_CONTROL:
-        return iobuf_write(&irp->read, &uart->line, sizeof(uart->line));
+        return iobuf_write(out, &uart->line, sizeof(uart->line));
+
+    case IOCTL_SERIAL_GET_MODEMSTATUS:
+        return iobuf_write(
+                out,
+                &uart->modem_status,
+                sizeof(uart->modem_status));
 
     case IOCTL_SERIAL_GET_TIMEOUTS:
-        return iobuf_write(&irp->read, &uart->timeouts, sizeof(uart->timeouts));
+        return iobuf_write(out, &uart->timeouts, sizeof(uart->timeouts));
 
     case IOCTL_SERIAL_GET_WAIT_MASK:
-        return iobuf_write(&irp->read, &uart->mask, sizeof(uart->mask));
+        return iobuf_write(out, &uart->mask, sizeof(uart->mask));
 
     case IOCTL_SERIAL_SET_BAUD_RATE:
-        return iobuf_read(&irp->write, &uart->baud, sizeof(uart->baud));
+        return iobuf_read(in, &uart->baud, sizeof(uart->baud));
 
     case IOCTL_SERIAL_SET_CHARS:
-        return iobuf_read(&irp->write, &uart->chars, sizeof(uart->chars));
+        return iobuf_read(in, &uart->chars, sizeof(uart->chars));
 
     case IOCTL_SERIAL_SET_HANDFLOW:
-        return iobuf_read(&irp->write, &uart->handflow, sizeof(uart->handflow));
+        return uart_set_handflow(uart, in);
 
     case IOCTL_SERIAL_SET_LINE_CONTROL:
-        return iobuf_read(&irp->write, &uart->line, sizeof(uart->line));
+        return iobuf_read(in, &uart->line, sizeof(uart->line));
 
     case IOCTL_SERIAL_SET_TIMEOUTS:
-        return iobuf_read(&irp->write, &uart->timeouts, sizeof(uart->timeouts));
+        return iobuf_read(in, &uart->timeouts, sizeof(uart->timeouts));
 
     case IOCTL_SERIAL_SET_WAIT_MASK:
-        return iobuf_read(&irp->write, &uart->mask, sizeof(uart->mask));
+        return uart_set_wait_mask(uart, in);
+
+    case IOCTL_SERIAL_SET_QUEUE_SIZE:
+        return uart_set_queue_size(uart, in);
+
+    case IOCTL_SERIAL_PURGE:
+        return uart_purge(uart, in);
 
-    /* These can be safely ignored */
-    case IOCTL_SERIAL_SET_BREAK_ON:
-    case IOCTL_SERIAL_SET_BREAK_OFF:
     case IOCTL_SERIAL_CLR_DTR:
     case IOCTL_SERIAL_CLR_RTS:
     case IOCTL_SERIAL_SET_DTR:
     case IOCTL_SERIAL_SET_RTS:
+        return uart_set_lines(uart, ioctl);
+
+    /* As if the device had sent XOFF or XON */
     case IOCTL_SERIAL_SET_XOFF:
-    case IOCTL_SERIAL_SET_XON:
+        uart_set_xoff(uart, true);
 
-    case IOCTL_SERIAL_PURGE:
-    case IOCTL_SERIAL_SET_QUEUE_SIZE:
+        return S_OK;
+
+    case IOCTL_SERIAL_SET_XON:
+        uart_set_xoff(uart, false);
+
+        return S_OK;
+
+    /* These can be safely ignored */
+    case IOCTL_SERIAL_SET_BREAK_ON:
+    case IOCTL_SERIAL_SET_BREAK_OFF:
         return S_OK;
 
     default:
         return HRESULT_FROM_WIN32(ERROR_INVALID_FUNCTION);
     }
 }
+
+void uart_raise_events(struct uart *uart, uint32_t events)
+{
+    assert(uart != NULL);
+
+    EnterCriticalSection(&uart->pending_lock);
+    uart_wait_raise(uart, events);
+    LeaveCriticalSection(&uart->pending_lock);
+}
+
+void uart_set_modem_status(struct uart *uart, uint32_t status)
+{
+    uint32_t changed;
+    uint32_t events;
+
+    assert(uart != NULL);
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    changed = uart->modem_status ^ status;
+    uart->modem_status = status;
+    events = 0;
+
+    if (changed & SERIAL_MSR_CTS) {
+        events |= SERIAL_EV_CTS;
+    }
+
+    if (changed & SERIAL_MSR_DSR) {
+        events |= SERIAL_EV_DSR;
+    }
+
+    if (changed & SERIAL_MSR_DCD) {
+        events |= SERIAL_EV_RLSD;
+    }
+
+    if (changed & SERIAL_MSR_RI) {
+        events |= SERIAL_EV_RING;
+    }
+
+    uart_wait_raise(uart, events);
+
+    /* Handshaking may have been holding writes back */
+
+    if (uart->nwrites > uart->nwrites_sent) {
+        uart_write_pump(uart, uart_pace_now(uart));
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+}
+
+void uart_set_xoff(struct uart *uart, bool xoff)
+{
+    assert(uart != NULL);
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    uart->tx_xoff = xoff;
+
+    if (!xoff && uart->nwrites > uart->nwrites_sent) {
+        uart_write_pump(uart, uart_pace_now(uart));
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+}
+
+static size_t uart_rx_size(struct uart *uart)
+{
+    size_t size;
+
+    /* Caller holds pending_lock */
+
+    if (uart->rx != NULL) {
+        size = uart->rx->nbytes;
+    } else {
+        size = uart->readable.nbytes;
+    }
+
+    if (uart->queue.InSize != 0 && uart->queue.InSize < size) {
+        size = uart->queue.InSize;
+    }
+
+    return size;
+}
+
+static void uart_rx_flow(struct uart *uart)
+{
+    const SERIAL_HANDFLOW *hf;
+    size_t avail;
+    size_t size;
+    bool off;
+
+    /* Caller holds pending_lock. Switch the owner off once the input buffer
+       is down to XoffLimit bytes free, and back on again once the
+       application has drained it to XonLimit bytes. */
+
+    hf = &uart->handflow;
+
+    if (    (hf->ControlHandShake & SERIAL_DTR_MASK) != SERIAL_DTR_HANDSHAKE &&
+            (hf->FlowReplace & SERIAL_RTS_MASK) != SERIAL_RTS_HANDSHAKE &&
+            !(hf->FlowReplace & SERIAL_AUTO_RECEIVE)) {
+        uart->rx_flow_off = false;
+
+        return;
+    }
+
+    avail = uart_rx_avail(uart);
+    size = uart_rx_size(uart);
+
+    if (uart->rx_flow_off) {
+        off = avail > (size_t) hf->XonLimit;
+    } else {
+        off = avail >= size || size - avail <= (size_t) hf->XoffLimit;
+    }
+
+    uart->rx_flow_off = off;
+
+    if ((hf->ControlHandShake & SERIAL_DTR_MASK) == SERIAL_DTR_HANDSHAKE) {
+        if (off) {
+            uart->lines &= ~SERIAL_DTR_STATE;
+        } else {
+            uart->lines |= SERIAL_DTR_STATE;
+        }
+    }
+
+    if ((hf->FlowReplace & SERIAL_RTS_MASK) == SERIAL_RTS_HANDSHAKE) {
+        if (off) {
+            uart->lines &= ~SERIAL_RTS_STATE;
+        } else {
+            uart->lines |= SERIAL_RTS_STATE;
+        }
+    }
+}
+
+static HRESULT uart_set_handflow(struct uart *uart, struct const_iobuf *in)
+{
+    SERIAL_HANDFLOW hf;
+    HRESULT hr;
+
+    hr = iobuf_read(in, &hf, sizeof(hf));
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    uart->handflow = hf;
+
+    /* Lines that are simply switched on or off follow the new settings
+       straight away, handshaking lines follow the input buffer. */
+
+    switch (hf.ControlHandShake & SERIAL_DTR_MASK) {
+    case 0:                  uart->lines &= ~SERIAL_DTR_STATE; break;
+    case SERIAL_DTR_CONTROL: uart->lines |= SERIAL_DTR_STATE; break;
+    }
+
+    switch (hf.FlowReplace & SERIAL_RTS_MASK) {
+    case 0:                  uart->lines &= ~SERIAL_RTS_STATE; break;
+    case SERIAL_RTS_CONTROL: uart->lines |= SERIAL_RTS_STATE; break;
+    }
+
+    uart->rx_flow_off = false;
+    uart_rx_flow(uart);
+
+    if (uart->nwrites > uart->nwrites_sent) {
+        uart_write_pump(uart, uart_pace_now(uart));
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+
+    return S_OK;
+}
+
+static HRESULT uart_set_lines(struct uart *uart, uint32_t ioctl)
+{
+    uint32_t line;
+    HRESULT hr;
+
+    if (ioctl == IOCTL_SERIAL_SET_RTS || ioctl == IOCTL_SERIAL_CLR_RTS) {
+        line = SERIAL_RTS_STATE;
+    } else {
+        line = SERIAL_DTR_STATE;
+    }
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    /* Lines that are being used for handshaking can't be driven by hand.
+       serial.sys rejects this too. */
+
+    if (    (   line == SERIAL_RTS_STATE &&
+                (uart->handflow.FlowReplace & SERIAL_RTS_MASK) ==
+                        SERIAL_RTS_HANDSHAKE) ||
+            (   line == SERIAL_DTR_STATE &&
+                (uart->handflow.ControlHandShake & SERIAL_DTR_MASK) ==
+                        SERIAL_DTR_HANDSHAKE)) {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+
+        goto end;
+    }
+
+    if (ioctl == IOCTL_SERIAL_SET_RTS || ioctl == IOCTL_SERIAL_SET_DTR) {
+        uart->lines |= line;
+    } else {
+        uart->lines &= ~line;
+    }
+
+    hr = S_OK;
+
+end:
+    LeaveCriticalSection(&uart->pending_lock);
+
+    return hr;
+}
+
+static HRESULT uart_set_queue_size(struct uart *uart, struct const_iobuf *in)
+{
+    SERIAL_QUEUE_SIZE queue;
+    HRESULT hr;
+
+    hr = iobuf_read(in, &queue, sizeof(queue));
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    /* Sizes are only recommendations, zero means keep the current one */
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    if (queue.InSize != 0) {
+        uart->queue.InSize = queue.InSize;
+    }
+
+    if (queue.OutSize != 0) {
+        uart->queue.OutSize = queue.OutSize;
+        uart->written.limit = queue.OutSize;
+    }
+
+    uart_rx_flow(uart);
+
+    LeaveCriticalSection(&uart->pending_lock);
+
+    return S_OK;
+}
+
+static HRESULT uart_purge(struct uart *uart, struct const_iobuf *in)
+{
+    uint32_t flags;
+    uint64_t now;
+    HRESULT hr;
+    size_t i;
+
+    hr = iobuf_read(in, &flags, sizeof(flags));
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    now = uart_pace_now(uart);
+
+    if (flags & SERIAL_PURGE_TXABORT) {
+        for (i = 0 ; i < uart->nwrites ; i++) {
+            uart_write_finish(
+                    uart,
+                    uart->write_irps[i],
+                    HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+        }
+
+        uart->nwrites = 0;
+        uart->nwrites_sent = 0;
+    }
+
+    if ((flags & SERIAL_PURGE_RXABORT) && uart->read_irp != NULL) {
+        uart_read_finish(uart, HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+    }
+
+    if (flags & SERIAL_PURGE_TXCLEAR) {
+        /* Writes that had been sent and were only waiting for the wire are
+           done now that there's nothing left on it. */
+
+        if (uart->tx == NULL) {
+            iobuf_arena_reset(&uart->written);
+        }
+
+        for (i = 0 ; i < uart->nwrites_sent ; i++) {
+            uart->write_due[i] = 0;
+        }
+
+        if (uart->pace_tx_clock > now) {
+            uart->pace_tx_clock = now;
+        }
+    }
+
+    if (flags & SERIAL_PURGE_RXCLEAR) {
+        if (uart->rx != NULL) {
+            iobuf_spsc_skip(uart->rx, (size_t) -1);
+        } else {
+            iobuf_ring_clear(&uart->readable);
+        }
+
+        uart->pace_rx_released = 0;
+        uart->pace_rx_busy = false;
+        uart_rx_flow(uart);
+    }
+
+    uart_write_pump(uart, now);
+
+    if (uart->pace) {
+        uart_pace_tx(uart, now);
+        uart_pace_arm(uart);
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+
+    return S_OK;
+}
+
+static HRESULT uart_set_wait_mask(struct uart *uart, struct const_iobuf *in)
+{
+    DWORD mask;
+    HRESULT hr;
+
+    hr = iobuf_read(in, &mask, sizeof(mask));
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    /* Changing the mask completes any outstanding wait with no events and
+       forgets whatever had accumulated under the old mask. */
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    uart->mask = mask;
+    uart->events = 0;
+
+    if (uart->wait_irp != NULL) {
+        uart_wait_finish(uart, S_OK);
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+
+    return S_OK;
+}
+
+static HRESULT uart_handle_wait(struct uart *uart, struct irp *irp)
+{
+    struct irp *pending;
+    DWORD events;
+    HRESULT hr;
+
+    if (irp->read.nbytes - irp->read.pos < sizeof(events)) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    if (uart->mask == 0 || uart->wait_irp != NULL) {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+
+        goto end;
+    }
+
+    if (uart->events != 0) {
+        events = uart->events;
+        uart->events = 0;
+        hr = iobuf_write(&irp->read, &events, sizeof(events));
+
+        goto end;
+    }
+
+    hr = iohook_pend_irp(irp, uart_wait_cancel, uart, &pending);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    uart->wait_irp = pending;
+    hr = HRESULT_FROM_WIN32(ERROR_IO_PENDING);
+
+end:
+    LeaveCriticalSection(&uart->pending_lock);
+
+    return hr;
+}
+
+static void uart_wait_raise(struct uart *uart, uint32_t events)
+{
+    /* Caller holds pending_lock */
+
+    events &= uart->mask;
+
+    if (events == 0) {
+        return;
+    }
+
+    uart->events |= events;
+
+    if (uart->wait_irp != NULL) {
+        uart_wait_finish(uart, S_OK);
+    }
+}
+
+static void uart_wait_finish(struct uart *uart, HRESULT hr)
+{
+    struct irp *irp;
+    DWORD events;
+
+    irp = uart->wait_irp;
+    uart->wait_irp = NULL;
+
+    if (SUCCEEDED(hr)) {
+        events = uart->events;
+        uart->events = 0;
+        hr = iobuf_write(&irp->read, &events, sizeof(events));
+    }
+
+    iohook_complete_irp(irp, hr);
+}
+
+static void uart_wait_cancel(struct irp *irp, void *ctx)
+{
+    struct uart *uart;
+
+    uart = ctx;
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    if (uart->wait_irp == irp) {
+        uart_wait_finish(uart, HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+}
+
+static uint32_t uart_tx_hold(struct uart *uart)
+{
+    const SERIAL_HANDFLOW *hf;
+    uint32_t hold;
+
+    /* Caller holds pending_lock. Returns SERIAL_TX_WAITING_xxx reasons. */
+
+    hf = &uart->handflow;
+    hold = 0;
+
+    if (    (hf->ControlHandShake & SERIAL_CTS_HANDSHAKE) &&
+            !(uart->modem_status & SERIAL_MSR_CTS)) {
+        hold |= SERIAL_TX_WAITING_FOR_CTS;
+    }
+
+    if (    (hf->ControlHandShake & SERIAL_DSR_HANDSHAKE) &&
+            !(uart->modem_status & SERIAL_MSR_DSR)) {
+        hold |= SERIAL_TX_WAITING_FOR_DSR;
+    }
+
+    if (    (hf->ControlHandShake & SERIAL_DCD_HANDSHAKE) &&
+            !(uart->modem_status & SERIAL_MSR_DCD)) {
+        hold |= SERIAL_TX_WAITING_FOR_DCD;
+    }
+
+    if ((hf->FlowReplace & SERIAL_AUTO_TRANSMIT) && uart->tx_xoff) {
+        hold |= SERIAL_TX_WAITING_FOR_XON;
+    }
+
+    return hold;
+}
+
+static uint64_t uart_write_send(struct uart *uart, struct irp *irp)
+{
+    uint64_t byte_ns;
+    uint64_t now;
+    size_t nbytes;
+
+    /* Caller holds pending_lock. Hands as much of the write over to the
+       owner as there is room for. When pacing, returns the time at which the
+       last of that will have left the wire, otherwise zero. */
+
+    nbytes = irp->write.pos;
+
+    if (uart->tx != NULL) {
+        iobuf_spsc_move(uart->tx, &irp->write);
+    } else {
+        iobuf_arena_move(&uart->written, &irp->write);
+    }
+
+    nbytes = irp->write.pos - nbytes;
+
+    if (nbytes == 0) {
+        return 0;
+    }
+
+    if (uart->capture != NULL) {
+        uart_capture_data(
+                uart->capture,
+                UART_CAPTURE_TX,
+                &irp->write.bytes[irp->write.pos - nbytes],
+                nbytes);
+    }
+
+    if (!uart->pace) {
+        /* As far as the application can tell, everything that it writes
+           goes out on the wire immediately. In the queued mode EV_TXEMPTY is
+           up to the device thread, since only it knows when tx drains. */
+
+        if (uart->tx == NULL) {
+            uart_wait_raise(uart, SERIAL_EV_TXEMPTY);
+        }
+
+        return 0;
+    }
+
+    byte_ns = uart_pace_byte_ns(uart);
+
+    if (byte_ns == 0) {
+        return 0;
+    }
+
+    /* The new bytes queue up behind whatever is still going out */
+
+    now = timer_wheel_now();
+
+    if (uart->pace_tx_clock < now) {
+        uart->pace_tx_clock = now;
+    }
+
+    uart->pace_tx_clock += nbytes * byte_ns;
+
+    if (uart->tx == NULL) {
+        uart->pace_tx_empty = true;
+    }
+
+    return uart->pace_tx_clock;
+}
+
+static void uart_write_pump(struct uart *uart, uint64_t now)
+{
+    struct irp *irp;
+    size_t i;
+
+    /* Caller holds pending_lock. write_irps holds the writes that have been
+       sent in full (which only remain while they are being paced out) and
+       then those that are still waiting for room or for flow control, in
+       the order that they were issued. Send what we can, then complete
+       whatever is finished. */
+
+    while (uart->nwrites_sent < uart->nwrites && uart_tx_hold(uart) == 0) {
+        irp = uart->write_irps[uart->nwrites_sent];
+        uart->write_due[uart->nwrites_sent] = uart_write_send(uart, irp);
+
+        if (irp->write.pos < irp->write.nbytes) {
+            break;
+        }
+
+        uart->nwrites_sent++;
+    }
+
+    for (i = 0 ; i < uart->nwrites_sent ; i++) {
+        if (uart->write_due[i] > now) {
+            break;
+        }
+
+        uart_write_finish(uart, uart->write_irps[i], S_OK);
+    }
+
+    if (i == 0) {
+        return;
+    }
+
+    uart->nwrites -= i;
+    uart->nwrites_sent -= i;
+    memmove(uart->write_irps,
+            &uart->write_irps[i],
+            uart->nwrites * sizeof(uart->write_irps[0]));
+    memmove(uart->write_due,
+            &uart->write_due[i],
+            uart->nwrites * sizeof(uart->write_due[0]));
+}
+
+static void uart_write_cancel(struct irp *irp, void *ctx)
+{
+    struct uart *uart;
+    size_t i;
+
+    uart = ctx;
+
+    /* Whatever had been sent before the cancellation stays sent */
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    for (i = 0 ; i < uart->nwrites ; i++) {
+        if (uart->write_irps[i] == irp) {
+            break;
+        }
+    }
+
+    if (i < uart->nwrites) {
+        if (i < uart->nwrites_sent) {
+            uart->nwrites_sent--;
+        }
+
+        uart->nwrites--;
+        memmove(&uart->write_irps[i],
+                &uart->write_irps[i + 1],
+                (uart->nwrites - i) * sizeof(uart->write_irps[0]));
+        memmove(&uart->write_due[i],
+                &uart->write_due[i + 1],
+                (uart->nwrites - i) * sizeof(uart->write_due[0]));
+        uart_write_finish(
+                uart,
+                irp,
+                HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+
+        /* The next write might have been stuck behind this one */
+
+        uart_write_pump(uart, uart_pace_now(uart));
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+}
+
+static void uart_write_finish(
+        struct uart *uart,
+        struct irp *irp,
+        HRESULT hr)
+{
+    /* Caller holds pending_lock and has already removed irp from
+       write_irps. */
+
+    if (uart->capture != NULL) {
+        uart_capture_end(
+                uart->capture,
+                UART_CAPTURE_TX_END,
+                irp->write.pos,
+                hr);
+    }
+
+    iohook_complete_irp(irp, hr);
+}
+
+static void uart_read_policy_get(
+        struct uart_read_policy *policy,
+        const SERIAL_TIMEOUTS *timeouts,
+        size_t nbytes)
+{
+    uint32_t interval;
+    uint32_t multiplier;
+    uint32_t constant;
+
+    interval = timeouts->ReadIntervalTimeout;
+    multiplier = timeouts->ReadTotalTimeoutMultiplier;
+    constant = timeouts->ReadTotalTimeoutConstant;
+
+    memset(policy, 0, sizeof(*policy));
+
+    /* An interval of MAXDWORD selects one of two special modes depending on
+       the other two values, otherwise it simply means "no interval timeout".
+       These rules follow the behavior of serial.sys. */
+
+    if (interval == MAXDWORD) {
+        if (multiplier == 0 && constant == 0) {
+            /* Return whatever is available right now, possibly nothing */
+            policy->immediate = true;
+
+            return;
+        }
+
+        if (    multiplier == MAXDWORD &&
+                constant != 0 &&
+                constant != MAXDWORD) {
+            /* Return as soon as anything at all is available, or fail to read
+               anything once the constant expires. */
+            policy->any = true;
+            policy->total_ms = constant;
+
+            return;
+        }
+    } else {
+        policy->interval_ms = interval;
+    }
+
+    policy->total_ms = (uint64_t) multiplier * nbytes + constant;
+}
+
+static uint64_t uart_read_now(const struct uart *uart)
+{
+    /* Caller holds pending_lock and has checked that a read is pending. Only
+       a read with a timeout has started the timer wheel, and only such a read
+       needs its clock. */
+
+    if (uart->read_deadline == 0 && uart->read_interval == 0) {
+        return 0;
+    }
+
+    return timer_wheel_now();
+}
+
+static void uart_read_feed(struct uart *uart)
+{
+    uint64_t now;
+
+    /* Caller holds pending_lock */
+
+    if (uart->read_irp == NULL) {
+        return;
+    }
+
+    now = uart_read_now(uart);
+
+    if (uart_readable_shift(uart, &uart->read_irp->read) > 0) {
+        uart->read_last = now;
+    }
+
+    uart_read_check(uart, now);
+}
+
+static void uart_read_check(struct uart *uart, uint64_t now)
+{
+    const struct iobuf *read;
+
+    /* Caller holds pending_lock and has checked that a read is pending */
+
+    read = &uart->read_irp->read;
+
+    if (    read->pos == read->nbytes ||
+            (uart->read_any && read->pos > 0) ||
+            (uart->read_deadline != 0 && now >= uart->read_deadline) ||
+            (   uart->read_interval != 0 &&
+                read->pos > 0 &&
+                now - uart->read_last >= uart->read_interval)) {
+        /* Timeouts are not errors: the read succeeds with whatever it has
+           managed to collect, which may be nothing at all. */
+        uart_read_finish(uart, S_OK);
+    } else {
+        uart_read_arm(uart, now);
+    }
+}
+
+static void uart_read_arm(struct uart *uart, uint64_t now)
+{
+    uint64_t next;
+
+    /* Caller holds pending_lock. The interval timer only starts running once
+       the first byte is in. The wheel is only touched if the time at which
+       the read next needs looking at has changed. */
+
+    next = uart->read_deadline;
+
+    if (uart->read_interval != 0 && uart->read_irp->read.pos > 0) {
+        if (next == 0 || uart->read_last + uart->read_interval < next) {
+            next = uart->read_last + uart->read_interval;
+        }
+    }
+
+    if (next == 0) {
+        if (uart->read_due != 0) {
+            uart->read_due = 0;
+            timer_wheel_disarm(&uart->read_timer);
+        }
+    } else if (next != uart->read_due) {
+        uart->read_due = next;
+        timer_wheel_arm(&uart->read_timer, next);
+    }
+}
+
+static void uart_read_finish(struct uart *uart, HRESULT hr)
+{
+    struct irp *irp;
+
+    irp = uart->read_irp;
+    uart->read_irp = NULL;
+
+    if (uart->read_due != 0) {
+        uart->read_due = 0;
+        timer_wheel_disarm(&uart->read_timer);
+    }
+
+    if (uart->capture != NULL) {
+        uart_capture_end(
+                uart->capture,
+                UART_CAPTURE_RX_END,
+                irp->read.pos,
+                hr);
+    }
+
+    iohook_complete_irp(irp, hr);
+}
+
+static void uart_read_cancel(struct irp *irp, void *ctx)
+{
+    struct uart *uart;
+
+    uart = ctx;
+
+    /* iohook has already failed the read on our behalf; we still need to
+       release our copy of the IRP, unless we got there first. */
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    if (uart->read_irp == irp) {
+        uart_read_finish(uart, HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+}
+
+static void uart_read_timer_proc(
+        struct timer_wheel_entry *entry,
+        uint64_t now,
+        void *ctx)
+{
+    struct uart *uart;
+
+    uart = ctx;
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    if (uart->read_irp != NULL) {
+        uart->read_due = 0;
+        uart_read_check(uart, now);
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+}
+
+static uint64_t uart_pace_now(const struct uart *uart)
+{
+    /* Write completion times are only ever non-zero when pacing, so there
+       is no need to read the clock otherwise. */
+
+    return uart->pace ? timer_wheel_now() : 0;
+}
+
+static uint64_t uart_pace_byte_ns(const struct uart *uart)
+{
+    uint64_t half_bits;
+    uint64_t baud;
+
+    baud = uart->baud.BaudRate;
+
+    if (baud == 0) {
+        return 0;
+    }
+
+    /* Counted in half bits so that 1.5 stop bits comes out exact. There is
+       always one start bit in front of the data. */
+
+    half_bits = 2 * (1 + uart->line.WordLength);
+
+    if (uart->line.Parity != NO_PARITY) {
+        half_bits += 2;
+    }
+
+    switch (uart->line.StopBits) {
+    case STOP_BITS_1_5: half_bits += 3; break;
+    case STOP_BITS_2:   half_bits += 4; break;
+    default:            half_bits += 2; break;
+    }
+
+    return (half_bits * 1000000000 + baud) / (2 * baud);
+}
+
+static void uart_pace_update(struct uart *uart, uint64_t now)
+{
+    /* Caller holds pending_lock */
+
+    if (uart_pace_rx(uart, now)) {
+        uart_read_feed(uart);
+    }
+
+    uart_write_pump(uart, now);
+    uart_pace_tx(uart, now);
+    uart_pace_arm(uart);
+}
+
+static bool uart_pace_rx(struct uart *uart, uint64_t now)
+{
+    uint64_t byte_ns;
+    uint64_t nbytes;
+    size_t held;
+
+    /* Caller holds pending_lock. Returns true and raises EV_RXCHAR if any
+       bytes arrived since the last call. */
+
+    held = uart_rx_avail(uart) - uart->pace_rx_released;
+
+    if (held == 0) {
+        uart->pace_rx_busy = false;
+
+        return false;
+    }
+
+    byte_ns = uart_pace_byte_ns(uart);
+
+    if (byte_ns == 0) {
+        nbytes = held;
+    } else {
+        /* An idle line starts receiving now, or once the application's own
+           transmission is done if the device is answering it. */
+
+        if (!uart->pace_rx_busy) {
+            uart->pace_rx_next = now > uart->pace_tx_clock ?
+                    now : uart->pace_tx_clock;
+            uart->pace_rx_next += byte_ns;
+            uart->pace_rx_busy = true;
+        }
+
+        if (now < uart->pace_rx_next) {
+            return false;
+        }
+
+        /* Catch up on everything that arrived while we weren't looking */
+
+        nbytes = (now - uart->pace_rx_next) / byte_ns + 1;
+
+        if (nbytes > held) {
+            nbytes = held;
+        }
+
+        uart->pace_rx_next += nbytes * byte_ns;
+    }
+
+    uart->pace_rx_released += (size_t) nbytes;
+
+    if (nbytes == held) {
+        uart->pace_rx_busy = false;
+    }
+
+    uart_wait_raise(uart, SERIAL_EV_RXCHAR);
+
+    return true;
+}
+
+static void uart_pace_tx(struct uart *uart, uint64_t now)
+{
+    /* Caller holds pending_lock */
+
+    if (uart->pace_tx_empty && uart->pace_tx_clock <= now) {
+        uart->pace_tx_empty = false;
+        uart_wait_raise(uart, SERIAL_EV_TXEMPTY);
+    }
+}
+
+static void uart_pace_arm(struct uart *uart)
+{
+    uint64_t due;
+
+    /* Caller holds pending_lock. Wake up for whichever comes first out of
+       the next byte arriving, the next write finishing and the line going
+       idle. The wheel is only touched if that time has changed. */
+
+    due = UINT64_MAX;
+
+    if (uart->pace_rx_busy) {
+        due = uart->pace_rx_next;
+    }
+
+    if (uart->nwrites_sent > 0 && uart->write_due[0] < due) {
+        due = uart->write_due[0];
+    }
+
+    if (uart->pace_tx_empty && uart->pace_tx_clock < due) {
+        due = uart->pace_tx_clock;
+    }
+
+    if (due == UINT64_MAX) {
+        if (uart->pace_due != 0) {
+            uart->pace_due = 0;
+            timer_wheel_disarm(&uart->pace_timer);
+        }
+    } else if (due != uart->pace_due) {
+        uart->pace_due = due;
+        timer_wheel_arm(&uart->pace_timer, due);
+    }
+}
+
+static void uart_pace_timer_proc(
+        struct timer_wheel_entry *entry,
+        uint64_t now,
+        void *ctx)
+{
+    struct uart *uart;
+
+    uart = ctx;
+
+    EnterCriticalSection(&uart->pending_lock);
+
+    if (uart->pace) {
+        uart->pace_due = 0;
+        uart_pace_update(uart, now);
+    }
+
+    LeaveCriticalSection(&uart->pending_lock);
+}
@@ -2,7 +2,7 @@
 
 #include <windows.h>
 
-#ifdef __GNUC__
+#if defined(__GNUC__) && defined(_WIN32)
 #include <ntdef.h>
 #else
 #include <winnt.h>
@@ -11,10 +11,19 @@
 #include <ntddser.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 
+#include "hook/iobuf-arena.h"
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf-spsc.h"
 #include "hook/iobuf.h"
 #include "hook/iohook.h"
 
+#include "hooklib/timer-wheel.h"
+#include "hooklib/uart-capture.h"
+
+#define UART_MAX_WRITES 16
+
 struct uart {
     HANDLE fd;
     unsigned int port_no;
@@ -24,12 +33,162 @@ struct uart {
     SERIAL_HANDFLOW handflow;
     SERIAL_LINE_CONTROL line;
     SERIAL_TIMEOUTS timeouts;
+    SERIAL_QUEUE_SIZE queue;
     DWORD mask;
-    struct iobuf written;
-    struct iobuf readable;
+    uint32_t events;
+    uint32_t modem_status;
+    uint32_t lines;
+    struct iobuf_arena written;
+    struct iobuf_ring readable;
+    struct iobuf_spsc *rx;
+    struct iobuf_spsc *tx;
+    struct uart_capture *capture;
+    CRITICAL_SECTION pending_lock;
+    struct timer_wheel_entry read_timer;
+    struct irp *read_irp;
+    uint64_t read_due;
+    uint64_t read_deadline;
+    uint64_t read_last;
+    uint64_t read_interval;
+    bool read_any;
+    struct irp *wait_irp;
+    struct irp *write_irps[UART_MAX_WRITES];
+    uint64_t write_due[UART_MAX_WRITES];
+    size_t nwrites;
+    size_t nwrites_sent;
+    bool rx_flow_off;
+    bool tx_xoff;
+    bool pace;
+    struct timer_wheel_entry pace_timer;
+    uint64_t pace_due;
+    size_t pace_rx_released;
+    uint64_t pace_rx_next;
+    bool pace_rx_busy;
+    uint64_t pace_tx_clock;
+    bool pace_tx_empty;
 };
 
+/* The owner supplies the buffer for readable by calling iobuf_ring_init() on
+   it with a power-of-two sized buffer. written grows on demand up to
+   UART_WRITTEN_LIMIT bytes (adjust written.limit to taste); consume it via
+   written.buf and then rewind it with iobuf_arena_reset(), or hand it to
+   frame_decode_arena() for sync/escape framed protocols. Either way, call
+   uart_notify_writable() afterwards in case a write is waiting for room.
+
+   Reads follow the SERIAL_TIMEOUTS that the application has set, so a read
+   that cannot be satisfied from readable straight away is left pending until
+   enough data arrives or one of its timeouts expires. Read timeouts run on
+   the timer_wheel (see timer-wheel.h), which is started up the first time
+   that a read with a timeout has to wait. The owner must call
+   uart_notify_readable() after adding bytes to readable (while holding the
+   same lock that it holds around uart_handle_irp()) to wake such a read up.
+
+   WaitCommEvent() is served in the same way. Events are accumulated in
+   events (filtered by the mask that the application set with SetCommMask())
+   until a wait collects them. uart.c raises EV_RXCHAR from
+   uart_notify_readable() and EV_TXEMPTY whenever a write is accepted; the
+   owner reports modem line changes by calling uart_set_modem_status() with
+   SERIAL_MSR_xxx bits, which raises EV_CTS, EV_DSR, EV_RLSD and EV_RING as
+   appropriate, and can raise anything else (EV_BREAK, EV_ERR, EV_RXFLAG and
+   so on) directly through uart_raise_events(). These have the same locking
+   requirements as uart_notify_readable().
+
+   Alternatively, the owner can call uart_attach_queues() before the port is
+   opened so that device emulation can run on a thread of its own. Bytes that
+   the application writes then go into tx instead of written, and reads are
+   served from rx instead of readable. Both are lock-free single-producer
+   single-consumer queues: the owner's IRP handler (which must still be
+   serialized) is the producer for tx and the consumer for rx, and the device
+   thread is the other end of each. The device thread calls
+   uart_notify_readable(), uart_notify_writable(), uart_raise_events(),
+   uart_set_modem_status() and uart_set_xoff() without taking the owner's
+   lock, and it is responsible for raising EV_TXEMPTY when it drains tx.
+   If the queues go away before the uart does, stop the device thread and
+   then call uart_detach_queues(), which waits for the pacing timer (if any)
+   to let go of them; the port is no longer paced afterwards, and any IRPs
+   that are still pending stay that way until uart_fini().
+
+   Writes are never cut short. A write that doesn't fit into written (or tx)
+   stays pending until the owner makes room and calls
+   uart_notify_writable(), as does one that flow control is holding back, and
+   later writes queue up behind it; at most UART_MAX_WRITES can be
+   outstanding, after which writes fail with ERROR_BUSY. SetupComm() sets
+   written.limit to its output queue size, and its input queue size (capped
+   at the size of readable, or rx) is the point at which the application's
+   input buffer counts as full. The application's DCB picks which flow
+   control applies:
+
+       CTS, DSR or DCD handshaking holds writes back while the owner has the
+       corresponding SERIAL_MSR_xxx bit clear in uart_set_modem_status().
+
+       XON/XOFF output (fOutX) holds writes back from when the owner reports
+       an XOFF with uart_set_xoff() until the matching XON. The application
+       can fake either with EscapeCommFunction(SETXOFF/SETXON).
+
+       RTS or DTR handshaking, or XON/XOFF input (fInX), tells the owner to
+       stop sending once the input buffer has no more than XoffLim bytes
+       free, and to resume once it holds no more than XonLim bytes.
+
+   The owner should ask uart_rx_space() how much it may add to readable (or
+   rx) before doing so. This is zero while the application has flow
+   controlled the owner off, and otherwise however much room is left in the
+   input buffer. The state of the application's RTS and DTR outputs, whether
+   set explicitly or by handshaking, is in lines as SERIAL_RTS_STATE and
+   SERIAL_DTR_STATE. PurgeComm() empties readable (or rx), written and any
+   bytes still being paced out, and aborts pending IRPs as asked; in the
+   queued mode nothing can be taken back out of tx, since it belongs to the
+   device thread.
+
+   Either way, bytes normally move as fast as the owner can shuffle them. The
+   owner can call uart_enable_pacing() before the port is opened to make the
+   port behave as if it were clocking bits out at the rate set by the
+   application's baud and line control settings instead, with one start bit
+   and the configured data, parity and stop bits per byte. Bytes that the
+   owner adds to readable (or rx) then only become visible to the application
+   one byte time apart, starting no earlier than the end of whatever the
+   application has most recently written, so a reply can't overtake the
+   command that caused it. Writes still reach the owner as soon as they are
+   sent, but the write IRP stays pending (and counts towards the output
+   queue length in GetCommStatus) until its last byte would have left the
+   wire. EV_TXEMPTY is raised once the wire falls idle. All paced
+   ports share a single timer_wheel thread (see timer-wheel.h), so pacing has
+   a resolution of TIMER_WHEEL_TICK_NS at worst.
+
+   For debugging, the owner can open a uart_capture (see uart-capture.h) and
+   call uart_attach_capture() before the port is opened to have every byte
+   that the application writes and reads, and the completion of every read
+   and write IRP, recorded with a timestamp. The capture must outlive the
+   uart; close it after calling uart_fini().
+
+   The events, read_xxx, wait_xxx, write_xxx, rx_xxx, tx_xxx and pace_xxx
+   fields are private to uart.c. */
+
+#define UART_WRITTEN_LIMIT 0x10000
+
 void uart_init(struct uart *uart, unsigned int port_no);
 void uart_fini(struct uart *uart);
+void uart_attach_queues(
+        struct uart *uart,
+        struct iobuf_spsc *rx,
+        struct iobuf_spsc *tx);
+void uart_detach_queues(struct uart *uart);
+void uart_attach_capture(struct uart *uart, struct uart_capture *capture);
+HRESULT uart_enable_pacing(struct uart *uart);
 bool uart_match_irp(const struct uart *uart, const struct irp *irp);
+
+/* Extract the port number from any of the forms of COM port path that
+   CreateFile accepts. Returns false if path does not name a COM port. */
+
+bool uart_parse_path(const wchar_t *path, unsigned int *port_no);
+
+/* Also serves IRP_OP_IOCTL_BATCH IRPs in a single pass, so a handler that
+   forwards matching IRPs here can be pushed using
+   iohook_push_batch_handler(). */
+
 HRESULT uart_handle_irp(struct uart *uart, struct irp *irp);
+void uart_notify_readable(struct uart *uart);
+void uart_notify_writable(struct uart *uart);
+size_t uart_rx_space(struct uart *uart);
+void uart_set_xoff(struct uart *uart, bool xoff);
+void uart_raise_events(struct uart *uart, uint32_t events);
+void uart_set_modem_status(struct uart *uart, uint32_t status);
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "windows.h"
+
+#define CTL_CODE(type, func, method, access) \
+        (((type) << 16) | ((access) << 14) | ((func) << 2) | (method))
+
+#define METHOD_BUFFERED 0
+#define FILE_ANY_ACCESS 0
+#define FILE_DEVICE_UNKNOWN 0x00000022
+#define FILE_DEVICE_SERIAL_PORT 0x0000001b
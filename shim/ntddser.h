@@ -0,0 +1,153 @@
+#pragma once
+
+/* The serial port ioctl interface, laid out exactly as it is on Windows so
+   that the uart emulation can be driven with the same structures and codes
+   that kernel32 sends it. Only what the uart emulation uses is here. */
+
+#include "windows.h"
+#include "devioctl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IOCTL_SERIAL_(func) \
+        CTL_CODE(FILE_DEVICE_SERIAL_PORT, (func), METHOD_BUFFERED, \
+                FILE_ANY_ACCESS)
+
+#define IOCTL_SERIAL_SET_BAUD_RATE      IOCTL_SERIAL_(1)
+#define IOCTL_SERIAL_SET_QUEUE_SIZE     IOCTL_SERIAL_(2)
+#define IOCTL_SERIAL_SET_LINE_CONTROL   IOCTL_SERIAL_(3)
+#define IOCTL_SERIAL_SET_BREAK_ON       IOCTL_SERIAL_(4)
+#define IOCTL_SERIAL_SET_BREAK_OFF      IOCTL_SERIAL_(5)
+#define IOCTL_SERIAL_SET_TIMEOUTS       IOCTL_SERIAL_(7)
+#define IOCTL_SERIAL_GET_TIMEOUTS       IOCTL_SERIAL_(8)
+#define IOCTL_SERIAL_SET_DTR            IOCTL_SERIAL_(9)
+#define IOCTL_SERIAL_CLR_DTR            IOCTL_SERIAL_(10)
+#define IOCTL_SERIAL_SET_RTS            IOCTL_SERIAL_(12)
+#define IOCTL_SERIAL_CLR_RTS            IOCTL_SERIAL_(13)
+#define IOCTL_SERIAL_SET_XOFF           IOCTL_SERIAL_(14)
+#define IOCTL_SERIAL_SET_XON            IOCTL_SERIAL_(15)
+#define IOCTL_SERIAL_GET_WAIT_MASK      IOCTL_SERIAL_(16)
+#define IOCTL_SERIAL_SET_WAIT_MASK      IOCTL_SERIAL_(17)
+#define IOCTL_SERIAL_WAIT_ON_MASK       IOCTL_SERIAL_(18)
+#define IOCTL_SERIAL_PURGE              IOCTL_SERIAL_(19)
+#define IOCTL_SERIAL_GET_BAUD_RATE      IOCTL_SERIAL_(20)
+#define IOCTL_SERIAL_GET_LINE_CONTROL   IOCTL_SERIAL_(21)
+#define IOCTL_SERIAL_GET_CHARS          IOCTL_SERIAL_(22)
+#define IOCTL_SERIAL_SET_CHARS          IOCTL_SERIAL_(23)
+#define IOCTL_SERIAL_GET_HANDFLOW       IOCTL_SERIAL_(24)
+#define IOCTL_SERIAL_SET_HANDFLOW       IOCTL_SERIAL_(25)
+#define IOCTL_SERIAL_GET_MODEMSTATUS    IOCTL_SERIAL_(26)
+#define IOCTL_SERIAL_GET_COMMSTATUS     IOCTL_SERIAL_(27)
+#define IOCTL_SERIAL_GET_DTRRTS         IOCTL_SERIAL_(30)
+
+typedef struct _SERIAL_BAUD_RATE {
+    ULONG BaudRate;
+} SERIAL_BAUD_RATE;
+
+typedef struct _SERIAL_STATUS {
+    ULONG Errors;
+    ULONG HoldReasons;
+    ULONG AmountInInQueue;
+    ULONG AmountInOutQueue;
+    BOOLEAN EofReceived;
+    BOOLEAN WaitForImmediate;
+} SERIAL_STATUS;
+
+typedef struct _SERIAL_CHARS {
+    UCHAR EofChar;
+    UCHAR ErrorChar;
+    UCHAR BreakChar;
+    UCHAR EventChar;
+    UCHAR XonChar;
+    UCHAR XoffChar;
+} SERIAL_CHARS;
+
+typedef struct _SERIAL_HANDFLOW {
+    ULONG ControlHandShake;
+    ULONG FlowReplace;
+    LONG XonLimit;
+    LONG XoffLimit;
+} SERIAL_HANDFLOW;
+
+typedef struct _SERIAL_LINE_CONTROL {
+    UCHAR StopBits;
+    UCHAR Parity;
+    UCHAR WordLength;
+} SERIAL_LINE_CONTROL;
+
+typedef struct _SERIAL_TIMEOUTS {
+    ULONG ReadIntervalTimeout;
+    ULONG ReadTotalTimeoutMultiplier;
+    ULONG ReadTotalTimeoutConstant;
+    ULONG WriteTotalTimeoutMultiplier;
+    ULONG WriteTotalTimeoutConstant;
+} SERIAL_TIMEOUTS;
+
+typedef struct _SERIAL_QUEUE_SIZE {
+    ULONG InSize;
+    ULONG OutSize;
+} SERIAL_QUEUE_SIZE;
+
+#define STOP_BIT_1 0
+#define STOP_BITS_1_5 1
+#define STOP_BITS_2 2
+
+#define NO_PARITY 0
+#define ODD_PARITY 1
+#define EVEN_PARITY 2
+#define MARK_PARITY 3
+#define SPACE_PARITY 4
+
+/* SERIAL_HANDFLOW.ControlHandShake */
+
+#define SERIAL_DTR_MASK 0x00000003
+#define SERIAL_DTR_CONTROL 0x00000001
+#define SERIAL_DTR_HANDSHAKE 0x00000002
+#define SERIAL_CTS_HANDSHAKE 0x00000008
+#define SERIAL_DSR_HANDSHAKE 0x00000010
+#define SERIAL_DCD_HANDSHAKE 0x00000020
+
+/* SERIAL_HANDFLOW.FlowReplace */
+
+#define SERIAL_AUTO_TRANSMIT 0x00000001
+#define SERIAL_AUTO_RECEIVE 0x00000002
+#define SERIAL_RTS_MASK 0x000000C0
+#define SERIAL_RTS_CONTROL 0x00000040
+#define SERIAL_RTS_HANDSHAKE 0x00000080
+
+/* SERIAL_STATUS.HoldReasons */
+
+#define SERIAL_TX_WAITING_FOR_CTS 0x00000001
+#define SERIAL_TX_WAITING_FOR_DSR 0x00000002
+#define SERIAL_TX_WAITING_FOR_DCD 0x00000004
+#define SERIAL_TX_WAITING_FOR_XON 0x00000008
+#define SERIAL_TX_WAITING_XOFF_SENT 0x00000010
+
+#define SERIAL_PURGE_TXABORT 0x00000001
+#define SERIAL_PURGE_RXABORT 0x00000002
+#define SERIAL_PURGE_TXCLEAR 0x00000004
+#define SERIAL_PURGE_RXCLEAR 0x00000008
+
+#define SERIAL_EV_RXCHAR 0x0001
+#define SERIAL_EV_RXFLAG 0x0002
+#define SERIAL_EV_TXEMPTY 0x0004
+#define SERIAL_EV_CTS 0x0008
+#define SERIAL_EV_DSR 0x0010
+#define SERIAL_EV_RLSD 0x0020
+#define SERIAL_EV_BREAK 0x0040
+#define SERIAL_EV_ERR 0x0080
+#define SERIAL_EV_RING 0x0100
+
+#define SERIAL_DTR_STATE 0x00000001
+#define SERIAL_RTS_STATE 0x00000002
+
+#define SERIAL_MSR_CTS 0x10
+#define SERIAL_MSR_DSR 0x20
+#define SERIAL_MSR_RI 0x40
+#define SERIAL_MSR_DCD 0x80
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "windows.h"
+
+#define STATUS_SUCCESS ((NTSTATUS) 0x00000000)
+#define STATUS_TIMEOUT ((NTSTATUS) 0x00000102)
+#define STATUS_PENDING ((NTSTATUS) 0x00000103)
+#define STATUS_CANCELLED ((NTSTATUS) 0xC0000120)
@@ -0,0 +1,1339 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "windows.h"
+#include "winsock2.h"
+#include "winternl.h"
+#include "ws2tcpip.h"
+
+/* Kernel objects. Events and threads are the only kinds of object that the
+   host build ever waits on; a thread object is simply an event that becomes
+   signalled when the thread exits. Objects are reference counted since a
+   thread's handle can be closed while the thread is still running. A
+   waitable timer is an event that signals itself once its due time has
+   passed. A file is an object that nobody waits on, with a host file
+   descriptor in it, and a section is one with a block of memory in it.
+   Overlapped reads and writes of a file are carried out on the spot, so
+   they have already completed (and signalled their event) by the time that
+   ReadFile() or WriteFile() returns. That is all a regular file needs, but
+   it means that anything which can block, such as a pipe, will block the
+   caller here.
+
+   Events and sections can be named, so that different parts of a test can
+   open the same object, but names are only visible within the process.
+   Sections are listed along with named objects so that UnmapViewOfFile()
+   can find them again, and every view of a section is the section's own
+   memory and holds a reference to it. */
+
+struct shim_object {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int nrefs;
+    bool manual_reset;
+    bool signalled;
+    LPTHREAD_START_ROUTINE proc;
+    void *param;
+    DWORD thread_id;
+    bool suspended;
+    bool timer_armed;
+    struct timespec timer_due;
+    int fd;
+    void *view;
+    size_t view_nbytes;
+    bool listed;
+    wchar_t *name;
+    struct shim_object *next;
+};
+
+static struct shim_object *shim_object_new(bool manual_reset, bool signalled);
+static struct shim_object *shim_object_open(
+        LPCWSTR name,
+        bool manual_reset,
+        bool signalled,
+        size_t view_nbytes);
+static void shim_object_unref(struct shim_object *obj);
+static void shim_object_signal(struct shim_object *obj);
+static DWORD shim_object_wait(struct shim_object *obj, DWORD timeout_ms);
+static void shim_object_poll(struct shim_object *obj);
+static void shim_timespec_add_ns(struct timespec *ts, uint64_t ns);
+static bool shim_timespec_before(
+        const struct timespec *lhs,
+        const struct timespec *rhs);
+static off_t shim_ovl_offset(const OVERLAPPED *ovl);
+static void shim_ovl_complete(OVERLAPPED *ovl, DWORD nbytes);
+static void *shim_thread_main(void *ctx);
+static DWORD shim_errno_to_win32(int error);
+
+static __thread DWORD shim_last_error;
+static pthread_mutex_t shim_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shim_object *shim_list;
+static PEB_LDR_DATA shim_ldr;
+static PEB shim_peb;
+
+DWORD GetLastError(void)
+{
+    return shim_last_error;
+}
+
+void SetLastError(DWORD error)
+{
+    shim_last_error = error;
+}
+
+void InitializeCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutex_t *mutex;
+
+    assert(cs != NULL);
+
+    /* Win32 critical sections are recursive */
+
+    mutex = malloc(sizeof(*mutex));
+
+    if (mutex == NULL) {
+        abort();
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    cs->impl = mutex;
+}
+
+void DeleteCriticalSection(CRITICAL_SECTION *cs)
+{
+    assert(cs != NULL);
+
+    pthread_mutex_destroy(cs->impl);
+    free(cs->impl);
+    cs->impl = NULL;
+}
+
+void EnterCriticalSection(CRITICAL_SECTION *cs)
+{
+    assert(cs != NULL);
+
+    pthread_mutex_lock(cs->impl);
+}
+
+void LeaveCriticalSection(CRITICAL_SECTION *cs)
+{
+    assert(cs != NULL);
+
+    pthread_mutex_unlock(cs->impl);
+}
+
+HANDLE CreateEventW(
+        SECURITY_ATTRIBUTES *sa,
+        BOOL manual_reset,
+        BOOL initial_state,
+        LPCWSTR name)
+{
+    return shim_object_open(name, manual_reset, initial_state, 0);
+}
+
+BOOL SetEvent(HANDLE event)
+{
+    shim_object_signal(event);
+
+    return TRUE;
+}
+
+BOOL ResetEvent(HANDLE event)
+{
+    struct shim_object *obj;
+
+    obj = event;
+
+    pthread_mutex_lock(&obj->lock);
+    obj->signalled = false;
+    pthread_mutex_unlock(&obj->lock);
+
+    return TRUE;
+}
+
+DWORD WaitForSingleObject(HANDLE obj, DWORD timeout_ms)
+{
+    return shim_object_wait(obj, timeout_ms);
+}
+
+DWORD WaitForMultipleObjects(
+        DWORD nobjs,
+        const HANDLE *objs,
+        BOOL wait_all,
+        DWORD timeout_ms)
+{
+    DWORD result;
+    DWORD i;
+
+    assert(objs != NULL || nobjs == 0);
+
+    if (wait_all) {
+        /* Good enough for waiting on a batch of threads, which is all that
+           host builds use this for. The timeout applies to each object in
+           turn rather than to the whole batch. */
+
+        for (i = 0 ; i < nobjs ; i++) {
+            result = shim_object_wait(objs[i], timeout_ms);
+
+            if (result != WAIT_OBJECT_0) {
+                return result;
+            }
+        }
+
+        return WAIT_OBJECT_0;
+    }
+
+    for (;;) {
+        for (i = 0 ; i < nobjs ; i++) {
+            if (shim_object_wait(objs[i], 0) == WAIT_OBJECT_0) {
+                return WAIT_OBJECT_0 + i;
+            }
+        }
+
+        if (timeout_ms == 0) {
+            return WAIT_TIMEOUT;
+        }
+
+        Sleep(1);
+
+        if (timeout_ms != INFINITE) {
+            timeout_ms--;
+        }
+    }
+}
+
+BOOL CloseHandle(HANDLE obj)
+{
+    if (obj == NULL || obj == INVALID_HANDLE_VALUE) {
+        SetLastError(ERROR_INVALID_HANDLE);
+
+        return FALSE;
+    }
+
+    shim_object_unref(obj);
+
+    return TRUE;
+}
+
+HANDLE CreateWaitableTimerW(
+        SECURITY_ATTRIBUTES *sa,
+        BOOL manual_reset,
+        LPCWSTR name)
+{
+    return CreateWaitableTimerExW(
+            sa,
+            name,
+            manual_reset ? CREATE_WAITABLE_TIMER_MANUAL_RESET : 0,
+            TIMER_ALL_ACCESS);
+}
+
+HANDLE CreateWaitableTimerExW(
+        SECURITY_ATTRIBUTES *sa,
+        LPCWSTR name,
+        DWORD flags,
+        DWORD access)
+{
+    struct shim_object *obj;
+
+    /* Every timer is as high resolution as the host's condition variables */
+
+    if (name != NULL) {
+        SetLastError(ERROR_NOT_SUPPORTED);
+
+        return NULL;
+    }
+
+    obj = shim_object_new(flags & CREATE_WAITABLE_TIMER_MANUAL_RESET, false);
+
+    if (obj == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+
+        return NULL;
+    }
+
+    return obj;
+}
+
+BOOL SetWaitableTimer(
+        HANDLE timer,
+        const LARGE_INTEGER *due,
+        LONG period_ms,
+        void *completion,
+        void *completion_arg,
+        BOOL resume)
+{
+    struct shim_object *obj;
+
+    assert(timer != NULL);
+    assert(due != NULL);
+
+    /* One-shot relative timers only, which is all that the timer wheel
+       uses. Relative due times are negative, in units of 100ns. */
+
+    assert(due->QuadPart <= 0);
+    assert(period_ms == 0);
+    assert(completion == NULL);
+
+    obj = timer;
+
+    pthread_mutex_lock(&obj->lock);
+    clock_gettime(CLOCK_REALTIME, &obj->timer_due);
+    shim_timespec_add_ns(&obj->timer_due, (uint64_t) -due->QuadPart * 100);
+    obj->timer_armed = true;
+    obj->signalled = false;
+    pthread_cond_broadcast(&obj->cond);
+    pthread_mutex_unlock(&obj->lock);
+
+    return TRUE;
+}
+
+HANDLE CreateFileMappingW(
+        HANDLE file,
+        SECURITY_ATTRIBUTES *sa,
+        DWORD protect,
+        DWORD size_high,
+        DWORD size_low,
+        LPCWSTR name)
+{
+    /* Memory sections only, not mappings of files */
+
+    assert(file == INVALID_HANDLE_VALUE);
+    assert(protect == PAGE_READWRITE);
+    assert(size_high == 0);
+    assert(size_low > 0);
+
+    return shim_object_open(name, true, false, size_low);
+}
+
+LPVOID MapViewOfFile(
+        HANDLE section,
+        DWORD access,
+        DWORD offset_high,
+        DWORD offset_low,
+        SIZE_T nbytes)
+{
+    struct shim_object *obj;
+
+    assert(section != NULL);
+    assert(offset_high == 0 && offset_low == 0);
+
+    obj = section;
+
+    if (obj->view == NULL || nbytes > obj->view_nbytes) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+
+        return NULL;
+    }
+
+    pthread_mutex_lock(&obj->lock);
+    obj->nrefs++;
+    pthread_mutex_unlock(&obj->lock);
+
+    return obj->view;
+}
+
+BOOL UnmapViewOfFile(LPCVOID addr)
+{
+    struct shim_object *obj;
+
+    pthread_mutex_lock(&shim_list_lock);
+
+    for (obj = shim_list ; obj != NULL ; obj = obj->next) {
+        if (obj->view == addr) {
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&shim_list_lock);
+
+    if (obj == NULL) {
+        SetLastError(ERROR_INVALID_ADDRESS);
+
+        return FALSE;
+    }
+
+    shim_object_unref(obj);
+
+    return TRUE;
+}
+
+HANDLE CreateFileW(
+        LPCWSTR path,
+        DWORD access,
+        DWORD share,
+        SECURITY_ATTRIBUTES *sa,
+        DWORD creation,
+        DWORD flags,
+        HANDLE tmpl)
+{
+    struct shim_object *obj;
+    char buf[4096];
+    size_t i;
+    int oflags;
+    int fd;
+
+    assert(path != NULL);
+    assert(creation == CREATE_ALWAYS ||
+           creation == OPEN_EXISTING ||
+           creation == OPEN_ALWAYS);
+
+    /* ASCII paths only, as with MultiByteToWideChar() */
+
+    for (i = 0 ; path[i] != L'\0' ; i++) {
+        if (i + 1 >= sizeof(buf) || path[i] > 0x7F) {
+            SetLastError(ERROR_INVALID_PARAMETER);
+
+            return INVALID_HANDLE_VALUE;
+        }
+
+        buf[i] = (char) path[i];
+    }
+
+    buf[i] = '\0';
+
+    if ((access & GENERIC_READ) && (access & GENERIC_WRITE)) {
+        oflags = O_RDWR;
+    } else if (access & GENERIC_WRITE) {
+        oflags = O_WRONLY;
+    } else {
+        oflags = O_RDONLY;
+    }
+
+    if (creation == CREATE_ALWAYS) {
+        oflags |= O_CREAT | O_TRUNC;
+    } else if (creation == OPEN_ALWAYS) {
+        oflags |= O_CREAT;
+    }
+
+    fd = open(buf, oflags | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        SetLastError(shim_errno_to_win32(errno));
+
+        return INVALID_HANDLE_VALUE;
+    }
+
+    obj = shim_object_new(true, false);
+
+    if (obj == NULL) {
+        close(fd);
+        SetLastError(ERROR_OUTOFMEMORY);
+
+        return INVALID_HANDLE_VALUE;
+    }
+
+    obj->fd = fd;
+
+    return obj;
+}
+
+BOOL ReadFile(
+        HANDLE file,
+        LPVOID bytes,
+        DWORD nbytes,
+        LPDWORD nread,
+        OVERLAPPED *ovl)
+{
+    struct shim_object *obj;
+    ssize_t r;
+
+    assert(file != NULL);
+    assert(bytes != NULL || nbytes == 0);
+
+    obj = file;
+
+    if (obj->fd < 0) {
+        SetLastError(ERROR_INVALID_HANDLE);
+
+        return FALSE;
+    }
+
+    do {
+        if (ovl != NULL) {
+            r = pread(obj->fd, bytes, nbytes, shim_ovl_offset(ovl));
+        } else {
+            r = read(obj->fd, bytes, nbytes);
+        }
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        SetLastError(shim_errno_to_win32(errno));
+
+        return FALSE;
+    }
+
+    if (nread != NULL) {
+        *nread = (DWORD) r;
+    }
+
+    if (ovl == NULL) {
+        return TRUE;
+    }
+
+    /* Unlike a synchronous read, an overlapped one fails at end of file */
+
+    if (r == 0 && nbytes > 0) {
+        SetLastError(ERROR_HANDLE_EOF);
+
+        return FALSE;
+    }
+
+    shim_ovl_complete(ovl, (DWORD) r);
+
+    return TRUE;
+}
+
+BOOL WriteFile(
+        HANDLE file,
+        LPCVOID bytes,
+        DWORD nbytes,
+        LPDWORD nwritten,
+        OVERLAPPED *ovl)
+{
+    struct shim_object *obj;
+    const uint8_t *pos;
+    DWORD total;
+    ssize_t r;
+
+    assert(file != NULL);
+    assert(bytes != NULL || nbytes == 0);
+
+    obj = file;
+    pos = bytes;
+    total = 0;
+
+    if (obj->fd < 0) {
+        SetLastError(ERROR_INVALID_HANDLE);
+
+        return FALSE;
+    }
+
+    while (total < nbytes) {
+        if (ovl != NULL) {
+            r = pwrite(
+                    obj->fd,
+                    pos + total,
+                    nbytes - total,
+                    shim_ovl_offset(ovl) + total);
+        } else {
+            r = write(obj->fd, pos + total, nbytes - total);
+        }
+
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (r < 0) {
+            SetLastError(shim_errno_to_win32(errno));
+
+            break;
+        }
+
+        total += (DWORD) r;
+    }
+
+    if (nwritten != NULL) {
+        *nwritten = total;
+    }
+
+    if (total != nbytes) {
+        return FALSE;
+    }
+
+    if (ovl != NULL) {
+        shim_ovl_complete(ovl, total);
+    }
+
+    return TRUE;
+}
+
+BOOL GetOverlappedResult(
+        HANDLE file,
+        OVERLAPPED *ovl,
+        LPDWORD nbytes,
+        BOOL wait)
+{
+    assert(file != NULL);
+    assert(ovl != NULL);
+    assert(nbytes != NULL);
+
+    /* Only ever asked about operations that succeeded, and those have
+       always completed already. */
+
+    *nbytes = (DWORD) ovl->InternalHigh;
+
+    return TRUE;
+}
+
+BOOL CancelIoEx(HANDLE file, OVERLAPPED *ovl)
+{
+    assert(file != NULL);
+
+    /* Nothing is ever left in flight to cancel */
+
+    SetLastError(ERROR_NOT_FOUND);
+
+    return FALSE;
+}
+
+BOOL GetFileSizeEx(HANDLE file, LARGE_INTEGER *size)
+{
+    struct shim_object *obj;
+    struct stat st;
+
+    assert(file != NULL);
+    assert(size != NULL);
+
+    obj = file;
+
+    if (obj->fd < 0) {
+        SetLastError(ERROR_INVALID_HANDLE);
+
+        return FALSE;
+    }
+
+    if (fstat(obj->fd, &st) != 0) {
+        SetLastError(shim_errno_to_win32(errno));
+
+        return FALSE;
+    }
+
+    size->QuadPart = st.st_size;
+
+    return TRUE;
+}
+
+HANDLE CreateThread(
+        SECURITY_ATTRIBUTES *sa,
+        SIZE_T stack_size,
+        LPTHREAD_START_ROUTINE proc,
+        LPVOID param,
+        DWORD flags,
+        LPDWORD thread_id)
+{
+    struct shim_object *obj;
+    pthread_t thread;
+    int r;
+
+    assert(proc != NULL);
+    assert((flags & ~CREATE_SUSPENDED) == 0);
+
+    obj = shim_object_new(true, false);
+
+    if (obj == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+
+        return NULL;
+    }
+
+    obj->proc = proc;
+    obj->param = param;
+    obj->suspended = flags & CREATE_SUSPENDED;
+    obj->nrefs++;
+
+    r = pthread_create(&thread, NULL, shim_thread_main, obj);
+
+    if (r != 0) {
+        obj->nrefs = 1;
+        shim_object_unref(obj);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+
+        return NULL;
+    }
+
+    pthread_detach(thread);
+
+    if (thread_id != NULL) {
+        *thread_id = GetThreadId(obj);
+    }
+
+    return obj;
+}
+
+DWORD ResumeThread(HANDLE thread)
+{
+    struct shim_object *obj;
+    DWORD count;
+
+    obj = thread;
+
+    /* A thread can only be suspended when it is created */
+
+    pthread_mutex_lock(&obj->lock);
+    count = obj->suspended ? 1 : 0;
+    obj->suspended = false;
+    pthread_cond_broadcast(&obj->cond);
+    pthread_mutex_unlock(&obj->lock);
+
+    return count;
+}
+
+DWORD GetCurrentThreadId(void)
+{
+    return (DWORD) syscall(SYS_gettid);
+}
+
+DWORD GetThreadId(HANDLE thread)
+{
+    struct shim_object *obj;
+    DWORD thread_id;
+
+    obj = thread;
+
+    /* Wait for the thread to report in if it has only just been created */
+
+    pthread_mutex_lock(&obj->lock);
+
+    while (obj->proc != NULL && obj->thread_id == 0) {
+        pthread_cond_wait(&obj->cond, &obj->lock);
+    }
+
+    thread_id = obj->thread_id;
+    pthread_mutex_unlock(&obj->lock);
+
+    return thread_id;
+}
+
+BOOL SetThreadPriority(HANDLE thread, int priority)
+{
+    /* Raising a thread's priority needs privileges that a build box won't
+       give us, and nothing on the host is that sensitive to latency. */
+
+    return TRUE;
+}
+
+BOOL SwitchToThread(void)
+{
+    sched_yield();
+
+    return TRUE;
+}
+
+void Sleep(DWORD ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count)
+{
+    struct timespec ts;
+
+    assert(count != NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    count->QuadPart = (LONGLONG) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq)
+{
+    assert(freq != NULL);
+
+    freq->QuadPart = 1000000000;
+
+    return TRUE;
+}
+
+void GetSystemInfo(SYSTEM_INFO *si)
+{
+    assert(si != NULL);
+
+    memset(si, 0, sizeof(*si));
+    si->dwPageSize = (DWORD) sysconf(_SC_PAGESIZE);
+    si->dwNumberOfProcessors = (DWORD) sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+HMODULE GetModuleHandleW(LPCWSTR name)
+{
+    /* There are no DLLs on the host */
+
+    SetLastError(ERROR_FILE_NOT_FOUND);
+
+    return NULL;
+}
+
+FARPROC GetProcAddress(HMODULE module, LPCSTR name)
+{
+    /* Only the exits that iohook has to look up for itself, since nothing
+       on the host has an import table for it to find them in. */
+
+    assert(name != NULL);
+
+    if (strcmp(name, "CloseHandle") == 0) {
+        return (FARPROC) CloseHandle;
+    }
+
+    SetLastError(ERROR_PROC_NOT_FOUND);
+
+    return NULL;
+}
+
+BOOL VirtualProtect(
+        LPVOID addr,
+        SIZE_T nbytes,
+        DWORD new_protect,
+        DWORD *old_protect)
+{
+    /* Only ever used to patch import tables, which on the host can only be
+       ones that somebody built in ordinary writable memory. */
+
+    if (old_protect != NULL) {
+        *old_protect = PAGE_READWRITE;
+    }
+
+    return TRUE;
+}
+
+LPSTR GetCommandLineA(void)
+{
+    static char *cmdline;
+    char buf[4096];
+    size_t nbytes;
+    size_t i;
+    FILE *f;
+
+    if (cmdline != NULL) {
+        return cmdline;
+    }
+
+    /* Reconstitute a Win32-style command line from the NUL-separated one */
+
+    nbytes = 0;
+    f = fopen("/proc/self/cmdline", "rb");
+
+    if (f != NULL) {
+        nbytes = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+    }
+
+    while (nbytes > 0 && buf[nbytes - 1] == '\0') {
+        nbytes--;
+    }
+
+    for (i = 0 ; i < nbytes ; i++) {
+        if (buf[i] == '\0') {
+            buf[i] = ' ';
+        }
+    }
+
+    buf[nbytes] = '\0';
+    cmdline = strdup(buf);
+
+    return cmdline;
+}
+
+int MultiByteToWideChar(
+        UINT cp,
+        DWORD flags,
+        LPCSTR src,
+        int src_nchars,
+        LPWSTR dest,
+        int dest_nchars)
+{
+    int nchars;
+    int i;
+
+    /* ASCII only, which is all that a host build ever feeds through here */
+
+    if (src_nchars < 0) {
+        nchars = (int) strlen(src) + 1;
+    } else {
+        nchars = src_nchars;
+    }
+
+    if (dest_nchars == 0) {
+        return nchars;
+    }
+
+    if (dest_nchars < nchars) {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+
+        return 0;
+    }
+
+    for (i = 0 ; i < nchars ; i++) {
+        dest[i] = (unsigned char) src[i];
+    }
+
+    return nchars;
+}
+
+int _stricmp(const char *lhs, const char *rhs)
+{
+    return strcasecmp(lhs, rhs);
+}
+
+int _strnicmp(const char *lhs, const char *rhs, size_t nchars)
+{
+    return strncasecmp(lhs, rhs, nchars);
+}
+
+int WSAStartup(WORD version, WSADATA *data)
+{
+    assert(data != NULL);
+
+    /* See winsock2.h. Nothing else here can be reached without this. */
+
+    memset(data, 0, sizeof(*data));
+
+    return WSASYSNOTREADY;
+}
+
+int WSACleanup(void)
+{
+    SetLastError(WSANOTINITIALISED);
+
+    return SOCKET_ERROR;
+}
+
+int WSAGetLastError(void)
+{
+    return (int) GetLastError();
+}
+
+SOCKET WSASocketW(
+        int family,
+        int type,
+        int protocol,
+        void *info,
+        unsigned int group,
+        DWORD flags)
+{
+    SetLastError(WSANOTINITIALISED);
+
+    return INVALID_SOCKET;
+}
+
+int connect(SOCKET sock, const struct sockaddr *addr, int addr_nbytes)
+{
+    SetLastError(WSANOTINITIALISED);
+
+    return SOCKET_ERROR;
+}
+
+int setsockopt(
+        SOCKET sock,
+        int level,
+        int name,
+        const char *value,
+        int value_nbytes)
+{
+    SetLastError(WSANOTINITIALISED);
+
+    return SOCKET_ERROR;
+}
+
+int closesocket(SOCKET sock)
+{
+    SetLastError(WSANOTINITIALISED);
+
+    return SOCKET_ERROR;
+}
+
+int WSASend(
+        SOCKET sock,
+        WSABUF *bufs,
+        DWORD nbufs,
+        LPDWORD nsent,
+        DWORD flags,
+        OVERLAPPED *ovl,
+        void *completion)
+{
+    SetLastError(WSANOTINITIALISED);
+
+    return SOCKET_ERROR;
+}
+
+int WSARecv(
+        SOCKET sock,
+        WSABUF *bufs,
+        DWORD nbufs,
+        LPDWORD nrecvd,
+        LPDWORD flags,
+        OVERLAPPED *ovl,
+        void *completion)
+{
+    SetLastError(WSANOTINITIALISED);
+
+    return SOCKET_ERROR;
+}
+
+BOOL WSAGetOverlappedResult(
+        SOCKET sock,
+        OVERLAPPED *ovl,
+        LPDWORD nbytes,
+        BOOL wait,
+        LPDWORD flags)
+{
+    SetLastError(WSANOTINITIALISED);
+
+    return FALSE;
+}
+
+int GetAddrInfoW(
+        LPCWSTR host,
+        LPCWSTR service,
+        const ADDRINFOW *hints,
+        ADDRINFOW **out)
+{
+    assert(out != NULL);
+
+    *out = NULL;
+
+    return WSANOTINITIALISED;
+}
+
+void FreeAddrInfoW(ADDRINFOW *addrs)
+{
+    assert(addrs == NULL);
+}
+
+PEB *shim_get_peb(void)
+{
+    /* Empty circular module list, see winternl.h */
+
+    shim_ldr.InMemoryOrderModuleList.Flink = &shim_ldr.InMemoryOrderModuleList;
+    shim_ldr.InMemoryOrderModuleList.Blink = &shim_ldr.InMemoryOrderModuleList;
+    shim_peb.Ldr = &shim_ldr;
+
+    return &shim_peb;
+}
+
+static struct shim_object *shim_object_new(bool manual_reset, bool signalled)
+{
+    struct shim_object *obj;
+
+    obj = calloc(1, sizeof(*obj));
+
+    if (obj == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&obj->lock, NULL);
+    pthread_cond_init(&obj->cond, NULL);
+    obj->nrefs = 1;
+    obj->manual_reset = manual_reset;
+    obj->signalled = signalled;
+    obj->fd = -1;
+
+    return obj;
+}
+
+static struct shim_object *shim_object_open(
+        LPCWSTR name,
+        bool manual_reset,
+        bool signalled,
+        size_t view_nbytes)
+{
+    struct shim_object *obj;
+
+    /* Opens the named event (or section, if view_nbytes is not zero) if it
+       already exists, otherwise creates it. */
+
+    pthread_mutex_lock(&shim_list_lock);
+
+    obj = NULL;
+
+    if (name != NULL) {
+        for (obj = shim_list ; obj != NULL ; obj = obj->next) {
+            if (obj->name != NULL && wcscmp(obj->name, name) == 0) {
+                break;
+            }
+        }
+    }
+
+    if (obj != NULL) {
+        if ((obj->view != NULL) != (view_nbytes != 0)) {
+            pthread_mutex_unlock(&shim_list_lock);
+            SetLastError(ERROR_INVALID_HANDLE);
+
+            return NULL;
+        }
+
+        pthread_mutex_lock(&obj->lock);
+        obj->nrefs++;
+        pthread_mutex_unlock(&obj->lock);
+        pthread_mutex_unlock(&shim_list_lock);
+        SetLastError(ERROR_ALREADY_EXISTS);
+
+        return obj;
+    }
+
+    obj = shim_object_new(manual_reset, signalled);
+
+    if (obj == NULL) {
+        goto fail;
+    }
+
+    if (name != NULL) {
+        obj->name = wcsdup(name);
+
+        if (obj->name == NULL) {
+            goto fail;
+        }
+    }
+
+    if (view_nbytes != 0) {
+        obj->view = calloc(1, view_nbytes);
+        obj->view_nbytes = view_nbytes;
+
+        if (obj->view == NULL) {
+            goto fail;
+        }
+    }
+
+    if (obj->name != NULL || obj->view != NULL) {
+        obj->listed = true;
+        obj->next = shim_list;
+        shim_list = obj;
+    }
+
+    pthread_mutex_unlock(&shim_list_lock);
+    SetLastError(ERROR_SUCCESS);
+
+    return obj;
+
+fail:
+    pthread_mutex_unlock(&shim_list_lock);
+
+    if (obj != NULL) {
+        shim_object_unref(obj);
+    }
+
+    SetLastError(ERROR_OUTOFMEMORY);
+
+    return NULL;
+}
+
+static void shim_object_unref(struct shim_object *obj)
+{
+    struct shim_object **pos;
+    unsigned int nrefs;
+    bool listed;
+
+    /* Listed objects come off the list under the same lock that opening
+       them by name takes, so that nobody can open one as it goes away. */
+
+    listed = obj->listed;
+
+    if (listed) {
+        pthread_mutex_lock(&shim_list_lock);
+    }
+
+    pthread_mutex_lock(&obj->lock);
+    nrefs = --obj->nrefs;
+    pthread_mutex_unlock(&obj->lock);
+
+    if (listed && nrefs == 0) {
+        for (pos = &shim_list ; *pos != obj ; pos = &(*pos)->next);
+
+        *pos = obj->next;
+    }
+
+    if (listed) {
+        pthread_mutex_unlock(&shim_list_lock);
+    }
+
+    if (nrefs > 0) {
+        return;
+    }
+
+    if (obj->fd >= 0) {
+        close(obj->fd);
+    }
+
+    free(obj->view);
+    free(obj->name);
+
+    pthread_cond_destroy(&obj->cond);
+    pthread_mutex_destroy(&obj->lock);
+    free(obj);
+}
+
+static void shim_object_signal(struct shim_object *obj)
+{
+    pthread_mutex_lock(&obj->lock);
+    obj->signalled = true;
+    pthread_cond_broadcast(&obj->cond);
+    pthread_mutex_unlock(&obj->lock);
+}
+
+static DWORD shim_object_wait(struct shim_object *obj, DWORD timeout_ms)
+{
+    struct timespec deadline;
+    struct timespec wake;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    if (timeout_ms != INFINITE) {
+        shim_timespec_add_ns(&deadline, (uint64_t) timeout_ms * 1000000);
+    }
+
+    pthread_mutex_lock(&obj->lock);
+
+    /* An armed timer wakes us up when it falls due, so that it can signal
+       itself. */
+
+    for (;;) {
+        shim_object_poll(obj);
+
+        if (obj->signalled) {
+            break;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        if (timeout_ms != INFINITE && !shim_timespec_before(&now, &deadline)) {
+            break;
+        }
+
+        if (timeout_ms == INFINITE && !obj->timer_armed) {
+            pthread_cond_wait(&obj->cond, &obj->lock);
+
+            continue;
+        }
+
+        wake = deadline;
+
+        if (    obj->timer_armed &&
+                (   timeout_ms == INFINITE ||
+                    shim_timespec_before(&obj->timer_due, &wake))) {
+            wake = obj->timer_due;
+        }
+
+        pthread_cond_timedwait(&obj->cond, &obj->lock, &wake);
+    }
+
+    if (!obj->signalled) {
+        pthread_mutex_unlock(&obj->lock);
+
+        return WAIT_TIMEOUT;
+    }
+
+    if (!obj->manual_reset) {
+        obj->signalled = false;
+    }
+
+    pthread_mutex_unlock(&obj->lock);
+
+    return WAIT_OBJECT_0;
+}
+
+static void shim_object_poll(struct shim_object *obj)
+{
+    struct timespec now;
+
+    /* Caller holds obj->lock */
+
+    if (!obj->timer_armed) {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    if (!shim_timespec_before(&now, &obj->timer_due)) {
+        obj->timer_armed = false;
+        obj->signalled = true;
+    }
+}
+
+static void shim_timespec_add_ns(struct timespec *ts, uint64_t ns)
+{
+    ts->tv_sec += ns / 1000000000;
+    ts->tv_nsec += ns % 1000000000;
+
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static bool shim_timespec_before(
+        const struct timespec *lhs,
+        const struct timespec *rhs)
+{
+    if (lhs->tv_sec != rhs->tv_sec) {
+        return lhs->tv_sec < rhs->tv_sec;
+    }
+
+    return lhs->tv_nsec < rhs->tv_nsec;
+}
+
+static off_t shim_ovl_offset(const OVERLAPPED *ovl)
+{
+    return (off_t) (((uint64_t) ovl->OffsetHigh << 32) | ovl->Offset);
+}
+
+static void shim_ovl_complete(OVERLAPPED *ovl, DWORD nbytes)
+{
+    ovl->Internal = 0;
+    ovl->InternalHigh = nbytes;
+
+    if (ovl->hEvent != NULL) {
+        SetEvent(ovl->hEvent);
+    }
+}
+
+static void *shim_thread_main(void *ctx)
+{
+    struct shim_object *obj;
+
+    obj = ctx;
+
+    pthread_mutex_lock(&obj->lock);
+    obj->thread_id = GetCurrentThreadId();
+    pthread_cond_broadcast(&obj->cond);
+
+    while (obj->suspended) {
+        pthread_cond_wait(&obj->cond, &obj->lock);
+    }
+
+    pthread_mutex_unlock(&obj->lock);
+
+    obj->proc(obj->param);
+
+    shim_object_signal(obj);
+    shim_object_unref(obj);
+
+    return NULL;
+}
+
+static DWORD shim_errno_to_win32(int error)
+{
+    switch (error) {
+    case ENOENT:    return ERROR_FILE_NOT_FOUND;
+    case EACCES:    return ERROR_ACCESS_DENIED;
+    case EPERM:     return ERROR_ACCESS_DENIED;
+    case EBADF:     return ERROR_INVALID_HANDLE;
+    case ENOMEM:    return ERROR_NOT_ENOUGH_MEMORY;
+    case EINVAL:    return ERROR_INVALID_PARAMETER;
+    default:        return ERROR_GEN_FAILURE;
+    }
+}
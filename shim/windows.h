@@ -0,0 +1,347 @@
+#pragma once
+
+/* Minimal Win32 shim for host builds.
+
+   This provides just enough of the Win32 type system and API surface for the
+   portable parts of capnhook (iobuf, args, options, PE parsing, the iohook
+   dispatch core and the uart emulation in hooklib) to be compiled and run
+   natively on a POSIX build box, which is where fuzzers, sanitizers,
+   benchmarks and tests get run. It is not, and never
+   will be, an emulation layer: anything that is not needed by those units is
+   deliberately left out. Sizes of integer types follow the Win32 LLP64
+   model, not the host's LP64 model. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WINAPI
+#define CALLBACK
+#define NTAPI
+
+/* Types */
+
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef uint8_t BOOLEAN;
+typedef uint8_t UCHAR;
+typedef char CHAR;
+typedef uint16_t WORD;
+typedef uint16_t USHORT;
+typedef wchar_t WCHAR;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint32_t DWORD;
+typedef int INT;
+typedef unsigned int UINT;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uint64_t DWORD64;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR;
+typedef uintptr_t DWORD_PTR;
+typedef uintptr_t SIZE_T;
+typedef int32_t HRESULT;
+typedef int32_t NTSTATUS;
+
+typedef void *HANDLE;
+typedef void *HMODULE;
+typedef void *PVOID;
+typedef void *LPVOID;
+typedef const void *LPCVOID;
+typedef void (*FARPROC)(void);
+typedef char *LPSTR;
+typedef const char *LPCSTR;
+typedef wchar_t *LPWSTR;
+typedef const wchar_t *LPCWSTR;
+typedef DWORD *LPDWORD;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        DWORD LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _OVERLAPPED {
+    ULONG_PTR Internal;
+    ULONG_PTR InternalHigh;
+    union {
+        struct {
+            DWORD Offset;
+            DWORD OffsetHigh;
+        };
+        PVOID Pointer;
+    };
+    HANDLE hEvent;
+} OVERLAPPED, *LPOVERLAPPED;
+
+typedef struct _SECURITY_ATTRIBUTES {
+    DWORD nLength;
+    LPVOID lpSecurityDescriptor;
+    BOOL bInheritHandle;
+} SECURITY_ATTRIBUTES;
+
+typedef struct _CRITICAL_SECTION {
+    void *impl;
+} CRITICAL_SECTION;
+
+typedef struct _SYSTEM_INFO {
+    DWORD dwPageSize;
+    DWORD dwNumberOfProcessors;
+} SYSTEM_INFO;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY;
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID param);
+
+/* Constants */
+
+#define TRUE 1
+#define FALSE 0
+
+#define INFINITE 0xFFFFFFFF
+#define MAXDWORD 0xFFFFFFFF
+#define MAX_PATH 260
+#define INVALID_HANDLE_VALUE ((HANDLE) (LONG_PTR) -1)
+#define INVALID_SET_FILE_POINTER ((DWORD) -1)
+
+#define WAIT_OBJECT_0 0x00000000
+#define WAIT_TIMEOUT 0x00000102
+#define WAIT_FAILED 0xFFFFFFFF
+
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_SHARE_READ 0x00000001
+#define FILE_SHARE_WRITE 0x00000002
+#define FILE_SHARE_DELETE 0x00000004
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+#define FILE_FLAG_OVERLAPPED 0x40000000
+#define FILE_BEGIN 0
+#define FILE_CURRENT 1
+#define FILE_END 2
+
+#define CP_ACP 0
+
+#define TIMER_ALL_ACCESS 0x001F0003
+#define CREATE_WAITABLE_TIMER_MANUAL_RESET 0x00000001
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+
+#define THREAD_PRIORITY_NORMAL 0
+#define THREAD_PRIORITY_HIGHEST 2
+#define CREATE_SUSPENDED 0x00000004
+
+#define PAGE_READWRITE 0x04
+#define PAGE_EXECUTE_READWRITE 0x40
+#define FILE_MAP_ALL_ACCESS 0x000F001F
+
+/* Error handling */
+
+#define ERROR_SUCCESS 0
+#define ERROR_INVALID_FUNCTION 1
+#define ERROR_FILE_NOT_FOUND 2
+#define ERROR_ACCESS_DENIED 5
+#define ERROR_INVALID_HANDLE 6
+#define ERROR_NOT_ENOUGH_MEMORY 8
+#define ERROR_INVALID_DATA 13
+#define ERROR_OUTOFMEMORY 14
+#define ERROR_CRC 23
+#define ERROR_WRITE_FAULT 29
+#define ERROR_READ_FAULT 30
+#define ERROR_GEN_FAILURE 31
+#define ERROR_HANDLE_EOF 38
+#define ERROR_NOT_SUPPORTED 50
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_BROKEN_PIPE 109
+#define ERROR_SEM_TIMEOUT 121
+#define ERROR_INSUFFICIENT_BUFFER 122
+#define ERROR_PROC_NOT_FOUND 127
+#define ERROR_BUSY 170
+#define ERROR_ALREADY_EXISTS 183
+#define ERROR_NO_DATA 232
+#define ERROR_MORE_DATA 234
+#define ERROR_INVALID_ADDRESS 487
+#define ERROR_OPERATION_ABORTED 995
+#define ERROR_IO_INCOMPLETE 996
+#define ERROR_IO_PENDING 997
+#define ERROR_NOT_FOUND 1168
+#define ERROR_INTERNAL_ERROR 1359
+#define ERROR_TIMEOUT 1460
+
+#define FACILITY_WIN32 7
+#define FACILITY_NTWIN32 7
+
+#define S_OK ((HRESULT) 0x00000000)
+#define S_FALSE ((HRESULT) 0x00000001)
+#define E_NOTIMPL ((HRESULT) 0x80004001)
+#define E_NOINTERFACE ((HRESULT) 0x80004002)
+#define E_POINTER ((HRESULT) 0x80004003)
+#define E_ABORT ((HRESULT) 0x80004004)
+#define E_FAIL ((HRESULT) 0x80004005)
+#define E_UNEXPECTED ((HRESULT) 0x8000FFFF)
+#define E_ACCESSDENIED ((HRESULT) 0x80070005)
+#define E_HANDLE ((HRESULT) 0x80070006)
+#define E_OUTOFMEMORY ((HRESULT) 0x8007000E)
+#define E_INVALIDARG ((HRESULT) 0x80070057)
+
+#define SUCCEEDED(hr) (((HRESULT) (hr)) >= 0)
+#define FAILED(hr) (((HRESULT) (hr)) < 0)
+#define HRESULT_CODE(hr) ((hr) & 0xFFFF)
+#define HRESULT_FACILITY(hr) (((hr) >> 16) & 0x1FFF)
+#define HRESULT_FROM_WIN32(x) \
+        ((HRESULT) (x) <= 0 ? ((HRESULT) (x)) : ((HRESULT) \
+        (((x) & 0x0000FFFF) | (FACILITY_WIN32 << 16) | 0x80000000)))
+
+/* Macros */
+
+#define _countof(a) (sizeof(a) / sizeof((a)[0]))
+#define CONTAINING_RECORD(addr, type, field) \
+        ((type *) ((uint8_t *) (addr) - offsetof(type, field)))
+#define MemoryBarrier() __sync_synchronize()
+#define InterlockedIncrement(p) __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p) __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(p, v) \
+        __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, v, cmp) \
+        __sync_val_compare_and_swap((p), (cmp), (v))
+#define GetCommandLine GetCommandLineA
+
+/* Functions */
+
+DWORD GetLastError(void);
+void SetLastError(DWORD error);
+
+void InitializeCriticalSection(CRITICAL_SECTION *cs);
+void DeleteCriticalSection(CRITICAL_SECTION *cs);
+void EnterCriticalSection(CRITICAL_SECTION *cs);
+void LeaveCriticalSection(CRITICAL_SECTION *cs);
+
+HANDLE CreateEventW(
+        SECURITY_ATTRIBUTES *sa,
+        BOOL manual_reset,
+        BOOL initial_state,
+        LPCWSTR name);
+BOOL SetEvent(HANDLE event);
+BOOL ResetEvent(HANDLE event);
+DWORD WaitForSingleObject(HANDLE obj, DWORD timeout_ms);
+DWORD WaitForMultipleObjects(
+        DWORD nobjs,
+        const HANDLE *objs,
+        BOOL wait_all,
+        DWORD timeout_ms);
+BOOL CloseHandle(HANDLE obj);
+
+HANDLE CreateWaitableTimerW(
+        SECURITY_ATTRIBUTES *sa,
+        BOOL manual_reset,
+        LPCWSTR name);
+HANDLE CreateWaitableTimerExW(
+        SECURITY_ATTRIBUTES *sa,
+        LPCWSTR name,
+        DWORD flags,
+        DWORD access);
+BOOL SetWaitableTimer(
+        HANDLE timer,
+        const LARGE_INTEGER *due,
+        LONG period_ms,
+        void *completion,
+        void *completion_arg,
+        BOOL resume);
+
+HANDLE CreateFileMappingW(
+        HANDLE file,
+        SECURITY_ATTRIBUTES *sa,
+        DWORD protect,
+        DWORD size_high,
+        DWORD size_low,
+        LPCWSTR name);
+LPVOID MapViewOfFile(
+        HANDLE section,
+        DWORD access,
+        DWORD offset_high,
+        DWORD offset_low,
+        SIZE_T nbytes);
+BOOL UnmapViewOfFile(LPCVOID addr);
+
+HANDLE CreateFileW(
+        LPCWSTR path,
+        DWORD access,
+        DWORD share,
+        SECURITY_ATTRIBUTES *sa,
+        DWORD creation,
+        DWORD flags,
+        HANDLE tmpl);
+BOOL ReadFile(
+        HANDLE file,
+        LPVOID bytes,
+        DWORD nbytes,
+        LPDWORD nread,
+        OVERLAPPED *ovl);
+BOOL WriteFile(
+        HANDLE file,
+        LPCVOID bytes,
+        DWORD nbytes,
+        LPDWORD nwritten,
+        OVERLAPPED *ovl);
+BOOL GetOverlappedResult(
+        HANDLE file,
+        OVERLAPPED *ovl,
+        LPDWORD nbytes,
+        BOOL wait);
+BOOL CancelIoEx(HANDLE file, OVERLAPPED *ovl);
+BOOL GetFileSizeEx(HANDLE file, LARGE_INTEGER *size);
+
+HANDLE CreateThread(
+        SECURITY_ATTRIBUTES *sa,
+        SIZE_T stack_size,
+        LPTHREAD_START_ROUTINE proc,
+        LPVOID param,
+        DWORD flags,
+        LPDWORD thread_id);
+DWORD ResumeThread(HANDLE thread);
+DWORD GetCurrentThreadId(void);
+DWORD GetThreadId(HANDLE thread);
+BOOL SetThreadPriority(HANDLE thread, int priority);
+BOOL SwitchToThread(void);
+void Sleep(DWORD ms);
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *count);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *freq);
+void GetSystemInfo(SYSTEM_INFO *si);
+
+HMODULE GetModuleHandleW(LPCWSTR name);
+FARPROC GetProcAddress(HMODULE module, LPCSTR name);
+BOOL VirtualProtect(
+        LPVOID addr,
+        SIZE_T nbytes,
+        DWORD new_protect,
+        DWORD *old_protect);
+
+LPSTR GetCommandLineA(void);
+int MultiByteToWideChar(
+        UINT cp,
+        DWORD flags,
+        LPCSTR src,
+        int src_nchars,
+        LPWSTR dest,
+        int dest_nchars);
+
+int _stricmp(const char *lhs, const char *rhs);
+int _strnicmp(const char *lhs, const char *rhs, size_t nchars);
+
+#include "winnt.h"
+
+#ifdef __cplusplus
+}
+#endif
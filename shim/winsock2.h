@@ -0,0 +1,99 @@
+#pragma once
+
+/* The host build has no sockets. Just enough of Winsock is declared here for
+   code that can talk TCP on Windows to compile, but WSAStartup() always
+   fails with WSASYSNOTREADY, so such code has to be exercised through some
+   other transport on the host. */
+
+#include "windows.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* These two share their names with the host's own socket calls, which take
+   different argument types. */
+
+#define connect shim_connect
+#define setsockopt shim_setsockopt
+
+typedef ULONG_PTR SOCKET;
+
+typedef struct WSAData {
+    WORD wVersion;
+    WORD wHighVersion;
+} WSADATA;
+
+typedef struct _WSABUF {
+    ULONG len;
+    CHAR *buf;
+} WSABUF;
+
+struct sockaddr {
+    USHORT sa_family;
+    CHAR sa_data[14];
+};
+
+#define INVALID_SOCKET ((SOCKET) ~0)
+#define SOCKET_ERROR (-1)
+
+#define MAKEWORD(lo, hi) ((WORD) (((BYTE) (lo)) | (((WORD) (BYTE) (hi)) << 8)))
+
+#define AF_UNSPEC 0
+#define SOCK_STREAM 1
+#define IPPROTO_TCP 6
+#define TCP_NODELAY 0x0001
+#define WSA_FLAG_OVERLAPPED 0x01
+
+#define WSA_IO_INCOMPLETE ERROR_IO_INCOMPLETE
+#define WSA_IO_PENDING ERROR_IO_PENDING
+#define WSAECONNREFUSED 10061
+#define WSASYSNOTREADY 10091
+#define WSANOTINITIALISED 10093
+
+int WSAStartup(WORD version, WSADATA *data);
+int WSACleanup(void);
+int WSAGetLastError(void);
+
+SOCKET WSASocketW(
+        int family,
+        int type,
+        int protocol,
+        void *info,
+        unsigned int group,
+        DWORD flags);
+int connect(SOCKET sock, const struct sockaddr *addr, int addr_nbytes);
+int setsockopt(
+        SOCKET sock,
+        int level,
+        int name,
+        const char *value,
+        int value_nbytes);
+int closesocket(SOCKET sock);
+
+int WSASend(
+        SOCKET sock,
+        WSABUF *bufs,
+        DWORD nbufs,
+        LPDWORD nsent,
+        DWORD flags,
+        OVERLAPPED *ovl,
+        void *completion);
+int WSARecv(
+        SOCKET sock,
+        WSABUF *bufs,
+        DWORD nbufs,
+        LPDWORD nrecvd,
+        LPDWORD flags,
+        OVERLAPPED *ovl,
+        void *completion);
+BOOL WSAGetOverlappedResult(
+        SOCKET sock,
+        OVERLAPPED *ovl,
+        LPDWORD nbytes,
+        BOOL wait,
+        LPDWORD flags);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+
+/* The host has no loader, so the PEB that this shim hands out describes a
+   process with no modules in it at all. The list head is followed by enough
+   zeroed space that walking it the same way capnhook does on Windows
+   yields a single entry with a NULL base address, which gets skipped. */
+
+#include "windows.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _LDR_DATA_TABLE_ENTRY {
+    LIST_ENTRY InMemoryOrderLinks;
+    PVOID Reserved[2];
+    PVOID DllBase;
+    PVOID EntryPoint;
+} LDR_DATA_TABLE_ENTRY;
+
+typedef struct _PEB_LDR_DATA {
+    LIST_ENTRY InMemoryOrderModuleList;
+    PVOID Reserved[sizeof(LDR_DATA_TABLE_ENTRY) / sizeof(PVOID)];
+} PEB_LDR_DATA;
+
+typedef struct _PEB {
+    PEB_LDR_DATA *Ldr;
+} PEB;
+
+PEB *shim_get_peb(void);
+
+#define __readfsdword(off) ((uintptr_t) shim_get_peb())
+#define __readgsqword(off) ((uintptr_t) shim_get_peb())
+
+#ifdef __cplusplus
+}
+#endif
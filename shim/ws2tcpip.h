@@ -0,0 +1,29 @@
+#pragma once
+
+#include "winsock2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct addrinfoW {
+    int ai_flags;
+    int ai_family;
+    int ai_socktype;
+    int ai_protocol;
+    size_t ai_addrlen;
+    LPWSTR ai_canonname;
+    struct sockaddr *ai_addr;
+    struct addrinfoW *ai_next;
+} ADDRINFOW;
+
+int GetAddrInfoW(
+        LPCWSTR host,
+        LPCWSTR service,
+        const ADDRINFOW *hints,
+        ADDRINFOW **out);
+void FreeAddrInfoW(ADDRINFOW *addrs);
+
+#ifdef __cplusplus
+}
+#endif
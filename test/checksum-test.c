@@ -0,0 +1,310 @@
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/checksum.h"
+#include "hook/cpu.h"
+#include "hook/iobuf.h"
+
+#include "test/test.h"
+
+/* The checksum module against the published check values and against
+   bit-at-a-time reference implementations, on buffers of every length and
+   alignment either side of the eight byte table step and the PCLMULQDQ
+   threshold. */
+
+#define TEST_SIZE 320
+
+/* Below this many bytes checksum_crc32() always takes the slice-by-8 path.
+   Keep in step with CHECKSUM_PCLMUL_MIN in checksum.c. */
+
+#define TEST_PCLMUL_MIN 64
+
+enum test_algo {
+    TEST_ALGO_SUM8,
+    TEST_ALGO_CRC8,
+    TEST_ALGO_CRC16,
+    TEST_ALGO_CRC32,
+};
+
+static void test_check_values(void);
+static void test_reference(void);
+static void test_split(void);
+static void test_pclmul(void);
+static uint8_t test_ref_sum8(const uint8_t *bytes, size_t nbytes);
+static uint8_t test_ref_crc8(const uint8_t *bytes, size_t nbytes);
+static uint16_t test_ref_crc16(const uint8_t *bytes, size_t nbytes);
+static uint32_t test_ref_crc32(const uint8_t *bytes, size_t nbytes);
+static uint32_t test_checksum(
+        enum test_algo algo,
+        const uint8_t *bytes,
+        size_t nbytes);
+static uint32_t test_expected(
+        enum test_algo algo,
+        const uint8_t *bytes,
+        size_t nbytes);
+
+static const char *const test_algo_names[] = {
+    "sum8",
+    "crc8",
+    "crc16_ccitt",
+    "crc32",
+};
+
+static uint8_t test_buf[TEST_SIZE + 16];
+
+int main(int argc, char **argv)
+{
+    size_t i;
+
+    (void) argc;
+    (void) argv;
+
+    srand(1);
+
+    for (i = 0 ; i < sizeof(test_buf) ; i++) {
+        test_buf[i] = rand();
+    }
+
+    test_check_values();
+    test_reference();
+    test_split();
+    test_pclmul();
+
+    return test_result();
+}
+
+static void test_check_values(void)
+{
+    static const char check[] = "123456789";
+    struct const_iobuf span;
+
+    span.bytes = (const uint8_t *) check;
+    span.nbytes = strlen(check);
+    span.pos = 0;
+
+    TEST_CHECK(checksum_sum8(0, &span) == 0xDD);
+    TEST_CHECK(checksum_crc8(0, &span) == 0xF4);
+    TEST_CHECK(checksum_crc16_ccitt(0xFFFF, &span) == 0x29B1);
+    TEST_CHECK(checksum_crc16_ccitt(0, &span) == 0x31C3);
+    TEST_CHECK(checksum_crc32(0, &span) == UINT32_C(0xCBF43926));
+    TEST_CHECK(span.pos == 0);
+}
+
+static void test_reference(void)
+{
+    uint32_t expected;
+    uint32_t actual;
+    size_t offset;
+    size_t nbytes;
+    size_t i;
+
+    for (i = 0 ; i < _countof(test_algo_names) ; i++) {
+        for (offset = 0 ; offset < 16 ; offset++) {
+            for (nbytes = 0 ; nbytes <= TEST_SIZE ; nbytes++) {
+                expected = test_expected(i, &test_buf[offset], nbytes);
+                actual = test_checksum(i, &test_buf[offset], nbytes);
+
+                if (!TEST_CHECK(actual == expected)) {
+                    fprintf(stderr,
+                            "%s at offset %u length %u: %08x != %08x\n",
+                            test_algo_names[i],
+                            (unsigned int) offset,
+                            (unsigned int) nbytes,
+                            (unsigned int) actual,
+                            (unsigned int) expected);
+
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static void test_split(void)
+{
+    struct const_iobuf span;
+    uint32_t expected;
+    uint32_t actual;
+    size_t split;
+
+    /* Accumulating piecewise has to agree with a single pass */
+
+    expected = test_ref_crc32(test_buf, TEST_SIZE);
+
+    for (split = 0 ; split <= TEST_SIZE ; split++) {
+        span.bytes = test_buf;
+        span.nbytes = split;
+        span.pos = 0;
+        actual = checksum_crc32(0, &span);
+
+        span.nbytes = TEST_SIZE;
+        span.pos = split;
+        actual = checksum_crc32(actual, &span);
+
+        if (!TEST_CHECK(actual == expected)) {
+            fprintf(stderr, "crc32 split at %u\n", (unsigned int) split);
+
+            return;
+        }
+    }
+}
+
+static void test_pclmul(void)
+{
+    struct const_iobuf span;
+    uint32_t features;
+    uint32_t folded;
+    uint32_t sliced;
+    size_t nbytes;
+    size_t step;
+
+    /* Feeding a buffer through in pieces that are too short for PCLMULQDQ
+       keeps every byte on the slice-by-8 path, so this compares the two
+       kernels directly. Where the CPU has no PCLMULQDQ both sides take the
+       same path and this degenerates into another split test. */
+
+    features = CPU_FEATURE_PCLMUL | CPU_FEATURE_SSE41;
+
+    if ((cpu_get_features() & features) != features) {
+        printf("No PCLMULQDQ here, only slice-by-8 is being tested\n");
+    }
+
+    for (nbytes = TEST_PCLMUL_MIN ; nbytes <= TEST_SIZE ; nbytes++) {
+        span.bytes = test_buf;
+        span.nbytes = nbytes;
+        span.pos = 0;
+        folded = checksum_crc32(0, &span);
+
+        sliced = 0;
+
+        for (span.pos = 0 ; span.pos < nbytes ; span.pos += step) {
+            step = TEST_PCLMUL_MIN - 1;
+
+            if (step > nbytes - span.pos) {
+                step = nbytes - span.pos;
+            }
+
+            span.nbytes = span.pos + step;
+            sliced = checksum_crc32(sliced, &span);
+        }
+
+        if (!TEST_CHECK(folded == sliced)) {
+            fprintf(stderr,
+                    "crc32 kernels disagree at length %u\n",
+                    (unsigned int) nbytes);
+
+            return;
+        }
+    }
+}
+
+static uint8_t test_ref_sum8(const uint8_t *bytes, size_t nbytes)
+{
+    uint8_t sum;
+    size_t i;
+
+    sum = 0;
+
+    for (i = 0 ; i < nbytes ; i++) {
+        sum += bytes[i];
+    }
+
+    return sum;
+}
+
+static uint8_t test_ref_crc8(const uint8_t *bytes, size_t nbytes)
+{
+    uint8_t crc;
+    size_t i;
+    int j;
+
+    crc = 0;
+
+    for (i = 0 ; i < nbytes ; i++) {
+        crc ^= bytes[i];
+
+        for (j = 0 ; j < 8 ; j++) {
+            crc = (crc << 1) ^ (crc & 0x80 ? 0x07 : 0);
+        }
+    }
+
+    return crc;
+}
+
+static uint16_t test_ref_crc16(const uint8_t *bytes, size_t nbytes)
+{
+    uint16_t crc;
+    size_t i;
+    int j;
+
+    crc = 0xFFFF;
+
+    for (i = 0 ; i < nbytes ; i++) {
+        crc ^= bytes[i] << 8;
+
+        for (j = 0 ; j < 8 ; j++) {
+            crc = (crc << 1) ^ (crc & 0x8000 ? 0x1021 : 0);
+        }
+    }
+
+    return crc;
+}
+
+static uint32_t test_ref_crc32(const uint8_t *bytes, size_t nbytes)
+{
+    uint32_t crc;
+    size_t i;
+    int j;
+
+    crc = ~UINT32_C(0);
+
+    for (i = 0 ; i < nbytes ; i++) {
+        crc ^= bytes[i];
+
+        for (j = 0 ; j < 8 ; j++) {
+            crc = (crc >> 1) ^ (crc & 1 ? UINT32_C(0xEDB88320) : 0);
+        }
+    }
+
+    return ~crc;
+}
+
+static uint32_t test_checksum(
+        enum test_algo algo,
+        const uint8_t *bytes,
+        size_t nbytes)
+{
+    struct const_iobuf span;
+
+    span.bytes = bytes;
+    span.nbytes = nbytes;
+    span.pos = 0;
+
+    switch (algo) {
+    case TEST_ALGO_SUM8:    return checksum_sum8(0, &span);
+    case TEST_ALGO_CRC8:    return checksum_crc8(0, &span);
+    case TEST_ALGO_CRC16:   return checksum_crc16_ccitt(0xFFFF, &span);
+    case TEST_ALGO_CRC32:   return checksum_crc32(0, &span);
+    default:                abort();
+    }
+}
+
+static uint32_t test_expected(
+        enum test_algo algo,
+        const uint8_t *bytes,
+        size_t nbytes)
+{
+    switch (algo) {
+    case TEST_ALGO_SUM8:    return test_ref_sum8(bytes, nbytes);
+    case TEST_ALGO_CRC8:    return test_ref_crc8(bytes, nbytes);
+    case TEST_ALGO_CRC16:   return test_ref_crc16(bytes, nbytes);
+    case TEST_ALGO_CRC32:   return test_ref_crc32(bytes, nbytes);
+    default:                abort();
+    }
+}
@@ -0,0 +1,157 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hooklib/timer-wheel.h"
+
+#include "test/fake-timer-wheel.h"
+
+static struct timer_wheel_entry *fake_timer_wheel_earliest(void);
+static void fake_timer_wheel_unlink(struct timer_wheel_entry *entry);
+
+static bool fake_timer_wheel_initted;
+static uint64_t fake_timer_wheel_clock = 1000000000;
+static struct timer_wheel_entry fake_timer_wheel_list = {
+    .prev = &fake_timer_wheel_list,
+    .next = &fake_timer_wheel_list,
+};
+
+HRESULT timer_wheel_init(void)
+{
+    if (fake_timer_wheel_initted) {
+        return S_FALSE;
+    }
+
+    fake_timer_wheel_initted = true;
+
+    return S_OK;
+}
+
+uint64_t timer_wheel_now(void)
+{
+    return fake_timer_wheel_clock;
+}
+
+void timer_wheel_entry_init(
+        struct timer_wheel_entry *entry,
+        timer_wheel_fn_t fn,
+        void *ctx)
+{
+    assert(entry != NULL);
+    assert(fn != NULL);
+
+    entry->prev = NULL;
+    entry->next = NULL;
+    entry->fn = fn;
+    entry->ctx = ctx;
+    entry->due = 0;
+    entry->armed = false;
+    entry->running = false;
+}
+
+void timer_wheel_arm(struct timer_wheel_entry *entry, uint64_t due)
+{
+    assert(entry != NULL);
+    assert(fake_timer_wheel_initted);
+
+    if (entry->armed) {
+        fake_timer_wheel_unlink(entry);
+    }
+
+    entry->due = due;
+    entry->armed = true;
+    entry->prev = fake_timer_wheel_list.prev;
+    entry->next = &fake_timer_wheel_list;
+    fake_timer_wheel_list.prev->next = entry;
+    fake_timer_wheel_list.prev = entry;
+}
+
+void timer_wheel_disarm(struct timer_wheel_entry *entry)
+{
+    assert(entry != NULL);
+    assert(fake_timer_wheel_initted);
+
+    if (entry->armed) {
+        fake_timer_wheel_unlink(entry);
+    }
+}
+
+void timer_wheel_disarm_sync(struct timer_wheel_entry *entry)
+{
+    assert(entry != NULL);
+
+    /* Callbacks only ever run inside fake_timer_wheel_advance(), so there is
+       never one to wait for unless it is the caller itself. */
+
+    assert(!entry->running);
+
+    if (fake_timer_wheel_initted) {
+        timer_wheel_disarm(entry);
+    }
+}
+
+uint64_t fake_timer_wheel_next(void)
+{
+    struct timer_wheel_entry *entry;
+
+    entry = fake_timer_wheel_earliest();
+
+    return entry != NULL ? entry->due : 0;
+}
+
+void fake_timer_wheel_advance(uint64_t ns)
+{
+    struct timer_wheel_entry *entry;
+    uint64_t end;
+
+    end = fake_timer_wheel_clock + ns;
+
+    for (;;) {
+        entry = fake_timer_wheel_earliest();
+
+        if (entry == NULL || entry->due > end) {
+            break;
+        }
+
+        if (entry->due > fake_timer_wheel_clock) {
+            fake_timer_wheel_clock = entry->due;
+        }
+
+        fake_timer_wheel_unlink(entry);
+        entry->running = true;
+        entry->fn(entry, fake_timer_wheel_clock, entry->ctx);
+        entry->running = false;
+    }
+
+    fake_timer_wheel_clock = end;
+}
+
+static struct timer_wheel_entry *fake_timer_wheel_earliest(void)
+{
+    struct timer_wheel_entry *earliest;
+    struct timer_wheel_entry *pos;
+
+    earliest = NULL;
+
+    for (   pos = fake_timer_wheel_list.next ;
+            pos != &fake_timer_wheel_list ;
+            pos = pos->next) {
+        if (earliest == NULL || pos->due < earliest->due) {
+            earliest = pos;
+        }
+    }
+
+    return earliest;
+}
+
+static void fake_timer_wheel_unlink(struct timer_wheel_entry *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+    entry->armed = false;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "hooklib/timer-wheel.h"
+
+/* Stands in for hooklib/timer-wheel.c in tests, implementing the whole of
+   timer-wheel.h against a clock that only moves when the test says so.
+   timer_wheel_now() starts out at one second. Callbacks run on the thread
+   that calls fake_timer_wheel_advance(), in order of due time and exactly on
+   time, with the clock reading the time at which each one was due. */
+
+/* Due time of the earliest armed entry, or zero if nothing is armed. */
+
+uint64_t fake_timer_wheel_next(void);
+
+/* Move the clock forward by ns, running every callback that falls due on
+   the way, including any that those callbacks arm. */
+
+void fake_timer_wheel_advance(uint64_t ns);
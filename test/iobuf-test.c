@@ -0,0 +1,1727 @@
+#include <windows.h>
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "hook/cpu.h"
+#include "hook/iobuf-arena.h"
+#include "hook/iobuf-array.h"
+#include "hook/iobuf-bits.h"
+#include "hook/iobuf-chain.h"
+#include "hook/iobuf-codec.h"
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf-spsc.h"
+#include "hook/iobuf-varint.h"
+#include "hook/iobuf.h"
+
+#include "test/test.h"
+
+/* The fixed-width accessors against their byte images, the bounds on move and
+   shift, an arena whose limit is lowered after it has grown, reserved cursors
+   and their bounds, the ring buffer across the end of its storage and at its
+   full and empty bounds, chains split, spliced, skipped and gathered with each
+   segment released exactly once, every byte-swap kernel for the bulk array
+   codecs at every width, length and alignment that it treats differently, the
+   generated and table-driven codecs against a known packet and against each
+   other, and the bit field and varint codecs against bit-at-a-time and
+   byte-at-a-time reference implementations, on random field widths and varint
+   magnitudes plus the signed varint edge cases. Finally the lock-free queue,
+   single-threaded around its wrap point and then streaming a byte sequence
+   across two threads. */
+
+#define TEST_NFIELDS 4096
+#define TEST_MAX_WIDTH 24
+#define TEST_NPKTS 256
+#define TEST_SPSC_NBYTES 1000000
+#define TEST_SPSC_CHUNK 7
+#define TEST_ARRAY_MAX 70
+#define TEST_ARRAY_NBYTES (16 + TEST_ARRAY_MAX * 8)
+#define TEST_ARRAY_POISON UINT64_C(0xA5A5A5A5A5A5A5A5)
+
+#define TEST_PKT_FIELDS(X) \
+        X(8,    sync) \
+        X(8,    cmd) \
+        X(le16, seq) \
+        X(be32, addr) \
+        X(le32, length) \
+        X(be16, status) \
+        X(le64, timestamp)
+
+IOBUF_CODEC_DECLARE(test_pkt, TEST_PKT_FIELDS)
+IOBUF_CODEC_DEFINE(test_pkt, TEST_PKT_FIELDS)
+
+#define TEST_PKT_NBYTES sizeof(struct test_pkt_wire)
+
+static void test_read_scalars(void);
+static void test_write_scalars(void);
+static void test_move(void);
+static void test_shift(void);
+static void test_arena(void);
+static void test_reserve(void);
+static void test_cursor(void);
+static void test_cursor_overrun(void);
+static void test_ring_wrap(void);
+static void test_ring_bounds(void);
+static void test_ring_partial(void);
+static void test_chain_split(void);
+static void test_chain_splice(void);
+static void test_chain_gather(void);
+static void test_chain_wrap(
+        struct iobuf_seg **out,
+        const char *str,
+        size_t index);
+static void test_chain_release(struct iobuf_seg *seg, void *ctx);
+static void test_arrays(void);
+static bool test_array_case(size_t width, size_t nvalues);
+static HRESULT test_array_read(
+        struct const_iobuf *src,
+        size_t nvalues,
+        size_t width);
+static HRESULT test_array_write(
+        struct iobuf *dest,
+        size_t nvalues,
+        size_t width);
+static uint64_t test_array_ref(struct const_iobuf *src, size_t width);
+static uint64_t test_array_value(size_t i, size_t width);
+static void test_codec_layout(void);
+static void test_codec_known(void);
+static void test_codec_random(void);
+static bool test_pkt_equal(
+        const struct test_pkt *lhs,
+        const struct test_pkt *rhs);
+static void test_bits(void);
+static void test_uleb128(void);
+static void test_sleb128(void);
+static void test_spsc(void);
+static void test_spsc_threads(void);
+static DWORD WINAPI test_spsc_producer_proc(void *ctx);
+static void test_ref_write_bits(
+        uint8_t *bytes,
+        size_t *bitpos,
+        unsigned int nbits,
+        uint64_t value);
+static void test_ref_write_uleb128(struct iobuf *dest, uint64_t value);
+
+/* Every byte has its top bit set so that sign extension shows up */
+
+static const uint8_t test_be[] = {
+    0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88,
+};
+
+static const uint8_t test_le[] = {
+    0x88, 0x87, 0x86, 0x85, 0x84, 0x83, 0x82, 0x81,
+};
+
+static unsigned int test_widths[TEST_NFIELDS];
+static uint64_t test_fields[TEST_NFIELDS];
+static uint64_t test_varints[TEST_NFIELDS];
+static uint8_t test_encoded[TEST_NFIELDS * 10];
+static uint8_t test_expected[TEST_NFIELDS * 10];
+static unsigned int test_releases[4];
+static uint8_t test_array_src[TEST_ARRAY_NBYTES];
+static uint8_t test_array_dest[TEST_ARRAY_NBYTES];
+
+static union {
+    uint16_t u16[TEST_ARRAY_MAX];
+    uint32_t u32[TEST_ARRAY_MAX];
+    uint64_t u64[TEST_ARRAY_MAX];
+} test_array_values;
+
+int main(int argc, char **argv)
+{
+    unsigned int nbits;
+    size_t i;
+
+    (void) argc;
+    (void) argv;
+
+    srand(1);
+
+    for (i = 0 ; i < TEST_NFIELDS ; i++) {
+        test_widths[i] = 1 + rand() % TEST_MAX_WIDTH;
+        test_fields[i] =
+                ((uint64_t) rand() << 16 ^ rand()) &
+                ((UINT64_C(1) << test_widths[i]) - 1);
+
+        nbits = rand() % 65;
+        test_varints[i] = ((uint64_t) rand() << 48) ^
+                ((uint64_t) rand() << 32) ^
+                ((uint64_t) rand() << 16) ^
+                rand();
+        test_varints[i] = nbits < 64 ?
+                test_varints[i] & ((UINT64_C(1) << nbits) - 1) :
+                test_varints[i];
+    }
+
+    test_read_scalars();
+    test_write_scalars();
+    test_move();
+    test_shift();
+    test_arena();
+    test_reserve();
+    test_cursor();
+    test_cursor_overrun();
+    test_ring_wrap();
+    test_ring_bounds();
+    test_ring_partial();
+    test_chain_split();
+    test_chain_splice();
+    test_chain_gather();
+    test_arrays();
+    test_codec_layout();
+    test_codec_known();
+    test_codec_random();
+    test_bits();
+    test_uleb128();
+    test_sleb128();
+    test_spsc();
+    test_spsc_threads();
+
+    return test_result();
+}
+
+static void test_read_scalars(void)
+{
+    struct const_iobuf src;
+    uint8_t v8;
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    src.bytes = &test_be[7];
+    src.nbytes = 1;
+    src.pos = 0;
+    TEST_CHECK(iobuf_read_8(&src, &v8) == S_OK);
+    TEST_CHECK(v8 == 0x88);
+    TEST_CHECK(src.pos == 1);
+
+    src.bytes = &test_be[6];
+    src.nbytes = 2;
+    src.pos = 0;
+    TEST_CHECK(iobuf_read_be16(&src, &v16) == S_OK);
+    TEST_CHECK(v16 == 0x8788);
+    TEST_CHECK(src.pos == 2);
+
+    src.bytes = &test_be[4];
+    src.nbytes = 4;
+    src.pos = 0;
+    TEST_CHECK(iobuf_read_be32(&src, &v32) == S_OK);
+    TEST_CHECK(v32 == UINT32_C(0x85868788));
+    TEST_CHECK(src.pos == 4);
+
+    src.bytes = test_be;
+    src.nbytes = 8;
+    src.pos = 0;
+    TEST_CHECK(iobuf_read_be64(&src, &v64) == S_OK);
+    TEST_CHECK(v64 == UINT64_C(0x8182838485868788));
+    TEST_CHECK(src.pos == 8);
+
+    src.bytes = test_le;
+    src.nbytes = 2;
+    src.pos = 0;
+    TEST_CHECK(iobuf_read_le16(&src, &v16) == S_OK);
+    TEST_CHECK(v16 == 0x8788);
+    TEST_CHECK(src.pos == 2);
+
+    src.nbytes = 4;
+    src.pos = 0;
+    TEST_CHECK(iobuf_read_le32(&src, &v32) == S_OK);
+    TEST_CHECK(v32 == UINT32_C(0x85868788));
+    TEST_CHECK(src.pos == 4);
+
+    src.nbytes = 8;
+    src.pos = 0;
+    TEST_CHECK(iobuf_read_le64(&src, &v64) == S_OK);
+    TEST_CHECK(v64 == UINT64_C(0x8182838485868788));
+    TEST_CHECK(src.pos == 8);
+
+    /* Short reads fail without consuming anything */
+
+    src.nbytes = 7;
+    src.pos = 0;
+    TEST_CHECK(FAILED(iobuf_read_le64(&src, &v64)));
+    TEST_CHECK(src.pos == 0);
+}
+
+static void test_write_scalars(void)
+{
+    struct iobuf dest;
+    uint8_t bytes[8];
+
+    dest.bytes = bytes;
+    dest.nbytes = 1;
+    dest.pos = 0;
+    TEST_CHECK(iobuf_write_8(&dest, 0x88) == S_OK);
+    TEST_CHECK(dest.pos == 1 && bytes[0] == 0x88);
+
+    dest.nbytes = 2;
+    dest.pos = 0;
+    TEST_CHECK(iobuf_write_be16(&dest, 0x8788) == S_OK);
+    TEST_CHECK(dest.pos == 2 && memcmp(bytes, &test_be[6], 2) == 0);
+
+    dest.nbytes = 4;
+    dest.pos = 0;
+    TEST_CHECK(iobuf_write_be32(&dest, UINT32_C(0x85868788)) == S_OK);
+    TEST_CHECK(dest.pos == 4 && memcmp(bytes, &test_be[4], 4) == 0);
+
+    dest.nbytes = 8;
+    dest.pos = 0;
+    TEST_CHECK(iobuf_write_be64(&dest, UINT64_C(0x8182838485868788)) == S_OK);
+    TEST_CHECK(dest.pos == 8 && memcmp(bytes, test_be, 8) == 0);
+
+    dest.nbytes = 2;
+    dest.pos = 0;
+    TEST_CHECK(iobuf_write_le16(&dest, 0x8788) == S_OK);
+    TEST_CHECK(dest.pos == 2 && memcmp(bytes, test_le, 2) == 0);
+
+    dest.nbytes = 4;
+    dest.pos = 0;
+    TEST_CHECK(iobuf_write_le32(&dest, UINT32_C(0x85868788)) == S_OK);
+    TEST_CHECK(dest.pos == 4 && memcmp(bytes, test_le, 4) == 0);
+
+    dest.nbytes = 8;
+    dest.pos = 0;
+    TEST_CHECK(iobuf_write_le64(&dest, UINT64_C(0x8182838485868788)) == S_OK);
+    TEST_CHECK(dest.pos == 8 && memcmp(bytes, test_le, 8) == 0);
+
+    /* Writes that do not fit fail without writing anything */
+
+    memset(bytes, 0xCC, sizeof(bytes));
+    dest.nbytes = 7;
+    dest.pos = 0;
+    TEST_CHECK(iobuf_write_be64(&dest, 0) ==
+            HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(dest.pos == 0 && bytes[0] == 0xCC);
+}
+
+static void test_move(void)
+{
+    struct const_iobuf src;
+    struct iobuf dest;
+    size_t moved;
+
+    /* Bounded by whichever side runs out first */
+
+    memset(test_expected, 0, sizeof(test_expected));
+
+    dest.bytes = test_expected;
+    dest.nbytes = 100;
+    dest.pos = 10;
+    src.bytes = test_be;
+    src.nbytes = 8;
+    src.pos = 2;
+
+    moved = iobuf_move(&dest, &src);
+
+    TEST_CHECK(moved == 6);
+    TEST_CHECK(dest.pos == 16);
+    TEST_CHECK(src.pos == 8);
+    TEST_CHECK(memcmp(&test_expected[10], &test_be[2], 6) == 0);
+
+    dest.nbytes = 20;
+    dest.pos = 16;
+    src.pos = 0;
+
+    moved = iobuf_move(&dest, &src);
+
+    TEST_CHECK(moved == 4);
+    TEST_CHECK(dest.pos == 20);
+    TEST_CHECK(src.pos == 4);
+    TEST_CHECK(memcmp(&test_expected[16], test_be, 4) == 0);
+}
+
+static void test_shift(void)
+{
+    struct iobuf dest;
+    struct iobuf src;
+    uint8_t bytes[8];
+    size_t moved;
+    size_t i;
+
+    /* Whatever did not fit into dest has to stay at the front of src */
+
+    for (i = 0 ; i < 200 ; i++) {
+        test_encoded[i] = i;
+    }
+
+    src.bytes = test_encoded;
+    src.nbytes = 200;
+    src.pos = 100;
+    dest.bytes = bytes;
+    dest.nbytes = sizeof(bytes);
+    dest.pos = 0;
+
+    moved = iobuf_shift(&dest, &src);
+
+    TEST_CHECK(moved == 8);
+    TEST_CHECK(dest.pos == 8);
+    TEST_CHECK(src.pos == 92);
+
+    for (i = 0 ; i < 8 ; i++) {
+        TEST_CHECK(bytes[i] == i);
+    }
+
+    for (i = 0 ; i < 92 ; i++) {
+        if (!TEST_CHECK(test_encoded[i] == i + 8)) {
+            break;
+        }
+    }
+}
+
+static void test_arena(void)
+{
+    struct iobuf_arena arena;
+    struct const_iobuf src;
+    size_t moved;
+    size_t i;
+
+    for (i = 0 ; i < 300 ; i++) {
+        test_encoded[i] = (uint8_t) i;
+    }
+
+    /* Grow the arena well past what its limit will later be lowered to */
+
+    iobuf_arena_init(&arena, 0);
+
+    TEST_CHECK(iobuf_arena_write(&arena, test_encoded, 256) == S_OK);
+    TEST_CHECK(arena.buf.nbytes >= 256);
+    TEST_CHECK(arena.high_water == 256);
+
+    /* Moves stop at the new limit even though there is room beyond it */
+
+    iobuf_arena_reset(&arena);
+    arena.limit = 100;
+
+    src.bytes = test_encoded;
+    src.nbytes = 300;
+    src.pos = 0;
+
+    moved = iobuf_arena_move(&arena, &src);
+
+    TEST_CHECK(moved == 100);
+    TEST_CHECK(arena.buf.pos == 100);
+    TEST_CHECK(src.pos == 100);
+    TEST_CHECK(memcmp(arena.buf.bytes, test_encoded, 100) == 0);
+
+    moved = iobuf_arena_move(&arena, &src);
+
+    TEST_CHECK(moved == 0);
+    TEST_CHECK(arena.buf.pos == 100);
+    TEST_CHECK(src.pos == 100);
+
+    /* Likewise writes and allocations, which are all or nothing */
+
+    iobuf_arena_reset(&arena);
+
+    TEST_CHECK(iobuf_arena_write(&arena, test_encoded, 101) ==
+            HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(arena.buf.pos == 0);
+    TEST_CHECK(iobuf_arena_alloc(&arena, 101) == NULL);
+    TEST_CHECK(arena.buf.pos == 0);
+    TEST_CHECK(iobuf_arena_alloc(&arena, 60) == arena.buf.bytes);
+    TEST_CHECK(iobuf_arena_reserve(&arena, 41) ==
+            HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(iobuf_arena_write(&arena, test_encoded, 40) == S_OK);
+    TEST_CHECK(arena.buf.pos == 100);
+
+    /* A move that starts part way into src only advances it by what fit */
+
+    iobuf_arena_reset(&arena);
+    src.pos = 250;
+
+    TEST_CHECK(iobuf_arena_write(&arena, test_encoded, 90) == S_OK);
+
+    moved = iobuf_arena_move(&arena, &src);
+
+    TEST_CHECK(moved == 10);
+    TEST_CHECK(src.pos == 260);
+    TEST_CHECK(memcmp(&arena.buf.bytes[90], &test_encoded[250], 10) == 0);
+    TEST_CHECK(arena.high_water == 256);
+
+    iobuf_arena_fini(&arena);
+}
+
+static void test_reserve(void)
+{
+    struct const_iobuf src;
+    struct iobuf_cursor cur;
+    HRESULT hr;
+
+    /* A failed reserve leaves both pos and the cursor alone, however large
+       the length that it was asked for. */
+
+    src.bytes = test_be;
+    src.nbytes = sizeof(test_be);
+    src.pos = 3;
+
+    cur.bytes = NULL;
+    cur.end = NULL;
+
+    hr = iobuf_reserve(&src, &cur, 6);
+
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(src.pos == 3);
+    TEST_CHECK(cur.bytes == NULL && cur.end == NULL);
+
+    hr = iobuf_reserve(&src, &cur, SIZE_MAX);
+
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(src.pos == 3);
+
+    hr = iobuf_reserve(&src, &cur, SIZE_MAX - 2);
+
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(src.pos == 3);
+
+    /* Exactly what is left is fine, and so is nothing at all */
+
+    hr = iobuf_reserve(&src, &cur, 5);
+
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(src.pos == 8);
+    TEST_CHECK(cur.bytes == &test_be[3]);
+    TEST_CHECK(iobuf_cursor_remaining(&cur) == 5);
+
+    hr = iobuf_reserve(&src, &cur, 0);
+
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(src.pos == 8);
+    TEST_CHECK(iobuf_cursor_remaining(&cur) == 0);
+
+    hr = iobuf_reserve(&src, &cur, 1);
+
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(src.pos == 8);
+}
+
+static void test_cursor(void)
+{
+    struct const_iobuf src;
+    struct iobuf_cursor cur;
+    const uint8_t *bytes;
+    size_t pos;
+    HRESULT hr;
+
+    /* Reserving commits the span: pos moves past it straight away, and the
+       accessors then walk the cursor to its end without any more checks. */
+
+    src.bytes = test_be;
+    src.nbytes = sizeof(test_be);
+    src.pos = 0;
+
+    hr = iobuf_reserve(&src, &cur, 8);
+
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(src.pos == 8);
+
+    TEST_CHECK(iobuf_cursor_8(&cur) == 0x81);
+    TEST_CHECK(iobuf_cursor_be16(&cur) == 0x8283);
+    TEST_CHECK(iobuf_cursor_le16(&cur) == 0x8584);
+    iobuf_cursor_skip(&cur, 1);
+    bytes = iobuf_cursor_bytes(&cur, 2);
+    TEST_CHECK(bytes == &test_be[6]);
+    TEST_CHECK(iobuf_cursor_remaining(&cur) == 0);
+
+    src.pos = 0;
+    TEST_CHECK(iobuf_reserve(&src, &cur, 8) == S_OK);
+    TEST_CHECK(iobuf_cursor_be32(&cur) == 0x81828384);
+    TEST_CHECK(iobuf_cursor_le32(&cur) == 0x88878685);
+
+    src.pos = 0;
+    TEST_CHECK(iobuf_reserve(&src, &cur, 8) == S_OK);
+    TEST_CHECK(iobuf_cursor_be64(&cur) == UINT64_C(0x8182838485868788));
+
+    src.pos = 0;
+    TEST_CHECK(iobuf_reserve(&src, &cur, 8) == S_OK);
+    TEST_CHECK(iobuf_cursor_le64(&cur) == UINT64_C(0x8887868584838281));
+    TEST_CHECK(iobuf_cursor_remaining(&cur) == 0);
+
+    /* Rolling back is putting pos back where it was, say once a field in
+       the span turns out to be unacceptable. The bytes are still there to
+       be reserved again by whatever parses them next. */
+
+    src.pos = 2;
+    pos = src.pos;
+
+    TEST_CHECK(iobuf_reserve(&src, &cur, 4) == S_OK);
+
+    if (iobuf_cursor_8(&cur) != 0x00) {
+        src.pos = pos;
+    }
+
+    TEST_CHECK(src.pos == 2);
+    TEST_CHECK(iobuf_reserve(&src, &cur, 4) == S_OK);
+    TEST_CHECK(iobuf_cursor_be32(&cur) == 0x83848586);
+    TEST_CHECK(src.pos == 6);
+}
+
+static void test_cursor_overrun(void)
+{
+#ifndef NDEBUG
+    struct const_iobuf src;
+    struct iobuf_cursor cur;
+    pid_t pid;
+    int status;
+
+    /* The accessors only check their bounds in debug builds, where running
+       off the end of the span has to trip an assertion rather than read the
+       bytes after it. That kills the process, so do it in a child. */
+
+    src.bytes = test_be;
+    src.nbytes = sizeof(test_be);
+    src.pos = 0;
+
+    TEST_CHECK(iobuf_reserve(&src, &cur, 3) == S_OK);
+    TEST_CHECK(iobuf_cursor_be16(&cur) == 0x8182);
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+
+    if (pid == 0) {
+        close(STDERR_FILENO);
+        iobuf_cursor_be16(&cur);
+        _exit(0);
+    }
+
+    if (    !TEST_CHECK(pid > 0) ||
+            !TEST_CHECK(waitpid(pid, &status, 0) == pid)) {
+        return;
+    }
+
+    TEST_CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+
+    /* The parent's cursor never moved, so its last byte is still there */
+
+    TEST_CHECK(iobuf_cursor_remaining(&cur) == 1);
+    TEST_CHECK(iobuf_cursor_8(&cur) == 0x83);
+#endif
+}
+
+static void test_ring_wrap(void)
+{
+    struct iobuf_ring ring;
+    uint8_t storage[16];
+    uint8_t bytes[16];
+    uint32_t v32;
+    size_t i;
+
+    for (i = 0 ; i < sizeof(bytes) ; i++) {
+        bytes[i] = 0x40 + i;
+    }
+
+    /* Run the ring up to 4 bytes short of the end of its storage, then
+       write 10 bytes, which have to split four and six across the end. */
+
+    iobuf_ring_init(&ring, storage, sizeof(storage));
+    memset(storage, 0, sizeof(storage));
+
+    TEST_CHECK(iobuf_ring_write(&ring, bytes, 12) == S_OK);
+    TEST_CHECK(iobuf_ring_skip(&ring, 12) == 12);
+    TEST_CHECK(iobuf_ring_avail(&ring) == 0);
+
+    TEST_CHECK(iobuf_ring_write(&ring, bytes, 10) == S_OK);
+    TEST_CHECK(iobuf_ring_avail(&ring) == 10);
+    TEST_CHECK(memcmp(&storage[12], bytes, 4) == 0);
+    TEST_CHECK(memcmp(storage, &bytes[4], 6) == 0);
+
+    /* A read across the end puts them back together */
+
+    memset(bytes, 0, sizeof(bytes));
+    TEST_CHECK(iobuf_ring_read(&ring, bytes, 10) == S_OK);
+    TEST_CHECK(iobuf_ring_avail(&ring) == 0);
+
+    for (i = 0 ; i < 10 ; i++) {
+        TEST_CHECK(bytes[i] == 0x40 + i);
+    }
+
+    /* Likewise a multi-byte value that straddles the end */
+
+    ring.head = 14;
+    ring.tail = 14;
+
+    TEST_CHECK(iobuf_ring_write_be32(&ring, 0x81828384) == S_OK);
+    TEST_CHECK(storage[14] == 0x81 && storage[15] == 0x82);
+    TEST_CHECK(storage[0] == 0x83 && storage[1] == 0x84);
+    TEST_CHECK(iobuf_ring_read_be32(&ring, &v32) == S_OK);
+    TEST_CHECK(v32 == 0x81828384);
+
+    /* The counters themselves are free-running and may wrap too */
+
+    ring.head = (size_t) -4;
+    ring.tail = (size_t) -4;
+
+    TEST_CHECK(iobuf_ring_write_le32(&ring, 0x01020304) == S_OK);
+    TEST_CHECK(iobuf_ring_write_le32(&ring, 0x05060708) == S_OK);
+    TEST_CHECK(ring.tail == 4);
+    TEST_CHECK(iobuf_ring_avail(&ring) == 8);
+    TEST_CHECK(iobuf_ring_space(&ring) == 8);
+    TEST_CHECK(iobuf_ring_read_le32(&ring, &v32) == S_OK);
+    TEST_CHECK(v32 == 0x01020304);
+    TEST_CHECK(iobuf_ring_read_le32(&ring, &v32) == S_OK);
+    TEST_CHECK(v32 == 0x05060708);
+    TEST_CHECK(ring.head == 4);
+}
+
+static void test_ring_bounds(void)
+{
+    struct iobuf_ring ring;
+    uint8_t storage[16];
+    uint8_t bytes[17];
+    uint8_t v8;
+    size_t i;
+
+    memset(bytes, 0x5A, sizeof(bytes));
+    iobuf_ring_init(&ring, storage, sizeof(storage));
+
+    /* Empty: nothing to read, and a failed read takes nothing */
+
+    ring.head = 9;
+    ring.tail = 9;
+
+    TEST_CHECK(iobuf_ring_avail(&ring) == 0);
+    TEST_CHECK(iobuf_ring_space(&ring) == 16);
+    TEST_CHECK(iobuf_ring_read_8(&ring, &v8) ==
+            HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(iobuf_ring_skip(&ring, 1) == 0);
+    TEST_CHECK(ring.head == 9);
+
+    /* One byte too many is refused outright, with nothing written */
+
+    TEST_CHECK(iobuf_ring_write(&ring, bytes, 17) ==
+            HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(ring.tail == 9);
+
+    /* Exactly full, which is the one state where head and tail are a whole
+       capacity apart rather than equal. */
+
+    for (i = 0 ; i < 16 ; i++) {
+        TEST_CHECK(iobuf_ring_write_8(&ring, (uint8_t) i) == S_OK);
+    }
+
+    TEST_CHECK(iobuf_ring_avail(&ring) == 16);
+    TEST_CHECK(iobuf_ring_space(&ring) == 0);
+    TEST_CHECK(iobuf_ring_write_8(&ring, 0xFF) ==
+            HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(ring.tail == 25);
+
+    /* Drain it to empty again, in order */
+
+    for (i = 0 ; i < 16 ; i++) {
+        TEST_CHECK(iobuf_ring_read_8(&ring, &v8) == S_OK && v8 == i);
+    }
+
+    TEST_CHECK(iobuf_ring_avail(&ring) == 0);
+    TEST_CHECK(iobuf_ring_read(&ring, bytes, 1) ==
+            HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(bytes[0] == 0x5A);
+
+    /* A zero-capacity ring is always both full and empty */
+
+    iobuf_ring_init(&ring, NULL, 0);
+
+    TEST_CHECK(iobuf_ring_avail(&ring) == 0);
+    TEST_CHECK(iobuf_ring_space(&ring) == 0);
+    TEST_CHECK(iobuf_ring_write(&ring, NULL, 0) == S_OK);
+    TEST_CHECK(iobuf_ring_write_8(&ring, 0) ==
+            HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+}
+
+static void test_ring_partial(void)
+{
+    struct iobuf_ring ring;
+    struct const_iobuf src;
+    struct iobuf dest;
+    uint8_t storage[16];
+    uint8_t bytes[8];
+    size_t moved;
+    size_t i;
+
+    /* A ring with room for only two more bytes, which are the last byte of
+       storage and the first. Moves take what fits and leave the rest. */
+
+    iobuf_ring_init(&ring, storage, sizeof(storage));
+    ring.head = 1;
+    ring.tail = 1;
+
+    for (i = 0 ; i < 14 ; i++) {
+        TEST_CHECK(iobuf_ring_write_8(&ring, (uint8_t) i) == S_OK);
+    }
+
+    src.bytes = test_be;
+    src.nbytes = sizeof(test_be);
+    src.pos = 1;
+
+    moved = iobuf_ring_move(&ring, &src);
+
+    TEST_CHECK(moved == 2);
+    TEST_CHECK(src.pos == 3);
+    TEST_CHECK(iobuf_ring_space(&ring) == 0);
+    TEST_CHECK(storage[15] == 0x82 && storage[0] == 0x83);
+
+    moved = iobuf_ring_move(&ring, &src);
+
+    TEST_CHECK(moved == 0);
+    TEST_CHECK(src.pos == 3);
+
+    /* Peek leaves the bytes where they are, shift takes them away */
+
+    dest.bytes = bytes;
+    dest.nbytes = sizeof(bytes);
+    dest.pos = 3;
+
+    moved = iobuf_ring_peek(&dest, &ring);
+
+    TEST_CHECK(moved == 5);
+    TEST_CHECK(dest.pos == 8);
+    TEST_CHECK(iobuf_ring_avail(&ring) == 16);
+
+    dest.pos = 0;
+    moved = iobuf_ring_shift(&dest, &ring);
+
+    TEST_CHECK(moved == 8);
+    TEST_CHECK(iobuf_ring_avail(&ring) == 8);
+
+    for (i = 0 ; i < 8 ; i++) {
+        TEST_CHECK(bytes[i] == i);
+    }
+
+    /* The rest crosses the end of storage on its way out */
+
+    memset(bytes, 0, sizeof(bytes));
+    dest.pos = 0;
+
+    moved = iobuf_ring_shift(&dest, &ring);
+
+    TEST_CHECK(moved == 8);
+    TEST_CHECK(iobuf_ring_avail(&ring) == 0);
+    TEST_CHECK(bytes[0] == 8 && bytes[5] == 13);
+    TEST_CHECK(bytes[6] == 0x82 && bytes[7] == 0x83);
+
+    /* And an empty ring moves nothing into a dest with room to spare */
+
+    dest.pos = 0;
+
+    TEST_CHECK(iobuf_ring_shift(&dest, &ring) == 0);
+    TEST_CHECK(dest.pos == 0);
+}
+
+static void test_chain_split(void)
+{
+    struct iobuf_chain dest;
+    struct iobuf_chain src;
+    struct iobuf_seg *segs[2];
+    uint8_t bytes[16];
+
+    /* Ten bytes then six, split three bytes into the second segment */
+
+    memset(test_releases, 0, sizeof(test_releases));
+    test_chain_wrap(&segs[0], "0123456789", 0);
+    test_chain_wrap(&segs[1], "abcdef", 1);
+
+    iobuf_chain_init(&src);
+    iobuf_chain_init(&dest);
+
+    TEST_CHECK(iobuf_chain_append(&src, segs[0], 0, 10) == S_OK);
+    TEST_CHECK(iobuf_chain_append(&src, segs[1], 0, 6) == S_OK);
+    TEST_CHECK(src.nbytes == 16);
+
+    TEST_CHECK(iobuf_chain_split(&dest, &src, 17) ==
+            HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(src.nbytes == 16 && dest.nspans == 0);
+
+    TEST_CHECK(iobuf_chain_split(&dest, &src, 13) == S_OK);
+    TEST_CHECK(dest.nspans == 2 && dest.nbytes == 13);
+    TEST_CHECK(src.nspans == 1 && src.nbytes == 3);
+
+    /* Both chains now hold the straddled segment, only dest the first */
+
+    TEST_CHECK(segs[0]->nrefs == 2);
+    TEST_CHECK(segs[1]->nrefs == 3);
+
+    iobuf_seg_unref(segs[0]);
+    iobuf_seg_unref(segs[1]);
+
+    TEST_CHECK(iobuf_chain_read(&dest, bytes, 13) == S_OK);
+    TEST_CHECK(memcmp(bytes, "0123456789abc", 13) == 0);
+    TEST_CHECK(dest.nspans == 0 && dest.nbytes == 0);
+    TEST_CHECK(test_releases[0] == 1);
+    TEST_CHECK(test_releases[1] == 0);
+
+    TEST_CHECK(iobuf_chain_read(&src, bytes, 3) == S_OK);
+    TEST_CHECK(memcmp(bytes, "def", 3) == 0);
+    TEST_CHECK(test_releases[1] == 1);
+
+    /* A split at a segment boundary hands the whole span over */
+
+    test_chain_wrap(&segs[0], "0123456789", 2);
+    test_chain_wrap(&segs[1], "abcdef", 3);
+
+    TEST_CHECK(iobuf_chain_append(&src, segs[0], 0, 10) == S_OK);
+    TEST_CHECK(iobuf_chain_append(&src, segs[1], 0, 6) == S_OK);
+    iobuf_seg_unref(segs[0]);
+    iobuf_seg_unref(segs[1]);
+
+    TEST_CHECK(iobuf_chain_split(&dest, &src, 10) == S_OK);
+    TEST_CHECK(dest.nspans == 1 && src.nspans == 1);
+    TEST_CHECK(segs[0]->nrefs == 1 && segs[1]->nrefs == 1);
+
+    iobuf_chain_fini(&dest);
+    iobuf_chain_fini(&src);
+
+    TEST_CHECK(test_releases[2] == 1);
+    TEST_CHECK(test_releases[3] == 1);
+}
+
+static void test_chain_splice(void)
+{
+    struct iobuf_chain head;
+    struct iobuf_chain tail;
+    struct iobuf_seg *segs[3];
+    uint8_t bytes[16];
+
+    /* A payload with a header prepended to it, then a second payload
+       spliced on behind. Skipping runs across the seam between them. */
+
+    memset(test_releases, 0, sizeof(test_releases));
+    test_chain_wrap(&segs[0], "HDR:", 0);
+    test_chain_wrap(&segs[1], "xyz", 1);
+    test_chain_wrap(&segs[2], "PQRS", 2);
+
+    iobuf_chain_init(&head);
+    iobuf_chain_init(&tail);
+
+    TEST_CHECK(iobuf_chain_append(&head, segs[1], 0, 3) == S_OK);
+    TEST_CHECK(iobuf_chain_prepend(&head, segs[0], 0, 4) == S_OK);
+    TEST_CHECK(iobuf_chain_append(&tail, segs[2], 1, 3) == S_OK);
+
+    iobuf_seg_unref(segs[0]);
+    iobuf_seg_unref(segs[1]);
+    iobuf_seg_unref(segs[2]);
+
+    TEST_CHECK(iobuf_chain_splice(&head, &tail) == S_OK);
+    TEST_CHECK(tail.nspans == 0 && tail.nbytes == 0);
+    TEST_CHECK(head.nspans == 3 && head.nbytes == 10);
+    TEST_CHECK(segs[2]->nrefs == 1);
+
+    TEST_CHECK(iobuf_chain_skip(&head, 5) == 5);
+    TEST_CHECK(test_releases[0] == 1);
+    TEST_CHECK(head.nspans == 2 && head.nbytes == 5);
+
+    TEST_CHECK(iobuf_chain_skip(&head, 3) == 3);
+    TEST_CHECK(test_releases[1] == 1);
+    TEST_CHECK(test_releases[2] == 0);
+    TEST_CHECK(head.nspans == 1 && head.nbytes == 2);
+
+    TEST_CHECK(iobuf_chain_read(&head, bytes, 3) ==
+            HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(iobuf_chain_read(&head, bytes, 2) == S_OK);
+    TEST_CHECK(memcmp(bytes, "RS", 2) == 0);
+    TEST_CHECK(test_releases[2] == 1);
+
+    /* Skipping more than there is stops at the end */
+
+    TEST_CHECK(iobuf_chain_skip(&head, 1) == 0);
+
+    iobuf_chain_fini(&head);
+    iobuf_chain_fini(&tail);
+
+    TEST_CHECK(test_releases[0] == 1);
+    TEST_CHECK(test_releases[1] == 1);
+    TEST_CHECK(test_releases[2] == 1);
+}
+
+static void test_chain_gather(void)
+{
+    struct iobuf_chain chain;
+    struct iobuf_seg *seg;
+    struct iobuf dest;
+    uint8_t bytes[6];
+    size_t moved;
+    size_t i;
+
+    /* Three four-byte views of one allocated segment, gathered into a
+       destination that only has room for six of their twelve bytes. */
+
+    TEST_CHECK(iobuf_seg_alloc(12, &seg) == S_OK);
+
+    for (i = 0 ; i < 12 ; i++) {
+        seg->bytes[i] = (uint8_t) i;
+    }
+
+    iobuf_chain_init(&chain);
+
+    for (i = 0 ; i < 3 ; i++) {
+        TEST_CHECK(iobuf_chain_append(&chain, seg, i * 4, 4) == S_OK);
+    }
+
+    TEST_CHECK(seg->nrefs == 4);
+
+    dest.bytes = bytes;
+    dest.nbytes = sizeof(bytes);
+    dest.pos = 0;
+
+    moved = iobuf_chain_gather(&dest, &chain);
+
+    TEST_CHECK(moved == 6);
+    TEST_CHECK(dest.pos == 6);
+    TEST_CHECK(memcmp(bytes, "\x00\x01\x02\x03\x04\x05", 6) == 0);
+    TEST_CHECK(chain.nbytes == 6);
+    TEST_CHECK(chain.nspans == 2);
+    TEST_CHECK(seg->nrefs == 3);
+
+    /* A full destination gathers nothing and leaves the chain alone */
+
+    TEST_CHECK(iobuf_chain_gather(&dest, &chain) == 0);
+    TEST_CHECK(chain.nbytes == 6);
+
+    dest.pos = 0;
+    moved = iobuf_chain_gather(&dest, &chain);
+
+    TEST_CHECK(moved == 6);
+    TEST_CHECK(memcmp(bytes, "\x06\x07\x08\x09\x0a\x0b", 6) == 0);
+    TEST_CHECK(chain.nspans == 0 && chain.nbytes == 0);
+    TEST_CHECK(seg->nrefs == 1);
+
+    iobuf_chain_fini(&chain);
+    iobuf_seg_unref(seg);
+}
+
+static void test_chain_wrap(
+        struct iobuf_seg **out,
+        const char *str,
+        size_t index)
+{
+    HRESULT hr;
+
+    hr = iobuf_seg_wrap(
+            str,
+            strlen(str),
+            test_chain_release,
+            (void *) index,
+            out);
+    TEST_CHECK(hr == S_OK);
+}
+
+static void test_chain_release(struct iobuf_seg *seg, void *ctx)
+{
+    (void) seg;
+
+    test_releases[(size_t) ctx]++;
+}
+
+static void test_arrays(void)
+{
+    static const struct {
+        const char *name;
+        uint32_t features;
+    } kernels[] = {
+        { "scalar", 0 },
+        { "SSE2",   CPU_FEATURE_SSE2 },
+        { "SSSE3",  CPU_FEATURE_SSE2 | CPU_FEATURE_SSSE3 },
+        { "AVX2",
+                CPU_FEATURE_SSE2 | CPU_FEATURE_SSSE3 | CPU_FEATURE_AVX2 },
+    };
+
+    uint32_t features;
+    size_t width;
+    size_t nvalues;
+    size_t i;
+
+    for (i = 0 ; i < TEST_ARRAY_NBYTES ; i++) {
+        test_array_src[i] = (uint8_t) rand();
+    }
+
+    /* Each kernel in turn, by hiding the features that the better ones
+       need. Kernels that the CPU cannot run are skipped. */
+
+    features = cpu_get_features();
+
+    for (i = 0 ; i < _countof(kernels) ; i++) {
+        if ((features & kernels[i].features) != kernels[i].features) {
+            printf("No %s here, skipping its swap kernel\n", kernels[i].name);
+
+            continue;
+        }
+
+        cpu_set_feature_mask(kernels[i].features);
+
+        for (width = 2 ; width <= 8 ; width *= 2) {
+            for (nvalues = 0 ; nvalues <= TEST_ARRAY_MAX ; nvalues++) {
+                if (!test_array_case(width, nvalues)) {
+                    fprintf(stderr,
+                            "%s kernel, width %u, %u values\n",
+                            kernels[i].name,
+                            (unsigned int) width,
+                            (unsigned int) nvalues);
+
+                    break;
+                }
+            }
+        }
+    }
+
+    cpu_set_feature_mask(UINT32_MAX);
+}
+
+static bool test_array_case(size_t width, size_t nvalues)
+{
+    struct const_iobuf src;
+    struct const_iobuf ref;
+    struct iobuf dest;
+    uint64_t expected;
+    size_t nbytes;
+    size_t src_off;
+    size_t dest_off;
+    size_t i;
+    HRESULT hr;
+
+    /* Read an array from every misalignment of the source bytes, check it
+       against the scalar accessors, then write it back out at every
+       misalignment and check that the same bytes come out. */
+
+    nbytes = nvalues * width;
+
+    for (src_off = 0 ; src_off < 16 ; src_off++) {
+        memset(&test_array_values, 0xA5, sizeof(test_array_values));
+
+        src.bytes = test_array_src;
+        src.nbytes = src_off + nbytes;
+        src.pos = src_off;
+
+        hr = test_array_read(&src, nvalues, width);
+
+        if (    !TEST_CHECK(hr == S_OK) ||
+                !TEST_CHECK(src.pos == src_off + nbytes)) {
+            return false;
+        }
+
+        ref.bytes = test_array_src;
+        ref.nbytes = src.nbytes;
+        ref.pos = src_off;
+
+        for (i = 0 ; i < nvalues ; i++) {
+            expected = test_array_ref(&ref, width);
+
+            if (!TEST_CHECK(test_array_value(i, width) == expected)) {
+                return false;
+            }
+        }
+
+        for (dest_off = 0 ; dest_off < 16 ; dest_off++) {
+            memset(test_array_dest, 0, sizeof(test_array_dest));
+
+            dest.bytes = test_array_dest;
+            dest.nbytes = dest_off + nbytes;
+            dest.pos = dest_off;
+
+            hr = test_array_write(&dest, nvalues, width);
+
+            if (    !TEST_CHECK(hr == S_OK) ||
+                    !TEST_CHECK(dest.pos == dest_off + nbytes) ||
+                    !TEST_CHECK(memcmp(
+                            &test_array_dest[dest_off],
+                            &test_array_src[src_off],
+                            nbytes) == 0)) {
+                return false;
+            }
+        }
+    }
+
+    if (nvalues == 0) {
+        return true;
+    }
+
+    /* One byte short is all or nothing: no values, no bytes, same pos */
+
+    memset(&test_array_values, 0xA5, sizeof(test_array_values));
+
+    src.bytes = test_array_src;
+    src.nbytes = 3 + nbytes - 1;
+    src.pos = 3;
+
+    hr = test_array_read(&src, nvalues, width);
+
+    if (    !TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER)) ||
+            !TEST_CHECK(src.pos == 3) ||
+            !TEST_CHECK(test_array_values.u64[0] == TEST_ARRAY_POISON)) {
+        return false;
+    }
+
+    memset(test_array_dest, 0, sizeof(test_array_dest));
+
+    dest.bytes = test_array_dest;
+    dest.nbytes = 5 + nbytes - 1;
+    dest.pos = 5;
+
+    hr = test_array_write(&dest, nvalues, width);
+
+    if (    !TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER)) ||
+            !TEST_CHECK(dest.pos == 5) ||
+            !TEST_CHECK(test_array_dest[5] == 0)) {
+        return false;
+    }
+
+    return true;
+}
+
+static HRESULT test_array_read(
+        struct const_iobuf *src,
+        size_t nvalues,
+        size_t width)
+{
+    switch (width) {
+    case 2:
+        return iobuf_read_be16_array(src, test_array_values.u16, nvalues);
+
+    case 4:
+        return iobuf_read_be32_array(src, test_array_values.u32, nvalues);
+
+    default:
+        return iobuf_read_be64_array(src, test_array_values.u64, nvalues);
+    }
+}
+
+static HRESULT test_array_write(
+        struct iobuf *dest,
+        size_t nvalues,
+        size_t width)
+{
+    switch (width) {
+    case 2:
+        return iobuf_write_be16_array(dest, test_array_values.u16, nvalues);
+
+    case 4:
+        return iobuf_write_be32_array(dest, test_array_values.u32, nvalues);
+
+    default:
+        return iobuf_write_be64_array(dest, test_array_values.u64, nvalues);
+    }
+}
+
+static uint64_t test_array_ref(struct const_iobuf *src, size_t width)
+{
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    switch (width) {
+    case 2:
+        TEST_CHECK(iobuf_read_be16(src, &v16) == S_OK);
+
+        return v16;
+
+    case 4:
+        TEST_CHECK(iobuf_read_be32(src, &v32) == S_OK);
+
+        return v32;
+
+    default:
+        TEST_CHECK(iobuf_read_be64(src, &v64) == S_OK);
+
+        return v64;
+    }
+}
+
+static uint64_t test_array_value(size_t i, size_t width)
+{
+    switch (width) {
+    case 2:     return test_array_values.u16[i];
+    case 4:     return test_array_values.u32[i];
+    default:    return test_array_values.u64[i];
+    }
+}
+
+static void test_codec_layout(void)
+{
+    const struct iobuf_codec *codec;
+
+    codec = test_pkt_codec();
+
+    TEST_CHECK(codec->wire_nbytes == 22);
+    TEST_CHECK(codec->wire_nbytes == TEST_PKT_NBYTES);
+    TEST_CHECK(codec->nfields == 7);
+    TEST_CHECK(strcmp(codec->fields[3].name, "addr") == 0);
+    TEST_CHECK(codec->fields[3].kind == IOBUF_CODEC_BE32);
+    TEST_CHECK(codec->fields[3].wire_offset == 4);
+    TEST_CHECK(codec->fields[3].struct_offset ==
+            offsetof(struct test_pkt, addr));
+}
+
+static void test_codec_known(void)
+{
+    static const uint8_t known[] = {
+        0xA5, 0x01, 0x34, 0x12, 0x11, 0x22, 0x33, 0x44,
+        0x78, 0x56, 0x34, 0x12, 0xBE, 0xEF, 0x08, 0x07,
+        0x06, 0x05, 0x04, 0x03, 0x02, 0x01,
+    };
+    struct const_iobuf src;
+    struct iobuf dest;
+    struct test_pkt pkt;
+    uint8_t bytes[sizeof(known)];
+    HRESULT hr;
+
+    src.bytes = known;
+    src.nbytes = sizeof(known);
+    src.pos = 0;
+
+    hr = test_pkt_decode(&src, &pkt);
+
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(src.pos == sizeof(known));
+    TEST_CHECK(pkt.sync == 0xA5);
+    TEST_CHECK(pkt.cmd == 0x01);
+    TEST_CHECK(pkt.seq == 0x1234);
+    TEST_CHECK(pkt.addr == UINT32_C(0x11223344));
+    TEST_CHECK(pkt.length == UINT32_C(0x12345678));
+    TEST_CHECK(pkt.status == 0xBEEF);
+    TEST_CHECK(pkt.timestamp == UINT64_C(0x0102030405060708));
+
+    /* Truncated input fails without consuming anything */
+
+    src.nbytes = sizeof(known) - 1;
+    src.pos = 0;
+    hr = test_pkt_decode(&src, &pkt);
+
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(src.pos == 0);
+
+    hr = iobuf_codec_decode(test_pkt_codec(), &src, &pkt);
+
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(src.pos == 0);
+
+    /* As does output that does not fit */
+
+    dest.bytes = bytes;
+    dest.nbytes = sizeof(bytes) - 1;
+    dest.pos = 0;
+    hr = test_pkt_encode(&dest, &pkt);
+
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(dest.pos == 0);
+
+    hr = iobuf_codec_encode(test_pkt_codec(), &dest, &pkt);
+
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+    TEST_CHECK(dest.pos == 0);
+}
+
+static void test_codec_random(void)
+{
+    struct const_iobuf src;
+    struct iobuf dest;
+    struct test_pkt generated;
+    struct test_pkt table;
+    size_t nbytes;
+    size_t i;
+    HRESULT hr;
+
+    /* Both implementations have to decode random packets identically, and
+       re-encode them into the original bytes. */
+
+    nbytes = TEST_NPKTS * TEST_PKT_NBYTES;
+
+    for (i = 0 ; i < nbytes ; i++) {
+        test_expected[i] = rand();
+    }
+
+    src.bytes = test_expected;
+    src.nbytes = nbytes;
+    src.pos = 0;
+    dest.bytes = test_encoded;
+    dest.nbytes = nbytes;
+    dest.pos = 0;
+
+    for (i = 0 ; i < TEST_NPKTS ; i++) {
+        hr = test_pkt_decode(&src, &generated);
+
+        if (!TEST_CHECK(hr == S_OK)) {
+            return;
+        }
+
+        src.pos -= TEST_PKT_NBYTES;
+        hr = iobuf_codec_decode(test_pkt_codec(), &src, &table);
+
+        if (    !TEST_CHECK(hr == S_OK) ||
+                !TEST_CHECK(test_pkt_equal(&generated, &table))) {
+            fprintf(stderr, "Packet %u\n", (unsigned int) i);
+
+            return;
+        }
+
+        if (i % 2 == 0) {
+            hr = test_pkt_encode(&dest, &generated);
+        } else {
+            hr = iobuf_codec_encode(test_pkt_codec(), &dest, &table);
+        }
+
+        if (!TEST_CHECK(hr == S_OK)) {
+            return;
+        }
+    }
+
+    TEST_CHECK(dest.pos == nbytes);
+    TEST_CHECK(memcmp(test_encoded, test_expected, nbytes) == 0);
+}
+
+static bool test_pkt_equal(
+        const struct test_pkt *lhs,
+        const struct test_pkt *rhs)
+{
+    const struct iobuf_codec *codec;
+    size_t i;
+
+    /* Compare field by field, since the structs themselves contain padding */
+
+    codec = test_pkt_codec();
+
+    for (i = 0 ; i < codec->nfields ; i++) {
+        if (    iobuf_codec_get(&codec->fields[i], lhs) !=
+                iobuf_codec_get(&codec->fields[i], rhs)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void test_bits(void)
+{
+    struct iobuf_bit_writer w;
+    struct iobuf_bit_reader r;
+    struct const_iobuf src;
+    struct iobuf dest;
+    uint64_t value;
+    size_t bitpos;
+    size_t i;
+    HRESULT hr;
+
+    dest.bytes = test_encoded;
+    dest.nbytes = sizeof(test_encoded);
+    dest.pos = 0;
+    iobuf_bit_writer_init(&w, &dest);
+
+    for (i = 0 ; i < TEST_NFIELDS ; i++) {
+        hr = iobuf_write_bits(&w, test_widths[i], test_fields[i]);
+
+        if (!TEST_CHECK(hr == S_OK)) {
+            return;
+        }
+    }
+
+    iobuf_bit_writer_finish(&w);
+    memset(test_expected, 0, sizeof(test_expected));
+    bitpos = 0;
+
+    for (i = 0 ; i < TEST_NFIELDS ; i++) {
+        test_ref_write_bits(
+                test_expected,
+                &bitpos,
+                test_widths[i],
+                test_fields[i]);
+    }
+
+    TEST_CHECK(dest.pos == (bitpos + 7) / 8);
+    TEST_CHECK(memcmp(test_encoded, test_expected, dest.pos) == 0);
+
+    src.bytes = test_encoded;
+    src.nbytes = dest.pos;
+    src.pos = 0;
+    iobuf_bit_reader_init(&r, &src);
+
+    for (i = 0 ; i < TEST_NFIELDS ; i++) {
+        hr = iobuf_read_bits(&r, test_widths[i], &value);
+
+        if (!TEST_CHECK(hr == S_OK && value == test_fields[i])) {
+            fprintf(stderr, "Bit field %u\n", (unsigned int) i);
+
+            return;
+        }
+    }
+
+    iobuf_bit_reader_finish(&r);
+
+    TEST_CHECK(src.pos == src.nbytes);
+}
+
+static void test_uleb128(void)
+{
+    struct const_iobuf src;
+    struct iobuf dest;
+    uint64_t value;
+    size_t nbytes;
+    size_t i;
+    HRESULT hr;
+
+    dest.bytes = test_encoded;
+    dest.nbytes = sizeof(test_encoded);
+    dest.pos = 0;
+
+    for (i = 0 ; i < TEST_NFIELDS ; i++) {
+        hr = iobuf_write_uleb128(&dest, test_varints[i]);
+
+        if (!TEST_CHECK(hr == S_OK)) {
+            return;
+        }
+    }
+
+    nbytes = dest.pos;
+    dest.bytes = test_expected;
+    dest.nbytes = sizeof(test_expected);
+    dest.pos = 0;
+
+    for (i = 0 ; i < TEST_NFIELDS ; i++) {
+        test_ref_write_uleb128(&dest, test_varints[i]);
+    }
+
+    TEST_CHECK(dest.pos == nbytes);
+    TEST_CHECK(memcmp(test_encoded, test_expected, nbytes) == 0);
+
+    src.bytes = test_encoded;
+    src.nbytes = nbytes;
+    src.pos = 0;
+
+    for (i = 0 ; i < TEST_NFIELDS ; i++) {
+        hr = iobuf_read_uleb128(&src, &value);
+
+        if (!TEST_CHECK(hr == S_OK && value == test_varints[i])) {
+            fprintf(stderr, "Varint %u\n", (unsigned int) i);
+
+            return;
+        }
+    }
+
+    TEST_CHECK(src.pos == src.nbytes);
+}
+
+static void test_sleb128(void)
+{
+    static const int64_t cases[] = {
+        0, 1, -1, 63, 64, -64, -65, 8191, -8192,
+        INT64_MAX, INT64_MIN, INT64_MIN + 1,
+    };
+
+    struct const_iobuf src;
+    struct iobuf dest;
+    int64_t value;
+    size_t i;
+    HRESULT hr;
+
+    /* Each value both at the end of the buffer (slow path) and followed by
+       padding (fast path where it fits in eight bytes). */
+
+    for (i = 0 ; i < _countof(cases) ; i++) {
+        dest.bytes = test_encoded;
+        dest.nbytes = sizeof(test_encoded);
+        dest.pos = 0;
+        hr = iobuf_write_sleb128(&dest, cases[i]);
+
+        if (!TEST_CHECK(hr == S_OK)) {
+            continue;
+        }
+
+        src.bytes = test_encoded;
+        src.nbytes = dest.pos;
+        src.pos = 0;
+        hr = iobuf_read_sleb128(&src, &value);
+
+        TEST_CHECK(hr == S_OK && value == cases[i]);
+
+        memset(&test_encoded[dest.pos], 0, 8);
+        src.nbytes = dest.pos + 8;
+        src.pos = 0;
+        hr = iobuf_read_sleb128(&src, &value);
+
+        TEST_CHECK(hr == S_OK && value == cases[i]);
+        TEST_CHECK(src.pos == dest.pos);
+    }
+}
+
+static void test_spsc(void)
+{
+    struct iobuf_spsc q;
+    struct const_iobuf src;
+    struct iobuf dest;
+    uint8_t bytes[16];
+    uint8_t out[32];
+    size_t i;
+
+    /* The two ends have to sit on cache lines of their own */
+
+    TEST_CHECK(offsetof(struct iobuf_spsc, head) >= IOBUF_SPSC_LINE);
+    TEST_CHECK(offsetof(struct iobuf_spsc, tail) -
+            offsetof(struct iobuf_spsc, head) >= IOBUF_SPSC_LINE);
+
+    for (i = 0 ; i < 32 ; i++) {
+        test_encoded[i] = i;
+    }
+
+    iobuf_spsc_init(&q, bytes, sizeof(bytes));
+
+    /* Fill, drain part of it, then wrap around the end of the buffer */
+
+    TEST_CHECK(iobuf_spsc_write(&q, &test_encoded[0], 10) == S_OK);
+    TEST_CHECK(iobuf_spsc_read(&q, out, 6) == S_OK);
+    TEST_CHECK(memcmp(out, &test_encoded[0], 6) == 0);
+    TEST_CHECK(iobuf_spsc_write(&q, &test_encoded[10], 12) == S_OK);
+    TEST_CHECK(iobuf_spsc_space(&q) == 0);
+    TEST_CHECK(FAILED(iobuf_spsc_write(&q, &test_encoded[22], 1)));
+    TEST_CHECK(iobuf_spsc_avail(&q) == 16);
+
+    dest.bytes = out;
+    dest.nbytes = sizeof(out);
+    dest.pos = 0;
+
+    TEST_CHECK(iobuf_spsc_shift(&dest, &q) == 16);
+    TEST_CHECK(memcmp(out, &test_encoded[6], 16) == 0);
+    TEST_CHECK(iobuf_spsc_avail(&q) == 0);
+    TEST_CHECK(FAILED(iobuf_spsc_read(&q, out, 1)));
+
+    /* Partial move, then skip */
+
+    src.bytes = test_encoded;
+    src.nbytes = 20;
+    src.pos = 0;
+
+    TEST_CHECK(iobuf_spsc_move(&q, &src) == 16);
+    TEST_CHECK(src.pos == 16);
+    TEST_CHECK(iobuf_spsc_skip(&q, 10) == 10);
+    TEST_CHECK(iobuf_spsc_skip(&q, 10) == 6);
+    TEST_CHECK(iobuf_spsc_avail(&q) == 0);
+
+    /* Commit, as if a peer had filled the buffer directly */
+
+    TEST_CHECK(iobuf_spsc_commit(&q, 20) == 16);
+    TEST_CHECK(iobuf_spsc_space(&q) == 0);
+    TEST_CHECK(iobuf_spsc_avail(&q) == 16);
+    TEST_CHECK(iobuf_spsc_skip(&q, 16) == 16);
+}
+
+static void test_spsc_threads(void)
+{
+    struct iobuf_spsc q;
+    struct iobuf dest;
+    uint8_t bytes[64];
+    uint8_t out[13];
+    uint8_t expected;
+    size_t remaining;
+    size_t i;
+    HANDLE thread;
+    bool ok;
+
+    /* A small queue and chunk sizes that do not divide it, so that both
+       sides keep wrapping and keep finding the queue full or empty. */
+
+    iobuf_spsc_init(&q, bytes, sizeof(bytes));
+    thread = CreateThread(NULL, 0, test_spsc_producer_proc, &q, 0, NULL);
+
+    if (!TEST_CHECK(thread != NULL)) {
+        return;
+    }
+
+    remaining = TEST_SPSC_NBYTES;
+    expected = 0;
+    ok = true;
+
+    while (remaining > 0) {
+        dest.bytes = out;
+        dest.nbytes = remaining < sizeof(out) ? remaining : sizeof(out);
+        dest.pos = 0;
+
+        if (iobuf_spsc_shift(&dest, &q) == 0) {
+            Sleep(0);
+
+            continue;
+        }
+
+        for (i = 0 ; i < dest.pos ; i++) {
+            if (out[i] != expected++) {
+                ok = false;
+            }
+        }
+
+        remaining -= dest.pos;
+    }
+
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+
+    TEST_CHECK(ok);
+    TEST_CHECK(iobuf_spsc_avail(&q) == 0);
+}
+
+static DWORD WINAPI test_spsc_producer_proc(void *ctx)
+{
+    struct iobuf_spsc *q;
+    struct const_iobuf src;
+    uint8_t chunk[TEST_SPSC_CHUNK];
+    uint8_t next;
+    size_t sent;
+    size_t i;
+
+    q = ctx;
+    next = 0;
+
+    for (sent = 0 ; sent < TEST_SPSC_NBYTES ; sent += src.nbytes) {
+        src.bytes = chunk;
+        src.nbytes = TEST_SPSC_NBYTES - sent;
+        src.pos = 0;
+
+        if (src.nbytes > sizeof(chunk)) {
+            src.nbytes = sizeof(chunk);
+        }
+
+        for (i = 0 ; i < src.nbytes ; i++) {
+            chunk[i] = next++;
+        }
+
+        while (src.pos < src.nbytes) {
+            if (iobuf_spsc_move(q, &src) == 0) {
+                Sleep(0);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void test_ref_write_bits(
+        uint8_t *bytes,
+        size_t *bitpos,
+        unsigned int nbits,
+        uint64_t value)
+{
+    unsigned int i;
+    size_t pos;
+
+    pos = *bitpos;
+
+    for (i = nbits ; i > 0 ; i--, pos++) {
+        if ((value >> (i - 1)) & 1) {
+            bytes[pos / 8] |= 0x80 >> (pos % 8);
+        } else {
+            bytes[pos / 8] &= ~(0x80 >> (pos % 8));
+        }
+    }
+
+    *bitpos = pos;
+}
+
+static void test_ref_write_uleb128(struct iobuf *dest, uint64_t value)
+{
+    uint8_t byte;
+
+    do {
+        byte = value & 0x7F;
+        value >>= 7;
+        dest->bytes[dest->pos++] = value != 0 ? byte | 0x80 : byte;
+    } while (value != 0);
+}
@@ -0,0 +1,205 @@
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/iobuf.h"
+#include "hook/iohook.h"
+
+#include "test/test.h"
+
+/* Synchronous ioctl batches running through a handler that does not
+   understand batches, and which leaves every ioctl it is given pending until
+   a worker thread gets round to completing it. The batch has to come back
+   with every ioctl done, in order, and with no pending record left behind
+   (the leak checker catches those). */
+
+#define TEST_IOCTL_FAIL 0xDEAD
+
+#define TEST_NIOCTLS 8
+
+static HRESULT test_pender(struct irp *irp);
+static void test_cancel(struct irp *irp, void *ctx);
+static DWORD WINAPI test_worker_proc(void *ctx);
+static void test_batch(void);
+static void test_batch_failure(void);
+
+static HANDLE test_kick;
+static HANDLE test_worker;
+static struct irp *test_pended;
+static bool test_stop;
+static uint32_t test_seen[TEST_NIOCTLS];
+static size_t test_nseen;
+
+int main(int argc, char **argv)
+{
+    HRESULT hr;
+
+    (void) argc;
+    (void) argv;
+
+    hr = iohook_push_handler(test_pender);
+
+    if (!TEST_CHECK(SUCCEEDED(hr))) {
+        return test_result();
+    }
+
+    test_kick = CreateEventW(NULL, FALSE, FALSE, NULL);
+    test_worker = CreateThread(NULL, 0, test_worker_proc, NULL, 0, NULL);
+
+    test_batch();
+    test_batch_failure();
+
+    test_stop = true;
+    SetEvent(test_kick);
+    WaitForSingleObject(test_worker, INFINITE);
+    CloseHandle(test_worker);
+    CloseHandle(test_kick);
+
+    return test_result();
+}
+
+static HRESULT test_pender(struct irp *irp)
+{
+    struct irp *pended;
+    HRESULT hr;
+
+    if (!TEST_CHECK(irp->op == IRP_OP_IOCTL)) {
+        return E_FAIL;
+    }
+
+    if (test_nseen < TEST_NIOCTLS) {
+        test_seen[test_nseen++] = irp->ioctl;
+    }
+
+    if (irp->ioctl == TEST_IOCTL_FAIL) {
+        return E_FAIL;
+    }
+
+    hr = iohook_pend_irp(irp, test_cancel, NULL, &pended);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    test_pended = pended;
+    SetEvent(test_kick);
+
+    return HRESULT_FROM_WIN32(ERROR_IO_PENDING);
+}
+
+static void test_cancel(struct irp *irp, void *ctx)
+{
+    (void) irp;
+    (void) ctx;
+
+    TEST_CHECK(!"pended ioctl was cancelled");
+}
+
+static DWORD WINAPI test_worker_proc(void *ctx)
+{
+    struct irp *irp;
+
+    (void) ctx;
+
+    for (;;) {
+        WaitForSingleObject(test_kick, INFINITE);
+
+        if (test_stop) {
+            break;
+        }
+
+        /* Give the issuing thread time to get back out of the handler */
+
+        Sleep(1);
+
+        irp = test_pended;
+        test_pended = NULL;
+
+        if (irp->read.pos < irp->read.nbytes) {
+            irp->read.bytes[irp->read.pos++] = (uint8_t) irp->ioctl;
+        }
+
+        iohook_complete_irp(irp, S_OK);
+    }
+
+    return 0;
+}
+
+static void test_batch(void)
+{
+    struct irp_ioctl ioctls[TEST_NIOCTLS];
+    uint8_t replies[TEST_NIOCTLS];
+    struct irp irp;
+    HRESULT hr;
+    size_t i;
+
+    memset(ioctls, 0, sizeof(ioctls));
+    memset(replies, 0, sizeof(replies));
+
+    for (i = 0 ; i < TEST_NIOCTLS ; i++) {
+        ioctls[i].ioctl = 0x40 + i;
+        ioctls[i].read.bytes = &replies[i];
+        ioctls[i].read.nbytes = 1;
+    }
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_IOCTL_BATCH;
+    irp.fd = INVALID_HANDLE_VALUE;
+    irp.ioctls = ioctls;
+    irp.nioctls = TEST_NIOCTLS;
+    test_nseen = 0;
+
+    hr = iohook_invoke_next(&irp);
+
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_nseen == TEST_NIOCTLS);
+
+    for (i = 0 ; i < TEST_NIOCTLS ; i++) {
+        TEST_CHECK(test_seen[i] == 0x40 + i);
+        TEST_CHECK(ioctls[i].read.pos == 1);
+        TEST_CHECK(replies[i] == 0x40 + i);
+    }
+}
+
+static void test_batch_failure(void)
+{
+    struct irp_ioctl ioctls[3];
+    uint8_t replies[3];
+    struct irp irp;
+    HRESULT hr;
+    size_t i;
+
+    /* The batch stops at the first failure, pended ioctls before it having
+       completed and the ones after it never being issued. */
+
+    memset(ioctls, 0, sizeof(ioctls));
+    memset(replies, 0, sizeof(replies));
+
+    for (i = 0 ; i < _countof(ioctls) ; i++) {
+        ioctls[i].ioctl = 0x50 + i;
+        ioctls[i].read.bytes = &replies[i];
+        ioctls[i].read.nbytes = 1;
+    }
+
+    ioctls[1].ioctl = TEST_IOCTL_FAIL;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_IOCTL_BATCH;
+    irp.fd = INVALID_HANDLE_VALUE;
+    irp.ioctls = ioctls;
+    irp.nioctls = _countof(ioctls);
+    test_nseen = 0;
+
+    hr = iohook_invoke_next(&irp);
+
+    TEST_CHECK(hr == E_FAIL);
+    TEST_CHECK(test_nseen == 2);
+    TEST_CHECK(ioctls[0].read.pos == 1);
+    TEST_CHECK(replies[0] == 0x50);
+    TEST_CHECK(ioctls[2].read.pos == 0);
+}
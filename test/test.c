@@ -0,0 +1,31 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test/test.h"
+
+static unsigned int test_nchecks;
+static unsigned int test_nfailed;
+
+bool test_check(bool ok, const char *expr, const char *file, int line)
+{
+    assert(expr != NULL);
+    assert(file != NULL);
+
+    test_nchecks++;
+
+    if (!ok) {
+        test_nfailed++;
+        fprintf(stderr, "%s:%i: check failed: %s\n", file, line, expr);
+    }
+
+    return ok;
+}
+
+int test_result(void)
+{
+    printf("%u checks, %u failed\n", test_nchecks, test_nfailed);
+
+    return test_nfailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Minimal test harness. A test executable runs its checks straight from
+   main() and returns test_result(), which meson's test() reads as pass or
+   fail. A failed check reports its expression and location and the run
+   carries on, so that one run shows everything that is wrong. */
+
+#define TEST_CHECK(expr) test_check((expr), #expr, __FILE__, __LINE__)
+
+bool test_check(bool ok, const char *expr, const char *file, int line);
+int test_result(void);
@@ -0,0 +1,236 @@
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hooklib/timer-wheel.h"
+
+#include "test/test.h"
+
+/* The real timer wheel, on its own thread, against the real clock. Entries
+   are spread over more than one revolution of the wheel, some re-arm
+   themselves from their callbacks and some are disarmed before they fire.
+   Every firing must come no earlier than its due time and exactly as many
+   times as it was armed for. Lateness is only reported, since a loaded
+   build box can hold the wheel thread up for as long as it likes. */
+
+#define TEST_NENTRIES 256
+#define TEST_NREARMS 3
+#define TEST_MS 1000000ULL
+
+static void test_fired(
+        struct timer_wheel_entry *entry,
+        uint64_t now,
+        void *ctx);
+static void test_slow(
+        struct timer_wheel_entry *entry,
+        uint64_t now,
+        void *ctx);
+static bool test_rearms(size_t i);
+static bool test_disarms(size_t i);
+static void test_spread(void);
+static void test_disarm_sync(void);
+static void test_disarm_sync_running(void);
+
+static struct timer_wheel_entry test_entries[TEST_NENTRIES];
+static uint64_t test_due[TEST_NENTRIES];
+static unsigned int test_counts[TEST_NENTRIES];
+static unsigned int test_rearms_left[TEST_NENTRIES];
+static LONG test_nfired;
+static LONG test_nexpected;
+static LONG test_nearly;
+static uint64_t test_worst;
+static HANDLE test_done;
+static HANDLE test_started;
+static bool test_slow_finished;
+
+int main(int argc, char **argv)
+{
+    (void) argc;
+    (void) argv;
+
+    TEST_CHECK(timer_wheel_init() == S_OK);
+    TEST_CHECK(timer_wheel_init() == S_FALSE);
+
+    test_done = CreateEventW(NULL, TRUE, FALSE, NULL);
+    test_started = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    test_spread();
+    test_disarm_sync();
+    test_disarm_sync_running();
+
+    CloseHandle(test_started);
+    CloseHandle(test_done);
+
+    return test_result();
+}
+
+static void test_fired(
+        struct timer_wheel_entry *entry,
+        uint64_t now,
+        void *ctx)
+{
+    uint64_t late;
+    size_t i;
+
+    i = (size_t) ctx;
+    now = timer_wheel_now();
+    test_counts[i]++;
+
+    if (now < test_due[i]) {
+        InterlockedIncrement(&test_nearly);
+    } else {
+        late = now - test_due[i];
+
+        if (late > test_worst) {
+            test_worst = late;
+        }
+    }
+
+    if (test_rearms_left[i] > 0) {
+        test_rearms_left[i]--;
+        test_due[i] = now + TEST_MS + (i % 7) * TEST_MS / 10;
+        timer_wheel_arm(entry, test_due[i]);
+    }
+
+    if (InterlockedIncrement(&test_nfired) == test_nexpected) {
+        SetEvent(test_done);
+    }
+}
+
+static void test_slow(
+        struct timer_wheel_entry *entry,
+        uint64_t now,
+        void *ctx)
+{
+    (void) entry;
+    (void) now;
+    (void) ctx;
+
+    SetEvent(test_started);
+    Sleep(20);
+    test_slow_finished = true;
+}
+
+static bool test_rearms(size_t i)
+{
+    return i % 8 == 0;
+}
+
+static bool test_disarms(size_t i)
+{
+    return i % 32 == 1;
+}
+
+static void test_spread(void)
+{
+    LONG nexpected;
+    DWORD result;
+    uint64_t now;
+    size_t i;
+
+    srand(1);
+    nexpected = 0;
+    now = timer_wheel_now();
+
+    /* Every 16th entry is more than a whole revolution of the wheel away,
+       so it shares a slot with entries that are due much sooner. */
+
+    for (i = 0 ; i < TEST_NENTRIES ; i++) {
+        test_due[i] = now + (i % 64) * TEST_MS + rand() % TEST_MS;
+
+        if (i % 16 == 5) {
+            test_due[i] += TIMER_WHEEL_NSLOTS * TIMER_WHEEL_TICK_NS;
+        }
+
+        test_rearms_left[i] = test_rearms(i) ? TEST_NREARMS : 0;
+
+        if (!test_disarms(i)) {
+            nexpected += 1 + test_rearms_left[i];
+        }
+
+        timer_wheel_entry_init(&test_entries[i], test_fired, (void *) i);
+    }
+
+    test_nexpected = nexpected;
+
+    for (i = 0 ; i < TEST_NENTRIES ; i++) {
+        timer_wheel_arm(&test_entries[i], test_due[i]);
+    }
+
+    for (i = 0 ; i < TEST_NENTRIES ; i++) {
+        if (test_disarms(i)) {
+            timer_wheel_disarm(&test_entries[i]);
+        }
+    }
+
+    result = WaitForSingleObject(test_done, 10000);
+
+    if (!TEST_CHECK(result == WAIT_OBJECT_0)) {
+        return;
+    }
+
+    /* Give anything that should not have fired the chance to do so */
+
+    Sleep(50);
+
+    TEST_CHECK(test_nfired == test_nexpected);
+    TEST_CHECK(test_nearly == 0);
+
+    for (i = 0 ; i < TEST_NENTRIES ; i++) {
+        if (test_disarms(i)) {
+            TEST_CHECK(test_counts[i] == 0);
+        } else {
+            TEST_CHECK(test_counts[i] ==
+                    1 + (test_rearms(i) ? TEST_NREARMS : 0));
+        }
+
+        TEST_CHECK(!test_entries[i].armed);
+    }
+
+    printf("Worst lateness %u us\n", (unsigned int) (test_worst / 1000));
+}
+
+static void test_disarm_sync(void)
+{
+    struct timer_wheel_entry *entry;
+    unsigned int count;
+
+    /* A disarmed entry never fires, even once its time has come */
+
+    entry = &test_entries[0];
+    count = test_counts[0];
+
+    timer_wheel_arm(entry, timer_wheel_now() + 5 * TEST_MS);
+    timer_wheel_disarm_sync(entry);
+    Sleep(20);
+
+    TEST_CHECK(test_counts[0] == count);
+    TEST_CHECK(!entry->armed);
+}
+
+static void test_disarm_sync_running(void)
+{
+    struct timer_wheel_entry entry;
+    DWORD result;
+
+    /* Waits for a callback that is already under way to return */
+
+    timer_wheel_entry_init(&entry, test_slow, NULL);
+    timer_wheel_arm(&entry, timer_wheel_now());
+
+    result = WaitForSingleObject(test_started, 10000);
+
+    if (!TEST_CHECK(result == WAIT_OBJECT_0)) {
+        return;
+    }
+
+    timer_wheel_disarm_sync(&entry);
+
+    TEST_CHECK(test_slow_finished);
+    TEST_CHECK(!entry.running);
+}
@@ -0,0 +1,351 @@
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "hook/iohook.h"
+
+#include "hooklib/uart-bridge.h"
+#include "hooklib/uart.h"
+
+#include "test/test.h"
+
+/* A bridge with the file backend, driven with synchronous IRPs the way an
+   application's ReadFile() and WriteFile() would send them. The test plays
+   the program at the other end with plain stdio, appending to the file that
+   the bridge follows for incoming bytes and reading back the one that it
+   appends outgoing bytes to. The host shim has neither sockets nor overlapped
+   I/O that can be left in flight, so the tcp: and pipe backends only run on
+   Windows; here a tcp: target just has to fail cleanly. Invoked as
+
+       uart-bridge-test <path for the rx file> <path for the tx file> */
+
+#define TEST_NBYTES 0x30000
+#define TEST_TIMEOUT_MS 10000
+
+static HRESULT test_handler(struct irp *irp);
+static HRESULT test_io(
+        enum irp_op op,
+        const void *bytes,
+        size_t nbytes,
+        size_t *pos);
+static uint32_t test_modem_status(void);
+static bool test_append(const char *path, const void *bytes, size_t nbytes);
+static size_t test_wait_tx(size_t nbytes);
+static void test_targets(void);
+static void test_transfer(void);
+static void test_stream(void);
+static void test_close(void);
+
+static struct uart test_uart;
+static struct uart_bridge *test_bridge;
+static HANDLE test_fd;
+static const char *test_rx_path;
+static const char *test_tx_path;
+static uint8_t test_out[TEST_NBYTES];
+static uint8_t test_in[TEST_NBYTES];
+static uint8_t test_tx[TEST_NBYTES + 16];
+
+int main(int argc, char **argv)
+{
+    wchar_t target[512];
+    HRESULT hr;
+    size_t i;
+
+    if (!TEST_CHECK(argc == 3)) {
+        return test_result();
+    }
+
+    test_rx_path = argv[1];
+    test_tx_path = argv[2];
+
+    i = (size_t) swprintf(
+            target,
+            _countof(target),
+            L"file:%s|%s",
+            test_rx_path,
+            test_tx_path);
+
+    if (!TEST_CHECK(i < _countof(target))) {
+        return test_result();
+    }
+
+    hr = iohook_push_handler(test_handler);
+
+    if (!TEST_CHECK(SUCCEEDED(hr))) {
+        return test_result();
+    }
+
+    for (i = 0 ; i < sizeof(test_out) ; i++) {
+        test_out[i] = (uint8_t) (i * 13 + (i >> 11));
+    }
+
+    test_targets();
+
+    /* Something is already waiting in both files from a previous session.
+       Incoming bytes are read from the start, outgoing ones go after. */
+
+    remove(test_rx_path);
+    remove(test_tx_path);
+
+    if (    !TEST_CHECK(test_append(test_rx_path, "ping", 4)) ||
+            !TEST_CHECK(test_append(test_tx_path, "old", 3))) {
+        return test_result();
+    }
+
+    test_fd = (HANDLE) &test_uart;
+
+    uart_init(&test_uart, 3);
+
+    hr = uart_bridge_open(&test_bridge, &test_uart, target);
+
+    if (!TEST_CHECK(hr == S_OK)) {
+        uart_fini(&test_uart);
+
+        return test_result();
+    }
+
+    test_uart.fd = test_fd;
+
+    test_transfer();
+    test_stream();
+    test_close();
+
+    uart_fini(&test_uart);
+
+    return test_result();
+}
+
+static HRESULT test_handler(struct irp *irp)
+{
+    if (irp->fd != test_fd) {
+        return iohook_invoke_next(irp);
+    }
+
+    /* uart_fini() sends the close for its fd down the chain */
+
+    if (irp->op == IRP_OP_CLOSE) {
+        return S_OK;
+    }
+
+    return uart_bridge_handle_irp(&test_uart, irp, test_bridge);
+}
+
+static HRESULT test_io(
+        enum irp_op op,
+        const void *bytes,
+        size_t nbytes,
+        size_t *pos)
+{
+    struct irp irp;
+    HRESULT hr;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = op;
+    irp.fd = test_fd;
+
+    if (op == IRP_OP_WRITE) {
+        irp.write.bytes = bytes;
+        irp.write.nbytes = nbytes;
+    } else {
+        irp.read.bytes = (uint8_t *) bytes;
+        irp.read.nbytes = nbytes;
+    }
+
+    hr = iohook_invoke_and_wait(&irp);
+    *pos = op == IRP_OP_WRITE ? irp.write.pos : irp.read.pos;
+
+    return hr;
+}
+
+static uint32_t test_modem_status(void)
+{
+    uint32_t status;
+    struct irp irp;
+    HRESULT hr;
+
+    status = 0xDEAD;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_IOCTL;
+    irp.fd = test_fd;
+    irp.ioctl = IOCTL_SERIAL_GET_MODEMSTATUS;
+    irp.read.bytes = (uint8_t *) &status;
+    irp.read.nbytes = sizeof(status);
+
+    hr = iohook_invoke_and_wait(&irp);
+    TEST_CHECK(hr == S_OK);
+
+    return status;
+}
+
+static bool test_append(const char *path, const void *bytes, size_t nbytes)
+{
+    FILE *f;
+    bool ok;
+
+    f = fopen(path, "ab");
+
+    if (f == NULL) {
+        return false;
+    }
+
+    ok = fwrite(bytes, 1, nbytes, f) == nbytes;
+
+    return fclose(f) == 0 && ok;
+}
+
+static size_t test_wait_tx(size_t nbytes)
+{
+    size_t total;
+    DWORD waited;
+    FILE *f;
+
+    /* Read the tx file into test_tx until nbytes have shown up in it, or
+       until it is clear that they never will. */
+
+    total = 0;
+
+    for (waited = 0 ; waited < TEST_TIMEOUT_MS ; waited++) {
+        f = fopen(test_tx_path, "rb");
+
+        if (f != NULL) {
+            total = fread(test_tx, 1, sizeof(test_tx), f);
+            fclose(f);
+        }
+
+        if (total >= nbytes) {
+            break;
+        }
+
+        Sleep(1);
+    }
+
+    return total;
+}
+
+static void test_targets(void)
+{
+    static const wchar_t *bad[] = {
+        L"file:",
+        L"file:rx",
+        L"file:|tx",
+        L"file:rx|",
+        L"tcp:",
+        L"tcp:localhost",
+        L"tcp::1234",
+        L"tcp:localhost:",
+    };
+
+    struct uart_bridge *bridge;
+    struct uart uart;
+    HRESULT hr;
+    size_t i;
+
+    uart_init(&uart, 4);
+
+    for (i = 0 ; i < _countof(bad) ; i++) {
+        bridge = (struct uart_bridge *) &uart;
+
+        hr = uart_bridge_open(&bridge, &uart, bad[i]);
+        TEST_CHECK(hr == E_INVALIDARG);
+        TEST_CHECK(bridge == NULL);
+    }
+
+    /* A well-formed target that cannot be reached leaves the uart alone */
+
+    hr = uart_bridge_open(&bridge, &uart, L"tcp:localhost:1");
+    TEST_CHECK(FAILED(hr));
+    TEST_CHECK(bridge == NULL);
+
+    hr = uart_bridge_open(&bridge, &uart, L"/nonexistent/capnhook-bridge");
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND));
+    TEST_CHECK(bridge == NULL);
+
+    TEST_CHECK(uart.rx == NULL);
+    TEST_CHECK(uart.tx == NULL);
+
+    uart_fini(&uart);
+}
+
+static void test_transfer(void)
+{
+    uint8_t buf[8];
+    size_t nbytes;
+    size_t pos;
+    HRESULT hr;
+
+    /* The other end counts as connected for as long as the files are open */
+
+    TEST_CHECK(test_modem_status() ==
+            (SERIAL_MSR_CTS | SERIAL_MSR_DSR | SERIAL_MSR_DCD));
+
+    hr = test_io(IRP_OP_READ, buf, 4, &pos);
+    TEST_CHECK(hr == S_OK && pos == 4);
+    TEST_CHECK(memcmp(buf, "ping", 4) == 0);
+
+    hr = test_io(IRP_OP_WRITE, "hello", 5, &pos);
+    TEST_CHECK(hr == S_OK && pos == 5);
+
+    nbytes = test_wait_tx(8);
+    TEST_CHECK(nbytes == 8);
+    TEST_CHECK(memcmp(test_tx, "oldhello", 8) == 0);
+
+    /* The rx file is followed as it grows, so a read that finds nothing in
+       it yet is completed once the other end gets round to answering. */
+
+    TEST_CHECK(test_append(test_rx_path, "pong", 4));
+
+    hr = test_io(IRP_OP_READ, buf, 4, &pos);
+    TEST_CHECK(hr == S_OK && pos == 4);
+    TEST_CHECK(memcmp(buf, "pong", 4) == 0);
+}
+
+static void test_stream(void)
+{
+    size_t total;
+    size_t pos;
+    HRESULT hr;
+
+    /* Several times the size of either queue and many chunks, each way */
+
+    TEST_CHECK(sizeof(test_out) > 2 * UART_BRIDGE_QUEUE_SIZE);
+    TEST_CHECK(test_append(test_rx_path, test_out, sizeof(test_out)));
+
+    memset(test_in, 0, sizeof(test_in));
+
+    for (total = 0 ; total < sizeof(test_in) ; total += pos) {
+        pos = 0;
+        hr = test_io(IRP_OP_READ, &test_in[total], 0x1000, &pos);
+
+        if (!TEST_CHECK(hr == S_OK && pos == 0x1000)) {
+            break;
+        }
+    }
+
+    TEST_CHECK(memcmp(test_in, test_out, sizeof(test_in)) == 0);
+
+    hr = test_io(IRP_OP_WRITE, test_out, sizeof(test_out), &pos);
+    TEST_CHECK(hr == S_OK && pos == sizeof(test_out));
+
+    total = test_wait_tx(8 + sizeof(test_out));
+    TEST_CHECK(total == 8 + sizeof(test_out));
+    TEST_CHECK(memcmp(test_tx, "oldhello", 8) == 0);
+    TEST_CHECK(memcmp(&test_tx[8], test_out, sizeof(test_out)) == 0);
+}
+
+static void test_close(void)
+{
+    /* The queues go with the bridge, so the uart has to let go of them */
+
+    uart_bridge_close(test_bridge);
+    test_bridge = NULL;
+
+    TEST_CHECK(test_uart.rx == NULL);
+    TEST_CHECK(test_uart.tx == NULL);
+}
@@ -0,0 +1,370 @@
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf.h"
+#include "hook/iohook.h"
+
+#include "hooklib/frame.h"
+#include "hooklib/uart-bus.h"
+#include "hooklib/uart.h"
+
+#include "test/test.h"
+
+/* Three nodes on a JVS-style bus: E0 sync, D0 escape that decrements the
+   byte after it, and frame bodies of address, length (of everything that
+   follows it), command and checksum. The master's frames arrive as write
+   IRPs, just as an application's WriteFile() would deliver them, and are
+   split and batched in awkward places. The nodes start out without
+   addresses and are enumerated with broadcast F1 (set address) commands,
+   one per node in the order that they were attached, then reset with a
+   broadcast F0 and enumerated again. */
+
+#define TEST_NNODES 3
+#define TEST_BROADCAST 0xFF
+#define TEST_CMD_RESET 0xF0
+#define TEST_CMD_SET_ADDR 0xF1
+
+static size_t test_measure(const struct const_iobuf *body);
+static HRESULT test_node_proc(
+        struct uart_bus_node *node,
+        const struct const_iobuf *frame,
+        void *ctx);
+static void test_send(const uint8_t *body, size_t nbytes);
+static void test_flush(size_t nbytes);
+static size_t test_replies(uint8_t *bytes, size_t nbytes);
+static void test_enumerate(uint8_t first);
+static void test_unclaimed(void);
+static void test_split(void);
+static void test_mixed(void);
+static void test_clash(void);
+static void test_reset(void);
+
+static struct uart test_uart;
+static uint8_t test_readable[4096];
+static struct iobuf_ring test_frames;
+static uint8_t test_frame_bytes[4096];
+static struct uart_bus test_bus;
+static struct uart_bus_node test_nodes[TEST_NNODES];
+static unsigned int test_hits[TEST_NNODES];
+
+int main(int argc, char **argv)
+{
+    struct uart_bus_config config;
+    size_t i;
+
+    (void) argc;
+    (void) argv;
+
+    uart_init(&test_uart, 1);
+    iobuf_ring_init(
+            &test_uart.readable,
+            test_readable,
+            sizeof(test_readable));
+
+    iobuf_ring_init(
+            &test_frames,
+            test_frame_bytes,
+            sizeof(test_frame_bytes));
+
+    memset(&config, 0, sizeof(config));
+    config.frame.sync = 0xE0;
+    config.frame.mark = 0xD0;
+    config.frame.escape = FRAME_ESCAPE_DECREMENT;
+    config.addr_offset = 0;
+    config.broadcast = TEST_BROADCAST;
+    config.has_broadcast = true;
+    config.measure = test_measure;
+
+    uart_bus_init(&test_bus, &test_uart, &config);
+
+    for (i = 0 ; i < TEST_NNODES ; i++) {
+        uart_bus_attach(
+                &test_bus,
+                &test_nodes[i],
+                test_node_proc,
+                (void *) i);
+    }
+
+    TEST_CHECK(!uart_bus_enumerated(&test_bus));
+    TEST_CHECK(test_bus.nunaddressed == TEST_NNODES);
+
+    test_unclaimed();
+    test_enumerate(1);
+    test_split();
+    test_mixed();
+    test_clash();
+    test_reset();
+    test_enumerate(0x10);
+
+    uart_bus_fini(&test_bus);
+    uart_fini(&test_uart);
+
+    return test_result();
+}
+
+static size_t test_measure(const struct const_iobuf *body)
+{
+    if (body->nbytes < 2) {
+        return 0;
+    }
+
+    return 2 + body->bytes[1];
+}
+
+static HRESULT test_node_proc(
+        struct uart_bus_node *node,
+        const struct const_iobuf *frame,
+        void *ctx)
+{
+    struct const_iobuf src;
+    uint8_t reply[4];
+    size_t i;
+
+    i = (size_t) ctx;
+    test_hits[i]++;
+
+    TEST_CHECK(frame->pos == 0);
+    TEST_CHECK(frame->nbytes == test_measure(frame));
+
+    if (frame->bytes[0] == TEST_BROADCAST) {
+        if (frame->bytes[2] == TEST_CMD_RESET) {
+            uart_bus_clear_address(node);
+        } else if (frame->bytes[2] == TEST_CMD_SET_ADDR && !node->has_addr) {
+            TEST_CHECK(uart_bus_set_address(node, frame->bytes[3]) == S_OK);
+        }
+
+        return S_OK;
+    }
+
+    /* Answer the master (address 0) with our index */
+
+    reply[0] = 0x00;
+    reply[1] = 2;
+    reply[2] = (uint8_t) (0x10 + i);
+    reply[3] = 0;
+
+    src.bytes = reply;
+    src.nbytes = sizeof(reply);
+    src.pos = 0;
+
+    return uart_bus_reply(node, &src);
+}
+
+static void test_send(const uint8_t *body, size_t nbytes)
+{
+    struct const_iobuf src;
+    HRESULT hr;
+
+    src.bytes = body;
+    src.nbytes = nbytes;
+    src.pos = 0;
+
+    hr = frame_encode(&test_bus.config.frame, &test_frames, &src);
+    TEST_CHECK(hr == S_OK);
+}
+
+static void test_flush(size_t nbytes)
+{
+    uint8_t bytes[256];
+    struct iobuf dest;
+    struct irp irp;
+    HRESULT hr;
+
+    /* Hand over (up to) nbytes of whatever has been sent as one write */
+
+    dest.bytes = bytes;
+    dest.nbytes = nbytes < sizeof(bytes) ? nbytes : sizeof(bytes);
+    dest.pos = 0;
+
+    iobuf_ring_shift(&dest, &test_frames);
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_WRITE;
+    irp.fd = (HANDLE) &test_uart;
+    irp.write.bytes = bytes;
+    irp.write.nbytes = dest.pos;
+
+    hr = uart_handle_irp(&test_uart, &irp);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(irp.write.pos == dest.pos);
+
+    hr = uart_bus_process(&test_bus);
+    TEST_CHECK(hr == S_OK);
+
+    /* The bus consumes everything that it was given */
+
+    TEST_CHECK(test_uart.written.buf.pos == 0);
+}
+
+static size_t test_replies(uint8_t *bytes, size_t nbytes)
+{
+    struct iobuf dest;
+
+    dest.bytes = bytes;
+    dest.nbytes = nbytes;
+    dest.pos = 0;
+
+    iobuf_ring_shift(&dest, &test_uart.readable);
+    TEST_CHECK(iobuf_ring_avail(&test_uart.readable) == 0);
+
+    return dest.pos;
+}
+
+static void test_enumerate(uint8_t first)
+{
+    uint8_t frame[5];
+    unsigned int hits[TEST_NNODES];
+    uint8_t replies[16];
+    size_t i;
+
+    /* All three set-address commands arrive in a single write. Each goes to
+       the addressed nodes and the head of the chain, which takes the
+       address and drops out of the chain. */
+
+    memcpy(hits, test_hits, sizeof(hits));
+
+    for (i = 0 ; i < TEST_NNODES ; i++) {
+        frame[0] = TEST_BROADCAST;
+        frame[1] = 3;
+        frame[2] = TEST_CMD_SET_ADDR;
+        frame[3] = (uint8_t) (first + i);
+        frame[4] = 0;
+
+        test_send(frame, sizeof(frame));
+    }
+
+    test_flush((size_t) -1);
+
+    TEST_CHECK(uart_bus_enumerated(&test_bus));
+    TEST_CHECK(test_bus.nunaddressed == 0);
+
+    for (i = 0 ; i < TEST_NNODES ; i++) {
+        TEST_CHECK(test_nodes[i].has_addr);
+        TEST_CHECK(test_nodes[i].addr == first + i);
+        TEST_CHECK(test_bus.nodes[first + i] == &test_nodes[i]);
+        TEST_CHECK(test_hits[i] - hits[i] == TEST_NNODES - i);
+    }
+
+    /* Broadcasts are never answered */
+
+    TEST_CHECK(test_replies(replies, sizeof(replies)) == 0);
+}
+
+static void test_unclaimed(void)
+{
+    static const uint8_t frame[] = { 0x01, 0x02, 0x10, 0x00 };
+
+    size_t i;
+
+    /* Nobody has address 1 yet, so the frame goes nowhere */
+
+    test_send(frame, sizeof(frame));
+    test_flush((size_t) -1);
+
+    TEST_CHECK(test_bus.nunclaimed == 1);
+
+    for (i = 0 ; i < TEST_NNODES ; i++) {
+        TEST_CHECK(test_hits[i] == 0);
+    }
+}
+
+static void test_split(void)
+{
+    static const uint8_t frame[] = { 0x02, 0x03, 0x20, 0xE0, 0x00 };
+    static const uint8_t expected[] = { 0xE0, 0x00, 0x02, 0x11, 0x00 };
+
+    uint8_t replies[16];
+    unsigned int hits;
+
+    /* A frame for node 1 (address 2) with an escaped sync byte in it,
+       split over two writes. Nothing happens until the last of it is in. */
+
+    hits = test_hits[1];
+
+    test_send(frame, sizeof(frame));
+    test_flush(3);
+
+    TEST_CHECK(test_hits[1] == hits);
+    TEST_CHECK(test_replies(replies, sizeof(replies)) == 0);
+
+    test_flush((size_t) -1);
+
+    TEST_CHECK(test_hits[1] == hits + 1);
+
+    if (TEST_CHECK(test_replies(replies, sizeof(replies)) ==
+            sizeof(expected))) {
+        TEST_CHECK(memcmp(replies, expected, sizeof(expected)) == 0);
+    }
+}
+
+static void test_mixed(void)
+{
+    static const uint8_t stray[] = { 0x09, 0x03, 0x01, 0x02, 0x03 };
+    static const uint8_t frame[] = { 0x03, 0x02, 0x20, 0x00 };
+    static const uint8_t expected[] = { 0xE0, 0x00, 0x02, 0x12, 0x00 };
+
+    uint8_t replies[16];
+    unsigned int hits[TEST_NNODES];
+    size_t i;
+
+    /* A frame for an address that nobody has is skipped without upsetting
+       the one for node 2 (address 3) that follows it in the same write. */
+
+    memcpy(hits, test_hits, sizeof(hits));
+
+    test_send(stray, sizeof(stray));
+    test_send(frame, sizeof(frame));
+    test_flush((size_t) -1);
+
+    TEST_CHECK(test_bus.nunclaimed == 2);
+
+    for (i = 0 ; i < TEST_NNODES ; i++) {
+        TEST_CHECK(test_hits[i] == hits[i] + (i == 2));
+    }
+
+    if (TEST_CHECK(test_replies(replies, sizeof(replies)) ==
+            sizeof(expected))) {
+        TEST_CHECK(memcmp(replies, expected, sizeof(expected)) == 0);
+    }
+}
+
+static void test_clash(void)
+{
+    HRESULT hr;
+
+    hr = uart_bus_set_address(&test_nodes[0], 2);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS));
+
+    hr = uart_bus_set_address(&test_nodes[0], TEST_BROADCAST);
+    TEST_CHECK(hr == E_INVALIDARG);
+
+    TEST_CHECK(test_nodes[0].addr == 1);
+    TEST_CHECK(test_bus.nodes[2] == &test_nodes[1]);
+}
+
+static void test_reset(void)
+{
+    static const uint8_t frame[] = {
+        TEST_BROADCAST, 0x02, TEST_CMD_RESET, 0x00,
+    };
+
+    size_t i;
+
+    test_send(frame, sizeof(frame));
+    test_flush((size_t) -1);
+
+    TEST_CHECK(!uart_bus_enumerated(&test_bus));
+    TEST_CHECK(test_bus.nunaddressed == TEST_NNODES);
+
+    for (i = 0 ; i < TEST_NNODES ; i++) {
+        TEST_CHECK(!test_nodes[i].has_addr);
+        TEST_CHECK(test_bus.nodes[1 + i] == NULL);
+    }
+}
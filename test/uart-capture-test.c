@@ -0,0 +1,273 @@
+#include <windows.h>
+#include <ntstatus.h>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf.h"
+#include "hook/iohook.h"
+
+#include "hooklib/uart-capture.h"
+#include "hooklib/uart.h"
+
+#include "test/test.h"
+
+/* A capture of some traffic on a uart, written out by the capture thread
+   and then read back by running capdump over it, so that the two ends of
+   the file format are checked against each other. Timestamps come from the
+   real clock, so only their order is checked; everything after them on
+   each line of capdump's output has to match exactly. Invoked as
+
+       uart-capture-test <path to capdump> <path for the capture file> */
+
+static HRESULT test_handler(struct irp *irp);
+static HRESULT test_read(OVERLAPPED *ovl, size_t nbytes);
+static HRESULT test_write(const char *str);
+static void test_push(const char *str);
+static void test_traffic(void);
+static void test_dump(const char *capdump, const char *path);
+
+static const char *test_expected[] = {
+    "TX 4 bytes",
+    "        0000  41 54 0d 0a                                      |AT..|",
+    "TX end, 4 bytes, hr=00000000",
+    "RX 4 bytes",
+    "        0000  4f 4b 0d 0a                                      |OK..|",
+    "RX end, 4 bytes, hr=00000000",
+    "RX end, 0 bytes, hr=00000000",
+    "RX 3 bytes",
+    "        0000  78 79 7a                                         |xyz|",
+    "RX end, 3 bytes, hr=00000000",
+    "RX end, 0 bytes, hr=800703e3",
+    "TX 5 bytes",
+    "        0000  61 66 74 65 72                                   |after|",
+    "TX end, 5 bytes, hr=00000000",
+};
+
+static struct uart test_uart;
+static uint8_t test_readable[64];
+static uint8_t test_buf[16];
+static HANDLE test_fd;
+
+int main(int argc, char **argv)
+{
+    struct uart_capture *cap;
+    wchar_t wpath[256];
+    HRESULT hr;
+
+    if (!TEST_CHECK(argc == 3)) {
+        return test_result();
+    }
+
+    if (!TEST_CHECK(mbstowcs(wpath, argv[2], _countof(wpath)) < 256)) {
+        return test_result();
+    }
+
+    hr = iohook_push_handler(test_handler);
+
+    if (!TEST_CHECK(SUCCEEDED(hr))) {
+        return test_result();
+    }
+
+    hr = uart_capture_open(&cap, wpath, 3, UART_CAPTURE_RING_SIZE);
+
+    if (!TEST_CHECK(hr == S_OK)) {
+        return test_result();
+    }
+
+    test_fd = (HANDLE) &test_uart;
+
+    uart_init(&test_uart, 3);
+    iobuf_ring_init(
+            &test_uart.readable,
+            test_readable,
+            sizeof(test_readable));
+    uart_attach_capture(&test_uart, cap);
+    test_uart.fd = test_fd;
+
+    test_traffic();
+
+    uart_fini(&test_uart);
+    uart_capture_close(cap);
+
+    test_dump(argv[1], argv[2]);
+
+    return test_result();
+}
+
+static HRESULT test_handler(struct irp *irp)
+{
+    if (irp->op == IRP_OP_CLOSE && irp->fd == test_fd) {
+        return S_OK;
+    }
+
+    return iohook_invoke_next(irp);
+}
+
+static HRESULT test_read(OVERLAPPED *ovl, size_t nbytes)
+{
+    struct irp irp;
+
+    memset(ovl, 0, sizeof(*ovl));
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_READ;
+    irp.fd = test_fd;
+    irp.ovl = ovl;
+    irp.read.bytes = test_buf;
+    irp.read.nbytes = nbytes;
+
+    return uart_handle_irp(&test_uart, &irp);
+}
+
+static HRESULT test_write(const char *str)
+{
+    struct irp irp;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_WRITE;
+    irp.fd = test_fd;
+    irp.write.bytes = (const uint8_t *) str;
+    irp.write.nbytes = strlen(str);
+
+    return uart_handle_irp(&test_uart, &irp);
+}
+
+static void test_push(const char *str)
+{
+    struct const_iobuf src;
+
+    src.bytes = (const uint8_t *) str;
+    src.nbytes = strlen(str);
+    src.pos = 0;
+
+    iobuf_ring_move(&test_uart.readable, &src);
+    uart_notify_readable(&test_uart);
+}
+
+static void test_traffic(void)
+{
+    OVERLAPPED ovl;
+    HRESULT hr;
+
+    /* A command and its reply, then a read that finds nothing */
+
+    test_uart.timeouts.ReadIntervalTimeout = MAXDWORD;
+
+    hr = test_write("AT\r\n");
+    TEST_CHECK(hr == S_OK);
+
+    test_push("OK\r\n");
+
+    hr = test_read(&ovl, sizeof(test_buf));
+    TEST_CHECK(hr == S_OK);
+
+    hr = test_read(&ovl, sizeof(test_buf));
+    TEST_CHECK(hr == S_OK);
+
+    /* A read that has to wait for its bytes, and one that is cancelled */
+
+    test_uart.timeouts.ReadIntervalTimeout = 0;
+
+    hr = test_read(&ovl, 3);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    test_push("xyz");
+    TEST_CHECK(ovl.Internal == STATUS_SUCCESS);
+
+    hr = test_read(&ovl, 3);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    hr = iohook_cancel_io(test_fd, &ovl);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(ovl.Internal == STATUS_CANCELLED);
+
+    hr = test_write("after");
+    TEST_CHECK(hr == S_OK);
+}
+
+static void test_dump(const char *capdump, const char *path)
+{
+    char cmd[1024];
+    char line[128];
+    uint64_t secs;
+    uint64_t nsecs;
+    uint64_t now;
+    uint64_t prev;
+    size_t nlines;
+    size_t len;
+    char *rest;
+    FILE *f;
+    int n;
+
+    n = snprintf(cmd, sizeof(cmd), "\"%s\" \"%s\"", capdump, path);
+
+    if (!TEST_CHECK(n > 0 && (size_t) n < sizeof(cmd))) {
+        return;
+    }
+
+    f = popen(cmd, "r");
+
+    if (!TEST_CHECK(f != NULL)) {
+        return;
+    }
+
+    /* The header line first, then one line per record or line of hex */
+
+    if (    TEST_CHECK(fgets(line, sizeof(line), f) != NULL) &&
+            TEST_CHECK(strncmp(line, "COM3, started at ", 17) == 0)) {
+        TEST_CHECK(strtoull(&line[17], NULL, 10) > 0);
+    }
+
+    nlines = 0;
+    prev = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        len = strlen(line);
+
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        if (strncmp(line, "        ", 8) != 0) {
+            /* A record, which leads with its timestamp */
+
+            secs = strtoull(line, &rest, 10);
+
+            if (!TEST_CHECK(*rest == '.')) {
+                break;
+            }
+
+            nsecs = strtoull(rest + 1, &rest, 10);
+            now = secs * 1000000000 + nsecs;
+
+            TEST_CHECK(now >= prev);
+            TEST_CHECK(*rest == ' ');
+
+            prev = now;
+            rest++;
+        } else {
+            rest = line;
+        }
+
+        if (!TEST_CHECK(nlines < _countof(test_expected))) {
+            break;
+        }
+
+        if (!TEST_CHECK(strcmp(rest, test_expected[nlines]) == 0)) {
+            printf("Expected \"%s\"\n", test_expected[nlines]);
+            printf("Got      \"%s\"\n", rest);
+        }
+
+        nlines++;
+    }
+
+    TEST_CHECK(nlines == _countof(test_expected));
+    TEST_CHECK(pclose(f) == 0);
+}
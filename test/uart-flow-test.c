@@ -0,0 +1,554 @@
+#include <windows.h>
+#include <ntstatus.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/iobuf-arena.h"
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf.h"
+#include "hook/iohook.h"
+
+#include "hooklib/uart.h"
+
+#include "test/test.h"
+
+/* Flow control as the application sets it up through SetupComm(),
+   SetCommState() and EscapeCommFunction(), and as the owner drives it from the
+   other end: writes held back for room in written (also once it has been
+   shrunk below what it had already grown to), for CTS and for XON, input
+   throttled through RTS and XOFF as the application's input buffer fills and
+   drains, and PurgeComm() clearing and aborting whatever it is asked to. */
+
+static HRESULT test_handler(struct irp *irp);
+static HRESULT test_ioctl(
+        uint32_t ioctl,
+        const void *in,
+        size_t in_nbytes,
+        void *out,
+        size_t out_nbytes);
+static void test_set_handflow(
+        ULONG control,
+        ULONG replace,
+        LONG xon_limit,
+        LONG xoff_limit);
+static void test_set_queue_size(ULONG out_size);
+static void test_purge(uint32_t flags);
+static SERIAL_STATUS test_status(void);
+static HRESULT test_read(OVERLAPPED *ovl, size_t nbytes, size_t *nread);
+static HRESULT test_write(OVERLAPPED *ovl, size_t nbytes);
+static bool test_completed(const OVERLAPPED *ovl, NTSTATUS status);
+static void test_push(size_t nbytes);
+static void test_queue_size(void);
+static void test_backpressure(void);
+static void test_queue_shrink(void);
+static void test_cts(void);
+static void test_xon(void);
+static void test_tx_abort(void);
+static void test_rts(void);
+static void test_xoff(void);
+static void test_lines(void);
+static void test_rx_abort(void);
+static void test_busy(void);
+
+static struct uart test_uart;
+static uint8_t test_readable[64];
+static uint8_t test_buf[256];
+static HANDLE test_fd;
+
+int main(int argc, char **argv)
+{
+    HRESULT hr;
+
+    (void) argc;
+    (void) argv;
+
+    hr = iohook_push_handler(test_handler);
+
+    if (!TEST_CHECK(SUCCEEDED(hr))) {
+        return test_result();
+    }
+
+    test_fd = (HANDLE) &test_uart;
+
+    uart_init(&test_uart, 1);
+    iobuf_ring_init(
+            &test_uart.readable,
+            test_readable,
+            sizeof(test_readable));
+    test_uart.fd = test_fd;
+
+    test_queue_size();
+    test_backpressure();
+    test_queue_shrink();
+    test_cts();
+    test_xon();
+    test_tx_abort();
+    test_rts();
+    test_xoff();
+    test_lines();
+    test_rx_abort();
+    test_busy();
+
+    uart_fini(&test_uart);
+
+    return test_result();
+}
+
+static HRESULT test_handler(struct irp *irp)
+{
+    if (irp->op == IRP_OP_CLOSE && irp->fd == test_fd) {
+        return S_OK;
+    }
+
+    return iohook_invoke_next(irp);
+}
+
+static HRESULT test_ioctl(
+        uint32_t ioctl,
+        const void *in,
+        size_t in_nbytes,
+        void *out,
+        size_t out_nbytes)
+{
+    struct irp irp;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_IOCTL;
+    irp.fd = test_fd;
+    irp.ioctl = ioctl;
+    irp.write.bytes = in;
+    irp.write.nbytes = in_nbytes;
+    irp.read.bytes = out;
+    irp.read.nbytes = out_nbytes;
+
+    return uart_handle_irp(&test_uart, &irp);
+}
+
+static void test_set_handflow(
+        ULONG control,
+        ULONG replace,
+        LONG xon_limit,
+        LONG xoff_limit)
+{
+    SERIAL_HANDFLOW handflow;
+    HRESULT hr;
+
+    handflow.ControlHandShake = control;
+    handflow.FlowReplace = replace;
+    handflow.XonLimit = xon_limit;
+    handflow.XoffLimit = xoff_limit;
+
+    hr = test_ioctl(
+            IOCTL_SERIAL_SET_HANDFLOW,
+            &handflow,
+            sizeof(handflow),
+            NULL,
+            0);
+    TEST_CHECK(hr == S_OK);
+}
+
+static void test_set_queue_size(ULONG out_size)
+{
+    SERIAL_QUEUE_SIZE queue;
+    HRESULT hr;
+
+    queue.InSize = 0;
+    queue.OutSize = out_size;
+
+    hr = test_ioctl(
+            IOCTL_SERIAL_SET_QUEUE_SIZE,
+            &queue,
+            sizeof(queue),
+            NULL,
+            0);
+    TEST_CHECK(hr == S_OK);
+}
+
+static void test_purge(uint32_t flags)
+{
+    HRESULT hr;
+
+    hr = test_ioctl(IOCTL_SERIAL_PURGE, &flags, sizeof(flags), NULL, 0);
+    TEST_CHECK(hr == S_OK);
+}
+
+static SERIAL_STATUS test_status(void)
+{
+    SERIAL_STATUS status;
+    HRESULT hr;
+
+    memset(&status, 0, sizeof(status));
+
+    hr = test_ioctl(
+            IOCTL_SERIAL_GET_COMMSTATUS,
+            NULL,
+            0,
+            &status,
+            sizeof(status));
+    TEST_CHECK(hr == S_OK);
+
+    return status;
+}
+
+static HRESULT test_read(OVERLAPPED *ovl, size_t nbytes, size_t *nread)
+{
+    struct irp irp;
+    HRESULT hr;
+
+    memset(ovl, 0, sizeof(*ovl));
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_READ;
+    irp.fd = test_fd;
+    irp.ovl = ovl;
+    irp.read.bytes = test_buf;
+    irp.read.nbytes = nbytes;
+
+    hr = uart_handle_irp(&test_uart, &irp);
+
+    if (nread != NULL) {
+        *nread = irp.read.pos;
+    }
+
+    return hr;
+}
+
+static HRESULT test_write(OVERLAPPED *ovl, size_t nbytes)
+{
+    struct irp irp;
+
+    memset(ovl, 0, sizeof(*ovl));
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_WRITE;
+    irp.fd = test_fd;
+    irp.ovl = ovl;
+    irp.write.bytes = test_buf;
+    irp.write.nbytes = nbytes;
+
+    return uart_handle_irp(&test_uart, &irp);
+}
+
+static bool test_completed(const OVERLAPPED *ovl, NTSTATUS status)
+{
+    return ovl->Internal == (ULONG_PTR) status;
+}
+
+static void test_push(size_t nbytes)
+{
+    size_t i;
+
+    for (i = 0 ; i < nbytes ; i++) {
+        iobuf_ring_write_8(&test_uart.readable, (uint8_t) i);
+    }
+
+    uart_notify_readable(&test_uart);
+}
+
+static void test_queue_size(void)
+{
+    SERIAL_QUEUE_SIZE queue;
+    HRESULT hr;
+
+    /* SetupComm() caps written and sets where the input buffer is full */
+
+    queue.InSize = 32;
+    queue.OutSize = 100;
+
+    hr = test_ioctl(
+            IOCTL_SERIAL_SET_QUEUE_SIZE,
+            &queue,
+            sizeof(queue),
+            NULL,
+            0);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_uart.written.limit == 100);
+    TEST_CHECK(uart_rx_space(&test_uart) == 32);
+
+    /* Zero keeps the current size */
+
+    queue.InSize = 0;
+    queue.OutSize = 0;
+
+    hr = test_ioctl(
+            IOCTL_SERIAL_SET_QUEUE_SIZE,
+            &queue,
+            sizeof(queue),
+            NULL,
+            0);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_uart.written.limit == 100);
+    TEST_CHECK(uart_rx_space(&test_uart) == 32);
+}
+
+static void test_backpressure(void)
+{
+    OVERLAPPED first;
+    OVERLAPPED second;
+    OVERLAPPED third;
+    HRESULT hr;
+
+    /* A write that only partly fits waits for the owner to make room, and
+       the next one queues up behind it even though it would fit. */
+
+    hr = test_write(&first, 60);
+    TEST_CHECK(hr == S_OK);
+
+    hr = test_write(&second, 60);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(test_uart.written.buf.pos == 100);
+
+    hr = test_write(&third, 10);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(test_status().AmountInOutQueue == 130);
+
+    iobuf_arena_reset(&test_uart.written);
+    uart_notify_writable(&test_uart);
+
+    TEST_CHECK(test_completed(&second, STATUS_SUCCESS));
+    TEST_CHECK(second.InternalHigh == 60);
+    TEST_CHECK(test_completed(&third, STATUS_SUCCESS));
+    TEST_CHECK(third.InternalHigh == 10);
+    TEST_CHECK(test_uart.written.buf.pos == 30);
+    TEST_CHECK(test_status().AmountInOutQueue == 30);
+
+    iobuf_arena_reset(&test_uart.written);
+}
+
+static void test_queue_shrink(void)
+{
+    OVERLAPPED ovl;
+    HRESULT hr;
+
+    /* A smaller OutSize still holds once earlier writes have grown written
+       beyond it. */
+
+    test_set_queue_size(200);
+
+    hr = test_write(&ovl, 150);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_uart.written.buf.pos == 150);
+    TEST_CHECK(test_uart.written.buf.nbytes >= 150);
+
+    iobuf_arena_reset(&test_uart.written);
+    test_set_queue_size(40);
+
+    hr = test_write(&ovl, 60);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(test_uart.written.buf.pos == 40);
+    TEST_CHECK(test_status().AmountInOutQueue == 60);
+
+    iobuf_arena_reset(&test_uart.written);
+    uart_notify_writable(&test_uart);
+
+    TEST_CHECK(test_completed(&ovl, STATUS_SUCCESS));
+    TEST_CHECK(ovl.InternalHigh == 60);
+    TEST_CHECK(test_uart.written.buf.pos == 20);
+
+    iobuf_arena_reset(&test_uart.written);
+    test_set_queue_size(100);
+}
+
+static void test_cts(void)
+{
+    OVERLAPPED ovl;
+    HRESULT hr;
+
+    /* CTS handshaking holds writes back entirely until CTS comes up */
+
+    test_set_handflow(SERIAL_CTS_HANDSHAKE, 0, 0, 0);
+
+    hr = test_write(&ovl, 5);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(test_uart.written.buf.pos == 0);
+    TEST_CHECK(test_status().HoldReasons == SERIAL_TX_WAITING_FOR_CTS);
+
+    uart_set_modem_status(&test_uart, SERIAL_MSR_CTS);
+
+    TEST_CHECK(test_completed(&ovl, STATUS_SUCCESS));
+    TEST_CHECK(test_uart.written.buf.pos == 5);
+    TEST_CHECK(test_status().HoldReasons == 0);
+
+    hr = test_write(&ovl, 5);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_uart.written.buf.pos == 10);
+
+    iobuf_arena_reset(&test_uart.written);
+}
+
+static void test_xon(void)
+{
+    OVERLAPPED ovl;
+    HRESULT hr;
+
+    /* With fOutX an XOFF from the owner holds writes until the application
+       fakes an XON with EscapeCommFunction(). */
+
+    test_set_handflow(0, SERIAL_AUTO_TRANSMIT, 0, 0);
+    uart_set_xoff(&test_uart, true);
+
+    hr = test_write(&ovl, 3);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(test_status().HoldReasons == SERIAL_TX_WAITING_FOR_XON);
+
+    hr = test_ioctl(IOCTL_SERIAL_SET_XON, NULL, 0, NULL, 0);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_completed(&ovl, STATUS_SUCCESS));
+    TEST_CHECK(test_uart.written.buf.pos == 3);
+    TEST_CHECK(test_status().HoldReasons == 0);
+
+    iobuf_arena_reset(&test_uart.written);
+}
+
+static void test_tx_abort(void)
+{
+    OVERLAPPED first;
+    OVERLAPPED second;
+    HRESULT hr;
+
+    uart_set_xoff(&test_uart, true);
+
+    hr = test_write(&first, 7);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    hr = test_write(&second, 9);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    test_purge(SERIAL_PURGE_TXABORT);
+
+    TEST_CHECK(test_completed(&first, STATUS_CANCELLED));
+    TEST_CHECK(test_completed(&second, STATUS_CANCELLED));
+    TEST_CHECK(test_status().AmountInOutQueue == 0);
+    TEST_CHECK(test_uart.written.buf.pos == 0);
+
+    uart_set_xoff(&test_uart, false);
+}
+
+static void test_rts(void)
+{
+    OVERLAPPED ovl;
+    size_t nread;
+    HRESULT hr;
+
+    /* RTS handshaking on a 32 byte input buffer drops RTS once no more than
+       XoffLim (8) bytes are free, and raises it again once no more than
+       XonLim (4) bytes are held. The application can't touch RTS itself
+       meanwhile. */
+
+    test_set_handflow(0, SERIAL_RTS_HANDSHAKE, 4, 8);
+    TEST_CHECK(test_uart.lines & SERIAL_RTS_STATE);
+
+    hr = test_ioctl(IOCTL_SERIAL_SET_RTS, NULL, 0, NULL, 0);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER));
+
+    test_push(23);
+    TEST_CHECK(test_uart.lines & SERIAL_RTS_STATE);
+    TEST_CHECK(uart_rx_space(&test_uart) == 9);
+
+    test_push(1);
+    TEST_CHECK(!(test_uart.lines & SERIAL_RTS_STATE));
+    TEST_CHECK(uart_rx_space(&test_uart) == 0);
+
+    test_uart.timeouts.ReadIntervalTimeout = MAXDWORD;
+
+    hr = test_read(&ovl, 19, &nread);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(nread == 19);
+    TEST_CHECK(!(test_uart.lines & SERIAL_RTS_STATE));
+
+    hr = test_read(&ovl, 1, &nread);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(nread == 1);
+    TEST_CHECK(test_uart.lines & SERIAL_RTS_STATE);
+    TEST_CHECK(uart_rx_space(&test_uart) == 28);
+
+    test_uart.timeouts.ReadIntervalTimeout = 0;
+}
+
+static void test_xoff(void)
+{
+    /* fInX does the same with an XOFF, which shows up in HoldReasons, and
+       PurgeComm() emptying the input buffer lets the owner go again. */
+
+    test_set_handflow(0, SERIAL_AUTO_RECEIVE, 4, 8);
+
+    test_push(24);
+    TEST_CHECK(uart_rx_space(&test_uart) == 0);
+    TEST_CHECK(test_status().HoldReasons == SERIAL_TX_WAITING_XOFF_SENT);
+
+    test_uart.written.buf.pos = 5;
+    test_purge(SERIAL_PURGE_RXCLEAR | SERIAL_PURGE_TXCLEAR);
+
+    TEST_CHECK(test_status().AmountInInQueue == 0);
+    TEST_CHECK(test_uart.written.buf.pos == 0);
+    TEST_CHECK(uart_rx_space(&test_uart) == 32);
+    TEST_CHECK(test_status().HoldReasons == 0);
+}
+
+static void test_lines(void)
+{
+    uint32_t lines;
+    HRESULT hr;
+
+    /* fDtrControl and fRtsControl ENABLE raise the lines, and with no
+       handshaking the application can then drop them itself. */
+
+    test_set_handflow(SERIAL_DTR_CONTROL, SERIAL_RTS_CONTROL, 0, 0);
+
+    lines = 0;
+
+    hr = test_ioctl(
+            IOCTL_SERIAL_GET_DTRRTS,
+            NULL,
+            0,
+            &lines,
+            sizeof(lines));
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(lines == (SERIAL_DTR_STATE | SERIAL_RTS_STATE));
+
+    hr = test_ioctl(IOCTL_SERIAL_CLR_DTR, NULL, 0, NULL, 0);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_uart.lines == SERIAL_RTS_STATE);
+}
+
+static void test_rx_abort(void)
+{
+    OVERLAPPED ovl;
+    HRESULT hr;
+
+    hr = test_read(&ovl, 4, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    test_purge(SERIAL_PURGE_RXABORT);
+
+    TEST_CHECK(test_completed(&ovl, STATUS_CANCELLED));
+    TEST_CHECK(test_uart.read_irp == NULL);
+}
+
+static void test_busy(void)
+{
+    OVERLAPPED ovls[UART_MAX_WRITES + 1];
+    HRESULT hr;
+    size_t i;
+
+    /* Writes held back by flow control still count towards the limit */
+
+    test_set_handflow(SERIAL_CTS_HANDSHAKE, 0, 0, 0);
+    uart_set_modem_status(&test_uart, 0);
+
+    for (i = 0 ; i < UART_MAX_WRITES ; i++) {
+        hr = test_write(&ovls[i], 1);
+        TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    }
+
+    hr = test_write(&ovls[UART_MAX_WRITES], 1);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_BUSY));
+
+    test_purge(SERIAL_PURGE_TXABORT);
+
+    for (i = 0 ; i < UART_MAX_WRITES ; i++) {
+        TEST_CHECK(test_completed(&ovls[i], STATUS_CANCELLED));
+    }
+}
@@ -0,0 +1,490 @@
+#include <windows.h>
+#include <ntstatus.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf.h"
+#include "hook/iohook.h"
+
+#include "hooklib/uart.h"
+
+#include "test/fake-timer-wheel.h"
+#include "test/test.h"
+
+/* A paced uart on a timer wheel whose clock only moves when we move it, so
+   that every byte time can be checked to the nanosecond: bytes added to
+   readable trickle out one byte time apart, a reply can't overtake the write
+   that it answers, writes stay pending until their last byte is off the
+   wire, and EV_TXEMPTY waits for the wire to fall idle. */
+
+static HRESULT test_handler(struct irp *irp);
+static HRESULT test_ioctl(
+        uint32_t ioctl,
+        const void *in,
+        size_t in_nbytes,
+        void *out,
+        size_t out_nbytes);
+static void test_set_line(ULONG baud, UCHAR bits, UCHAR parity, UCHAR stop);
+static SERIAL_STATUS test_status(void);
+static HRESULT test_read(OVERLAPPED *ovl, size_t nbytes, size_t *nread);
+static HRESULT test_write(OVERLAPPED *ovl, size_t nbytes);
+static HRESULT test_wait(OVERLAPPED *ovl, DWORD *events);
+static bool test_completed(const OVERLAPPED *ovl, NTSTATUS status);
+static void test_push(size_t nbytes);
+static void test_drain(size_t nbytes);
+static void test_rx(void);
+static void test_rx_read(void);
+static void test_tx(void);
+static void test_busy(void);
+static void test_framing(void);
+static void test_fini(void);
+
+static struct uart test_uart;
+static uint8_t test_readable[64];
+static uint8_t test_buf[64];
+static HANDLE test_fd;
+static uint64_t test_byte_ns;
+
+int main(int argc, char **argv)
+{
+    HRESULT hr;
+
+    (void) argc;
+    (void) argv;
+
+    hr = iohook_push_handler(test_handler);
+
+    if (!TEST_CHECK(SUCCEEDED(hr))) {
+        return test_result();
+    }
+
+    test_fd = (HANDLE) &test_uart;
+
+    uart_init(&test_uart, 1);
+    iobuf_ring_init(
+            &test_uart.readable,
+            test_readable,
+            sizeof(test_readable));
+
+    hr = uart_enable_pacing(&test_uart);
+
+    if (!TEST_CHECK(hr == S_OK)) {
+        return test_result();
+    }
+
+    test_uart.fd = test_fd;
+
+    /* 9600 8N1 is ten bits a byte */
+
+    test_set_line(9600, 8, NO_PARITY, STOP_BIT_1);
+    test_byte_ns = (20ULL * 1000000000 + 9600) / 19200;
+
+    test_rx();
+    test_rx_read();
+    test_tx();
+    test_busy();
+    test_framing();
+    test_fini();
+
+    return test_result();
+}
+
+static HRESULT test_handler(struct irp *irp)
+{
+    if (irp->op == IRP_OP_CLOSE && irp->fd == test_fd) {
+        return S_OK;
+    }
+
+    return iohook_invoke_next(irp);
+}
+
+static HRESULT test_ioctl(
+        uint32_t ioctl,
+        const void *in,
+        size_t in_nbytes,
+        void *out,
+        size_t out_nbytes)
+{
+    struct irp irp;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_IOCTL;
+    irp.fd = test_fd;
+    irp.ioctl = ioctl;
+    irp.write.bytes = in;
+    irp.write.nbytes = in_nbytes;
+    irp.read.bytes = out;
+    irp.read.nbytes = out_nbytes;
+
+    return uart_handle_irp(&test_uart, &irp);
+}
+
+static void test_set_line(ULONG baud, UCHAR bits, UCHAR parity, UCHAR stop)
+{
+    SERIAL_LINE_CONTROL line;
+    SERIAL_BAUD_RATE rate;
+    HRESULT hr;
+
+    rate.BaudRate = baud;
+    line.WordLength = bits;
+    line.Parity = parity;
+    line.StopBits = stop;
+
+    hr = test_ioctl(IOCTL_SERIAL_SET_BAUD_RATE, &rate, sizeof(rate), NULL, 0);
+    TEST_CHECK(hr == S_OK);
+
+    hr = test_ioctl(
+            IOCTL_SERIAL_SET_LINE_CONTROL,
+            &line,
+            sizeof(line),
+            NULL,
+            0);
+    TEST_CHECK(hr == S_OK);
+}
+
+static SERIAL_STATUS test_status(void)
+{
+    SERIAL_STATUS status;
+    HRESULT hr;
+
+    memset(&status, 0, sizeof(status));
+
+    hr = test_ioctl(
+            IOCTL_SERIAL_GET_COMMSTATUS,
+            NULL,
+            0,
+            &status,
+            sizeof(status));
+    TEST_CHECK(hr == S_OK);
+
+    return status;
+}
+
+static HRESULT test_read(OVERLAPPED *ovl, size_t nbytes, size_t *nread)
+{
+    struct irp irp;
+    HRESULT hr;
+
+    memset(ovl, 0, sizeof(*ovl));
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_READ;
+    irp.fd = test_fd;
+    irp.ovl = ovl;
+    irp.read.bytes = test_buf;
+    irp.read.nbytes = nbytes;
+
+    hr = uart_handle_irp(&test_uart, &irp);
+
+    if (nread != NULL) {
+        *nread = irp.read.pos;
+    }
+
+    return hr;
+}
+
+static HRESULT test_write(OVERLAPPED *ovl, size_t nbytes)
+{
+    struct irp irp;
+
+    memset(ovl, 0, sizeof(*ovl));
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_WRITE;
+    irp.fd = test_fd;
+    irp.ovl = ovl;
+    irp.write.bytes = test_buf;
+    irp.write.nbytes = nbytes;
+
+    return uart_handle_irp(&test_uart, &irp);
+}
+
+static HRESULT test_wait(OVERLAPPED *ovl, DWORD *events)
+{
+    struct irp irp;
+
+    memset(ovl, 0, sizeof(*ovl));
+    *events = 0;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_IOCTL;
+    irp.fd = test_fd;
+    irp.ovl = ovl;
+    irp.ioctl = IOCTL_SERIAL_WAIT_ON_MASK;
+    irp.read.bytes = (uint8_t *) events;
+    irp.read.nbytes = sizeof(*events);
+
+    return uart_handle_irp(&test_uart, &irp);
+}
+
+static bool test_completed(const OVERLAPPED *ovl, NTSTATUS status)
+{
+    return ovl->Internal == (ULONG_PTR) status;
+}
+
+static void test_push(size_t nbytes)
+{
+    struct const_iobuf src;
+    uint8_t bytes[16];
+
+    memset(bytes, 0x55, sizeof(bytes));
+    src.bytes = bytes;
+    src.nbytes = nbytes;
+    src.pos = 0;
+
+    iobuf_ring_move(&test_uart.readable, &src);
+    uart_notify_readable(&test_uart);
+}
+
+static void test_drain(size_t nbytes)
+{
+    SERIAL_TIMEOUTS timeouts;
+    OVERLAPPED ovl;
+    size_t nread;
+    HRESULT hr;
+
+    /* Take everything that has been released, then go back to blocking */
+
+    memset(&timeouts, 0, sizeof(timeouts));
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+    test_ioctl(
+            IOCTL_SERIAL_SET_TIMEOUTS,
+            &timeouts,
+            sizeof(timeouts),
+            NULL,
+            0);
+
+    hr = test_read(&ovl, sizeof(test_buf), &nread);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(nread == nbytes);
+
+    timeouts.ReadIntervalTimeout = 0;
+    test_ioctl(
+            IOCTL_SERIAL_SET_TIMEOUTS,
+            &timeouts,
+            sizeof(timeouts),
+            NULL,
+            0);
+}
+
+static void test_rx(void)
+{
+    OVERLAPPED ovl;
+    DWORD events;
+    DWORD mask;
+    HRESULT hr;
+    uint64_t b;
+
+    b = test_byte_ns;
+    mask = SERIAL_EV_RXCHAR;
+    hr = test_ioctl(IOCTL_SERIAL_SET_WAIT_MASK, &mask, sizeof(mask), NULL, 0);
+    TEST_CHECK(hr == S_OK);
+
+    hr = test_wait(&ovl, &events);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    /* Four bytes, released one byte time apart. EV_RXCHAR only goes off
+       once the first of them has arrived. */
+
+    test_push(4);
+    TEST_CHECK(test_status().AmountInInQueue == 0);
+    TEST_CHECK(fake_timer_wheel_next() == timer_wheel_now() + b);
+    TEST_CHECK(test_completed(&ovl, STATUS_PENDING));
+
+    fake_timer_wheel_advance(b - 1);
+    TEST_CHECK(test_status().AmountInInQueue == 0);
+
+    fake_timer_wheel_advance(1);
+    TEST_CHECK(test_status().AmountInInQueue == 1);
+    TEST_CHECK(test_completed(&ovl, STATUS_SUCCESS));
+    TEST_CHECK(events == SERIAL_EV_RXCHAR);
+
+    fake_timer_wheel_advance(3 * b);
+    TEST_CHECK(test_status().AmountInInQueue == 4);
+    TEST_CHECK(fake_timer_wheel_next() == 0);
+
+    test_drain(4);
+
+    mask = 0;
+    test_ioctl(IOCTL_SERIAL_SET_WAIT_MASK, &mask, sizeof(mask), NULL, 0);
+}
+
+static void test_rx_read(void)
+{
+    OVERLAPPED ovl;
+    HRESULT hr;
+    uint64_t b;
+
+    /* A pending read is fed byte by byte as they are released */
+
+    b = test_byte_ns;
+
+    hr = test_read(&ovl, 3, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    test_push(5);
+    fake_timer_wheel_advance(2 * b);
+    TEST_CHECK(test_completed(&ovl, STATUS_PENDING));
+
+    fake_timer_wheel_advance(b);
+    TEST_CHECK(test_completed(&ovl, STATUS_SUCCESS));
+    TEST_CHECK(ovl.InternalHigh == 3);
+
+    fake_timer_wheel_advance(2 * b);
+    TEST_CHECK(test_status().AmountInInQueue == 2);
+
+    test_drain(2);
+}
+
+static void test_tx(void)
+{
+    OVERLAPPED first;
+    OVERLAPPED second;
+    OVERLAPPED wait;
+    DWORD events;
+    DWORD mask;
+    HRESULT hr;
+    uint64_t b;
+
+    b = test_byte_ns;
+    fake_timer_wheel_advance(b);
+
+    mask = SERIAL_EV_TXEMPTY;
+    hr = test_ioctl(IOCTL_SERIAL_SET_WAIT_MASK, &mask, sizeof(mask), NULL, 0);
+    TEST_CHECK(hr == S_OK);
+
+    /* The first write reaches the owner straight away and the second waits
+       its turn behind it, but both count towards the output queue until
+       they are off the wire. */
+
+    hr = test_write(&first, 10);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(test_uart.written.buf.pos == 10);
+    TEST_CHECK(test_status().AmountInOutQueue == 10);
+
+    hr = test_write(&second, 5);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(test_uart.written.buf.pos == 10);
+    TEST_CHECK(test_status().AmountInOutQueue == 15);
+
+    hr = test_wait(&wait, &events);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    /* A reply pushed now can't arrive before the last byte has gone */
+
+    test_push(1);
+
+    fake_timer_wheel_advance(10 * b - 1);
+    TEST_CHECK(test_completed(&first, STATUS_PENDING));
+    TEST_CHECK(test_status().AmountInInQueue == 0);
+
+    fake_timer_wheel_advance(1);
+    TEST_CHECK(test_completed(&first, STATUS_SUCCESS));
+    TEST_CHECK(first.InternalHigh == 10);
+    TEST_CHECK(test_uart.written.buf.pos == 15);
+    TEST_CHECK(test_completed(&wait, STATUS_PENDING));
+    TEST_CHECK(test_status().AmountInOutQueue == 5);
+
+    fake_timer_wheel_advance(5 * b);
+    TEST_CHECK(test_completed(&second, STATUS_SUCCESS));
+    TEST_CHECK(test_completed(&wait, STATUS_SUCCESS));
+    TEST_CHECK(events == SERIAL_EV_TXEMPTY);
+    TEST_CHECK(test_status().AmountInOutQueue == 0);
+    TEST_CHECK(test_status().AmountInInQueue == 0);
+
+    fake_timer_wheel_advance(b);
+    TEST_CHECK(test_status().AmountInInQueue == 1);
+
+    test_drain(1);
+    iobuf_arena_reset(&test_uart.written);
+
+    mask = 0;
+    test_ioctl(IOCTL_SERIAL_SET_WAIT_MASK, &mask, sizeof(mask), NULL, 0);
+}
+
+static void test_busy(void)
+{
+    OVERLAPPED ovls[UART_MAX_WRITES + 1];
+    size_t before;
+    HRESULT hr;
+    size_t i;
+
+    /* A write that is turned away has not written anything */
+
+    for (i = 0 ; i < UART_MAX_WRITES ; i++) {
+        hr = test_write(&ovls[i], 1);
+        TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    }
+
+    before = test_uart.written.buf.pos;
+    hr = test_write(&ovls[UART_MAX_WRITES], 1);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_BUSY));
+    TEST_CHECK(test_uart.written.buf.pos == before);
+
+    fake_timer_wheel_advance(UART_MAX_WRITES * test_byte_ns);
+
+    for (i = 0 ; i < UART_MAX_WRITES ; i++) {
+        TEST_CHECK(test_completed(&ovls[i], STATUS_SUCCESS));
+    }
+
+    TEST_CHECK(fake_timer_wheel_next() == 0);
+    iobuf_arena_reset(&test_uart.written);
+}
+
+static void test_framing(void)
+{
+    OVERLAPPED ovl;
+    HRESULT hr;
+    uint64_t b;
+
+    /* 1200 7E2 is eleven bits a byte */
+
+    test_set_line(1200, 7, EVEN_PARITY, STOP_BITS_2);
+    b = (22ULL * 1000000000 + 1200) / 2400;
+
+    hr = test_write(&ovl, 2);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    fake_timer_wheel_advance(2 * b - 1);
+    TEST_CHECK(test_completed(&ovl, STATUS_PENDING));
+    fake_timer_wheel_advance(1);
+    TEST_CHECK(test_completed(&ovl, STATUS_SUCCESS));
+
+    /* 1200 5N1.5 is seven and a half */
+
+    test_set_line(1200, 5, NO_PARITY, STOP_BITS_1_5);
+    b = (15ULL * 1000000000 + 1200) / 2400;
+
+    hr = test_write(&ovl, 1);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    fake_timer_wheel_advance(b - 1);
+    TEST_CHECK(test_completed(&ovl, STATUS_PENDING));
+    fake_timer_wheel_advance(1);
+    TEST_CHECK(test_completed(&ovl, STATUS_SUCCESS));
+
+    iobuf_arena_reset(&test_uart.written);
+}
+
+static void test_fini(void)
+{
+    OVERLAPPED ovls[2];
+    HRESULT hr;
+
+    /* Tearing the port down aborts writes that are still on the wire and
+       takes the pacing timer down with them. */
+
+    hr = test_write(&ovls[0], 2);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    hr = test_write(&ovls[1], 1);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(fake_timer_wheel_next() != 0);
+
+    uart_fini(&test_uart);
+
+    TEST_CHECK(test_completed(&ovls[0], STATUS_CANCELLED));
+    TEST_CHECK(test_completed(&ovls[1], STATUS_CANCELLED));
+    TEST_CHECK(fake_timer_wheel_next() == 0);
+}
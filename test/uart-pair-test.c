@@ -0,0 +1,575 @@
+#include <windows.h>
+#include <ntstatus.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/iobuf-spsc.h"
+#include "hook/iohook.h"
+
+#include "hooklib/uart-pair.h"
+#include "hooklib/uart.h"
+
+#include "test/fake-timer-wheel.h"
+#include "test/test.h"
+
+/* Both ends of a uart pair in one process, each with its own pair thread,
+   driven with synchronous IRPs the way an application's ReadFile() and
+   WriteFile() would send them. The shared ring counters are seeded just
+   short of 2^32 before either end opens, so that everything streamed
+   through the pair carries them past it. The last part checks that closing
+   a paced end leaves nothing behind that still points into the pair. */
+
+#define TEST_SEED 0xFFFFF000U
+#define TEST_NBYTES 0x40000
+
+/* Mirrors struct uart_pair_shared, which is private to uart-pair.c */
+
+struct test_ring {
+    LONG tail;
+    uint8_t pad0[IOBUF_SPSC_LINE - sizeof(LONG)];
+    LONG head;
+    uint8_t pad1[IOBUF_SPSC_LINE - sizeof(LONG)];
+};
+
+struct test_shared {
+    LONG present[2];
+    LONG lines[2];
+    uint8_t pad[IOBUF_SPSC_LINE - 4 * sizeof(LONG)];
+    struct test_ring rings[2];
+    uint8_t bytes[2][UART_PAIR_QUEUE_SIZE];
+};
+
+struct test_writer {
+    unsigned int end;
+    const uint8_t *bytes;
+    size_t nbytes;
+    HRESULT hr;
+};
+
+static HRESULT test_handler(struct irp *irp);
+static HRESULT test_open(unsigned int end, const wchar_t *name);
+static void test_close(unsigned int end);
+static HRESULT test_io(
+        unsigned int end,
+        enum irp_op op,
+        const void *bytes,
+        size_t nbytes,
+        size_t *pos);
+static HRESULT test_ioctl(
+        unsigned int end,
+        uint32_t ioctl,
+        const void *in,
+        size_t in_nbytes,
+        void *out,
+        size_t out_nbytes);
+static uint32_t test_wait(unsigned int end, DWORD mask);
+static uint32_t test_modem_status(unsigned int end);
+static DWORD WINAPI test_writer_proc(void *ctx);
+static void test_stream(unsigned int from);
+static void test_names(void);
+static void test_transfer(void);
+static void test_lines(void);
+static void test_hangup(void);
+static void test_detach(void);
+
+static struct uart test_uarts[2];
+static struct uart_pair *test_pairs[2];
+static struct test_shared *test_shared;
+static uint8_t test_out[TEST_NBYTES];
+static uint8_t test_in[TEST_NBYTES];
+
+int main(int argc, char **argv)
+{
+    HANDLE section;
+    HRESULT hr;
+    size_t i;
+
+    (void) argc;
+    (void) argv;
+
+    hr = iohook_push_handler(test_handler);
+
+    if (!TEST_CHECK(SUCCEEDED(hr))) {
+        return test_result();
+    }
+
+    /* Create the section ahead of both ends, as if a lot of traffic had
+       already gone through it, and keep it open so that it stays that way
+       across the hangup. */
+
+    section = CreateFileMappingW(
+            INVALID_HANDLE_VALUE,
+            NULL,
+            PAGE_READWRITE,
+            0,
+            sizeof(struct test_shared),
+            L"Local\\capnhook-uart-pair-link");
+
+    if (!TEST_CHECK(section != NULL)) {
+        return test_result();
+    }
+
+    test_shared = MapViewOfFile(
+            section,
+            FILE_MAP_ALL_ACCESS,
+            0,
+            0,
+            sizeof(struct test_shared));
+
+    if (!TEST_CHECK(test_shared != NULL)) {
+        return test_result();
+    }
+
+    for (i = 0 ; i < 2 ; i++) {
+        test_shared->rings[i].tail = (LONG) TEST_SEED;
+        test_shared->rings[i].head = (LONG) TEST_SEED;
+    }
+
+    for (i = 0 ; i < sizeof(test_out) ; i++) {
+        test_out[i] = (uint8_t) (i * 7 + (i >> 12));
+    }
+
+    test_names();
+
+    if (    !TEST_CHECK(test_open(0, L"link") == S_OK) ||
+            !TEST_CHECK(test_open(1, L"link") == S_OK)) {
+        return test_result();
+    }
+
+    test_transfer();
+    test_lines();
+    test_stream(0);
+    test_stream(1);
+    test_hangup();
+
+    test_close(1);
+    test_close(0);
+
+    UnmapViewOfFile(test_shared);
+    CloseHandle(section);
+
+    test_detach();
+
+    return test_result();
+}
+
+static HRESULT test_handler(struct irp *irp)
+{
+    size_t i;
+
+    for (i = 0 ; i < 2 ; i++) {
+        if (irp->fd != (HANDLE) &test_uarts[i]) {
+            continue;
+        }
+
+        /* uart_fini() sends the close for its fd down the chain */
+
+        if (irp->op == IRP_OP_CLOSE) {
+            return S_OK;
+        }
+
+        return uart_pair_handle_irp(&test_uarts[i], irp, test_pairs[i]);
+    }
+
+    return iohook_invoke_next(irp);
+}
+
+static HRESULT test_open(unsigned int end, const wchar_t *name)
+{
+    HRESULT hr;
+
+    uart_init(&test_uarts[end], end + 1);
+
+    hr = uart_pair_open(&test_pairs[end], &test_uarts[end], name);
+
+    if (FAILED(hr)) {
+        uart_fini(&test_uarts[end]);
+
+        return hr;
+    }
+
+    test_uarts[end].fd = (HANDLE) &test_uarts[end];
+
+    return hr;
+}
+
+static void test_close(unsigned int end)
+{
+    uart_pair_close(test_pairs[end]);
+    test_pairs[end] = NULL;
+    uart_fini(&test_uarts[end]);
+}
+
+static HRESULT test_io(
+        unsigned int end,
+        enum irp_op op,
+        const void *bytes,
+        size_t nbytes,
+        size_t *pos)
+{
+    struct irp irp;
+    HRESULT hr;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = op;
+    irp.fd = (HANDLE) &test_uarts[end];
+
+    if (op == IRP_OP_WRITE) {
+        irp.write.bytes = bytes;
+        irp.write.nbytes = nbytes;
+    } else {
+        irp.read.bytes = (uint8_t *) bytes;
+        irp.read.nbytes = nbytes;
+    }
+
+    hr = iohook_invoke_and_wait(&irp);
+
+    if (pos != NULL) {
+        *pos = op == IRP_OP_WRITE ? irp.write.pos : irp.read.pos;
+    }
+
+    return hr;
+}
+
+static HRESULT test_ioctl(
+        unsigned int end,
+        uint32_t ioctl,
+        const void *in,
+        size_t in_nbytes,
+        void *out,
+        size_t out_nbytes)
+{
+    struct irp irp;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_IOCTL;
+    irp.fd = (HANDLE) &test_uarts[end];
+    irp.ioctl = ioctl;
+    irp.write.bytes = in;
+    irp.write.nbytes = in_nbytes;
+    irp.read.bytes = out;
+    irp.read.nbytes = out_nbytes;
+
+    return iohook_invoke_and_wait(&irp);
+}
+
+static uint32_t test_wait(unsigned int end, DWORD mask)
+{
+    DWORD events;
+    HRESULT hr;
+
+    events = 0;
+
+    hr = test_ioctl(
+            end,
+            IOCTL_SERIAL_WAIT_ON_MASK,
+            NULL,
+            0,
+            &events,
+            sizeof(events));
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(events & mask);
+
+    return events;
+}
+
+static uint32_t test_modem_status(unsigned int end)
+{
+    uint32_t status;
+    HRESULT hr;
+
+    status = 0xDEAD;
+
+    hr = test_ioctl(
+            end,
+            IOCTL_SERIAL_GET_MODEMSTATUS,
+            NULL,
+            0,
+            &status,
+            sizeof(status));
+    TEST_CHECK(hr == S_OK);
+
+    return status;
+}
+
+static DWORD WINAPI test_writer_proc(void *ctx)
+{
+    struct test_writer *writer;
+    size_t pos;
+
+    writer = ctx;
+    pos = 0;
+
+    writer->hr = test_io(
+            writer->end,
+            IRP_OP_WRITE,
+            writer->bytes,
+            writer->nbytes,
+            &pos);
+
+    if (pos != writer->nbytes) {
+        writer->hr = E_FAIL;
+    }
+
+    return 0;
+}
+
+static void test_stream(unsigned int from)
+{
+    struct test_writer writer;
+    unsigned int to;
+    uint32_t tail;
+    HANDLE thread;
+    size_t total;
+    size_t pos;
+    HRESULT hr;
+
+    /* Four times the size of the ring in one write, which can only finish
+       as the other end reads it, one page at a time. */
+
+    to = !from;
+    tail = (uint32_t) test_shared->rings[from].tail;
+
+    writer.end = from;
+    writer.bytes = test_out;
+    writer.nbytes = sizeof(test_out);
+    writer.hr = S_FALSE;
+
+    thread = CreateThread(NULL, 0, test_writer_proc, &writer, 0, NULL);
+
+    if (!TEST_CHECK(thread != NULL)) {
+        return;
+    }
+
+    memset(test_in, 0, sizeof(test_in));
+
+    for (total = 0 ; total < sizeof(test_in) ; total += pos) {
+        pos = 0;
+        hr = test_io(to, IRP_OP_READ, &test_in[total], 0x1000, &pos);
+
+        if (!TEST_CHECK(hr == S_OK && pos == 0x1000)) {
+            break;
+        }
+    }
+
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+
+    TEST_CHECK(writer.hr == S_OK);
+    TEST_CHECK(memcmp(test_in, test_out, sizeof(test_in)) == 0);
+
+    /* The shared counters have wrapped round by now */
+
+    TEST_CHECK((uint32_t) test_shared->rings[from].tail ==
+            (uint32_t) (tail + sizeof(test_out)));
+    TEST_CHECK((uint32_t) test_shared->rings[from].tail < TEST_SEED);
+}
+
+static void test_names(void)
+{
+    struct uart uart;
+    struct uart_pair *pair;
+    HRESULT hr;
+
+    /* Names can't reach into other namespaces */
+
+    uart_init(&uart, 3);
+
+    hr = uart_pair_open(&pair, &uart, L"x\\y");
+    TEST_CHECK(hr == E_INVALIDARG);
+    TEST_CHECK(pair == NULL);
+
+    hr = uart_pair_open(&pair, &uart, L"");
+    TEST_CHECK(hr == E_INVALIDARG);
+
+    uart_fini(&uart);
+}
+
+static void test_transfer(void)
+{
+    struct uart uart;
+    struct uart_pair *pair;
+    uint8_t buf[5];
+    size_t pos;
+    HRESULT hr;
+
+    TEST_CHECK(test_pairs[0] != NULL && test_pairs[1] != NULL);
+
+    /* Both ends are taken */
+
+    uart_init(&uart, 3);
+
+    hr = uart_pair_open(&pair, &uart, L"link");
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_BUSY));
+
+    uart_fini(&uart);
+
+    /* Each way round */
+
+    hr = test_io(0, IRP_OP_WRITE, "hello", 5, &pos);
+    TEST_CHECK(hr == S_OK && pos == 5);
+
+    hr = test_io(1, IRP_OP_READ, buf, 5, &pos);
+    TEST_CHECK(hr == S_OK && pos == 5);
+    TEST_CHECK(memcmp(buf, "hello", 5) == 0);
+
+    hr = test_io(1, IRP_OP_WRITE, "world", 5, &pos);
+    TEST_CHECK(hr == S_OK && pos == 5);
+
+    hr = test_io(0, IRP_OP_READ, buf, 5, &pos);
+    TEST_CHECK(hr == S_OK && pos == 5);
+    TEST_CHECK(memcmp(buf, "world", 5) == 0);
+}
+
+static void test_lines(void)
+{
+    DWORD mask;
+    HRESULT hr;
+
+    /* DTR shows up as DSR and DCD at the other end, RTS as CTS */
+
+    TEST_CHECK(test_modem_status(0) == 0);
+
+    mask = SERIAL_EV_DSR;
+    hr = test_ioctl(0, IOCTL_SERIAL_SET_WAIT_MASK, &mask, 4, NULL, 0);
+    TEST_CHECK(hr == S_OK);
+
+    hr = test_ioctl(1, IOCTL_SERIAL_SET_DTR, NULL, 0, NULL, 0);
+    TEST_CHECK(hr == S_OK);
+
+    test_wait(0, SERIAL_EV_DSR);
+    TEST_CHECK(test_modem_status(0) == (SERIAL_MSR_DSR | SERIAL_MSR_DCD));
+
+    mask = SERIAL_EV_CTS;
+    hr = test_ioctl(0, IOCTL_SERIAL_SET_WAIT_MASK, &mask, 4, NULL, 0);
+    TEST_CHECK(hr == S_OK);
+
+    hr = test_ioctl(1, IOCTL_SERIAL_SET_RTS, NULL, 0, NULL, 0);
+    TEST_CHECK(hr == S_OK);
+
+    test_wait(0, SERIAL_EV_CTS);
+    TEST_CHECK(test_modem_status(0) ==
+            (SERIAL_MSR_DSR | SERIAL_MSR_DCD | SERIAL_MSR_CTS));
+
+    /* Leave the DSR mask set up for the hangup */
+
+    mask = SERIAL_EV_DSR;
+    hr = test_ioctl(0, IOCTL_SERIAL_SET_WAIT_MASK, &mask, 4, NULL, 0);
+    TEST_CHECK(hr == S_OK);
+}
+
+static void test_hangup(void)
+{
+    SERIAL_TIMEOUTS timeouts;
+    uint8_t buf[16];
+    size_t pos;
+    HRESULT hr;
+
+    /* Every line drops when the other end goes away */
+
+    test_close(1);
+
+    test_wait(0, SERIAL_EV_DSR);
+    TEST_CHECK(test_modem_status(0) == 0);
+
+    /* What is written meanwhile is gone by the time somebody opens up */
+
+    hr = test_io(0, IRP_OP_WRITE, "stale", 5, &pos);
+    TEST_CHECK(hr == S_OK && pos == 5);
+
+    if (!TEST_CHECK(test_open(1, L"link") == S_OK)) {
+        return;
+    }
+
+    memset(&timeouts, 0, sizeof(timeouts));
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+
+    hr = test_ioctl(
+            1,
+            IOCTL_SERIAL_SET_TIMEOUTS,
+            &timeouts,
+            sizeof(timeouts),
+            NULL,
+            0);
+    TEST_CHECK(hr == S_OK);
+
+    hr = test_io(1, IRP_OP_READ, buf, sizeof(buf), &pos);
+    TEST_CHECK(hr == S_OK && pos == 0);
+
+    timeouts.ReadIntervalTimeout = 0;
+
+    hr = test_ioctl(
+            1,
+            IOCTL_SERIAL_SET_TIMEOUTS,
+            &timeouts,
+            sizeof(timeouts),
+            NULL,
+            0);
+    TEST_CHECK(hr == S_OK);
+
+    hr = test_io(0, IRP_OP_WRITE, "fresh", 5, &pos);
+    TEST_CHECK(hr == S_OK && pos == 5);
+
+    hr = test_io(1, IRP_OP_READ, buf, 5, &pos);
+    TEST_CHECK(hr == S_OK && pos == 5);
+    TEST_CHECK(memcmp(buf, "fresh", 5) == 0);
+}
+
+static void test_detach(void)
+{
+    struct irp irp;
+    OVERLAPPED ovl;
+    HRESULT hr;
+
+    /* A paced end with a write still on the wire. Nobody is on the other
+       end, so the pair thread never wakes up and the fake timer wheel only
+       ever runs on this thread. */
+
+    uart_init(&test_uarts[0], 1);
+
+    hr = uart_enable_pacing(&test_uarts[0]);
+    TEST_CHECK(hr == S_OK);
+
+    hr = uart_pair_open(&test_pairs[0], &test_uarts[0], L"paced");
+
+    if (!TEST_CHECK(hr == S_OK)) {
+        uart_fini(&test_uarts[0]);
+
+        return;
+    }
+
+    test_uarts[0].fd = (HANDLE) &test_uarts[0];
+
+    memset(&ovl, 0, sizeof(ovl));
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_WRITE;
+    irp.fd = (HANDLE) &test_uarts[0];
+    irp.ovl = &ovl;
+    irp.write.bytes = test_out;
+    irp.write.nbytes = 16;
+
+    hr = uart_pair_handle_irp(&test_uarts[0], &irp, test_pairs[0]);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(fake_timer_wheel_next() != 0);
+
+    /* Closing the pair frees its queues, so the uart has to forget them and
+       the pacing timer has to be gone before it is. */
+
+    uart_pair_close(test_pairs[0]);
+    test_pairs[0] = NULL;
+
+    TEST_CHECK(test_uarts[0].rx == NULL);
+    TEST_CHECK(test_uarts[0].tx == NULL);
+    TEST_CHECK(fake_timer_wheel_next() == 0);
+
+    fake_timer_wheel_advance(1000000000);
+    TEST_CHECK(ovl.Internal == STATUS_PENDING);
+
+    uart_fini(&test_uarts[0]);
+    TEST_CHECK(ovl.Internal == STATUS_CANCELLED);
+}
@@ -0,0 +1,374 @@
+#include <windows.h>
+#include <ntstatus.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf.h"
+#include "hook/iohook.h"
+
+#include "hooklib/uart.h"
+
+#include "test/fake-timer-wheel.h"
+#include "test/test.h"
+
+/* Overlapped reads against each of the SERIAL_TIMEOUTS modes, with the read
+   timeouts running on a timer wheel whose clock only moves when we move it.
+   A pending read shows up as STATUS_PENDING in its OVERLAPPED, exactly as it
+   would to an application. */
+
+#define TEST_MS 1000000ULL
+
+static HRESULT test_handler(struct irp *irp);
+static void test_set_timeouts(ULONG interval, ULONG multiplier, ULONG constant);
+static HRESULT test_read(OVERLAPPED *ovl, size_t nbytes, size_t *nread);
+static bool test_pending(void);
+static bool test_completed(NTSTATUS status, size_t nread);
+static void test_push(size_t nbytes);
+static void test_immediate(void);
+static void test_blocking(void);
+static void test_total(void);
+static void test_interval(void);
+static void test_any(void);
+static void test_busy(void);
+static void test_cancel(void);
+static void test_fini(void);
+
+static struct uart test_uart;
+static uint8_t test_readable[64];
+static uint8_t test_buf[16];
+static OVERLAPPED test_ovl;
+static HANDLE test_fd;
+
+int main(int argc, char **argv)
+{
+    HRESULT hr;
+
+    (void) argc;
+    (void) argv;
+
+    /* The uart sends the close for its fd down the chain when it is torn
+       down, so we need a handler to stop that going anywhere real. */
+
+    hr = iohook_push_handler(test_handler);
+
+    if (!TEST_CHECK(SUCCEEDED(hr))) {
+        return test_result();
+    }
+
+    test_fd = (HANDLE) &test_uart;
+
+    uart_init(&test_uart, 1);
+    iobuf_ring_init(
+            &test_uart.readable,
+            test_readable,
+            sizeof(test_readable));
+    test_uart.fd = test_fd;
+
+    test_immediate();
+    test_blocking();
+    test_total();
+    test_interval();
+    test_any();
+    test_busy();
+    test_cancel();
+    test_fini();
+
+    return test_result();
+}
+
+static HRESULT test_handler(struct irp *irp)
+{
+    if (irp->op == IRP_OP_CLOSE && irp->fd == test_fd) {
+        return S_OK;
+    }
+
+    return iohook_invoke_next(irp);
+}
+
+static void test_set_timeouts(ULONG interval, ULONG multiplier, ULONG constant)
+{
+    SERIAL_TIMEOUTS timeouts;
+    struct irp irp;
+    HRESULT hr;
+
+    memset(&timeouts, 0, sizeof(timeouts));
+    timeouts.ReadIntervalTimeout = interval;
+    timeouts.ReadTotalTimeoutMultiplier = multiplier;
+    timeouts.ReadTotalTimeoutConstant = constant;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_IOCTL;
+    irp.fd = test_fd;
+    irp.ioctl = IOCTL_SERIAL_SET_TIMEOUTS;
+    irp.write.bytes = (const uint8_t *) &timeouts;
+    irp.write.nbytes = sizeof(timeouts);
+
+    hr = uart_handle_irp(&test_uart, &irp);
+
+    TEST_CHECK(hr == S_OK);
+}
+
+static HRESULT test_read(OVERLAPPED *ovl, size_t nbytes, size_t *nread)
+{
+    struct irp irp;
+    HRESULT hr;
+
+    memset(ovl, 0, sizeof(*ovl));
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_READ;
+    irp.fd = test_fd;
+    irp.ovl = ovl;
+    irp.read.bytes = test_buf;
+    irp.read.nbytes = nbytes;
+
+    hr = uart_handle_irp(&test_uart, &irp);
+
+    if (nread != NULL) {
+        *nread = irp.read.pos;
+    }
+
+    return hr;
+}
+
+static bool test_pending(void)
+{
+    return test_ovl.Internal == (ULONG_PTR) STATUS_PENDING;
+}
+
+static bool test_completed(NTSTATUS status, size_t nread)
+{
+    return  test_ovl.Internal == (ULONG_PTR) status &&
+            test_ovl.InternalHigh == nread;
+}
+
+static void test_push(size_t nbytes)
+{
+    struct const_iobuf src;
+    uint8_t bytes[16];
+
+    memset(bytes, 0x55, sizeof(bytes));
+    src.bytes = bytes;
+    src.nbytes = nbytes;
+    src.pos = 0;
+
+    iobuf_ring_move(&test_uart.readable, &src);
+    uart_notify_readable(&test_uart);
+}
+
+static void test_immediate(void)
+{
+    size_t nread;
+    HRESULT hr;
+
+    /* Returns whatever is there, even nothing, and never arms a timer */
+
+    test_set_timeouts(MAXDWORD, 0, 0);
+
+    hr = test_read(&test_ovl, 8, &nread);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(nread == 0);
+
+    test_push(3);
+    hr = test_read(&test_ovl, 8, &nread);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(nread == 3);
+    TEST_CHECK(fake_timer_wheel_next() == 0);
+}
+
+static void test_blocking(void)
+{
+    HRESULT hr;
+
+    /* No timeouts at all: wait for as long as it takes to fill the buffer */
+
+    test_set_timeouts(0, 0, 0);
+
+    hr = test_read(&test_ovl, 8, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(test_pending());
+    TEST_CHECK(fake_timer_wheel_next() == 0);
+
+    test_push(5);
+    fake_timer_wheel_advance(100000 * TEST_MS);
+    TEST_CHECK(test_pending());
+
+    test_push(3);
+    TEST_CHECK(test_completed(STATUS_SUCCESS, 8));
+}
+
+static void test_total(void)
+{
+    HRESULT hr;
+
+    /* Multiplier and constant: 10 * 4 + 50 ms for four bytes. The read
+       completes with what it has when that runs out. */
+
+    test_set_timeouts(0, 10, 50);
+
+    hr = test_read(&test_ovl, 4, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(fake_timer_wheel_next() == timer_wheel_now() + 90 * TEST_MS);
+
+    test_push(1);
+    fake_timer_wheel_advance(89 * TEST_MS);
+    TEST_CHECK(test_pending());
+    fake_timer_wheel_advance(1 * TEST_MS);
+    TEST_CHECK(test_completed(STATUS_SUCCESS, 1));
+    TEST_CHECK(fake_timer_wheel_next() == 0);
+
+    /* A total timeout that runs out with nothing read is not an error */
+
+    test_set_timeouts(0, 0, 20);
+
+    hr = test_read(&test_ovl, 4, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    fake_timer_wheel_advance(19 * TEST_MS);
+    TEST_CHECK(test_pending());
+    fake_timer_wheel_advance(1 * TEST_MS);
+    TEST_CHECK(test_completed(STATUS_SUCCESS, 0));
+
+    /* An interval of MAXDWORD alongside a total timeout is no interval */
+
+    test_set_timeouts(MAXDWORD, 0, 30);
+
+    hr = test_read(&test_ovl, 4, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    test_push(1);
+    fake_timer_wheel_advance(29 * TEST_MS);
+    TEST_CHECK(test_pending());
+    fake_timer_wheel_advance(1 * TEST_MS);
+    TEST_CHECK(test_completed(STATUS_SUCCESS, 1));
+}
+
+static void test_interval(void)
+{
+    HRESULT hr;
+
+    /* The interval timer only starts with the first byte, and each byte
+       restarts it. */
+
+    test_set_timeouts(30, 0, 0);
+
+    hr = test_read(&test_ovl, 4, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(fake_timer_wheel_next() == 0);
+    fake_timer_wheel_advance(1000 * TEST_MS);
+    TEST_CHECK(test_pending());
+
+    test_push(1);
+    TEST_CHECK(fake_timer_wheel_next() == timer_wheel_now() + 30 * TEST_MS);
+    fake_timer_wheel_advance(20 * TEST_MS);
+    test_push(1);
+    fake_timer_wheel_advance(29 * TEST_MS);
+    TEST_CHECK(test_pending());
+    fake_timer_wheel_advance(1 * TEST_MS);
+    TEST_CHECK(test_completed(STATUS_SUCCESS, 2));
+
+    /* With a total timeout as well, whichever runs out first wins */
+
+    test_set_timeouts(30, 0, 40);
+
+    hr = test_read(&test_ovl, 4, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    fake_timer_wheel_advance(20 * TEST_MS);
+    test_push(1);
+    fake_timer_wheel_advance(19 * TEST_MS);
+    TEST_CHECK(test_pending());
+    fake_timer_wheel_advance(1 * TEST_MS);
+    TEST_CHECK(test_completed(STATUS_SUCCESS, 1));
+    TEST_CHECK(fake_timer_wheel_next() == 0);
+}
+
+static void test_any(void)
+{
+    size_t nread;
+    HRESULT hr;
+
+    /* Return as soon as there is anything, or with nothing once the
+       constant runs out. */
+
+    test_set_timeouts(MAXDWORD, MAXDWORD, 100);
+
+    test_push(2);
+    hr = test_read(&test_ovl, 8, &nread);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(nread == 2);
+
+    hr = test_read(&test_ovl, 8, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    fake_timer_wheel_advance(50 * TEST_MS);
+    test_push(1);
+    TEST_CHECK(test_completed(STATUS_SUCCESS, 1));
+    TEST_CHECK(fake_timer_wheel_next() == 0);
+
+    hr = test_read(&test_ovl, 8, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    fake_timer_wheel_advance(100 * TEST_MS);
+    TEST_CHECK(test_completed(STATUS_SUCCESS, 0));
+}
+
+static void test_busy(void)
+{
+    OVERLAPPED ovl;
+    HRESULT hr;
+
+    /* Only one read at a time. The one that is already pending is left
+       alone; it gets cancelled by test_cancel(). */
+
+    test_set_timeouts(0, 0, 0);
+
+    hr = test_read(&test_ovl, 4, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    hr = test_read(&ovl, 4, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_BUSY));
+    TEST_CHECK(test_pending());
+}
+
+static void test_cancel(void)
+{
+    HRESULT hr;
+
+    hr = iohook_cancel_io(test_fd, &test_ovl);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_completed(STATUS_CANCELLED, 0));
+
+    /* Cancelling a read that has a timeout must take its timer down too */
+
+    test_set_timeouts(0, 0, 50);
+
+    hr = test_read(&test_ovl, 4, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+    TEST_CHECK(fake_timer_wheel_next() != 0);
+
+    hr = iohook_cancel_io(test_fd, &test_ovl);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_completed(STATUS_CANCELLED, 0));
+    TEST_CHECK(fake_timer_wheel_next() == 0);
+
+    hr = iohook_cancel_io(test_fd, &test_ovl);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_NOT_FOUND));
+}
+
+static void test_fini(void)
+{
+    HRESULT hr;
+
+    /* Tearing the port down aborts a pending read and its timer */
+
+    test_set_timeouts(0, 0, 50);
+
+    hr = test_read(&test_ovl, 4, NULL);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    uart_fini(&test_uart);
+
+    TEST_CHECK(test_completed(STATUS_CANCELLED, 0));
+    TEST_CHECK(fake_timer_wheel_next() == 0);
+}
@@ -0,0 +1,300 @@
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/iohook.h"
+
+#include "hooklib/uart-registry.h"
+#include "hooklib/uart.h"
+
+#include "test/test.h"
+
+/* Several ports behind the registry's one handler, opened on handle values
+   that all land on the same slot of its direct-indexed table so that all but
+   the first go into the overflow list. IRPs have to reach the right port
+   through either, before and after the direct slot is freed and reused, and
+   IRPs for handles that nobody registered have to carry on down the chain
+   exactly as they arrived. */
+
+#define TEST_NUARTS 4
+
+/* Handles are hashed on bits 2 and up, so these all share slot zero */
+
+#define TEST_FD_A ((HANDLE) (uintptr_t) 0x1000)
+#define TEST_FD_B ((HANDLE) (uintptr_t) 0x2000)
+#define TEST_FD_C ((HANDLE) (uintptr_t) 0x3000)
+#define TEST_FD_D ((HANDLE) (uintptr_t) 0x4000)
+#define TEST_FD_OTHER ((HANDLE) (uintptr_t) 0x1004)
+
+static HRESULT test_port_fn(struct uart *uart, struct irp *irp, void *ctx);
+static HRESULT test_next(struct irp *irp);
+static void test_open(const wchar_t *path, HANDLE fd, int expected);
+static void test_irp(enum irp_op op, HANDLE fd, int expected);
+static void test_add(void);
+static void test_collide(void);
+static void test_reuse(void);
+static void test_spill_after_free(void);
+static void test_unregistered(void);
+static void test_remove(void);
+
+static struct uart test_uarts[TEST_NUARTS];
+static HANDLE test_open_fd;
+static int test_hit;
+static const struct irp *test_passed;
+static struct irp test_passed_copy;
+static size_t test_npassed;
+
+int main(int argc, char **argv)
+{
+    HRESULT hr;
+    size_t i;
+
+    (void) argc;
+    (void) argv;
+
+    /* The registry goes first, anything it doesn't claim falls through to
+       the test's own handler behind it. */
+
+    hr = uart_registry_init();
+
+    if (!TEST_CHECK(hr == S_OK)) {
+        return test_result();
+    }
+
+    TEST_CHECK(uart_registry_init() == S_FALSE);
+
+    hr = iohook_push_handler(test_next);
+
+    if (!TEST_CHECK(SUCCEEDED(hr))) {
+        return test_result();
+    }
+
+    for (i = 0 ; i < TEST_NUARTS ; i++) {
+        uart_init(&test_uarts[i], 1 + i);
+    }
+
+    test_add();
+    test_collide();
+    test_reuse();
+    test_spill_after_free();
+    test_unregistered();
+    test_remove();
+
+    for (i = 0 ; i < TEST_NUARTS ; i++) {
+        uart_registry_remove(&test_uarts[i]);
+        test_uarts[i].fd = NULL;
+        uart_fini(&test_uarts[i]);
+    }
+
+    return test_result();
+}
+
+static HRESULT test_port_fn(struct uart *uart, struct irp *irp, void *ctx)
+{
+    test_hit = (int) (intptr_t) ctx;
+
+    TEST_CHECK(uart == &test_uarts[test_hit]);
+
+    if (irp->op == IRP_OP_OPEN) {
+        irp->fd = test_open_fd;
+    }
+
+    return S_OK;
+}
+
+static HRESULT test_next(struct irp *irp)
+{
+    test_passed = irp;
+    test_passed_copy = *irp;
+    test_npassed++;
+
+    if (irp->op == IRP_OP_OPEN) {
+        irp->fd = test_open_fd;
+    }
+
+    return S_OK;
+}
+
+static void test_open(const wchar_t *path, HANDLE fd, int expected)
+{
+    struct irp irp;
+    HRESULT hr;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_OPEN;
+    irp.open_filename = path;
+
+    test_open_fd = fd;
+    test_hit = -1;
+    test_passed = NULL;
+
+    hr = iohook_invoke_next(&irp);
+
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(irp.fd == fd);
+    TEST_CHECK(test_hit == expected);
+    TEST_CHECK((test_passed == &irp) == (expected < 0));
+}
+
+static void test_irp(enum irp_op op, HANDLE fd, int expected)
+{
+    uint8_t bytes[4];
+    struct irp irp;
+    HRESULT hr;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = op;
+    irp.fd = fd;
+    irp.read.bytes = bytes;
+    irp.read.nbytes = sizeof(bytes);
+    irp.read.pos = 1;
+
+    test_hit = -1;
+    test_passed = NULL;
+
+    hr = iohook_invoke_next(&irp);
+
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_hit == expected);
+
+    if (expected >= 0) {
+        TEST_CHECK(test_passed == NULL);
+
+        return;
+    }
+
+    /* Passed on untouched, apart from the chain's own bookkeeping */
+
+    if (!TEST_CHECK(test_passed == &irp)) {
+        return;
+    }
+
+    TEST_CHECK(test_passed_copy.op == op);
+    TEST_CHECK(test_passed_copy.fd == fd);
+    TEST_CHECK(test_passed_copy.read.bytes == bytes);
+    TEST_CHECK(test_passed_copy.read.nbytes == sizeof(bytes));
+    TEST_CHECK(test_passed_copy.read.pos == 1);
+    TEST_CHECK(test_passed_copy.ovl == NULL);
+}
+
+static void test_add(void)
+{
+    struct uart bogus;
+    size_t i;
+
+    for (i = 0 ; i < TEST_NUARTS ; i++) {
+        TEST_CHECK(uart_registry_add(
+                &test_uarts[i],
+                test_port_fn,
+                (void *) (intptr_t) i) == S_OK);
+    }
+
+    /* One uart per port number, and only up to the table's size */
+
+    TEST_CHECK(uart_registry_add(&test_uarts[0], test_port_fn, NULL) ==
+            HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS));
+
+    uart_init(&bogus, UART_REGISTRY_MAX_PORT + 1);
+    TEST_CHECK(uart_registry_add(&bogus, test_port_fn, NULL) == E_INVALIDARG);
+    uart_fini(&bogus);
+}
+
+static void test_collide(void)
+{
+    /* COM1 takes the direct slot, COM2 and COM3 collide with it */
+
+    test_open(L"COM1", TEST_FD_A, 0);
+    test_open(L"\\\\.\\COM2", TEST_FD_B, 1);
+    test_open(L"\\\\.\\COM3", TEST_FD_C, 2);
+
+    test_irp(IRP_OP_READ, TEST_FD_A, 0);
+    test_irp(IRP_OP_WRITE, TEST_FD_B, 1);
+    test_irp(IRP_OP_IOCTL, TEST_FD_C, 2);
+}
+
+static void test_reuse(void)
+{
+    /* Closing COM1 frees the direct slot, and the handle value then goes
+       straight to COM4 when the OS hands it out again. */
+
+    test_irp(IRP_OP_CLOSE, TEST_FD_A, 0);
+    test_irp(IRP_OP_READ, TEST_FD_A, -1);
+
+    test_open(L"COM4", TEST_FD_A, 3);
+
+    test_irp(IRP_OP_READ, TEST_FD_A, 3);
+    test_irp(IRP_OP_READ, TEST_FD_B, 1);
+
+    /* And COM1 can be opened again, this time on a handle of its own */
+
+    test_open(L"COM1", TEST_FD_OTHER, 0);
+    test_irp(IRP_OP_READ, TEST_FD_OTHER, 0);
+}
+
+static void test_spill_after_free(void)
+{
+    /* With the direct slot empty again, the ports in the overflow list are
+       still found, and closing them empties it. */
+
+    test_irp(IRP_OP_CLOSE, TEST_FD_A, 3);
+
+    test_irp(IRP_OP_READ, TEST_FD_B, 1);
+    test_irp(IRP_OP_READ, TEST_FD_C, 2);
+
+    test_irp(IRP_OP_CLOSE, TEST_FD_C, 2);
+    test_irp(IRP_OP_READ, TEST_FD_C, -1);
+    test_irp(IRP_OP_READ, TEST_FD_B, 1);
+
+    /* A fresh handle in the same slot goes in directly once more */
+
+    test_open(L"COM3", TEST_FD_C, 2);
+    test_irp(IRP_OP_READ, TEST_FD_C, 2);
+    test_irp(IRP_OP_READ, TEST_FD_B, 1);
+}
+
+static void test_unregistered(void)
+{
+    size_t npassed;
+
+    npassed = test_npassed;
+
+    /* A handle that shares the slot but belongs to nobody, one that has a
+       slot to itself, no handle at all, and opens of paths that are not
+       registered ports. */
+
+    test_irp(IRP_OP_READ, TEST_FD_D, -1);
+    test_irp(IRP_OP_WRITE, TEST_FD_D, -1);
+    test_irp(IRP_OP_READ, (HANDLE) (uintptr_t) 0x1008, -1);
+    test_irp(IRP_OP_READ, NULL, -1);
+
+    test_open(L"COM9", TEST_FD_D, -1);
+    test_open(L"C:\\COM1", TEST_FD_D, -1);
+    test_irp(IRP_OP_CLOSE, TEST_FD_D, -1);
+
+    TEST_CHECK(test_npassed == npassed + 7);
+}
+
+static void test_remove(void)
+{
+    /* A removed port's handle is no longer claimed, and its number is free
+       to be registered again. */
+
+    uart_registry_remove(&test_uarts[1]);
+
+    test_irp(IRP_OP_READ, TEST_FD_B, -1);
+    test_open(L"COM2", TEST_FD_D, -1);
+
+    TEST_CHECK(uart_registry_add(
+            &test_uarts[1],
+            test_port_fn,
+            (void *) (intptr_t) 1) == S_OK);
+
+    test_open(L"COM2", TEST_FD_D, 1);
+    test_irp(IRP_OP_READ, TEST_FD_D, 1);
+    test_irp(IRP_OP_READ, TEST_FD_C, 2);
+}
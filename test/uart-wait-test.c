@@ -0,0 +1,319 @@
+#include <windows.h>
+#include <ntstatus.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/iobuf-ring.h"
+#include "hook/iobuf.h"
+#include "hook/iohook.h"
+
+#include "hooklib/uart.h"
+
+#include "test/test.h"
+
+/* WaitCommEvent() as the uart serves it: IOCTL_SERIAL_WAIT_ON_MASK, answered
+   straight away when masked events have already accumulated and otherwise
+   left pending until one arrives, the mask changes, the wait is cancelled or
+   the port is torn down. Overlapped waits are issued straight to the uart;
+   a synchronous one goes down the iohook chain the way the WaitCommEvent
+   hook sends it and has to block until another thread raises an event. */
+
+static HRESULT test_handler(struct irp *irp);
+static HRESULT test_ioctl(uint32_t ioctl, const void *bytes, size_t nbytes);
+static HRESULT test_wait(OVERLAPPED *ovl, DWORD *events);
+static HRESULT test_write(void);
+static bool test_completed(NTSTATUS status);
+static void test_push(void);
+static DWORD WINAPI test_modem_proc(void *ctx);
+static void test_no_mask(void);
+static void test_events(void);
+static void test_mask_change(void);
+static void test_sync(void);
+static void test_cancel(void);
+static void test_fini(void);
+
+static struct uart test_uart;
+static uint8_t test_readable[64];
+static OVERLAPPED test_ovl;
+static DWORD test_events_out;
+static HANDLE test_fd;
+
+int main(int argc, char **argv)
+{
+    HRESULT hr;
+
+    (void) argc;
+    (void) argv;
+
+    hr = iohook_push_handler(test_handler);
+
+    if (!TEST_CHECK(SUCCEEDED(hr))) {
+        return test_result();
+    }
+
+    test_fd = (HANDLE) &test_uart;
+
+    uart_init(&test_uart, 1);
+    iobuf_ring_init(
+            &test_uart.readable,
+            test_readable,
+            sizeof(test_readable));
+    test_uart.fd = test_fd;
+
+    test_no_mask();
+    test_events();
+    test_mask_change();
+    test_sync();
+    test_cancel();
+    test_fini();
+
+    return test_result();
+}
+
+static HRESULT test_handler(struct irp *irp)
+{
+    if (irp->fd != test_fd) {
+        return iohook_invoke_next(irp);
+    }
+
+    /* uart_fini() sends the close for its fd down the chain */
+
+    if (irp->op == IRP_OP_CLOSE) {
+        return S_OK;
+    }
+
+    return uart_handle_irp(&test_uart, irp);
+}
+
+static HRESULT test_ioctl(uint32_t ioctl, const void *bytes, size_t nbytes)
+{
+    struct irp irp;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_IOCTL;
+    irp.fd = test_fd;
+    irp.ioctl = ioctl;
+    irp.write.bytes = bytes;
+    irp.write.nbytes = nbytes;
+
+    return uart_handle_irp(&test_uart, &irp);
+}
+
+static HRESULT test_wait(OVERLAPPED *ovl, DWORD *events)
+{
+    struct irp irp;
+
+    memset(ovl, 0, sizeof(*ovl));
+    *events = 0xDEAD;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_IOCTL;
+    irp.fd = test_fd;
+    irp.ovl = ovl;
+    irp.ioctl = IOCTL_SERIAL_WAIT_ON_MASK;
+    irp.read.bytes = (uint8_t *) events;
+    irp.read.nbytes = sizeof(*events);
+
+    return uart_handle_irp(&test_uart, &irp);
+}
+
+static HRESULT test_write(void)
+{
+    static const uint8_t bytes[3];
+    struct irp irp;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_WRITE;
+    irp.fd = test_fd;
+    irp.write.bytes = bytes;
+    irp.write.nbytes = sizeof(bytes);
+
+    return uart_handle_irp(&test_uart, &irp);
+}
+
+static bool test_completed(NTSTATUS status)
+{
+    return test_ovl.Internal == (ULONG_PTR) status;
+}
+
+static void test_push(void)
+{
+    struct const_iobuf src;
+    uint8_t byte;
+
+    byte = 0x55;
+    src.bytes = &byte;
+    src.nbytes = sizeof(byte);
+    src.pos = 0;
+
+    iobuf_ring_move(&test_uart.readable, &src);
+    uart_notify_readable(&test_uart);
+}
+
+static DWORD WINAPI test_modem_proc(void *ctx)
+{
+    (void) ctx;
+
+    /* Give the main thread time to block in its wait */
+
+    Sleep(20);
+    uart_set_modem_status(&test_uart, SERIAL_MSR_DCD);
+
+    return 0;
+}
+
+static void test_no_mask(void)
+{
+    HRESULT hr;
+
+    /* Waiting with an empty mask is an error, as it is on Windows */
+
+    hr = test_wait(&test_ovl, &test_events_out);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER));
+}
+
+static void test_events(void)
+{
+    OVERLAPPED ovl;
+    DWORD events;
+    DWORD mask;
+    HRESULT hr;
+
+    mask = SERIAL_EV_RXCHAR | SERIAL_EV_CTS;
+    hr = test_ioctl(IOCTL_SERIAL_SET_WAIT_MASK, &mask, sizeof(mask));
+    TEST_CHECK(hr == S_OK);
+
+    hr = test_wait(&test_ovl, &test_events_out);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    /* Only one wait at a time */
+
+    hr = test_wait(&ovl, &events);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER));
+
+    /* EV_TXEMPTY is not in the mask, so a write does not end the wait */
+
+    hr = test_write();
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_completed(STATUS_PENDING));
+
+    test_push();
+    TEST_CHECK(test_completed(STATUS_SUCCESS));
+    TEST_CHECK(test_ovl.InternalHigh == sizeof(DWORD));
+    TEST_CHECK(test_events_out == SERIAL_EV_RXCHAR);
+
+    /* Events that arrive with no wait outstanding accumulate until the next
+       wait collects them all at once. */
+
+    uart_set_modem_status(&test_uart, SERIAL_MSR_CTS | SERIAL_MSR_DSR);
+    test_push();
+
+    hr = test_wait(&test_ovl, &test_events_out);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_events_out == (SERIAL_EV_RXCHAR | SERIAL_EV_CTS));
+
+    iobuf_ring_clear(&test_uart.readable);
+}
+
+static void test_mask_change(void)
+{
+    DWORD mask;
+    HRESULT hr;
+
+    /* Setting the mask completes an outstanding wait with no events */
+
+    hr = test_wait(&test_ovl, &test_events_out);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    mask = SERIAL_EV_TXEMPTY;
+    hr = test_ioctl(IOCTL_SERIAL_SET_WAIT_MASK, &mask, sizeof(mask));
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_completed(STATUS_SUCCESS));
+    TEST_CHECK(test_events_out == 0);
+
+    hr = test_wait(&test_ovl, &test_events_out);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    hr = test_write();
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_completed(STATUS_SUCCESS));
+    TEST_CHECK(test_events_out == SERIAL_EV_TXEMPTY);
+
+    iobuf_arena_reset(&test_uart.written);
+}
+
+static void test_sync(void)
+{
+    struct irp irp;
+    HANDLE thread;
+    DWORD events;
+    DWORD mask;
+    HRESULT hr;
+
+    mask = SERIAL_EV_RLSD;
+    hr = test_ioctl(IOCTL_SERIAL_SET_WAIT_MASK, &mask, sizeof(mask));
+    TEST_CHECK(hr == S_OK);
+
+    thread = CreateThread(NULL, 0, test_modem_proc, NULL, 0, NULL);
+
+    if (!TEST_CHECK(thread != NULL)) {
+        return;
+    }
+
+    events = 0;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_IOCTL;
+    irp.fd = test_fd;
+    irp.ioctl = IOCTL_SERIAL_WAIT_ON_MASK;
+    irp.read.bytes = (uint8_t *) &events;
+    irp.read.nbytes = sizeof(events);
+
+    hr = iohook_invoke_and_wait(&irp);
+
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(irp.read.pos == sizeof(events));
+    TEST_CHECK(events == SERIAL_EV_RLSD);
+
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+static void test_cancel(void)
+{
+    HRESULT hr;
+
+    hr = test_wait(&test_ovl, &test_events_out);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    hr = iohook_cancel_io(test_fd, &test_ovl);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_completed(STATUS_CANCELLED));
+    TEST_CHECK(test_events_out == 0xDEAD);
+
+    /* The uart has forgotten it, so there can be another */
+
+    hr = test_wait(&test_ovl, &test_events_out);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    hr = iohook_cancel_io(test_fd, NULL);
+    TEST_CHECK(hr == S_OK);
+    TEST_CHECK(test_completed(STATUS_CANCELLED));
+}
+
+static void test_fini(void)
+{
+    HRESULT hr;
+
+    hr = test_wait(&test_ovl, &test_events_out);
+    TEST_CHECK(hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING));
+
+    uart_fini(&test_uart);
+
+    TEST_CHECK(test_completed(STATUS_CANCELLED));
+}